@@ -0,0 +1,145 @@
+/*
+    BSD 2-Clause License
+
+    Copyright (c) 2017-2023, Nol Martinon
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+    Check and benchmark of ascii_ci_search() (common.cpp) against the locale
+    aware search ci_find_substr() that ci_offset() used for every needle before.
+
+    Random haystacks of 1 to 300 bytes (letters, the bytes next to them like
+    '@', '[', '`' and '{', digits, line breaks and non-ASCII bytes) are searched
+    from a random index for a random ASCII needle, or for a part of the haystack
+    with its case changed, with ascii_ci_search(), ci_offset() and
+    ci_find_substr() : the three results must be the same.
+    Then the search of "\nMessage-ID:" in a 3.8 KB header that has "Message-Id"
+    is timed with each of them, and with the case sensitive offset() for
+    reference. Return 0 if all the checks pass.
+    eg:
+        g++ -O2 -std=c++11 ascii_ci_check.cpp common.cpp -o ascii_ci_check -lcrypto && ./ascii_ci_check
+*/
+
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <iostream>
+#include "common.hpp"
+
+#define CHECK_CASES 200000
+#define CHECK_MAXLEN 300
+#define BENCH_RUNS 10000
+
+//---------------------------------------------------------------------------------------------
+/**
+ *  Reference()
+ *  Search as ci_offset() did before ascii_ci_search()
+ */
+size_t Reference(std::vector<char>& haystack, const std::string& str, size_t index) {
+
+    if (index>=haystack.size()) return -1;
+    std::vector<char> needle(str.begin(), str.end());
+    return ci_find_substr(haystack, needle, index);
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  Check()
+ *  Compare the searches on random cases, return the number of failures
+ */
+int Check(std::mt19937& rng) {
+
+    static const char alphabet[] = "aAzZmM@[`{09:- \r\n\x80\xC3\xA9\xFF";
+    int failures = 0;
+
+    for (int i = 0; i < CHECK_CASES && failures < 10; i++) {
+        std::vector<char> haystack(1 + rng() % CHECK_MAXLEN);
+        for (char& c : haystack) c = alphabet[rng() % (sizeof(alphabet)-1)];
+
+        // A part of the haystack with its case changed, or random ASCII bytes
+        std::string needle;
+        size_t len = rng() % 20;
+        if (haystack.size() > len && rng() % 2) {
+            size_t pos = rng() % (haystack.size()-len+1);
+            for (size_t k = 0; k < len; k++) {
+                char c = haystack[pos+k];
+                if ((unsigned char)c >= 0x80) c = 'x';
+                else if (isalpha((unsigned char)c) && rng() % 2) c ^= 0x20;
+                needle += c;
+            }
+        }
+        else for (size_t k = 0; k < len; k++) needle += alphabet[rng() % (sizeof(alphabet)-6)];
+
+        size_t index = rng() % haystack.size();
+        size_t expected = Reference(haystack, needle, index);
+        size_t found = ascii_ci_search(haystack.data(), haystack.size(), needle.data(), needle.size(), index);
+        size_t found_offset = ci_offset(haystack, needle, index);
+        if (found != expected || found_offset != expected) {
+            std::cerr << "  \"" << needle << "\" from " << index << " in " << haystack.size() << " bytes : "
+                      << (long)found << " and " << (long)found_offset << " instead of " << (long)expected << std::endl;
+            failures++;
+        }
+    }
+    return failures;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  Bench()
+ *  Print the mean time of a search in ns
+ */
+template<typename F>
+void Bench(const std::string& name, F search) {
+
+    volatile size_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < BENCH_RUNS; i++) sink = sink + search();
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-start).count();
+    std::cout << "  " << name << " : " << ns/BENCH_RUNS << " ns" << std::endl;
+}
+//---------------------------------------------------------------------------------------------
+int main() {
+
+    std::mt19937 rng(20170101);
+    int failures = Check(rng);
+    std::cout << "search : " << (failures ? "FAILED" : "ok") << std::endl;
+
+    // A header as the ones of a mailing list, the field is near the end
+    std::string header = "Return-Path: <list-bounces@lists.domain.net>\r\n";
+    for (int i = 0; header.size() < 3600; i++)
+        header += "Received: from mx" + std::to_string(i) + ".domain.net (mx" + std::to_string(i) +
+                  ".domain.net [192.0.2." + std::to_string(i) + "])\r\n\tby mail.domain.net with ESMTPS id "
+                  "4Abc" + std::to_string(i*7919) + "; Sun, 01 Jan 2017 10:00:00 +0100\r\n";
+    header += "Subject: Weekly report\r\nMessage-Id: <20170101100000.12345@mail.domain.net>\r\n"
+              "Content-Type: text/plain; charset=utf-8\r\n\r\n";
+    std::vector<char> vheader(header.begin(), header.end());
+    std::string needle = "\nMessage-ID:";
+
+    std::cout << "\"\\nMessage-ID:\" in a " << vheader.size() << " bytes header, " << BENCH_RUNS << " runs :" << std::endl;
+    Bench("ci_find_substr (previous ci_offset)", [&]() { return Reference(vheader, needle, 0); });
+    Bench("ascii_ci_search", [&]() { return ascii_ci_search(vheader.data(), vheader.size(), needle.data(), needle.size(), 0); });
+    Bench("offset (case sensitive, \"\\nMessage-Id:\")", [&]() { return offset(vheader, "\nMessage-Id:", 0); });
+
+    return failures ? 1 : 0;
+}
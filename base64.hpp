@@ -0,0 +1,296 @@
+/*
+    BSD 2-Clause License
+
+    Copyright (c) 2017-2023, Nol Martinon
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+    Base64 encoder and decoder (standard alphabet, "=" padding, no line breaks).
+
+    Functions work on caller provided buffers and never allocate.
+    On x86 the SSSE3 or AVX2 version is selected at runtime, with a scalar
+    fallback for the tail and the other platforms.
+    eg:
+        std::string s(base64_encoded_size(len), 0);
+        base64_encode((const unsigned char*)data, len, &s[0]);
+*/
+
+#ifndef __BASE64_HPP
+#define __BASE64_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define BASE64_X86
+    #include <immintrin.h>
+#endif
+
+/// Size of the base64 text for 'len' bytes
+inline size_t base64_encoded_size(size_t len) { return (len+2)/3*4; }
+
+/// Maximal size of the data decoded from 'len' base64 characters
+inline size_t base64_decoded_maxsize(size_t len) { return len/4*3; }
+
+namespace base64_detail {
+
+static const char encode_table[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/// Return value of a base64 character or -1 if invalid
+inline int decode_char(unsigned char c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+inline size_t encode_scalar(const unsigned char *src, size_t len, char *dst) {
+    char *out = dst;
+    size_t i = 0;
+    for (; i+3 <= len; i += 3) {
+        uint32_t v = (src[i] << 16) | (src[i+1] << 8) | src[i+2];
+        *out++ = encode_table[v >> 18];
+        *out++ = encode_table[(v >> 12) & 0x3f];
+        *out++ = encode_table[(v >> 6) & 0x3f];
+        *out++ = encode_table[v & 0x3f];
+    }
+    if (i < len) {
+        uint32_t v = src[i] << 16;
+        if (i+1 < len) v |= src[i+1] << 8;
+        *out++ = encode_table[v >> 18];
+        *out++ = encode_table[(v >> 12) & 0x3f];
+        *out++ = (i+1 < len) ? encode_table[(v >> 6) & 0x3f] : '=';
+        *out++ = '=';
+    }
+    return out - dst;
+}
+
+/// Decode complete quartets, the last one may be padded
+/**
+ * Return false if the length is not a multiple of 4 or a character is invalid
+ */
+inline bool decode_scalar(const char *src, size_t len, unsigned char *dst, size_t& outlen) {
+    outlen = 0;
+    if (len % 4) return false;
+    for (size_t i = 0; i < len; i += 4) {
+        int a = decode_char(src[i]);
+        int b = decode_char(src[i+1]);
+        if (a < 0 || b < 0) return false;
+        dst[outlen++] = (a << 2) | (b >> 4);
+
+        bool last = (i+4 == len);
+        if (last && src[i+2] == '=') {
+            if (src[i+3] != '=') return false;
+            break;
+        }
+        int c = decode_char(src[i+2]);
+        if (c < 0) return false;
+        dst[outlen++] = ((b & 0x0f) << 4) | (c >> 2);
+
+        if (last && src[i+3] == '=') break;
+        int d = decode_char(src[i+3]);
+        if (d < 0) return false;
+        dst[outlen++] = ((c & 0x03) << 6) | d;
+    }
+    return true;
+}
+
+#ifdef BASE64_X86
+// Vector algorithms are the ones described by Wojciech Mula and Daniel Lemire
+// in "Faster Base64 Encoding and Decoding using AVX2 Instructions"
+
+/// Encode 12 bytes per iteration, return the number of bytes consumed
+__attribute__((target("ssse3")))
+inline size_t encode_ssse3(const unsigned char *src, size_t len, char *dst) {
+    const __m128i shuf = _mm_set_epi8(10,11,9,10, 7,8,6,7, 4,5,3,4, 1,2,0,1);
+    const __m128i shift_lut = _mm_setr_epi8('a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52,
+                                            '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '+'-62,
+                                            '/'-63, 'A', 0, 0);
+    size_t i = 0;
+    for (; i+16 <= len; i += 12, dst += 16) { // 16 bytes are loaded
+        __m128i in = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src+i)), shuf);
+        __m128i t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+        __m128i t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+        __m128i idx = _mm_or_si128(t0, t1);
+        __m128i r = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+        r = _mm_or_si128(r, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx), _mm_set1_epi8(13)));
+        r = _mm_add_epi8(_mm_shuffle_epi8(shift_lut, r), idx);
+        _mm_storeu_si128((__m128i*)dst, r);
+    }
+    return i;
+}
+
+/// Encode 24 bytes per iteration, return the number of bytes consumed
+__attribute__((target("avx2")))
+inline size_t encode_avx2(const unsigned char *src, size_t len, char *dst) {
+    const __m256i shuf = _mm256_set_epi8(10,11,9,10, 7,8,6,7, 4,5,3,4, 1,2,0,1,
+                                         10,11,9,10, 7,8,6,7, 4,5,3,4, 1,2,0,1);
+    const __m256i shift_lut = _mm256_setr_epi8('a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52,
+                                               '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '+'-62,
+                                               '/'-63, 'A', 0, 0,
+                                               'a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52,
+                                               '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '+'-62,
+                                               '/'-63, 'A', 0, 0);
+    size_t i = 0;
+    for (; i+28 <= len; i += 24, dst += 32) { // 12 bytes per lane, 28 bytes are loaded
+        __m256i in = _mm256_inserti128_si256(
+                         _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(src+i))),
+                         _mm_loadu_si128((const __m128i*)(src+i+12)), 1);
+        in = _mm256_shuffle_epi8(in, shuf);
+        __m256i t0 = _mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+        __m256i t1 = _mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+        __m256i idx = _mm256_or_si256(t0, t1);
+        __m256i r = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+        r = _mm256_or_si256(r, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx), _mm256_set1_epi8(13)));
+        r = _mm256_add_epi8(_mm256_shuffle_epi8(shift_lut, r), idx);
+        _mm256_storeu_si256((__m256i*)dst, r);
+    }
+    return i;
+}
+
+/// Decode 16 characters per iteration, return the number of characters consumed
+/**
+ * Stops before a block that contains an invalid character or padding, the rest
+ * is left to decode_scalar() that reports the error
+ */
+__attribute__((target("ssse3")))
+inline size_t decode_ssse3(const char *src, size_t len, unsigned char *dst) {
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                         0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                         0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    size_t i = 0;
+    for (; i+24 <= len; i += 16, dst += 12) { // 16 bytes are stored, at least 16 remain in output
+        __m128i in = _mm_loadu_si128((const __m128i*)(src+i));
+        __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+        __m128i lo = _mm_shuffle_epi8(lut_lo, _mm_and_si128(in, _mm_set1_epi8(0x0f)));
+        __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0xffff)
+            break;
+        __m128i eq_2f = _mm_cmpeq_epi8(in, _mm_set1_epi8(0x2f));
+        __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+        __m128i v = _mm_add_epi8(in, roll);
+        v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+        v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+        _mm_storeu_si128((__m128i*)dst, _mm_shuffle_epi8(v, pack));
+    }
+    return i;
+}
+
+/// Decode 32 characters per iteration, return the number of characters consumed
+__attribute__((target("avx2")))
+inline size_t decode_avx2(const char *src, size_t len, unsigned char *dst) {
+    const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+                                            0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                            0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                              0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i perm = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    size_t i = 0;
+    for (; i+48 <= len; i += 32, dst += 24) { // 32 bytes are stored, at least 32 remain in output
+        __m256i in = _mm256_loadu_si256((const __m256i*)(src+i));
+        __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), _mm256_set1_epi8(0x0f));
+        __m256i lo = _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(in, _mm256_set1_epi8(0x0f)));
+        __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+        if (!_mm256_testz_si256(lo, hi))
+            break;
+        __m256i eq_2f = _mm256_cmpeq_epi8(in, _mm256_set1_epi8(0x2f));
+        __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+        __m256i v = _mm256_add_epi8(in, roll);
+        v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+        v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+        v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, pack), perm);
+        _mm256_storeu_si256((__m256i*)dst, v);
+    }
+    return i;
+}
+
+#endif // BASE64_X86
+
+/// Best instruction set available: 0 scalar, 1 SSSE3, 2 AVX2
+inline int cpu_level() {
+    #ifdef BASE64_X86
+    static const int level = __builtin_cpu_supports("avx2") ? 2 : __builtin_cpu_supports("ssse3") ? 1 : 0;
+    return level;
+    #else
+    return 0;
+    #endif
+}
+
+/// base64_encode() with the instruction set 'level' (at most cpu_level())
+inline size_t encode_level(const unsigned char *src, size_t len, char *dst, int level) {
+    size_t done = 0;
+    #ifdef BASE64_X86
+    if (level >= 2) done = encode_avx2(src, len, dst);
+    if (level >= 1) done += encode_ssse3(src+done, len-done, dst+done/3*4);
+    #endif
+    return done/3*4 + encode_scalar(src+done, len-done, dst+done/3*4);
+}
+
+/// base64_decode() with the instruction set 'level' (at most cpu_level())
+inline bool decode_level(const char *src, size_t len, unsigned char *dst, size_t& outlen, int level) {
+    size_t done = 0;
+    #ifdef BASE64_X86
+    if (level >= 2) done = decode_avx2(src, len, dst);
+    if (level >= 1) done += decode_ssse3(src+done, len-done, dst+done/4*3);
+    #endif
+    bool ok = decode_scalar(src+done, len-done, dst+done/4*3, outlen);
+    outlen += done/4*3;
+    return ok;
+}
+
+} // namespace base64_detail
+
+/// Encode 'len' bytes of 'src' to 'dst'
+/**
+ * 'dst' must have room for base64_encoded_size(len) characters (no terminating null)
+ * Returns the number of characters written
+ */
+inline size_t base64_encode(const unsigned char *src, size_t len, char *dst) {
+    return base64_detail::encode_level(src, len, dst, base64_detail::cpu_level());
+}
+
+/// Decode 'len' base64 characters of 'src' to 'dst'
+/**
+ * 'dst' must have room for base64_decoded_maxsize(len) bytes
+ * Returns false if 'src' is not valid base64, 'outlen' is the number of decoded bytes
+ */
+inline bool base64_decode(const char *src, size_t len, unsigned char *dst, size_t& outlen) {
+    return base64_detail::decode_level(src, len, dst, outlen, base64_detail::cpu_level());
+}
+
+#endif //__BASE64_HPP
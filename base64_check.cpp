@@ -0,0 +1,171 @@
+/*
+    BSD 2-Clause License
+
+    Copyright (c) 2017-2023, Nol Martinon
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+    Check of base64.hpp against the OpenSSL BIO base64 filter that mboxzilla
+    used before it.
+
+    For each instruction set supported by the CPU (scalar, SSSE3, AVX2), random
+    buffers of 0 to 1100 bytes (tails and several vector blocks) are encoded and
+    compared byte for byte with the BIO output, then the BIO output is decoded
+    back. Corrupted texts (invalid character, '=' inside the text, truncated
+    length) must be rejected. Return 0 if all the checks pass.
+    eg:
+        g++ -O2 -std=c++11 base64_check.cpp -o base64_check -lcrypto && ./base64_check
+*/
+
+#include <string>
+#include <vector>
+#include <random>
+#include <iostream>
+#include <openssl/bio.h>
+#include <openssl/evp.h>
+#include <openssl/buffer.h>
+#include "base64.hpp"
+
+#define CHECK_CASES 20000
+#define CHECK_MAXLEN 1100
+
+//---------------------------------------------------------------------------------------------
+/**
+ *  BioEncode()
+ *  Encode with the OpenSSL BIO base64 filter without line breaks
+ */
+std::string BioEncode(const std::string& data) {
+
+    BIO *b64 = BIO_new(BIO_f_base64());
+    BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
+    BIO *bio = BIO_push(b64, BIO_new(BIO_s_mem()));
+    BIO_write(bio, data.data(), (int)data.size());
+    (void)BIO_flush(bio);
+    BUF_MEM *mem;
+    BIO_get_mem_ptr(bio, &mem);
+    std::string result(mem->data, mem->length);
+    BIO_free_all(bio);
+    return result;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  BioDecode()
+ *  Decode with the OpenSSL BIO base64 filter without line breaks
+ */
+std::string BioDecode(const std::string& text) {
+
+    std::vector<char> buffer(text.size()+1);
+    BIO *b64 = BIO_new(BIO_f_base64());
+    BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
+    BIO *bio = BIO_push(b64, BIO_new_mem_buf(text.data(), (int)text.size()));
+    int len = BIO_read(bio, buffer.data(), (int)buffer.size());
+    BIO_free_all(bio);
+    return (len > 0) ? std::string(buffer.data(), len) : std::string();
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  Decode()
+ *  Decode with the instruction set 'level', return false if the text is rejected
+ */
+bool Decode(const std::string& text, std::string& data, int level) {
+
+    std::vector<unsigned char> buffer(base64_decoded_maxsize(text.size())+1);
+    size_t len = 0;
+    bool ok = base64_detail::decode_level(text.data(), text.size(), buffer.data(), len, level);
+    data.assign((const char*)buffer.data(), len);
+    return ok;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  CheckLevel()
+ *  Run the checks with the instruction set 'level', return the number of failures
+ */
+int CheckLevel(int level, std::mt19937& rng) {
+
+    static const char invalid[] = "!*-_.~ \n\r\t\"@";
+    int failures = 0;
+
+    for (int i = 0; i < CHECK_CASES && failures < 10; i++) {
+        std::string data(rng() % (CHECK_MAXLEN+1), 0);
+        for (char& c : data) c = (char)rng();
+
+        std::string expected = BioEncode(data);
+        std::string text(base64_encoded_size(data.size()), 0);
+        text.resize(base64_detail::encode_level((const unsigned char*)data.data(), data.size(), &text[0], level));
+        if (text != expected) {
+            std::cerr << "  encode differs from BIO for " << data.size() << " bytes" << std::endl;
+            failures++;
+            continue;
+        }
+
+        std::string decoded;
+        if (!Decode(expected, decoded, level) || decoded != data || BioDecode(expected) != data) {
+            std::cerr << "  decode differs from BIO for " << data.size() << " bytes" << std::endl;
+            failures++;
+            continue;
+        }
+        if (expected.empty()) continue;
+
+        // An invalid character anywhere, '=' before the last quartet, a truncated text
+        std::string bad = expected;
+        bad[rng() % bad.size()] = invalid[rng() % (sizeof(invalid)-1)];
+        if (Decode(bad, decoded, level)) {
+            std::cerr << "  invalid character accepted \"" << bad << "\"" << std::endl;
+            failures++;
+        }
+        if (expected.size() > 4) {
+            bad = expected;
+            bad[rng() % (bad.size()-4)] = '=';
+            if (Decode(bad, decoded, level)) {
+                std::cerr << "  padding inside the text accepted \"" << bad << "\"" << std::endl;
+                failures++;
+            }
+        }
+        bad = expected.substr(0, expected.size() - 1 - rng() % 3);
+        if (Decode(bad, decoded, level)) {
+            std::cerr << "  truncated text accepted \"" << bad << "\"" << std::endl;
+            failures++;
+        }
+    }
+    return failures;
+}
+//---------------------------------------------------------------------------------------------
+int main() {
+
+    static const char *names[] = {"scalar", "SSSE3", "AVX2"};
+    std::mt19937 rng(20170101);
+    int failures = 0;
+
+    for (int level = 0; level <= 2; level++) {
+        if (level > base64_detail::cpu_level()) {
+            std::cout << names[level] << " : skipped (not supported by this CPU)" << std::endl;
+            continue;
+        }
+        int nb = CheckLevel(level, rng);
+        std::cout << names[level] << " : " << (nb ? "FAILED" : "ok") << std::endl;
+        failures += nb;
+    }
+    return failures ? 1 : 0;
+}
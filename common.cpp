@@ -105,8 +105,14 @@ bool ListDirectoryContents(std::vector<std::string>& vList, const std::string di
                 // Cross platform code is used to avoid problems
                 // (eg: bad value on get S_ISDIR or S_IFDIR from stat(ent->st_mode, &stbuf) on Windows)
                 {
-                   is_dir = DirectoryExists(directory+"/"+ent->d_name);
-                   is_file = FileExists(directory+"/"+ent->d_name);
+                   struct stat st;
+                   #if defined(__linux__) || defined(__APPLE__)
+                   bool ok = (fstatat(dirfd(dir), ent->d_name, &st, 0) == 0);
+                   #else
+                   bool ok = (stat((directory+"/"+ent->d_name).c_str(), &st) == 0);
+                   #endif
+                   is_dir = ok && S_ISDIR(st.st_mode);
+                   is_file = ok && S_ISREG(st.st_mode);
                 }
 
         if ( (bGetDirectories && is_dir) || (bGetFiles && is_file) )
@@ -126,40 +132,330 @@ bool ListDirectoryContents(std::vector<std::string>& vList, const std::string di
  */
 bool ListAllSubDirectories(std::vector<std::string>& vList, const std::string directory) {
 
-    std::vector<std::string> vListCurrent;
-    ListDirectoryContents(vListCurrent, directory, false, true);
+    std::vector<Walk_entry> vEntries;
+    WalkDirectory(vEntries, directory, false, true);
 
-    for(auto n : vListCurrent){
-        vList.push_back(directory+"/"+n);
-        ListAllSubDirectories(vList, directory+"/"+n);
+    for (auto& entry : vEntries)
+        vList.push_back(directory+"/"+entry.path);
+    return true;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  Dir_reader
+ *  Read the entries of a directory opened relative to its parent (openat/fstatat on linux and
+ *  macOS, so no path is rebuilt and resolved for each level) or by full path on Windows
+ */
+class Dir_reader {
+
+    public:
+        Dir_reader(const std::string& directory) : dir(NULL) {
+            #if defined(__linux__) || defined(__APPLE__)
+                Open(open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+            #else
+                path = directory;
+                dir = opendir(path.c_str());
+            #endif
+        }
+
+        Dir_reader(const Dir_reader& parent, const std::string& name) : dir(NULL) {
+            #if defined(__linux__) || defined(__APPLE__)
+                Open(openat(parent.fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+            #else
+                path = parent.path + "/" + name;
+                dir = opendir(path.c_str());
+            #endif
+        }
+
+        ~Dir_reader() { if (dir) closedir(dir); }
+
+        bool IsOpen() const { return dir != NULL; }
+
+        /// Read next entry, 'type' is WALK_FILE, WALK_DIR or WALK_OTHER
+        /**
+         * Symbolic links are followed only if 'followlinks' is true
+         */
+        bool Next(std::string& name, int& type, bool followlinks=true) {
+            struct dirent *ent;
+            while (dir && (ent = readdir(dir)) != NULL) {
+                if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+                    continue;
+                name = ent->d_name;
+                type = WALK_OTHER;
+
+                #ifdef _DIRENT_HAVE_D_TYPE
+                if (ent->d_type == DT_DIR) type = WALK_DIR;
+                else if (ent->d_type == DT_REG) type = WALK_FILE;
+                else if (ent->d_type == DT_UNKNOWN || (ent->d_type == DT_LNK && followlinks))
+                #endif
+                {
+                    struct stat st;
+                    #if defined(__linux__) || defined(__APPLE__)
+                    if (fstatat(fd, ent->d_name, &st, followlinks?0:AT_SYMLINK_NOFOLLOW) == 0) {
+                    #else
+                    if (stat((path+"/"+name).c_str(), &st) == 0) {
+                    #endif
+                        if (S_ISDIR(st.st_mode)) type = WALK_DIR;
+                        else if (S_ISREG(st.st_mode)) type = WALK_FILE;
+                    }
+                }
+                return true;
+            }
+            return false;
+        }
+
+        /// Remove an empty sub-directory
+        bool RemoveDir(const std::string& name) {
+            #if defined(__linux__) || defined(__APPLE__)
+                return unlinkat(fd, name.c_str(), AT_REMOVEDIR) == 0;
+            #else
+                return rmdir((path+"/"+name).c_str()) == 0;
+            #endif
+        }
+
+    private:
+        DIR *dir;
+        #if defined(__linux__) || defined(__APPLE__)
+            int fd;
+            void Open(int newfd) {
+                fd = newfd;
+                if (fd < 0) return;
+                if ((dir = fdopendir(fd)) == NULL) close(fd); // else fd is owned by dir
+            }
+        #else
+            std::string path;
+        #endif
+
+        Dir_reader(const Dir_reader&);
+        Dir_reader& operator=(const Dir_reader&);
+};
+//---------------------------------------------------------------------------------------------
+/**
+ *  WalkSubtree()
+ *  Recursive part of WalkDirectory(), entries are added in depth-first pre-order
+ */
+static void WalkSubtree(Dir_reader& reader, const std::string& relpath, std::vector<Walk_entry>& vEntries, bool bGetFiles, bool bGetDirectories) {
+
+    std::string name;
+    int type;
+
+    while (reader.Next(name, type)) {
+        std::string path = relpath.empty()?name:relpath+"/"+name;
+        if (type == WALK_DIR) {
+            if (bGetDirectories) vEntries.push_back(Walk_entry(path, true));
+            Dir_reader sub(reader, name);
+            if (sub.IsOpen()) WalkSubtree(sub, path, vEntries, bGetFiles, bGetDirectories);
+        }
+        else if (type == WALK_FILE && bGetFiles)
+            vEntries.push_back(Walk_entry(path, false));
+    }
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  PruneSubtree()
+ *  Recursive part of PruneEmptyDirectories()
+ *  Return true if the directory is empty after its empty sub-directories have been removed
+ */
+static bool PruneSubtree(Dir_reader& reader, size_t& nbremoved) {
+
+    std::string name;
+    int type;
+    bool empty = true;
+
+    while (reader.Next(name, type, false)) {
+        if (type == WALK_DIR) {
+            Dir_reader sub(reader, name);
+            if (sub.IsOpen() && PruneSubtree(sub, nbremoved) && reader.RemoveDir(name)) {
+                nbremoved++;
+                continue;
+            }
+        }
+        empty = false;
+    }
+    return empty;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  ForEachSubtree()
+ *  Call 'func(root reader, sub-directory name, index)' for each sub-directory of the root
+ *  directory with 'nbthreads' threads (default is the number of cores, limited to 8)
+ */
+template<typename F>
+static void ForEachSubtree(Dir_reader& root, const std::vector<std::string>& vSubdirs, unsigned int nbthreads, F func) {
+
+    std::atomic<size_t> next(0);
+
+    if (!nbthreads) nbthreads = std::max(1u, std::min(8u, std::thread::hardware_concurrency()));
+    nbthreads = std::min<size_t>(nbthreads, vSubdirs.size());
+
+    auto worker = [&]() {
+        size_t i;
+        while ((i = next++) < vSubdirs.size())
+            func(root, vSubdirs[i], i);
+    };
+
+    std::vector<std::thread> vThreads;
+    for (unsigned int t = 1; t < nbthreads; t++) vThreads.push_back(std::thread(worker));
+    worker();
+    for (auto& th : vThreads) th.join();
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  WalkDirectory()
+ *  List recursively files and/or sub-directories of a directory to 'vEntries'
+ *  with paths relative to the directory (depth-first pre-order, as ListAllSubDirectories())
+ *  Sub-trees of the first level are read in parallel
+ */
+bool WalkDirectory(std::vector<Walk_entry>& vEntries, const std::string directory, bool bGetFiles, bool bGetDirectories, unsigned int nbthreads) {
+
+    vEntries.clear();
+    Dir_reader root(directory);
+    if (!root.IsOpen()) return false;
+
+    // Read the first level, each sub-directory is then walked by a thread
+    std::vector<std::string> vSubdirs;
+    std::vector<size_t> vSubdirIndex; // position of sub-directory tree in vEntries
+    std::string name;
+    int type;
+
+    while (root.Next(name, type)) {
+        if (type == WALK_DIR) {
+            if (bGetDirectories) vEntries.push_back(Walk_entry(name, true));
+            vSubdirs.push_back(name);
+            vSubdirIndex.push_back(vEntries.size());
+        }
+        else if (type == WALK_FILE && bGetFiles)
+            vEntries.push_back(Walk_entry(name, false));
     }
+
+    std::vector<std::vector<Walk_entry> > vSubEntries(vSubdirs.size());
+    ForEachSubtree(root, vSubdirs, nbthreads, [&](Dir_reader& parent, const std::string& subdir, size_t i) {
+        Dir_reader sub(parent, subdir);
+        if (sub.IsOpen()) WalkSubtree(sub, subdir, vSubEntries[i], bGetFiles, bGetDirectories);
+    });
+
+    // Merge sub-trees after their directory to keep the pre-order
+    std::vector<Walk_entry> vMerged;
+    size_t pos = 0;
+    for (size_t i = 0; i < vSubdirs.size(); i++) {
+        vMerged.insert(vMerged.end(), vEntries.begin()+pos, vEntries.begin()+vSubdirIndex[i]);
+        vMerged.insert(vMerged.end(), vSubEntries[i].begin(), vSubEntries[i].end());
+        pos = vSubdirIndex[i];
+    }
+    vMerged.insert(vMerged.end(), vEntries.begin()+pos, vEntries.end());
+    vEntries.swap(vMerged);
+
     return true;
 }
 //---------------------------------------------------------------------------------------------
 /**
- *  PrintMD5()
- *  Hash a string to MD5
+ *  PruneEmptyDirectories()
+ *  Remove all empty sub-directories of a directory (the directory itself is kept)
+ *  A directory that only contains empty directories is also removed
+ *  Return the number of removed directories
  */
-std::string PrintMD5(std::string str) {
+size_t PruneEmptyDirectories(const std::string directory, unsigned int nbthreads) {
 
-    std::stringstream ss;
-    ss << std::hex << std::setfill('0');
+    Dir_reader root(directory);
+    if (!root.IsOpen()) return 0;
 
-    unsigned char result[MD5_DIGEST_LENGTH];
-    const char *cstr = str.c_str();
+    std::vector<std::string> vSubdirs;
+    std::string name;
+    int type;
+
+    while (root.Next(name, type, false)) {
+        if (type == WALK_DIR) vSubdirs.push_back(name);
+    }
+
+    std::atomic<size_t> nbremoved(0);
+    ForEachSubtree(root, vSubdirs, nbthreads, [&](Dir_reader& parent, const std::string& subdir, size_t) {
+        size_t nb = 0;
+        Dir_reader sub(parent, subdir);
+        if (sub.IsOpen() && PruneSubtree(sub, nb) && parent.RemoveDir(subdir)) nb++;
+        nbremoved += nb;
+    });
+
+    return nbremoved;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  DiffDirectory()
+ *  List recursively the entries of a directory whose relative path is not in 'sKeep'
+ */
+bool DiffDirectory(std::vector<Walk_entry>& vDiff, const std::string directory, const std::unordered_set<std::string>& sKeep, bool bGetFiles, bool bGetDirectories, unsigned int nbthreads) {
+
+    std::vector<Walk_entry> vEntries;
+    vDiff.clear();
+    if (!WalkDirectory(vEntries, directory, bGetFiles, bGetDirectories, nbthreads)) return false;
+
+    for (auto& entry : vEntries) {
+        if (!sKeep.count(entry.path)) vDiff.push_back(entry);
+    }
+    return true;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  HexString()
+ *  Format bytes to lowercase hexadecimal string
+ */
+std::string HexString(const unsigned char *data, size_t len) {
+
+    static const char hex[] = "0123456789abcdef";
+    std::string str(len*2, 0);
+
+    for (size_t i = 0; i < len; ++i) {
+        str[2*i] = hex[data[i] >> 4];
+        str[2*i+1] = hex[data[i] & 0x0f];
+    }
+
+    return str;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  MD5Digest()
+ *  Hash a buffer to MD5 with the digest context of the calling thread
+ *  The context and the algorithm are allocated once instead of on each EVP_Digest() call
+ */
+static void MD5Digest(const char *data, size_t len, unsigned char *result) {
 
     #if OPENSSL_VERSION_NUMBER >= 0x030000000
-        EVP_Digest((const unsigned char *)cstr, str.length(), result, NULL, EVP_md5(), NULL);
+        struct Context {
+            EVP_MD *md;
+            EVP_MD_CTX *ctx;
+            Context() : md(EVP_MD_fetch(NULL, "MD5", NULL)), ctx(EVP_MD_CTX_new()) {}
+            ~Context() { EVP_MD_CTX_free(ctx); EVP_MD_free(md); }
+        };
+        static thread_local Context context;
+        unsigned int result_len = 0;
+
+        if (!context.md || !context.ctx
+            || EVP_DigestInit_ex2(context.ctx, context.md, NULL) != 1
+            || EVP_DigestUpdate(context.ctx, data, len) != 1
+            || EVP_DigestFinal_ex(context.ctx, result, &result_len) != 1)
+            throw std::runtime_error("MD5 digest failed");
     #else
-        MD5((const unsigned char*)cstr, str.length(), result);
+        MD5((const unsigned char*)data, len, result);
     #endif
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  PrintMD5()
+ *  Hash a string to MD5
+ */
+std::string PrintMD5(const std::string& str) {
 
-    for (size_t i = 0; i < MD5_DIGEST_LENGTH; ++i)
-    {
-        ss << std::setw(2) << static_cast<unsigned>(result[i]);
-    }
+    return PrintMD5(str.data(), str.length());
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  PrintMD5()
+ *  Hash a buffer to MD5 (no copy needed for vector content)
+ */
+std::string PrintMD5(const char *data, size_t len) {
 
-    return ss.str();
+    unsigned char result[MD5_DIGEST_LENGTH];
+    MD5Digest(data, len, result);
+
+    return HexString(result, MD5_DIGEST_LENGTH);
 }
 //---------------------------------------------------------------------------------------------
 /**
@@ -176,14 +472,85 @@ size_t offset(std::vector<char> &haystack, std::string const &str, size_t index)
     else return -1;
 }
 //---------------------------------------------------------------------------------------------
+/**
+ *  ascii_ci_equal()
+ *  Compare two buffers of same length, ASCII letters are case insensitive
+ */
+static inline bool ascii_ci_equal(const char *s1, const char *s2, size_t len) {
+
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c1 = s1[i], c2 = s2[i];
+        if (c1 == c2) continue;
+        if ((c1|0x20) != (c2|0x20) || (c1|0x20) < 'a' || (c1|0x20) > 'z') return false;
+    }
+    return true;
+}
+//---------------------------------------------------------------------------------------------
 /**
  *  ci_offset()
  *  Returns index of a search string in a vector of char arrays. The search is insensitive.
  */
 size_t ci_offset(std::vector<char> &haystack, std::string const &str, size_t index) {
 
-    std::vector<char> needle(str.begin(), str.end());
-    return ci_find_substr(haystack, needle, index);
+    if (index>=haystack.size()) return -1;
+
+    // Locale aware search is only needed for non-ASCII needle
+    for (size_t i = 0; i < str.length(); i++) {
+        if ((unsigned char)str[i] >= 0x80) {
+            std::vector<char> needle(str.begin(), str.end());
+            return ci_find_substr(haystack, needle, index);
+        }
+    }
+    return ascii_ci_search(haystack.data(), haystack.size(), str.data(), str.length(), index);
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  ascii_ci_search()
+ *  Returns index of an ASCII needle in a buffer from index (case insensitive) or -1 if not found
+ *  Candidates are found by comparing the case folded (OR 0x20) first two bytes of the needle
+ *  on 16 positions at once with SSE2, then the whole needle is verified
+ */
+size_t ascii_ci_search(const char *haystack, size_t len, const char *needle, size_t needlelen, size_t index) {
+
+    if (!needlelen) return (index<=len)?index:-1;
+    if (index>=len || needlelen>len-index) return -1;
+
+    // Letters are compared with bit 0x20 set on both sides, other bytes are compared as is
+    unsigned char fold[2], cmp[2];
+    for (size_t k = 0; k < 2; k++) {
+        unsigned char c = needle[(k<needlelen)?k:0];
+        bool isletter = ((c|0x20) >= 'a' && (c|0x20) <= 'z');
+        fold[k] = isletter?0x20:0;
+        cmp[k] = c|fold[k];
+    }
+
+    const size_t last = len-needlelen; // last possible match position
+    size_t i = index;
+
+    #if defined(__SSE2__)
+    const __m128i fold0 = _mm_set1_epi8(fold[0]), cmp0 = _mm_set1_epi8(cmp[0]);
+    const __m128i fold1 = _mm_set1_epi8(fold[1]), cmp1 = _mm_set1_epi8(cmp[1]);
+
+    for (; i+17 <= len && i+16 <= last+1; i += 16) {
+        __m128i b0 = _mm_loadu_si128((const __m128i*)(haystack+i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(b0, fold0), cmp0));
+        if (needlelen>1) {
+            __m128i b1 = _mm_loadu_si128((const __m128i*)(haystack+i+1));
+            mask &= _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(b1, fold1), cmp1));
+        }
+        while (mask) {
+            size_t pos = i+__builtin_ctz(mask);
+            if (ascii_ci_equal(haystack+pos, needle, needlelen)) return pos;
+            mask &= mask-1;
+        }
+    }
+    #endif
+
+    for (; i <= last; i++) {
+        if (((unsigned char)haystack[i]|fold[0]) == cmp[0] && ascii_ci_equal(haystack+i, needle, needlelen))
+            return i;
+    }
+    return -1;
 }
 //---------------------------------------------------------------------------------------------
 /**
@@ -561,6 +928,226 @@ size_t count_needle(std::vector<std::string> const &haystack, std::string const
     return occurrences;
 }
 //---------------------------------------------------------------------------------------------
+/**
+ *  RemoveFiles()
+ *  Delete a list of files as a parallel batch (useful on network file systems)
+ *  'vRemoved' receives for each file true if it was deleted
+ *  Return the number of deleted files
+ */
+size_t RemoveFiles(const std::vector<std::string>& vFiles, std::vector<bool>& vRemoved, unsigned int nbthreads) {
+
+    std::vector<char> removed(vFiles.size(), 0); // not vector<bool> which is not thread safe
+    std::atomic<size_t> next(0);
+
+    if (!nbthreads) nbthreads = std::max(1u, std::min(8u, std::thread::hardware_concurrency()));
+    nbthreads = std::min<size_t>(nbthreads, vFiles.size());
+
+    auto worker = [&]() {
+        size_t i;
+        while ((i = next++) < vFiles.size())
+            removed[i] = (std::remove(vFiles[i].c_str()) == 0);
+    };
+
+    std::vector<std::thread> vThreads;
+    for (unsigned int t = 1; t < nbthreads; t++) vThreads.push_back(std::thread(worker));
+    worker();
+    for (auto& th : vThreads) th.join();
+
+    vRemoved.assign(removed.begin(), removed.end());
+    return std::count(removed.begin(), removed.end(), 1);
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  GetEmlLayout()
+ *  Return the layout value from its name ("flat", "hash" or "date") or -1 if unknown
+ */
+int GetEmlLayout(const std::string& name) {
+
+    if (name == "flat") return EML_LAYOUT_FLAT;
+    if (name == "hash") return EML_LAYOUT_HASH;
+    if (name == "date") return EML_LAYOUT_DATE;
+    return -1;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  GetEmlLayoutName()
+ *  Return the name of a layout
+ */
+std::string GetEmlLayoutName(int layout) {
+
+    if (layout == EML_LAYOUT_HASH) return "hash";
+    if (layout == EML_LAYOUT_DATE) return "date";
+    return "flat";
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  GetEmlFormat()
+ *  Return the output format value from its name ("eml", "pack", "tar" or "maildir")
+ *  or -1 if unknown
+ */
+int GetEmlFormat(const std::string& name) {
+
+    if (name == "eml") return EML_FORMAT_FILE;
+    if (name == "pack") return EML_FORMAT_PACK;
+    if (name == "tar") return EML_FORMAT_TAR;
+    if (name == "maildir") return EML_FORMAT_MAILDIR;
+    return -1;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  MaildirUniqueName()
+ *  Return the unique part of a Maildir message name, without its info part ":2,FLAGS"
+ *  eg: "20170102030405_abc.eml:2,RS" -> "20170102030405_abc.eml"
+ */
+std::string MaildirUniqueName(const std::string& filename) {
+
+    size_t pos = filename.rfind(MAILDIR_INFO_SEPARATOR);
+    if (pos == std::string::npos || filename.compare(pos+1, 2, "2,") != 0) return filename;
+    return filename.substr(0, pos);
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  EmlNameStart()
+ *  Return the position of "YYYYmmddHHMMSS_MD5" in an eml file name after the prefixes
+ *  of deleted and duplicated emails, or std::string::npos if the name is malformed
+ */
+static size_t EmlNameStart(const std::string& filename) {
+
+    size_t pos = 0;
+    while (true) {
+        if (filename.compare(pos, 4, "del_") == 0) pos += 4;
+        else if (filename.compare(pos, 3, "dup") == 0 && filename.find('_', pos) != std::string::npos
+                 && is_number(filename.substr(pos+3, filename.find('_', pos)-pos-3)))
+            pos = filename.find('_', pos)+1;
+        else break;
+    }
+
+    if (filename.length() < pos+19 || filename[pos+14] != '_') return std::string::npos;
+    return pos;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  EmlLayoutDir()
+ *  Return the sub-directories (ending with '/') where an eml file is stored according to the layout.
+ *  They are derived from the file name "[del_][dupN_]YYYYmmddHHMMSS_MD5.eml" only, so that any
+ *  tool can find the file from its name :
+ *      EML_LAYOUT_HASH -> "ab/cd/" (first 4 characters of MD5)
+ *      EML_LAYOUT_DATE -> "YYYY/mm/"
+ *  Return empty string for flat layout or if the name is not formatted as above
+ */
+std::string EmlLayoutDir(const std::string& filename, int layout) {
+
+    if (layout != EML_LAYOUT_HASH && layout != EML_LAYOUT_DATE) return "";
+
+    size_t pos = EmlNameStart(filename);
+    if (pos == std::string::npos) return "";
+
+    if (layout == EML_LAYOUT_HASH)
+        return filename.substr(pos+15, 2)+"/"+filename.substr(pos+17, 2)+"/";
+    return filename.substr(pos, 4)+"/"+filename.substr(pos+4, 2)+"/";
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  IsEmlLayoutDir()
+ *  Return true if a directory name is a layout sub-directory at the given depth (1 or 2)
+ */
+bool IsEmlLayoutDir(const std::string& name, int layout, int depth) {
+
+    if (layout == EML_LAYOUT_HASH) {
+        return name.length() == 2 && isxdigit((unsigned char)name[0]) && isxdigit((unsigned char)name[1])
+               && !isupper((unsigned char)name[0]) && !isupper((unsigned char)name[1]);
+    }
+    if (layout == EML_LAYOUT_DATE) {
+        return name.length() == ((depth == 1)?4u:2u) && is_number(name);
+    }
+    return false;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  EmlLayoutOfDir()
+ *  Return the layout of a first level layout sub-directory ("ab" or "YYYY")
+ *  or EML_LAYOUT_FLAT if the directory name is not one of them
+ */
+int EmlLayoutOfDir(const std::string& name) {
+
+    if (IsEmlLayoutDir(name, EML_LAYOUT_HASH, 1)) return EML_LAYOUT_HASH;
+    if (IsEmlLayoutDir(name, EML_LAYOUT_DATE, 1)) return EML_LAYOUT_DATE;
+    return EML_LAYOUT_FLAT;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  GetEmlLayouts()
+ *  Return the layouts recorded in the marker file of an output directory (ending with '/')
+ *  The flat layout is never recorded, an empty list means no layout sub-directory
+ */
+std::vector<int> GetEmlLayouts(const std::string& directory) {
+
+    std::vector<int> vLayouts;
+    std::ifstream marker(directory + EML_LAYOUT_MARKER);
+    std::string name;
+    while (std::getline(marker, name)) {
+        int layout = GetEmlLayout(trim(name, " \t\r"));
+        if (layout > EML_LAYOUT_FLAT && std::find(vLayouts.begin(), vLayouts.end(), layout) == vLayouts.end())
+            vLayouts.push_back(layout);
+    }
+    return vLayouts;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  SetEmlLayouts()
+ *  Record the layouts of an output directory (ending with '/') in its marker file
+ *  The file is removed if there is none
+ *  Return false if the file cannot be written
+ */
+bool SetEmlLayouts(const std::string& directory, const std::vector<int>& vLayouts) {
+
+    std::string filename = directory + EML_LAYOUT_MARKER;
+    std::string content;
+    for (int layout : vLayouts)
+        if (layout > EML_LAYOUT_FLAT) content += GetEmlLayoutName(layout) + "\n";
+    if (content.empty()) {
+        std::remove(filename.c_str());
+        return true;
+    }
+
+    std::ofstream marker(filename, std::ios::binary | std::ios::trunc);
+    marker << content;
+    return marker.good();
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  GetSplitMode()
+ *  Return the split mode from its name ("size", "count", "parts", "year", "month" or "day")
+ *  or -1 if unknown
+ */
+int GetSplitMode(const std::string& name) {
+
+    if (name == "size") return MBOX_SPLIT_SIZE;
+    if (name == "count") return MBOX_SPLIT_COUNT;
+    if (name == "parts") return MBOX_SPLIT_PARTS;
+    if (name == "year") return MBOX_SPLIT_YEAR;
+    if (name == "month") return MBOX_SPLIT_MONTH;
+    if (name == "day") return MBOX_SPLIT_DAY;
+    return -1;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  EmlDatePeriod()
+ *  Return the period of the date of an eml file name for a split mode by date :
+ *  "YYYY", "YYYY-mm" or "YYYY-mm-dd"
+ *  Return an empty string if the name is malformed or undated (invalid emails are named "00000000000000_MD5")
+ */
+std::string EmlDatePeriod(const std::string& filename, int mode) {
+
+    size_t pos = EmlNameStart(filename);
+    if (pos == std::string::npos || filename.compare(pos, 14, "00000000000000") == 0) return "";
+
+    std::string period = filename.substr(pos, 4);
+    if (mode == MBOX_SPLIT_MONTH || mode == MBOX_SPLIT_DAY) period += "-"+filename.substr(pos+4, 2);
+    if (mode == MBOX_SPLIT_DAY) period += "-"+filename.substr(pos+6, 2);
+    return period;
+}
+//---------------------------------------------------------------------------------------------
 /**
  *  path_dusting()
  *  Reformat a path string :
@@ -33,18 +33,26 @@
 #include <iostream>        // string::iterator
 #include <vector>
 #include <sstream>
+#include <fstream>
 #include <iomanip>         //setfill
 #include <algorithm>    // search
 #include <cstring>         //strerror
 #include <map>
+#include <unordered_set>
 #include <sys/stat.h>
 #include <openssl/md5.h>
 #include <errno.h>
 #include <cmath>         // floor
 #include <dirent.h>     // dirent, opendir
+#include <thread>
+#include <atomic>
+#include <cstdio>        // remove
 #if OPENSSL_VERSION_NUMBER >= 0x030000000
     #include <openssl/evp.h>
 #endif
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
 
 /// Cross platform sleep functions
 #ifdef _WIN32
@@ -54,6 +62,7 @@
     }
 #elif defined(__linux__) || defined(__APPLE__)
     #include <unistd.h>
+    #include <fcntl.h>         // openat
     inline int Sleep(int sleepMs) {
         return usleep(sleepMs * 1000);
     }
@@ -104,6 +113,46 @@ int ci_find_substr( const T& str1, const T& str2, size_t index, const std::local
     else return -1; // not found
 }
 
+/// Output directory layouts of eml files
+#define EML_LAYOUT_FLAT 0 // all files in mbox output directory
+#define EML_LAYOUT_HASH 1 // sub-directories from MD5 part of the name "ab/cd/"
+#define EML_LAYOUT_DATE 2 // sub-directories from date part of the name "YYYY/mm/"
+
+/// File of an output directory recording the layouts whose sub-directories hold eml files
+/// (one name by line), so that a thunderbird child folder is never taken for one of them
+#define EML_LAYOUT_MARKER ".mboxzilla_layout"
+
+/// Output formats of extracted emails
+#define EML_FORMAT_FILE 0 // an eml (or eml.gz) file for each email
+#define EML_FORMAT_PACK 1 // a pack file for each mbox (see Mbox_pack)
+#define EML_FORMAT_TAR 2 // entries of a tar stream, no local file (see Eml_tar_writer)
+#define EML_FORMAT_MAILDIR 3 // a Maildir "tmp/", "new/" and "cur/" in the output directory
+
+/// Separator of the info part "2,FLAGS" of a Maildir message name (':' is not allowed on windows)
+#ifdef _WIN32
+    #define MAILDIR_INFO_SEPARATOR '!'
+#else
+    #define MAILDIR_INFO_SEPARATOR ':'
+#endif
+
+#define MBOX_SPLIT_SIZE 0 // parts of N bytes at most
+#define MBOX_SPLIT_COUNT 1 // parts of N emails
+#define MBOX_SPLIT_PARTS 2 // N parts of balanced size
+#define MBOX_SPLIT_YEAR 3 // a part for each year of the emails date "YYYY"
+#define MBOX_SPLIT_MONTH 4 // a part for each month of the emails date "YYYY-mm"
+#define MBOX_SPLIT_DAY 5 // a part for each day of the emails date "YYYY-mm-dd"
+
+/// Entry of a directory tree listed by WalkDirectory()
+#define WALK_OTHER 0
+#define WALK_FILE 1
+#define WALK_DIR 2
+
+struct Walk_entry {
+    std::string path; // relative to the walked directory
+    bool is_dir;
+    Walk_entry(const std::string& p, bool d) : path(p), is_dir(d) {}
+};
+
 template<class C, class T>
 auto contains(const C& v, const T& x)
 -> decltype(end(v), true)
@@ -116,9 +165,15 @@ bool FileExists(const std::string& file);
 bool DirectoryExists(const std::string& directory);
 bool ListDirectoryContents(std::vector<std::string>& vList, const std::string directory, bool bGetFiles=true, bool bGetDirectories=true);
 bool ListAllSubDirectories(std::vector<std::string>& vList, const std::string directory);
-std::string PrintMD5(std::string str);
+bool WalkDirectory(std::vector<Walk_entry>& vEntries, const std::string directory, bool bGetFiles=true, bool bGetDirectories=true, unsigned int nbthreads=0);
+size_t PruneEmptyDirectories(const std::string directory, unsigned int nbthreads=0);
+bool DiffDirectory(std::vector<Walk_entry>& vDiff, const std::string directory, const std::unordered_set<std::string>& sKeep, bool bGetFiles=true, bool bGetDirectories=true, unsigned int nbthreads=0);
+std::string HexString(const unsigned char *data, size_t len);
+std::string PrintMD5(const std::string& str);
+std::string PrintMD5(const char *data, size_t len);
 size_t  offset(std::vector<char> &haystack, std::string const &str, size_t index=0);
 size_t  ci_offset(std::vector<char> &haystack, std::string const &str, size_t index=0);
+size_t  ascii_ci_search(const char *haystack, size_t len, const char *needle, size_t needlelen, size_t index=0);
 void split(const std::string& s, char c, std::vector<std::string>& v, bool allowEmptyString=true);
 int get_month_num( std::string name );
 int get_day_index( std::string name );
@@ -131,6 +186,18 @@ bool match(const char *first, const char * second);
 void str_replace(std::string& str, const std::string& from, const std::string& to);
 size_t count_needle(std::string const &haystack, std::string const &needle);
 size_t count_needle(std::vector<std::string> const &haystack, std::string const &needle);
+size_t RemoveFiles(const std::vector<std::string>& vFiles, std::vector<bool>& vRemoved, unsigned int nbthreads=0);
+int GetEmlLayout(const std::string& name);
+std::string GetEmlLayoutName(int layout);
+int GetEmlFormat(const std::string& name);
+std::string MaildirUniqueName(const std::string& filename);
+std::string EmlLayoutDir(const std::string& filename, int layout);
+bool IsEmlLayoutDir(const std::string& name, int layout, int depth);
+int EmlLayoutOfDir(const std::string& name);
+std::vector<int> GetEmlLayouts(const std::string& directory);
+bool SetEmlLayouts(const std::string& directory, const std::vector<int>& vLayouts);
+int GetSplitMode(const std::string& name);
+std::string EmlDatePeriod(const std::string& filename, int mode);
 std::string path_dusting (const std::string path);
 std::string bytes_convert(double bytes);
 bool is_number(const std::string& s);
@@ -0,0 +1,131 @@
+/*
+    BSD 2-Clause License
+
+    Copyright (c) 2017-2023, Nol Martinon
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+    Line ending conversion from linux ("\n") to windows ("\r\n") format.
+
+    Every "\n" that is not preceded by "\r" (a bare LF) is expanded to "\r\n",
+    so the emails that contain a mix of linux and windows line breaks are
+    supported. The functions process 16 bytes at once with SSE2 when available.
+*/
+
+#ifndef __CRLF_HPP
+#define __CRLF_HPP
+
+#include <stddef.h>
+#include <string.h>
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+
+/// Count the bare LF of a buffer
+/**
+ * 'lastcr' is true if the byte just before 'data' is "\r" (streaming use).
+ * Returns the number of bytes that lf_to_crlf() will add.
+ */
+inline size_t count_bare_lf(const char *data, size_t len, bool lastcr=false) {
+
+    size_t count = 0;
+    size_t i = 0;
+
+    #if defined(__SSE2__)
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    unsigned carry = lastcr ? 1 : 0;
+
+    for (; i+16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data+i));
+        unsigned mlf = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+        unsigned mcr = _mm_movemask_epi8(_mm_cmpeq_epi8(v, cr));
+        count += __builtin_popcount(mlf & ~((mcr << 1) | carry));
+        carry = mcr >> 15;
+    }
+    lastcr = carry;
+    #endif
+
+    for (; i < len; i++) {
+        if (data[i] == '\n' && !lastcr) count++;
+        lastcr = (data[i] == '\r');
+    }
+    return count;
+}
+
+/// Convert a buffer to windows line endings
+/**
+ * 'dst' must have room for len + count_bare_lf() bytes (or 2*len bytes).
+ * 'lastcr' is the state of the byte preceding 'src' and is updated for the
+ * next call so that a buffer can be converted by chunks.
+ * Returns the number of bytes written to 'dst'.
+ */
+inline size_t lf_to_crlf(const char *src, size_t len, char *dst, bool& lastcr) {
+
+    char *out = dst;
+    size_t i = 0;
+
+    #if defined(__SSE2__)
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+
+    for (; i+16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src+i));
+        unsigned mlf = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+        unsigned mcr = _mm_movemask_epi8(_mm_cmpeq_epi8(v, cr));
+        unsigned bare = mlf & ~((mcr << 1) | (lastcr ? 1 : 0));
+        lastcr = (mcr >> 15) != 0;
+
+        // Most of the blocks have no line break and are copied as is
+        if (!bare) {
+            _mm_storeu_si128((__m128i*)out, v);
+            out += 16;
+            continue;
+        }
+
+        // Copy segments ending before each bare LF and insert "\r"
+        size_t start = 0;
+        while (bare) {
+            size_t pos = __builtin_ctz(bare);
+            memcpy(out, src+i+start, pos-start);
+            out += pos-start;
+            *out++ = '\r';
+            start = pos; // the "\n" is copied with the next segment
+            bare &= bare-1;
+        }
+        memcpy(out, src+i+start, 16-start);
+        out += 16-start;
+    }
+    #endif
+
+    for (; i < len; i++) {
+        if (src[i] == '\n' && !lastcr) *out++ = '\r';
+        *out++ = src[i];
+        lastcr = (src[i] == '\r');
+    }
+    return out - dst;
+}
+
+#endif //__CRLF_HPP
@@ -0,0 +1,295 @@
+/*
+    BSD 2-Clause License
+
+    Copyright (c) 2017-2023, Nol Martinon
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+    Streaming transform chain for eml content.
+
+    The bytes of a message go once through a chain of stages that all work on
+    fixed size chunk buffers (line ending conversion, gzip compression, AES
+    encryption) and end in a sink (vector, file stream). A tee sends the same
+    output to a second chain, so that the eml file gets the plain content and
+    the upload gets it encrypted in the same pass.
+    eg:
+        Eml_pipeline upload;
+        upload.Add(new Aes_stage(key)).Add(new Vector_sink(vupload));
+        Eml_pipeline pipe;
+        pipe.Add(new Crlf_stage()).Add(new Gzip_stage()).Add(new Tee_stage(upload)).Add(new Vector_sink(veml));
+        pipe.Write(data, len);
+        pipe.Finish();
+*/
+
+#ifndef __EML_PIPELINE_HPP
+#define __EML_PIPELINE_HPP
+
+#include <vector>
+#include <string>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>      // min
+#include <string.h>
+#include <zlib.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include "simplyzip.hpp"    // MOD_GZIP_ZLIB_WINDOWSIZE, MOD_GZIP_ZLIB_CFACTOR
+#include "crlf.hpp"
+
+#define EML_PIPELINE_CHUNK 65536
+#define EML_PIPELINE_IVLEN 16    // bytes of the IV written after the AES ciphertext
+
+/// Base class of a stage
+/**
+ * A stage receives bytes with Write() and forwards its output to the next stage.
+ * Finish() flushes the stage, then the next ones.
+ */
+class Eml_stage {
+    public:
+        Eml_stage() : next(NULL) {}
+        virtual ~Eml_stage() {}
+        void SetNext(Eml_stage *stage) { next = stage; }
+        virtual void Write(const char *data, size_t len) = 0;
+        virtual void Finish() { if (next) next->Finish(); }
+
+    protected:
+        Eml_stage *next;
+        void Forward(const char *data, size_t len) { if (next && len) next->Write(data, len); }
+
+    private:
+        Eml_stage(const Eml_stage&);
+        Eml_stage& operator=(const Eml_stage&);
+};
+
+/// Convert line endings to windows format
+/**
+ * Every "\n" that is not preceded by "\r" becomes "\r\n", so a mix of linux and
+ * windows line breaks is supported. State is kept between two Write() calls.
+ */
+class Crlf_stage : public Eml_stage {
+    public:
+        Crlf_stage() : lastcr(false), outlen(0) {}
+
+        void Write(const char *data, size_t len) {
+            while (len) {
+                size_t piece = std::min(len, sizeof(out)/2); // worst case output is twice the input
+                if (outlen + 2*piece > sizeof(out)) Flush();
+                outlen += lf_to_crlf(data, piece, out+outlen, lastcr);
+                data += piece;
+                len -= piece;
+            }
+        }
+
+        void Finish() {
+            Flush();
+            Eml_stage::Finish();
+        }
+
+    private:
+        bool lastcr;
+        size_t outlen;
+        char out[EML_PIPELINE_CHUNK];
+
+        void Flush() { Forward(out, outlen); outlen = 0; }
+};
+
+/// Compress to gzip format
+/**
+ * Same settings as compress_gzip() in simplyzip.hpp
+ */
+class Gzip_stage : public Eml_stage {
+    public:
+        Gzip_stage(int compressionlevel = Z_BEST_COMPRESSION) {
+            memset(&zs, 0, sizeof(zs));
+            if (deflateInit2(&zs,
+                             compressionlevel,
+                             Z_DEFLATED,
+                             MOD_GZIP_ZLIB_WINDOWSIZE + 16,
+                             MOD_GZIP_ZLIB_CFACTOR,
+                             Z_DEFAULT_STRATEGY) != Z_OK
+            ) {
+                throw(std::runtime_error("deflateInit2 failed while compressing."));
+            }
+        }
+
+        ~Gzip_stage() { deflateEnd(&zs); }
+
+        void Write(const char *data, size_t len) {
+            zs.next_in = (Bytef*)data;
+            zs.avail_in = len;
+            do {
+                zs.next_out = reinterpret_cast<Bytef*>(out);
+                zs.avail_out = sizeof(out);
+                if (deflate(&zs, Z_NO_FLUSH) == Z_STREAM_ERROR)
+                    throw(std::runtime_error("Exception during zlib compression"));
+                Forward(out, sizeof(out) - zs.avail_out);
+            } while (zs.avail_out == 0);
+        }
+
+        void Finish() {
+            int ret;
+            zs.next_in = NULL;
+            zs.avail_in = 0;
+            do {
+                zs.next_out = reinterpret_cast<Bytef*>(out);
+                zs.avail_out = sizeof(out);
+                ret = deflate(&zs, Z_FINISH);
+                Forward(out, sizeof(out) - zs.avail_out);
+            } while (ret == Z_OK);
+
+            if (ret != Z_STREAM_END) {          // an error occurred that was not EOF
+                std::ostringstream oss;
+                oss << "Exception during zlib compression: (" << ret << ") " << zs.msg;
+                throw(std::runtime_error(oss.str()));
+            }
+            Eml_stage::Finish();
+        }
+
+    private:
+        z_stream zs;
+        char out[EML_PIPELINE_CHUNK];
+};
+
+/// Encrypt with AES-256-CBC
+/**
+ * A random IV is drawn for each stage, so for each message, and written after the
+ * ciphertext : the output is the same as AES_Encrypt() of mboxzilla.hpp followed by its IV
+ */
+class Aes_stage : public Eml_stage {
+    public:
+        Aes_stage(const std::string& key) : ctx(EVP_CIPHER_CTX_new()) {
+            if (key.length() != 32 || !ctx || RAND_bytes(iv, sizeof(iv)) != 1
+                || EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, (const unsigned char*)key.data(), iv) != 1) {
+                EVP_CIPHER_CTX_free(ctx);
+                throw(std::runtime_error("AES-256-CBC initialization failed (key must be 256 bits)"));
+            }
+        }
+
+        ~Aes_stage() { EVP_CIPHER_CTX_free(ctx); }
+
+        void Write(const char *data, size_t len) {
+            while (len) {
+                size_t piece = std::min(len, (size_t)EML_PIPELINE_CHUNK);
+                int outlen = 0;
+                if (EVP_EncryptUpdate(ctx, out, &outlen, (const unsigned char*)data, (int)piece) != 1)
+                    throw(std::runtime_error("EVP_EncryptUpdate failed"));
+                Forward((const char*)out, outlen);
+                data += piece;
+                len -= piece;
+            }
+        }
+
+        void Finish() {
+            int outlen = 0;
+            if (EVP_EncryptFinal_ex(ctx, out, &outlen) != 1)
+                throw(std::runtime_error("EVP_EncryptFinal_ex failed"));
+            Forward((const char*)out, outlen);
+            Forward((const char*)iv, sizeof(iv));
+            Eml_stage::Finish();
+        }
+
+    private:
+        EVP_CIPHER_CTX *ctx;
+        unsigned char iv[EML_PIPELINE_IVLEN];
+        unsigned char out[EML_PIPELINE_CHUNK + EVP_MAX_BLOCK_LENGTH];
+};
+
+/// Sink that appends the data to a vector
+class Vector_sink : public Eml_stage {
+    public:
+        Vector_sink(std::vector<char>& v) : vout(v) {}
+        void Write(const char *data, size_t len) { vout.insert(vout.end(), data, data+len); }
+
+    private:
+        std::vector<char>& vout;
+};
+
+/// Sink that writes the data to an output stream (eg: std::ofstream)
+class Stream_sink : public Eml_stage {
+    public:
+        Stream_sink(std::ostream& os) : out(os) {}
+        void Write(const char *data, size_t len) { out.write(data, len); }
+
+    private:
+        std::ostream& out;
+};
+
+/// Chain of stages
+/**
+ * Stages are added with Add() in processing order, the last one must be a sink.
+ * The pipeline takes ownership of the stages.
+ */
+class Eml_pipeline {
+    public:
+        Eml_pipeline() {}
+
+        ~Eml_pipeline() {
+            for (size_t i = 0; i < stages.size(); i++) delete stages[i];
+        }
+
+        Eml_pipeline& Add(Eml_stage *stage) {
+            if (!stages.empty()) stages.back()->SetNext(stage);
+            stages.push_back(stage);
+            return *this;
+        }
+
+        void Write(const char *data, size_t len) {
+            if (!stages.empty() && len) stages.front()->Write(data, len);
+        }
+
+        void Finish() {
+            if (!stages.empty()) stages.front()->Finish();
+        }
+
+    private:
+        std::vector<Eml_stage*> stages;
+        Eml_pipeline(const Eml_pipeline&);
+        Eml_pipeline& operator=(const Eml_pipeline&);
+};
+
+/// Send the data to the next stage and to a second pipeline
+/**
+ * The branch pipeline is owned by the caller, it is finished with this stage.
+ */
+class Tee_stage : public Eml_stage {
+    public:
+        Tee_stage(Eml_pipeline& pipe) : branch(pipe) {}
+
+        void Write(const char *data, size_t len) {
+            branch.Write(data, len);
+            Forward(data, len);
+        }
+
+        void Finish() {
+            branch.Finish();
+            Eml_stage::Finish();
+        }
+
+    private:
+        Eml_pipeline& branch;
+};
+
+#endif //__EML_PIPELINE_HPP
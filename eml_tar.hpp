@@ -0,0 +1,240 @@
+/*
+    BSD 2-Clause License
+
+    Copyright (c) 2017-2023, Nol Martinon
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+    Streaming tar output of eml files.
+
+    The eml files are written as entries of a POSIX (ustar) tar stream to a
+    file descriptor (stdout, a pipe or a FIFO) instead of the output directory,
+    so they can be piped to other tools without creating any local file.
+    Headers and contents are gathered in a buffer of EML_TAR_BUFFER bytes that
+    is written by large write() calls, never one per email. Names longer than
+    the ustar fields are given by a pax extended header.
+    eg:
+        Eml_tar_writer tar;
+        tar.Open("-");
+        tar.Add("Inbox/20170101000000_MD5.eml", date, data, len);
+        tar.Close();
+*/
+
+#ifndef __EML_TAR_HPP
+#define __EML_TAR_HPP
+
+#include <vector>
+#include <string>
+#include <cerrno>
+#include <algorithm>      // min
+#include <string.h>       // strerror, memcpy
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+    #include <io.h>
+#else
+    #include <unistd.h>
+#endif
+#include "eml_writer.hpp"          // SyncFileDescriptor()
+#ifndef O_BINARY
+    #define O_BINARY 0
+#endif
+
+#define EML_TAR_BUFFER (4*1024*1024)   // bytes gathered before a write
+#define EML_TAR_BLOCK 512
+
+/// Tar stream of eml files
+/**
+ * The functions return false on error, the message is given by GetError().
+ */
+class Eml_tar_writer {
+    public:
+        Eml_tar_writer() : fd(-1), bOwner(false), nbentries(0) {}
+        ~Eml_tar_writer() { Close(); }
+
+        /// Write to a file or FIFO created if needed, "-" is the standard output
+        bool Open(const std::string& path) {
+            if (path == "-") return Open(1, false);
+            int newfd = open(path.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_BINARY, 0666);
+            if (newfd < 0) return Fail("Could not open \""+path+"\" ("+strerror(errno)+")");
+            return Open(newfd, true);
+        }
+
+        /// Write to an open file descriptor, closed by Close() if bCloseFd is true
+        bool Open(int descriptor, bool bCloseFd) {
+            Close();
+            fd = descriptor;
+            bOwner = bCloseFd;
+            nbentries = 0;
+            error.clear();
+            buffer.clear();
+            buffer.reserve(EML_TAR_BUFFER + EML_TAR_BLOCK);
+            #ifdef _WIN32
+                _setmode(fd, _O_BINARY);
+            #endif
+            return true;
+        }
+
+        bool IsOpen() { return fd >= 0; }
+
+        std::string GetError() { return error; }
+
+        /// Number of entries written
+        size_t GetEntries() { return nbentries; }
+
+        /// Append a file entry, 'mtime' is its modification date (seconds since epoch)
+        bool Add(const std::string& path, long long mtime, const char *data, size_t len) {
+            if (fd < 0) return Fail("Tar output is not open");
+            if (!error.empty()) return false;
+            std::string name = path;
+            while (!name.empty() && name[0] == '/') name.erase(0, 1); // relative names only
+
+            std::string prefix, shortname;
+            if (!SplitName(name, prefix, shortname)) {
+                // Long name in a pax extended header ("length path=name\n")
+                std::string record = " path=" + name + "\n";
+                size_t length = record.length() + 1;
+                while (std::to_string(length).length() + record.length() != length) length++;
+                record = std::to_string(length) + record;
+                std::string paxname = "PaxHeader/" + name.substr(name.find_last_of('/')+1);
+                AddHeader(paxname.substr(0, 99), "", 'x', mtime, record.length());
+                AddData(record.data(), record.length());
+                shortname = name.substr(name.find_last_of('/')+1).substr(0, 99);
+                prefix.clear();
+            }
+            AddHeader(shortname, prefix, '0', mtime, len);
+            AddData(data, len);
+            nbentries++;
+
+            if (buffer.size() >= EML_TAR_BUFFER) return Flush();
+            return true;
+        }
+
+        /// Write the buffered entries
+        bool Flush() {
+            const char *data = buffer.data();
+            size_t len = buffer.size();
+            while (len) {
+                #ifdef _WIN32
+                    long n = _write(fd, data, (unsigned int)len);
+                #else
+                    long n = (long)write(fd, data, len);
+                #endif
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                    buffer.clear();
+                    return Fail(std::string("Could not write tar output (")+strerror(errno)+")");
+                }
+                data += n;
+                len -= n;
+            }
+            buffer.clear();
+            return true;
+        }
+
+        /// Write the end of archive (two empty blocks) and the buffered entries
+        /// If bSync is true and the output is a regular file then it is synced
+        bool Close(bool bSync = false) {
+            if (fd < 0) return true;
+            buffer.insert(buffer.end(), 2*EML_TAR_BLOCK, '\0');
+            bool ok = error.empty() && Flush();
+            struct stat st;
+            if (ok && bSync && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && !SyncFileDescriptor(fd))
+                ok = Fail(std::string("Could not sync tar output (")+strerror(errno)+")");
+            if (bOwner && close(fd) != 0 && ok)
+                ok = Fail(std::string("Could not write tar output (")+strerror(errno)+")");
+            fd = -1;
+            return ok;
+        }
+
+    private:
+        int fd;
+        bool bOwner; // fd is closed by Close()
+        size_t nbentries;
+        std::string error;
+        std::vector<char> buffer;
+
+        bool Fail(const std::string& message) {
+            error = message;
+            return false;
+        }
+
+        /// Split a name in ustar fields 'prefix' (155) and 'name' (100) on a '/'
+        static bool SplitName(const std::string& name, std::string& prefix, std::string& shortname) {
+            prefix.clear();
+            shortname = name;
+            if (name.length() <= 100) return true;
+            for (size_t pos = name.find('/'); pos != std::string::npos && pos <= 155; pos = name.find('/', pos+1)) {
+                if (name.length() - pos - 1 <= 100) {
+                    prefix = name.substr(0, pos);
+                    shortname = name.substr(pos+1);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void AddHeader(const std::string& name, const std::string& prefix, char type, long long mtime, unsigned long long size) {
+            char header[EML_TAR_BLOCK];
+            memset(header, 0, sizeof(header));
+            memcpy(header, name.data(), std::min(name.length(), (size_t)100));
+            Octal(header+100, 8, 0644); // mode
+            Octal(header+108, 8, 0); // uid
+            Octal(header+116, 8, 0); // gid
+            Octal(header+124, 12, size);
+            Octal(header+136, 12, mtime > 0 ? (unsigned long long)mtime : 0);
+            memset(header+148, ' ', 8); // checksum is computed with spaces
+            header[156] = type;
+            memcpy(header+257, "ustar", 6);
+            memcpy(header+263, "00", 2);
+            memcpy(header+345, prefix.data(), std::min(prefix.length(), (size_t)155));
+
+            unsigned int checksum = 0;
+            for (size_t i = 0; i < sizeof(header); i++) checksum += (unsigned char)header[i];
+            Octal(header+148, 7, checksum);
+            buffer.insert(buffer.end(), header, header+sizeof(header));
+        }
+
+        /// Append data padded to a whole number of blocks
+        void AddData(const char *data, size_t len) {
+            buffer.insert(buffer.end(), data, data+len);
+            size_t padding = (EML_TAR_BLOCK - len % EML_TAR_BLOCK) % EML_TAR_BLOCK;
+            buffer.insert(buffer.end(), padding, '\0');
+        }
+
+        /// Write a zero padded octal number of 'width'-1 digits ended by NUL
+        static void Octal(char *field, size_t width, unsigned long long value) {
+            field[width-1] = '\0';
+            for (size_t i = width-1; i > 0; i--) {
+                field[i-1] = '0' + (value & 7);
+                value >>= 3;
+            }
+        }
+
+        Eml_tar_writer(const Eml_tar_writer&);
+        Eml_tar_writer& operator=(const Eml_tar_writer&);
+};
+
+#endif //__EML_TAR_HPP
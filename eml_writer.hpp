@@ -0,0 +1,752 @@
+/*
+    BSD 2-Clause License
+
+    Copyright (c) 2017-2023, Nol Martinon
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+    Write-behind writer for eml files.
+
+    The parse thread hands over the content of each eml with Submit() and goes
+    on with the next email while the files are written in background. Each file
+    is written to a temporary name and renamed once complete, so an interrupted
+    run never leaves a truncated eml that would be taken as already extracted.
+    The result of each file is given back by Collect().
+
+    On linux, when the kernel supports it, the files are written by batches with
+    io_uring: the open, write, sync and rename operations of up to
+    EML_WRITER_BATCH files are submitted with one system call for each step.
+    Otherwise a pool of threads writes the files one by one. With a single core,
+    the files are written by the calling thread since a background thread would
+    only add context switches.
+
+    The rename alone does not survive a power loss: the name can reach the disk
+    before the data. SetDurability() makes the writer sync the files before they
+    are renamed, then sync their directories:
+    - EML_DURABILITY_GROUP : written files are kept open and committed together
+      every 'nbfiles' files or 'ms' milliseconds (and by Flush()), so the file
+      system can merge the journal commits of the group.
+    - EML_DURABILITY_FILE  : each file is committed alone.
+    A file is reported by Collect() once committed.
+    The temporary name can be given to Submit(), eg to deliver into a Maildir
+    where messages are written in tmp/ then renamed into new/ or cur/.
+    eg:
+        Eml_writer writer;
+        writer.SetDurability(EML_DURABILITY_GROUP);
+        writer.Submit("/path/file.eml", vdata); // vdata is taken
+        writer.Flush();
+        writer.Collect(vResults);
+*/
+
+#ifndef __EML_WRITER_HPP
+#define __EML_WRITER_HPP
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <algorithm>      // min, max
+#include <cstdio>
+#include <cerrno>
+#include <string.h>
+#include <fcntl.h>
+#ifdef _WIN32
+    #include <io.h>       // _commit
+#else
+    #include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+    #if __has_include(<linux/io_uring.h>)
+        #include <linux/io_uring.h>
+        // IORING_OP_RENAMEAT is available with kernel headers >= 5.12
+        #ifdef IORING_FEAT_NATIVE_WORKERS
+            #define EML_WRITER_URING
+            #include <sys/mman.h>
+            #include <sys/syscall.h>
+        #endif
+    #endif
+#endif
+
+#define EML_WRITER_BATCH 64                         // max files for each io_uring batch
+#define EML_WRITER_MAXPENDING (64*1024*1024)        // max bytes waiting to be written
+#define EML_WRITER_TMPSUFFIX ".tmp"
+#define EML_WRITER_GROUPFILES 256                   // default max files of a durability group
+#define EML_WRITER_GROUPMS 1000                     // default max delay of a durability group
+
+#define EML_DURABILITY_NONE 0       // files are renamed once written, without sync
+#define EML_DURABILITY_GROUP 1      // files are synced by groups before being renamed
+#define EML_DURABILITY_FILE 2       // each file is synced before being renamed
+
+/// Return the durability mode of a name ("none", "group" or "file"), -1 if unknown
+inline int GetEmlDurability(const std::string& name) {
+    if (name == "none") return EML_DURABILITY_NONE;
+    if (name == "group") return EML_DURABILITY_GROUP;
+    if (name == "file") return EML_DURABILITY_FILE;
+    return -1;
+}
+
+/// Flush the data of an open file to the disk
+inline bool SyncFileDescriptor(int fd) {
+    #ifdef _WIN32
+        return _commit(fd) == 0;
+    #elif defined(__APPLE__)
+        // fsync() does not flush the disk cache on macOS
+        return fcntl(fd, F_FULLFSYNC) == 0 || fsync(fd) == 0;
+    #else
+        return fdatasync(fd) == 0;
+    #endif
+}
+
+/// Flush the content of a closed file to the disk
+inline bool SyncFile(const std::string& path) {
+    #ifdef _WIN32
+        int fd = _open(path.c_str(), _O_RDWR|_O_BINARY);
+    #else
+        int fd = open(path.c_str(), O_RDONLY);
+    #endif
+    if (fd < 0) return false;
+    bool ok = SyncFileDescriptor(fd);
+    int err = errno;
+    close(fd);
+    errno = err;
+    return ok;
+}
+
+/// Make the created or renamed entries of a directory durable (no-op on windows)
+inline bool SyncDirectory(const std::string& dir) {
+    #ifdef _WIN32
+        return true;
+    #else
+        int fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        bool ok = fsync(fd) == 0;
+        int err = errno;
+        close(fd);
+        errno = err;
+        return ok;
+    #endif
+}
+
+/// Result of a file write
+struct Eml_write_result {
+    std::string path;
+    bool ok;
+    std::string error; // error message when not ok
+    Eml_write_result(const std::string& p, bool b, const std::string& e="") : path(p), ok(b), error(e) {}
+};
+
+#ifdef EML_WRITER_URING
+/// Minimal io_uring instance used by Eml_writer (no liburing dependency)
+/**
+ * Run() submits a batch of prepared operations and waits for all of them,
+ * the result of each one is returned in the order of preparation.
+ */
+class Eml_uring {
+    public:
+        Eml_uring() : fd(-1), sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED), sqes(NULL), nbprepared(0) {
+            struct io_uring_params p;
+            memset(&p, 0, sizeof(p));
+            fd = (int)syscall(__NR_io_uring_setup, EML_WRITER_BATCH, &p);
+            if (fd < 0) return;
+
+            sq_len = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+            cq_len = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+            if (p.features & IORING_FEAT_SINGLE_MMAP) sq_len = cq_len = std::max(sq_len, cq_len);
+            sqes_len = p.sq_entries*sizeof(struct io_uring_sqe);
+
+            sq_ptr = mmap(NULL, sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+            if (sq_ptr == MAP_FAILED) return;
+            if (p.features & IORING_FEAT_SINGLE_MMAP) cq_ptr = sq_ptr;
+            else {
+                cq_ptr = mmap(NULL, cq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+                if (cq_ptr == MAP_FAILED) return;
+            }
+            void *ptr = mmap(NULL, sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+            if (ptr == MAP_FAILED) return;
+            sqes = (struct io_uring_sqe*)ptr;
+
+            sq_tail = (unsigned*)((char*)sq_ptr + p.sq_off.tail);
+            sq_mask = (unsigned*)((char*)sq_ptr + p.sq_off.ring_mask);
+            sq_array = (unsigned*)((char*)sq_ptr + p.sq_off.array);
+            cq_head = (unsigned*)((char*)cq_ptr + p.cq_off.head);
+            cq_tail = (unsigned*)((char*)cq_ptr + p.cq_off.tail);
+            cq_mask = (unsigned*)((char*)cq_ptr + p.cq_off.ring_mask);
+            cqes = (struct io_uring_cqe*)((char*)cq_ptr + p.cq_off.cqes);
+        }
+
+        ~Eml_uring() {
+            if (sqes) munmap(sqes, sqes_len);
+            if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_len);
+            if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_len);
+            if (fd >= 0) close(fd);
+        }
+
+        /// Return true if the ring is set up and supports all the operations used
+        bool IsUsable() {
+            if (!sqes) return false;
+            std::vector<char> buf(sizeof(struct io_uring_probe) + 256*sizeof(struct io_uring_probe_op), 0);
+            struct io_uring_probe *probe = (struct io_uring_probe*)buf.data();
+            if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0) return false;
+            const int ops[] = {IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_RENAMEAT, IORING_OP_UNLINKAT};
+            for (size_t i = 0; i < sizeof(ops)/sizeof(ops[0]); i++) {
+                if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) return false;
+            }
+            return true;
+        }
+
+        void PrepOpen(const char *path) {
+            struct io_uring_sqe *sqe = Prep(IORING_OP_OPENAT, AT_FDCWD);
+            sqe->addr = (unsigned long)path;
+            sqe->len = 0666;
+            sqe->open_flags = O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC;
+        }
+
+        void PrepWrite(int filefd, const char *data, unsigned int len, unsigned long long off) {
+            struct io_uring_sqe *sqe = Prep(IORING_OP_WRITE, filefd);
+            sqe->addr = (unsigned long)data;
+            sqe->len = len;
+            sqe->off = off;
+        }
+
+        void PrepDataSync(int filefd) {
+            struct io_uring_sqe *sqe = Prep(IORING_OP_FSYNC, filefd);
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        }
+
+        void PrepRename(const char *oldpath, const char *newpath) {
+            struct io_uring_sqe *sqe = Prep(IORING_OP_RENAMEAT, AT_FDCWD);
+            sqe->addr = (unsigned long)oldpath;
+            sqe->len = AT_FDCWD;
+            sqe->addr2 = (unsigned long)newpath;
+        }
+
+        void PrepUnlink(const char *path) {
+            struct io_uring_sqe *sqe = Prep(IORING_OP_UNLINKAT, AT_FDCWD);
+            sqe->addr = (unsigned long)path;
+        }
+
+        /// Submit the prepared operations and wait for their completion
+        /// vRes receives the result of each operation (value >= 0 or -errno)
+        bool Run(std::vector<int>& vRes) {
+            unsigned int n = nbprepared, submitted = 0, done = 0;
+            nbprepared = 0;
+            vRes.assign(n, -ECANCELED);
+            __atomic_store_n(sq_tail, *sq_tail + n, __ATOMIC_RELEASE);
+
+            while (done < n) {
+                int ret = (int)syscall(__NR_io_uring_enter, fd, n-submitted, n-done, IORING_ENTER_GETEVENTS, NULL, 0);
+                if (ret < 0) {
+                    if (errno == EINTR) continue;
+                    return false;
+                }
+                submitted += ret;
+
+                unsigned head = *cq_head;
+                unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+                for (; head != tail; head++) {
+                    struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+                    if (cqe->user_data < n) vRes[cqe->user_data] = cqe->res;
+                    done++;
+                }
+                __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            }
+            return true;
+        }
+
+    private:
+        int fd;
+        void *sq_ptr, *cq_ptr;
+        size_t sq_len, cq_len, sqes_len;
+        unsigned *sq_tail, *sq_mask, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+        unsigned int nbprepared;
+
+        struct io_uring_sqe* Prep(int opcode, int filefd) {
+            unsigned idx = (*sq_tail + nbprepared) & *sq_mask;
+            struct io_uring_sqe *sqe = &sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = opcode;
+            sqe->fd = filefd;
+            sqe->user_data = nbprepared;
+            sq_array[idx] = idx;
+            nbprepared++;
+            return sqe;
+        }
+
+        Eml_uring(const Eml_uring&);
+        Eml_uring& operator=(const Eml_uring&);
+};
+#endif
+
+/// Write eml files in background
+/**
+ * Submit() blocks while more than EML_WRITER_MAXPENDING bytes are waiting.
+ * 'nbthreads' is the size of the thread pool used without io_uring
+ * (default is the number of cores, limited to 8).
+ * Without worker thread (single core), Submit() writes the file itself and
+ * the delay of a durability group is checked on each call.
+ */
+class Eml_writer {
+    public:
+        Eml_writer(unsigned int nbthreads = 0) : pendingfiles(0), pendingbytes(0), bStop(false), bFlush(false), bUring(false),
+                                                 durability(EML_DURABILITY_NONE), groupfiles(EML_WRITER_GROUPFILES),
+                                                 groupms(EML_WRITER_GROUPMS) {
+            #ifdef EML_WRITER_URING
+                uring = NULL;
+            #endif
+            unsigned int nbcores = std::thread::hardware_concurrency();
+            if (nbcores == 1) return;
+
+            #ifdef EML_WRITER_URING
+                uring = new Eml_uring();
+                if (uring->IsUsable()) {
+                    bUring = true;
+                    workers.push_back(std::thread(&Eml_writer::UringWorker, this));
+                    return;
+                }
+                delete uring;
+                uring = NULL;
+            #endif
+            if (!nbthreads) nbthreads = nbcores;
+            nbthreads = std::max(1u, std::min(nbthreads, 8u));
+            for (unsigned int i = 0; i < nbthreads; i++)
+                workers.push_back(std::thread(&Eml_writer::PoolWorker, this));
+        }
+
+        ~Eml_writer() {
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                bStop = true;
+            }
+            cvJobs.notify_all();
+            for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+            std::vector<Eml_write_result> vResults;
+            CommitDue(inlinegroup, true, vResults);
+            #ifdef EML_WRITER_URING
+                delete uring;
+            #endif
+        }
+
+        /// Return true if files are written with io_uring
+        bool IsUring() { return bUring; }
+
+        /// Set the durability mode (EML_DURABILITY_*), must be called before the first Submit()
+        /// A group is committed when it holds 'nbfiles' files or is 'ms' milliseconds old
+        void SetDurability(int mode, size_t nbfiles = EML_WRITER_GROUPFILES, unsigned int ms = EML_WRITER_GROUPMS) {
+            std::unique_lock<std::mutex> lock(mtx);
+            durability = mode;
+            groupfiles = (mode == EML_DURABILITY_FILE) ? 1 : std::max((size_t)1, nbfiles);
+            groupms = ms;
+            // Each thread of the pool holds its own group, the open files are shared between them
+            if (!bUring && workers.size() > 1) groupfiles = std::max((size_t)1, groupfiles/workers.size());
+        }
+
+        /// Queue a file to write, the content of 'data' is taken (data is emptied)
+        /// The file is written to 'tmppath', by default 'path' + EML_WRITER_TMPSUFFIX,
+        /// then renamed to 'path'
+        void Submit(const std::string& path, std::vector<char>& data, const std::string& tmppath = "") {
+            if (workers.empty()) {
+                Job job;
+                job.path = path;
+                job.tmppath = tmppath.empty() ? path + EML_WRITER_TMPSUFFIX : tmppath;
+                job.data.swap(data);
+                std::vector<Eml_write_result> vResults;
+                WriteTmp(job, inlinegroup);
+                CommitDue(inlinegroup, false, vResults);
+                std::unique_lock<std::mutex> lock(mtx);
+                results.insert(results.end(), vResults.begin(), vResults.end());
+                return;
+            }
+
+            std::unique_lock<std::mutex> lock(mtx);
+            cvDone.wait(lock, [this]{ return pendingbytes <= EML_WRITER_MAXPENDING; });
+            jobs.push_back(Job());
+            jobs.back().path = path;
+            jobs.back().tmppath = tmppath.empty() ? path + EML_WRITER_TMPSUFFIX : tmppath;
+            jobs.back().data.swap(data);
+            pendingfiles++;
+            pendingbytes += jobs.back().data.size();
+            lock.unlock();
+            cvJobs.notify_one();
+        }
+
+        /// Move the results of the completed files to vResults, return their number
+        size_t Collect(std::vector<Eml_write_result>& vResults) {
+            std::unique_lock<std::mutex> lock(mtx);
+            size_t n = results.size();
+            vResults.insert(vResults.end(), results.begin(), results.end());
+            results.clear();
+            return n;
+        }
+
+        /// Wait for all submitted files to be written and committed
+        void Flush() {
+            if (workers.empty()) {
+                std::vector<Eml_write_result> vResults;
+                CommitDue(inlinegroup, true, vResults);
+                std::unique_lock<std::mutex> lock(mtx);
+                results.insert(results.end(), vResults.begin(), vResults.end());
+                return;
+            }
+
+            std::unique_lock<std::mutex> lock(mtx);
+            bFlush = true;
+            cvJobs.notify_all();
+            cvDone.wait(lock, [this]{ return pendingfiles == 0; });
+            bFlush = false;
+        }
+
+    private:
+        struct Job {
+            std::string path;
+            std::string tmppath;
+            std::vector<char> data;
+        };
+
+        /// Written file waiting for its commit (sync, close and rename)
+        struct Pending {
+            std::string path;
+            std::string tmppath;
+            FILE *f;            // stream of the temporary file, NULL if written with io_uring
+            int fd;             // descriptor of the temporary file, -1 if closed
+            std::string error;  // error message of the file, empty if none
+            Pending(const Job& job) : path(job.path), tmppath(job.tmppath), f(NULL), fd(-1) {}
+        };
+
+        /// Files of a worker waiting for their commit
+        struct Group {
+            std::vector<Pending> files;
+            std::chrono::steady_clock::time_point deadline; // commit time limit of the group
+        };
+
+        std::mutex mtx;
+        std::condition_variable cvJobs, cvDone;
+        std::deque<Job> jobs;
+        std::vector<Eml_write_result> results;
+        std::vector<std::thread> workers;
+        size_t pendingfiles, pendingbytes;
+        bool bStop;
+        bool bFlush;  // commit the groups without waiting for their time limit
+        bool bUring;
+        int durability;
+        size_t groupfiles;
+        unsigned int groupms;
+        Group inlinegroup; // group of the calling thread when there is no worker
+        #ifdef EML_WRITER_URING
+            Eml_uring *uring;
+        #endif
+
+        /// Take up to 'max' jobs
+        /// While the worker holds uncommitted files, wait for jobs no longer than the time limit
+        /// of its group or a Flush(), in that case no job is taken and the group is to be committed
+        /// Return false when the writer is stopped and no job remains
+        bool TakeJobs(std::vector<Job>& vJobs, size_t max, const Group& grp) {
+            std::unique_lock<std::mutex> lock(mtx);
+            auto ready = [this, &grp]{ return bStop || !jobs.empty() || (bFlush && !grp.files.empty()); };
+            if (grp.files.empty()) cvJobs.wait(lock, ready);
+            else cvJobs.wait_until(lock, grp.deadline, ready);
+            while (!jobs.empty() && vJobs.size() < max) {
+                vJobs.push_back(Job());
+                vJobs.back().path.swap(jobs.front().path);
+                vJobs.back().tmppath.swap(jobs.front().tmppath);
+                vJobs.back().data.swap(jobs.front().data);
+                jobs.pop_front();
+            }
+            return !(bStop && vJobs.empty());
+        }
+
+        /// Release the written jobs and publish the results of the committed files
+        void Done(std::vector<Job>& vJobs, std::vector<Eml_write_result>& vResults) {
+            std::unique_lock<std::mutex> lock(mtx);
+            for (size_t i = 0; i < vJobs.size(); i++) pendingbytes -= vJobs[i].data.size();
+            pendingfiles -= vResults.size();
+            results.insert(results.end(), vResults.begin(), vResults.end());
+            lock.unlock();
+            cvDone.notify_all();
+        }
+
+        static std::string ErrorMessage(const std::string& action, const std::string& path, int err) {
+            return "Could not "+action+" \""+path+"\" ("+strerror(err)+")";
+        }
+
+        static std::string ParentDirectory(const std::string& path) {
+            size_t pos = path.find_last_of("/\\");
+            return pos == std::string::npos ? "." : path.substr(0, pos+1);
+        }
+
+        /// Add a written file to a group, the time limit starts with its first file
+        void AddToGroup(Group& grp, const Pending& p) {
+            if (grp.files.empty()) grp.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(groupms);
+            grp.files.push_back(p);
+        }
+
+        /// Portable write of a file to its temporary name, the file is left open in the group
+        void WriteTmp(const Job& job, Group& grp) {
+            Pending p(job);
+            p.f = fopen(p.tmppath.c_str(), "wb");
+            if (!p.f) p.error = ErrorMessage("open", p.tmppath, errno);
+            else if ((!job.data.empty() && fwrite(job.data.data(), 1, job.data.size(), p.f) != job.data.size()) || fflush(p.f) != 0)
+                p.error = ErrorMessage("write to", p.tmppath, errno);
+            else p.fd = fileno(p.f);
+            AddToGroup(grp, p);
+        }
+
+        static void CloseFile(Pending& p) {
+            if (p.f) {
+                if (fclose(p.f) != 0 && p.error.empty()) p.error = ErrorMessage("write to", p.tmppath, errno);
+            }
+            else if (p.fd >= 0 && close(p.fd) != 0 && p.error.empty()) {
+                p.error = ErrorMessage("write to", p.tmppath, errno);
+            }
+            p.f = NULL;
+            p.fd = -1;
+        }
+
+        /// Rename the temporary file of a complete file, remove the one of a failed file
+        static void RenameOrRemove(Pending& p) {
+            if (p.error.empty() && std::rename(p.tmppath.c_str(), p.path.c_str()) != 0)
+                p.error = ErrorMessage("rename to", p.path, errno);
+            if (!p.error.empty()) std::remove(p.tmppath.c_str());
+        }
+
+        /// Commit the files of the group that are due and give their results in vResults
+        /// All files are committed if 'all', without durability or once the time limit is
+        /// reached, else only the complete groups
+        void CommitDue(Group& grp, bool all, std::vector<Eml_write_result>& vResults) {
+            size_t n = grp.files.size();
+            if (!n) return;
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            bool bNone = (durability == EML_DURABILITY_NONE);
+            if (!all && !bNone && now < grp.deadline) n -= n % groupfiles;
+
+            size_t chunk = bNone ? n : groupfiles;
+            for (size_t first = 0; first < n; first += chunk)
+                Commit(grp.files, first, std::min(chunk, n-first), vResults);
+
+            grp.files.erase(grp.files.begin(), grp.files.begin()+n);
+            if (!grp.files.empty()) grp.deadline = now + std::chrono::milliseconds(groupms);
+        }
+
+        /// Commit 'n' files from 'first' : sync (with durability), close then rename
+        /// The directories of the renamed files are synced once each
+        void Commit(std::vector<Pending>& vFiles, size_t first, size_t n, std::vector<Eml_write_result>& vResults) {
+            bool bSync = (durability != EML_DURABILITY_NONE);
+            bool done = false;
+            #ifdef EML_WRITER_URING
+                if (uring) done = UringCommit(vFiles, first, n);
+            #endif
+            if (!done) {
+                for (size_t i = first; i < first+n; i++) {
+                    Pending& p = vFiles[i];
+                    if (bSync && p.error.empty() && !SyncFileDescriptor(p.fd))
+                        p.error = ErrorMessage("sync", p.tmppath, errno);
+                    CloseFile(p);
+                    RenameOrRemove(p);
+                }
+            }
+
+            if (bSync) {
+                std::vector<std::string> vDirs;
+                for (size_t i = first; i < first+n; i++) {
+                    if (!vFiles[i].error.empty()) continue;
+                    std::string dir = ParentDirectory(vFiles[i].path);
+                    if (std::find(vDirs.begin(), vDirs.end(), dir) == vDirs.end()) vDirs.push_back(dir);
+                }
+                for (size_t d = 0; d < vDirs.size(); d++) {
+                    if (SyncDirectory(vDirs[d])) continue;
+                    std::string error = ErrorMessage("sync", vDirs[d], errno);
+                    for (size_t i = first; i < first+n; i++) {
+                        if (vFiles[i].error.empty() && ParentDirectory(vFiles[i].path) == vDirs[d]) vFiles[i].error = error;
+                    }
+                }
+            }
+
+            for (size_t i = first; i < first+n; i++)
+                vResults.push_back(Eml_write_result(vFiles[i].path, vFiles[i].error.empty(), vFiles[i].error));
+        }
+
+        void PoolWorker() {
+            std::vector<Job> vJobs;
+            std::vector<Eml_write_result> vResults;
+            Group grp;
+            while (true) {
+                bool running = TakeJobs(vJobs, 1, grp);
+                for (size_t i = 0; i < vJobs.size(); i++) WriteTmp(vJobs[i], grp);
+                CommitDue(grp, vJobs.empty(), vResults);
+                Done(vJobs, vResults);
+                vJobs.clear();
+                vResults.clear();
+                if (!running) break;
+            }
+        }
+
+        #ifdef EML_WRITER_URING
+        void UringWorker() {
+            std::vector<Job> vJobs;
+            std::vector<Eml_write_result> vResults;
+            Group grp;
+            while (true) {
+                bool running = TakeJobs(vJobs, EML_WRITER_BATCH, grp);
+                if (!vJobs.empty() && (!uring || !UringBatch(vJobs, grp))) {
+                    // Ring failure: the batch is written again without io_uring
+                    for (size_t i = 0; i < vJobs.size(); i++) WriteTmp(vJobs[i], grp);
+                }
+                CommitDue(grp, vJobs.empty(), vResults);
+                Done(vJobs, vResults);
+                vJobs.clear();
+                vResults.clear();
+                if (!running) break;
+            }
+        }
+
+        /// Write a batch of files to their temporary name with io_uring, each step is a single
+        /// submission for all files. The files are left open in the group.
+        /// Return false if the ring itself failed (nothing is then added to the group)
+        bool UringBatch(std::vector<Job>& vJobs, Group& grp) {
+            size_t n = vJobs.size();
+            std::vector<std::string> vTmp(n);
+            std::vector<std::string> vError(n); // error message of each file, empty if none
+            std::vector<int> vFd(n, -1), vRes;
+            std::vector<size_t> vWritten(n, 0), vIndex;
+
+            for (size_t i = 0; i < n; i++) {
+                vTmp[i] = vJobs[i].tmppath;
+                uring->PrepOpen(vTmp[i].c_str());
+            }
+            if (!uring->Run(vRes)) return RingFailure(vFd);
+            for (size_t i = 0; i < n; i++) {
+                if (vRes[i] >= 0) vFd[i] = vRes[i];
+                else vError[i] = ErrorMessage("open", vTmp[i], -vRes[i]);
+            }
+
+            // Writes are submitted again for the remaining bytes until all are complete
+            while (true) {
+                vIndex.clear();
+                for (size_t i = 0; i < n; i++) {
+                    if (vFd[i] < 0 || !vError[i].empty() || vWritten[i] == vJobs[i].data.size()) continue;
+                    size_t len = std::min(vJobs[i].data.size()-vWritten[i], (size_t)1 << 30);
+                    uring->PrepWrite(vFd[i], vJobs[i].data.data()+vWritten[i], (unsigned int)len, vWritten[i]);
+                    vIndex.push_back(i);
+                }
+                if (vIndex.empty()) break;
+                if (!uring->Run(vRes)) return RingFailure(vFd);
+                for (size_t k = 0; k < vIndex.size(); k++) {
+                    size_t i = vIndex[k];
+                    if (vRes[k] > 0) vWritten[i] += vRes[k];
+                    else vError[i] = ErrorMessage("write to", vTmp[i], vRes[k] ? -vRes[k] : EIO);
+                }
+            }
+
+            for (size_t i = 0; i < n; i++) {
+                Pending p(vJobs[i]);
+                p.fd = vFd[i];
+                p.error = vError[i];
+                AddToGroup(grp, p);
+            }
+            return true;
+        }
+
+        /// Commit 'n' files from 'first' with io_uring : the syncs of the files are submitted
+        /// together so that the file system can merge them, the renames too
+        /// Return false if the ring failed before any file was closed
+        bool UringCommit(std::vector<Pending>& vFiles, size_t first, size_t n) {
+            std::vector<int> vRes;
+            std::vector<size_t> vIndex;
+            size_t end = first+n;
+
+            if (durability != EML_DURABILITY_NONE) {
+                for (size_t start = first; start < end; start += EML_WRITER_BATCH) {
+                    vIndex.clear();
+                    for (size_t i = start; i < std::min(end, start+EML_WRITER_BATCH); i++) {
+                        if (!vFiles[i].error.empty()) continue;
+                        uring->PrepDataSync(vFiles[i].fd);
+                        vIndex.push_back(i);
+                    }
+                    if (vIndex.empty()) continue;
+                    if (!uring->Run(vRes)) {
+                        delete uring;
+                        uring = NULL;
+                        return false;
+                    }
+                    for (size_t k = 0; k < vIndex.size(); k++) {
+                        Pending& p = vFiles[vIndex[k]];
+                        if (vRes[k] < 0) p.error = ErrorMessage("sync", p.tmppath, -vRes[k]);
+                    }
+                }
+            }
+
+            for (size_t i = first; i < end; i++) CloseFile(vFiles[i]);
+
+            // Complete files are renamed, temporary files of failed ones are removed
+            std::vector<std::string> vTmp(n);
+            for (size_t i = first; i < end; i++) vTmp[i-first] = vFiles[i].tmppath;
+            for (size_t start = first; start < end; start += EML_WRITER_BATCH) {
+                size_t stop = std::min(end, start+EML_WRITER_BATCH);
+                for (size_t i = start; i < stop; i++) {
+                    if (vFiles[i].error.empty()) uring->PrepRename(vTmp[i-first].c_str(), vFiles[i].path.c_str());
+                    else uring->PrepUnlink(vTmp[i-first].c_str());
+                }
+                if (!uring->Run(vRes)) {
+                    // The files whose temporary name is still there were not handled by the ring
+                    delete uring;
+                    uring = NULL;
+                    for (size_t i = start; i < end; i++) {
+                        if (access(vTmp[i-first].c_str(), F_OK) == 0) RenameOrRemove(vFiles[i]);
+                    }
+                    return true;
+                }
+                for (size_t i = start; i < stop; i++) {
+                    Pending& p = vFiles[i];
+                    if (p.error.empty() && vRes[i-start] < 0) {
+                        p.error = ErrorMessage("rename to", p.path, -vRes[i-start]);
+                        std::remove(vTmp[i-first].c_str());
+                    }
+                }
+            }
+            return true;
+        }
+
+        /// Close the files left open by a failed batch and stop using the ring
+        bool RingFailure(std::vector<int>& vFd) {
+            for (size_t i = 0; i < vFd.size(); i++) {
+                if (vFd[i] >= 0) close(vFd[i]);
+            }
+            delete uring;
+            uring = NULL;
+            return false;
+        }
+        #endif
+
+        Eml_writer(const Eml_writer&);
+        Eml_writer& operator=(const Eml_writer&);
+};
+
+#endif //__EML_WRITER_HPP
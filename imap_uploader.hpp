@@ -0,0 +1,783 @@
+/*
+    BSD 2-Clause License
+
+    Copyright (c) 2017-2023, Nol Martinon
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+    Upload of emails to an IMAP server.
+
+    The messages are appended to the mailboxes with the date of the email as
+    INTERNALDATE. The parse thread hands over each message with Submit() and goes
+    on while a pool of threads appends them, each thread with its own connection
+    kept open between messages (TLS with "imaps://"). The APPEND commands are
+    pipelined : if the server advertises LITERAL+, up to IMAP_PIPELINE_DEPTH
+    commands are sent without waiting for their result, else if it advertises
+    MULTIAPPEND, up to IMAP_PIPELINE_DEPTH messages are sent by a single command.
+    The result of each message is given back by Collect().
+    The connections are opened by libcurl and the IMAP commands are exchanged over
+    them with curl_easy_send() and curl_easy_recv().
+    Prepare() creates a mailbox if needed and gives the Message-ID of the messages
+    it already contains, fetched once, so that they are not appended again.
+    eg:
+        IMAP_config config;
+        config.Parse("imaps://mail.domain.net/Archives");
+        config.user = "user"; config.password = "password";
+        IMAP_uploader uploader(config);
+        uploader.Prepare("Inbox", mailbox, vMessageIds, error); // mailbox is "Archives/Inbox"
+        uploader.Submit(mailbox, "20170101000000_MD5.eml", vdata, date); // vdata is taken
+        uploader.Flush();
+        uploader.Collect(vResults);
+*/
+
+#ifndef __IMAP_UPLOADER_HPP
+#define __IMAP_UPLOADER_HPP
+
+#include <map>
+#include <deque>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>      // min, max
+#include <cstdlib>        // strtoul
+#include <cctype>         // isxdigit, toupper
+#include <cstdio>         // snprintf
+#include <ctime>          // gmtime
+#include <curl/curl.h>
+#ifndef _WIN32
+    #include <sys/select.h>
+#endif
+#include "crlf.hpp"
+#include "rate_limiter.hpp"
+
+#define IMAP_PIPELINE_DEPTH 32                   // APPEND commands (or messages) sent without waiting
+#define IMAP_UPLOAD_MAXPENDING (64*1024*1024)    // bytes waiting for upload before Submit() blocks
+#define IMAP_SEND_BUFFER (256*1024)              // bytes gathered before being sent
+
+/// Location and credentials of the server
+struct IMAP_config {
+    std::string host;
+    int port;
+    bool bTls;              // "imaps://" (implicit TLS)
+    bool bInsecure;         // certificate and host name of the TLS server are not verified
+    std::string mailbox;    // root mailbox, '/' separated, empty for INBOX
+    std::string user;
+    std::string password;
+    long timeout;           // seconds allowed to wait for the server, 0 is unlimited
+    Rate_limiter *limiter;  // bandwidth shared with the other uploads, NULL is unlimited
+
+    IMAP_config() : port(993), bTls(true), bInsecure(false), timeout(600), limiter(NULL) {}
+
+    /// Set host, port and root mailbox from "imap(s)://host[:port][/mailbox]"
+    bool Parse(const std::string& url) {
+        size_t pos = url.find("://");
+        if (pos == std::string::npos) return false;
+        std::string scheme = url.substr(0, pos);
+        if (scheme != "imap" && scheme != "imaps") return false;
+        bTls = (scheme == "imaps");
+        size_t slash = url.find('/', pos+3);
+        host = url.substr(pos+3, slash == std::string::npos ? std::string::npos : slash-pos-3);
+        port = bTls ? 993 : 143;
+        size_t colon = host.rfind(':');
+        if (colon != std::string::npos && host.find(']', colon) == std::string::npos) {
+            port = atoi(host.c_str()+colon+1);
+            host.erase(colon);
+        }
+        mailbox.clear();
+        if (slash != std::string::npos) {
+            // Percent-decoded path, without leading and trailing '/'
+            std::string path = url.substr(slash+1);
+            for (size_t i = 0; i < path.length(); i++) {
+                if (path[i] == '%' && i+2 < path.length() && isxdigit((unsigned char)path[i+1]) && isxdigit((unsigned char)path[i+2])) {
+                    mailbox += (char)strtoul(path.substr(i+1, 2).c_str(), NULL, 16);
+                    i += 2;
+                }
+                else mailbox += path[i];
+            }
+            while (!mailbox.empty() && *mailbox.rbegin() == '/') mailbox.erase(mailbox.length()-1);
+        }
+        return !host.empty() && port > 0 && port < 65536;
+    }
+};
+
+/// Result of an appended message
+struct IMAP_upload_result {
+    std::string mailbox;
+    std::string name;
+    bool ok;
+    std::string error;  // error message, empty if ok
+    size_t size;
+    IMAP_upload_result(const std::string& m, const std::string& n, bool b, const std::string& e, size_t s)
+        : mailbox(m), name(n), ok(b), error(e), size(s) {}
+};
+
+/// Quoted string of a command argument
+inline std::string IMAP_Quote(const std::string& value) {
+    std::string quoted = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') quoted += '\\';
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+/// Mailbox name in modified UTF-7 (RFC 3501) from UTF-8
+inline std::string IMAP_MailboxUtf7(const std::string& name) {
+    static const char base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+,";
+    std::string encoded;
+    std::vector<unsigned short> units; // UTF-16 of the current non printable sequence
+    size_t i = 0;
+    while (i <= name.length()) {
+        unsigned char c = (i < name.length()) ? (unsigned char)name[i] : 0;
+        if (i < name.length() && c >= 0x80) {
+            // Decode one UTF-8 character, invalid bytes are taken as Latin-1
+            unsigned int cp = c;
+            int extra = (c >= 0xf0 && c < 0xf8) ? 3 : (c >= 0xe0) ? 2 : (c >= 0xc0) ? 1 : 0;
+            if (extra && i+extra < name.length()) {
+                cp = c & (0x3f >> extra);
+                for (int k = 1; k <= extra; k++) cp = (cp << 6) | ((unsigned char)name[i+k] & 0x3f);
+                i += extra;
+            }
+            if (cp >= 0x10000) {
+                cp -= 0x10000;
+                units.push_back((unsigned short)(0xd800 + (cp >> 10)));
+                units.push_back((unsigned short)(0xdc00 + (cp & 0x3ff)));
+            }
+            else units.push_back((unsigned short)cp);
+            i++;
+            continue;
+        }
+        if (!units.empty()) {
+            encoded += '&';
+            unsigned int bits = 0, nbbits = 0;
+            for (unsigned short u : units) {
+                bits = (bits << 16) | u;
+                nbbits += 16;
+                while (nbbits >= 6) {
+                    nbbits -= 6;
+                    encoded += base64[(bits >> nbbits) & 0x3f];
+                }
+                bits &= (1u << nbbits) - 1;
+            }
+            if (nbbits) encoded += base64[(bits << (6-nbbits)) & 0x3f];
+            encoded += '-';
+            units.clear();
+        }
+        if (i == name.length()) break;
+        if (c == '&') encoded += "&-";
+        else encoded += (char)c;
+        i++;
+    }
+    return encoded;
+}
+
+/// Date-time argument of APPEND (eg: "16-Nov-2012 17:16:09 +0000")
+inline std::string IMAP_Date(time_t date) {
+    static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    struct tm *tm_date = std::gmtime(&date);
+    if (!tm_date) return "";
+    char buffer[40];
+    snprintf(buffer, sizeof(buffer), "\"%02d-%s-%04d %02d:%02d:%02d +0000\"", tm_date->tm_mday, months[tm_date->tm_mon],
+             tm_date->tm_year+1900, tm_date->tm_hour, tm_date->tm_min, tm_date->tm_sec);
+    return buffer;
+}
+
+/// Value of the header field 'name' from a header, unfolded as the parser does
+inline std::string IMAP_HeaderValue(const std::string& header, const std::string& name) {
+    size_t pos = 0;
+    while (pos < header.length()) {
+        size_t end = header.find('\n', pos);
+        if (end == std::string::npos) end = header.length();
+        size_t colon = header.find(':', pos);
+        if (colon < end && colon-pos == name.length()) {
+            bool match = true;
+            for (size_t i = 0; i < name.length() && match; i++)
+                match = (toupper((unsigned char)header[pos+i]) == toupper((unsigned char)name[i]));
+            if (match) {
+                std::string value;
+                size_t start = colon+1;
+                do {
+                    std::string line = header.substr(start, end-start);
+                    size_t first = line.find_first_not_of(" \t\r");
+                    size_t last = line.find_last_not_of(" \t\r");
+                    if (first != std::string::npos) value += line.substr(first, last-first+1);
+                    start = end+1;
+                    end = header.find('\n', start);
+                    if (end == std::string::npos) end = header.length();
+                }
+                while (start < header.length() && (header[start] == ' ' || header[start] == '\t'));
+                return value;
+            }
+        }
+        pos = end+1;
+    }
+    return "";
+}
+
+/// Message to append
+struct IMAP_message {
+    std::string mailbox;    // name on the server
+    std::string name;       // eml file name, used in the results
+    std::string date;       // IMAP_Date() or empty
+    std::vector<char> data;
+};
+
+/// Response of the server, with the literals it contains
+struct IMAP_response {
+    std::string text;                   // lines of the response, literals are replaced by "{size}"
+    std::vector<std::string> literals;
+};
+
+/// Commands to the server over one connection, for one thread
+/**
+ * The functions return false on error, the message is given by GetError().
+ * After an error of the connection, IsConnected() is false.
+ */
+class IMAP_client {
+    public:
+        IMAP_client(const IMAP_config& cfg) : config(cfg), curl(NULL), sock(CURL_SOCKET_BAD), rpos(0), tagnum(0),
+                                              bLiteralPlus(false), bMultiAppend(false) {}
+        ~IMAP_client() { Close(); }
+
+        std::string GetError() { return error; }
+        bool IsConnected() { return curl != NULL; }
+        bool HasLiteralPlus() { return bLiteralPlus; }
+        bool HasMultiAppend() { return bMultiAppend; }
+
+        /// Connect, read the capabilities and log in
+        bool Connect() {
+            Close();
+            curl = curl_easy_init();
+            if (!curl) return Fail("curl_easy_init() failed");
+
+            // The connection (and TLS handshake) is done as for HTTP but nothing is sent
+            std::string url = std::string(config.bTls ? "https://" : "http://") + config.host + ":" + std::to_string(config.port) + "/";
+            char errbuf[CURL_ERROR_SIZE] = "";
+            curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+            curl_easy_setopt(curl, CURLOPT_CONNECT_ONLY, 1L);
+            curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L); // required by threads
+            curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errbuf);
+            curl_easy_setopt(curl, CURLOPT_PROXY, "");
+            curl_easy_setopt(curl, CURLOPT_SSL_ENABLE_ALPN, 0L);
+            curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, config.bInsecure ? 0L : 1L);
+            curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, config.bInsecure ? 0L : 2L);
+            curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30L);
+            CURLcode res = curl_easy_perform(curl);
+            if (res != CURLE_OK) return Broken("Connection to \""+config.host+"\" failed : "+(*errbuf ? errbuf : curl_easy_strerror(res)));
+            if (curl_easy_getinfo(curl, CURLINFO_ACTIVESOCKET, &sock) != CURLE_OK || sock == CURL_SOCKET_BAD)
+                return Broken("No socket for \""+config.host+"\"");
+
+            IMAP_response greeting;
+            if (!Read(greeting)) return false;
+            if (greeting.text.compare(0, 4, "* OK") != 0 && greeting.text.compare(0, 9, "* PREAUTH") != 0)
+                return Broken("Connection refused by \""+config.host+"\" : "+greeting.text);
+
+            std::vector<IMAP_response> vUntagged;
+            if (!Command("CAPABILITY", vUntagged)) return Broken(error);
+            if (Capabilities(vUntagged).count("LOGINDISABLED"))
+                return Broken("Login disabled by \""+config.host+"\", use 'imaps://'");
+            if (greeting.text.compare(0, 9, "* PREAUTH") != 0) {
+                vUntagged.clear();
+                if (!Command("LOGIN "+IMAP_Quote(config.user)+" "+IMAP_Quote(config.password), vUntagged)) return Broken(error);
+            }
+            // The capabilities can change once logged in
+            vUntagged.clear();
+            if (!Command("CAPABILITY", vUntagged)) return Broken(error);
+            std::map<std::string, bool> caps = Capabilities(vUntagged);
+            bLiteralPlus = caps.count("LITERAL+") > 0;
+            bMultiAppend = caps.count("MULTIAPPEND") > 0;
+            return true;
+        }
+
+        /// Log out and close the connection
+        void Close() {
+            if (!curl) return;
+            if (sock != CURL_SOCKET_BAD) {
+                std::string logout = NextTag() + " LOGOUT\r\n";
+                size_t sent = 0;
+                curl_easy_send(curl, logout.data(), logout.length(), &sent);
+            }
+            curl_easy_cleanup(curl);
+            curl = NULL;
+            sock = CURL_SOCKET_BAD;
+            rbuf.clear();
+            rpos = 0;
+        }
+
+        /// Send a command and read its responses, the untagged ones are added to vUntagged
+        bool Command(const std::string& command, std::vector<IMAP_response>& vUntagged) {
+            std::string tag = NextTag();
+            if (!Send(tag + " " + command + "\r\n")) return false;
+            IMAP_response response;
+            while (Read(response)) {
+                if (response.text.compare(0, 2, "* ") == 0) vUntagged.push_back(response);
+                else if (response.text.compare(0, tag.length()+1, tag+" ") == 0) {
+                    if (response.text.compare(tag.length()+1, 3, "OK ") == 0) return true;
+                    return Fail(command.substr(0, command.find(' '))+" failed : "+response.text.substr(tag.length()+1));
+                }
+            }
+            return false;
+        }
+
+        bool Noop() {
+            std::vector<IMAP_response> vUntagged;
+            return Command("NOOP", vUntagged);
+        }
+
+        /// Hierarchy delimiter of the mailboxes, empty if flat
+        bool Delimiter(std::string& delimiter) {
+            std::vector<IMAP_response> vUntagged;
+            if (!Command("LIST \"\" \"\"", vUntagged)) return false;
+            delimiter.clear();
+            for (const IMAP_response& response : vUntagged) {
+                if (response.text.compare(0, 7, "* LIST ") != 0) continue;
+                size_t pos = response.text.find(')');
+                if (pos == std::string::npos || pos+2 >= response.text.length()) continue;
+                pos += 2;
+                if (response.text[pos] == '"' && pos+1 < response.text.length()) {
+                    if (response.text[pos+1] == '\\' && pos+2 < response.text.length()) delimiter = response.text.substr(pos+2, 1);
+                    else delimiter = response.text.substr(pos+1, 1);
+                }
+                return true;
+            }
+            return true;
+        }
+
+        /// Create the mailbox if it does not exist
+        bool Create(const std::string& mailbox) {
+            std::vector<IMAP_response> vUntagged;
+            if (!Command("LIST \"\" "+IMAP_Quote(mailbox), vUntagged)) return false;
+            for (const IMAP_response& response : vUntagged)
+                if (response.text.compare(0, 7, "* LIST ") == 0) return true;
+            vUntagged.clear();
+            if (Command("CREATE "+IMAP_Quote(mailbox), vUntagged)) return true;
+            return error.find("[ALREADYEXISTS]") != std::string::npos;
+        }
+
+        /// Add to vValues the values of the header field 'field' of the messages of the mailbox
+        bool FetchHeader(const std::string& mailbox, const std::string& field, std::vector<std::string>& vValues) {
+            std::vector<IMAP_response> vUntagged;
+            if (!Command("EXAMINE "+IMAP_Quote(mailbox), vUntagged)) return false;
+            unsigned long exists = 0;
+            for (const IMAP_response& response : vUntagged)
+                if (response.text.length() > 9 && response.text.compare(response.text.length()-7, 7, " EXISTS") == 0)
+                    exists = strtoul(response.text.c_str()+2, NULL, 10);
+            if (!exists) return true;
+
+            vUntagged.clear();
+            if (!Command("FETCH 1:* (BODY.PEEK[HEADER.FIELDS ("+field+")])", vUntagged)) return false;
+            for (const IMAP_response& response : vUntagged) {
+                if (response.literals.empty() || response.text.find(" FETCH ") == std::string::npos) continue;
+                std::string value = IMAP_HeaderValue(response.literals[0], field);
+                if (!value.empty()) vValues.push_back(value);
+            }
+            return true;
+        }
+
+        /// Append the messages, vErrors is set with the error of each one (empty if appended)
+        /**
+         * Returns false if the connection failed, the messages not appended are given an error.
+         */
+        bool Append(const std::vector<IMAP_message*>& vMessages, std::vector<std::string>& vErrors) {
+            vErrors.assign(vMessages.size(), "");
+            bool ok = true;
+            if (bLiteralPlus) ok = AppendPipelined(vMessages, vErrors);
+            else {
+                // Messages of a same mailbox are sent by a single command
+                size_t first = 0;
+                while (ok && first < vMessages.size()) {
+                    size_t last = first+1;
+                    while (bMultiAppend && last < vMessages.size() && vMessages[last]->mailbox == vMessages[first]->mailbox) last++;
+                    ok = AppendSynchronized(vMessages, first, last, vErrors);
+                    first = last;
+                }
+            }
+            if (!ok)
+                for (size_t i = 0; i < vErrors.size(); i++)
+                    if (vErrors[i].empty()) vErrors[i] = error;
+            return ok;
+        }
+
+    private:
+        IMAP_config config;
+        CURL *curl;
+        curl_socket_t sock;
+        std::string rbuf;       // data received
+        size_t rpos;            // first byte of rbuf not read
+        std::string wbuf;       // data to send
+        unsigned long tagnum;
+        bool bLiteralPlus;
+        bool bMultiAppend;
+        std::string error;
+
+        IMAP_client(const IMAP_client&);
+        IMAP_client& operator=(const IMAP_client&);
+
+        bool Fail(const std::string& message) {
+            error = message;
+            return false;
+        }
+
+        /// Fail and close the connection that can not be used anymore
+        bool Broken(const std::string& message) {
+            if (curl) curl_easy_cleanup(curl);
+            curl = NULL;
+            sock = CURL_SOCKET_BAD;
+            rbuf.clear();
+            rpos = 0;
+            wbuf.clear();
+            return Fail(message);
+        }
+
+        std::string NextTag() { return "A" + std::to_string(++tagnum); }
+
+        std::map<std::string, bool> Capabilities(const std::vector<IMAP_response>& vUntagged) {
+            std::map<std::string, bool> caps;
+            for (const IMAP_response& response : vUntagged) {
+                if (response.text.compare(0, 13, "* CAPABILITY ") != 0) continue;
+                size_t pos = 13;
+                while (pos < response.text.length()) {
+                    size_t end = response.text.find(' ', pos);
+                    if (end == std::string::npos) end = response.text.length();
+                    std::string cap = response.text.substr(pos, end-pos);
+                    std::transform(cap.begin(), cap.end(), cap.begin(), ::toupper);
+                    caps[cap] = true;
+                    pos = end+1;
+                }
+            }
+            return caps;
+        }
+
+        /// APPEND commands with non synchronizing literals, sent without waiting for their result
+        bool AppendPipelined(const std::vector<IMAP_message*>& vMessages, std::vector<std::string>& vErrors) {
+            unsigned long firsttag = tagnum+1;
+            for (IMAP_message *msg : vMessages) {
+                wbuf += NextTag() + " APPEND " + IMAP_Quote(msg->mailbox) + (msg->date.empty() ? "" : " "+msg->date)
+                        + " {" + std::to_string(msg->data.size()) + "+}\r\n";
+                wbuf.append(msg->data.data(), msg->data.size());
+                wbuf += "\r\n";
+                if (wbuf.length() >= IMAP_SEND_BUFFER && !Send(std::string())) return false;
+            }
+            if (!Send(std::string())) return false;
+
+            size_t pending = vMessages.size();
+            IMAP_response response;
+            while (pending && Read(response)) {
+                if (response.text.empty() || response.text[0] != 'A') continue;
+                unsigned long tag = strtoul(response.text.c_str()+1, NULL, 10);
+                if (tag < firsttag || tag >= firsttag+vMessages.size()) continue;
+                size_t pos = response.text.find(' ');
+                if (response.text.compare(pos+1, 3, "OK ") != 0)
+                    vErrors[tag-firsttag] = "APPEND failed : "+response.text.substr(pos+1);
+                pending--;
+            }
+            return pending == 0;
+        }
+
+        /// APPEND command of the messages [first, last[ with synchronizing literals
+        bool AppendSynchronized(const std::vector<IMAP_message*>& vMessages, size_t first, size_t last, std::vector<std::string>& vErrors) {
+            std::string tag = NextTag();
+            std::string command = tag + " APPEND " + IMAP_Quote(vMessages[first]->mailbox);
+            IMAP_response response;
+            for (size_t i = first; i < last; i++) {
+                IMAP_message *msg = vMessages[i];
+                command += (msg->date.empty() ? "" : " "+msg->date) + " {" + std::to_string(msg->data.size()) + "}\r\n";
+                if (!Send(command)) return false;
+                command.clear();
+                // Wait for the continuation request, a tagged response ends the command
+                while (Read(response) && response.text.compare(0, 2, "* ") == 0);
+                if (response.text.compare(0, 1, "+") != 0) {
+                    if (response.text.compare(0, tag.length()+1, tag+" ") != 0) return false;
+                    for (size_t k = first; k < last; k++)
+                        vErrors[k] = "APPEND failed : "+response.text.substr(tag.length()+1);
+                    return true;
+                }
+                wbuf.append(msg->data.data(), msg->data.size());
+            }
+            if (!Send("\r\n")) return false;
+            while (Read(response)) {
+                if (response.text.compare(0, tag.length()+1, tag+" ") != 0) continue;
+                if (response.text.compare(tag.length()+1, 3, "OK ") != 0)
+                    for (size_t k = first; k < last; k++)
+                        vErrors[k] = "APPEND failed : "+response.text.substr(tag.length()+1);
+                return true;
+            }
+            return false;
+        }
+
+        /// Wait for the socket to be readable or writable
+        bool Wait(bool bWrite) {
+            fd_set fds;
+            FD_ZERO(&fds);
+            FD_SET(sock, &fds);
+            struct timeval tv;
+            tv.tv_sec = config.timeout;
+            tv.tv_usec = 0;
+            int ret = select((int)sock+1, bWrite ? NULL : &fds, bWrite ? &fds : NULL, NULL, config.timeout > 0 ? &tv : NULL);
+            if (ret > 0) return true;
+            return Broken(ret == 0 ? "Timeout of the connection to \""+config.host+"\"" : "Connection to \""+config.host+"\" failed");
+        }
+
+        /// Send the data to send, followed by 'data'
+        bool Send(const std::string& data) {
+            if (!curl) return Fail("Not connected to \""+config.host+"\"");
+            wbuf += data;
+            size_t pos = 0, allowed = 0;
+            while (pos < wbuf.length()) {
+                if (allowed == pos) allowed += config.limiter ? config.limiter->Acquire(wbuf.length()-pos) : wbuf.length()-pos;
+                size_t sent = 0;
+                CURLcode res = curl_easy_send(curl, wbuf.data()+pos, allowed-pos, &sent);
+                if (res == CURLE_AGAIN) {
+                    if (!Wait(true)) return false;
+                }
+                else if (res != CURLE_OK) return Broken("Sending to \""+config.host+"\" failed : "+curl_easy_strerror(res));
+                pos += sent;
+            }
+            wbuf.clear();
+            return true;
+        }
+
+        /// Receive more data
+        bool Receive() {
+            if (!curl) return Fail("Not connected to \""+config.host+"\"");
+            if (rpos && rpos == rbuf.length()) {
+                rbuf.clear();
+                rpos = 0;
+            }
+            char buffer[65536]; // larger than a TLS record
+            while (true) {
+                size_t received = 0;
+                CURLcode res = curl_easy_recv(curl, buffer, sizeof(buffer), &received);
+                if (res == CURLE_OK) {
+                    if (!received) return Broken("Connection closed by \""+config.host+"\"");
+                    rbuf.append(buffer, received);
+                    return true;
+                }
+                if (res != CURLE_AGAIN) return Broken("Receiving from \""+config.host+"\" failed : "+curl_easy_strerror(res));
+                if (!Wait(false)) return false;
+            }
+        }
+
+        /// Read a response, its literals included
+        bool Read(IMAP_response& response) {
+            response.text.clear();
+            response.literals.clear();
+            while (true) {
+                size_t end;
+                while ((end = rbuf.find("\r\n", rpos)) == std::string::npos)
+                    if (!Receive()) return false;
+                response.text.append(rbuf, rpos, end-rpos);
+                rpos = end+2;
+
+                // A line ending with "{size}" is followed by a literal of size bytes
+                size_t open = response.text.rfind('{');
+                if (response.text.empty() || *response.text.rbegin() != '}' || open == std::string::npos ||
+                    open+2 >= response.text.length() ||
+                    response.text.find_first_not_of("0123456789", open+1) != response.text.length()-1) break;
+                size_t size = strtoul(response.text.c_str()+open+1, NULL, 10);
+                while (rbuf.length()-rpos < size)
+                    if (!Receive()) return false;
+                response.literals.push_back(rbuf.substr(rpos, size));
+                rpos += size;
+            }
+            if (rpos > IMAP_SEND_BUFFER) {
+                rbuf.erase(0, rpos);
+                rpos = 0;
+            }
+            return true;
+        }
+};
+
+/// Parallel upload of messages
+/**
+ * Submit() blocks while more than IMAP_UPLOAD_MAXPENDING bytes are waiting.
+ * The destructor waits for the messages already submitted.
+ */
+class IMAP_uploader {
+    public:
+        IMAP_uploader(const IMAP_config& cfg, unsigned int nbthreads) : config(cfg), lister(cfg) {
+            bStop = false;
+            bDelimiter = false;
+            pendingbytes = 0;
+            pendingmessages = 0;
+            curl_global_init(CURL_GLOBAL_ALL); // before any thread
+            nbthreads = std::max(1u, std::min(nbthreads, 64u));
+            for (unsigned int i = 0; i < nbthreads; i++)
+                workers.push_back(std::thread(&IMAP_uploader::Worker, this));
+        }
+
+        ~IMAP_uploader() {
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                bStop = true;
+            }
+            cvJobs.notify_all();
+            for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+        }
+
+        size_t GetThreads() { return workers.size(); }
+
+        /// Bytes of the messages submitted and not uploaded yet
+        size_t GetPendingBytes() {
+            std::unique_lock<std::mutex> lock(mtx);
+            return pendingbytes;
+        }
+
+        /// Create the mailbox of 'folder' ('/' separated, under the root mailbox) if needed, from the calling thread
+        /**
+         * 'mailbox' is set with its name on the server and the Message-ID of its messages are added to vMessageIds.
+         */
+        bool Prepare(const std::string& folder, std::string& mailbox, std::vector<std::string>& vMessageIds, std::string& error) {
+            // The connection may have been closed by the server while it was not used
+            if (lister.IsConnected() && !lister.Noop() && !lister.IsConnected()) lister.Connect();
+            if (!lister.IsConnected() && !lister.Connect()) {
+                error = lister.GetError();
+                return false;
+            }
+            if (!bDelimiter && !lister.Delimiter(delimiter)) {
+                error = lister.GetError();
+                return false;
+            }
+            bDelimiter = true;
+
+            mailbox.clear();
+            std::string path = config.mailbox + "/" + folder;
+            size_t pos = 0;
+            while (pos < path.length()) {
+                size_t end = path.find('/', pos);
+                if (end == std::string::npos) end = path.length();
+                if (end > pos && path.compare(pos, end-pos, ".") != 0) {
+                    if (!mailbox.empty()) mailbox += delimiter.empty() ? "/" : delimiter;
+                    mailbox += IMAP_MailboxUtf7(path.substr(pos, end-pos));
+                }
+                pos = end+1;
+            }
+            if (mailbox.empty()) mailbox = "INBOX";
+
+            if (!lister.Create(mailbox) || !lister.FetchHeader(mailbox, "MESSAGE-ID", vMessageIds)) {
+                error = lister.GetError();
+                return false;
+            }
+            return true;
+        }
+
+        /// Queue a message to append with its date (0 if unknown), the content of 'data' is taken (data is emptied)
+        void Submit(const std::string& mailbox, const std::string& name, std::vector<char>& data, time_t date) {
+            IMAP_message *msg = new IMAP_message();
+            msg->mailbox = mailbox;
+            msg->name = name;
+            if (date > 0) msg->date = IMAP_Date(date);
+            msg->data.swap(data);
+
+            std::unique_lock<std::mutex> lock(mtx);
+            cvDone.wait(lock, [this]{ return pendingbytes <= IMAP_UPLOAD_MAXPENDING; });
+            jobs.push_back(msg);
+            pendingmessages++;
+            pendingbytes += msg->data.size();
+            lock.unlock();
+            cvJobs.notify_one();
+        }
+
+        /// Wait for all submitted messages to be appended
+        void Flush() {
+            std::unique_lock<std::mutex> lock(mtx);
+            cvDone.wait(lock, [this]{ return pendingmessages == 0; });
+        }
+
+        /// Move the results of the appended messages to vResults, return their number
+        size_t Collect(std::vector<IMAP_upload_result>& vResults) {
+            std::unique_lock<std::mutex> lock(mtx);
+            size_t n = results.size();
+            vResults.insert(vResults.end(), results.begin(), results.end());
+            results.clear();
+            return n;
+        }
+
+    private:
+        IMAP_config config;
+        IMAP_client lister;
+        std::string delimiter;
+        bool bDelimiter;
+        std::mutex mtx;
+        std::condition_variable cvJobs, cvDone;
+        std::deque<IMAP_message*> jobs;
+        std::vector<IMAP_upload_result> results;
+        std::vector<std::thread> workers;
+        size_t pendingbytes;
+        size_t pendingmessages;
+        bool bStop;
+
+        IMAP_uploader(const IMAP_uploader&);
+        IMAP_uploader& operator=(const IMAP_uploader&);
+
+        void Worker() {
+            IMAP_client client(config);
+            std::vector<IMAP_message*> vMessages;
+            std::vector<std::string> vErrors;
+            while (true) {
+                // The waiting messages are shared between the threads, IMAP_PIPELINE_DEPTH at most
+                std::unique_lock<std::mutex> lock(mtx);
+                cvJobs.wait(lock, [this]{ return bStop || !jobs.empty(); });
+                if (jobs.empty()) break;
+                size_t nb = std::min((size_t)IMAP_PIPELINE_DEPTH, (jobs.size()+workers.size()-1)/workers.size());
+                vMessages.assign(jobs.begin(), jobs.begin()+nb);
+                jobs.erase(jobs.begin(), jobs.begin()+nb);
+                lock.unlock();
+
+                // IMAP requires "\r\n" line endings
+                std::vector<size_t> vSizes;
+                for (IMAP_message *msg : vMessages) {
+                    vSizes.push_back(msg->data.size());
+                    size_t nblf = count_bare_lf(msg->data.data(), msg->data.size());
+                    if (!nblf) continue;
+                    std::vector<char> converted(msg->data.size()+nblf);
+                    bool lastcr = false;
+                    lf_to_crlf(msg->data.data(), msg->data.size(), converted.data(), lastcr);
+                    msg->data.swap(converted);
+                }
+
+                if (!client.IsConnected() && !client.Connect()) vErrors.assign(vMessages.size(), client.GetError());
+                else client.Append(vMessages, vErrors);
+                Done(vMessages, vSizes, vErrors);
+            }
+        }
+
+        void Done(const std::vector<IMAP_message*>& vMessages, const std::vector<size_t>& vSizes, const std::vector<std::string>& vErrors) {
+            std::unique_lock<std::mutex> lock(mtx);
+            for (size_t i = 0; i < vMessages.size(); i++) {
+                std::string error = vErrors[i].empty() ? "" : "Append of \""+vMessages[i]->name+"\" to \""+vMessages[i]->mailbox+"\" failed : "+vErrors[i];
+                results.push_back(IMAP_upload_result(vMessages[i]->mailbox, vMessages[i]->name, vErrors[i].empty(), error, vMessages[i]->data.size()));
+                pendingbytes -= vSizes[i];
+                pendingmessages--;
+                delete vMessages[i];
+            }
+            lock.unlock();
+            cvDone.notify_all();
+        }
+};
+
+#endif // __IMAP_UPLOADER_HPP
@@ -0,0 +1,491 @@
+/*
+    BSD 2-Clause License
+
+    Copyright (c) 2017-2023, Nol Martinon
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+    Pack file of emails (alternative to one eml file per email).
+
+    The emails are appended to a single file by blocks of about
+    MBOX_PACK_BLOCKSIZE bytes compressed together (solid compression), the
+    file ends with an index of all the emails (name, date, flags, position)
+    so that a single email is read by decompressing only its block.
+    A later run opens the pack to append : the names of the index are used to
+    skip the emails already stored, the new blocks replace the old index and a
+    new index is written by Close().
+
+    Layout (integers are little endian) :
+        header  "MZPACK" u16 version
+        block   "MZBK" u32 nbentries, u32 tablesize, u32 rawsize, u32 datasize, u32 crc32
+                table of entries (u16 namelength, name, u32 offset, u32 length, i64 date, u32 flags)
+                deflate data of the emails
+        ...
+        index   deflate of entries (u16 namelength, name, u64 block, u32 offset, u32 length, i64 date, u32 flags)
+        trailer "MZIX" u32 nbentries, u64 indexoffset, u32 indexsize, u32 rawsize, u32 crc32, "MZPK"
+
+    Each block describes its own emails, so if the index is missing or damaged
+    (eg: interrupted run) it is rebuilt from the valid blocks.
+    eg:
+        Mbox_pack pack;
+        pack.Open("/path/mbox.mzpack", true);
+        if (!pack.Find(name)) pack.Add(name, date, flags, data, len);
+        pack.Close();
+*/
+
+#ifndef __MBOX_PACK_HPP
+#define __MBOX_PACK_HPP
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <cerrno>
+#include <string.h>       // strerror
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef _WIN32
+    #include <io.h>
+#else
+    #include <unistd.h>
+#endif
+#include "eml_writer.hpp"          // SyncFileDescriptor()
+#ifndef O_BINARY
+    #define O_BINARY 0
+#endif
+
+#define MBOX_PACK_BLOCKSIZE (1024*1024)   // uncompressed size of a block
+#define MBOX_PACK_EXTENSION ".mzpack"
+#define MBOX_PACK_VERSION 1
+
+/// Flags of the packed emails
+#define MBOX_PACK_INVALID 1
+#define MBOX_PACK_DELETED 2
+#define MBOX_PACK_DUPLICATED 4
+
+/// Email of a pack
+struct Mbox_pack_entry {
+    std::string name; // eml file name
+    long long date; // mail date (0 if unknown)
+    unsigned int flags; // MBOX_PACK_*
+    unsigned long long block; // position of its block in the pack
+    unsigned int offset; // position in the uncompressed block
+    unsigned int length;
+};
+
+/// Indexed pack file of emails
+/**
+ * The functions return false on error, the message is given by GetError().
+ */
+class Mbox_pack {
+    public:
+        Mbox_pack() : fd(-1), bAppend(false), bRecovered(false), bChanged(false), end(0), nbpending(0), cacheblock(0) {}
+        ~Mbox_pack() { Close(); }
+
+        /// Open the pack to read, or to append if bAppend is true (created if needed)
+        bool Open(const std::string& path, bool bAppendMode = false) {
+            Close();
+            entries.clear();
+            names.clear();
+            cache.clear();
+            error.clear();
+            bAppend = bAppendMode;
+            bRecovered = bChanged = false;
+            filename = path;
+
+            fd = open(path.c_str(), (bAppend ? O_RDWR|O_CREAT : O_RDONLY)|O_BINARY, 0666);
+            if (fd < 0) return Fail("Could not open \""+path+"\" ("+strerror(errno)+")");
+            #ifdef _WIN32
+                long long size = _lseeki64(fd, 0, SEEK_END);
+            #else
+                long long size = (long long)lseek(fd, 0, SEEK_END);
+            #endif
+            if (size < 0) return Abort("Could not read \""+path+"\" ("+strerror(errno)+")");
+
+            // New pack
+            std::string header("MZPACK");
+            PutU16(header, MBOX_PACK_VERSION);
+            if (size == 0 && bAppend) {
+                if (!WriteAll(header.data(), header.size(), 0)) return Abort("Could not write to \""+path+"\" ("+strerror(errno)+")");
+                end = header.size();
+                bChanged = true;
+                return true;
+            }
+
+            std::string head(header.size(), '\0');
+            if (!ReadAll(&head[0], head.size(), 0) || head.compare(0, 6, "MZPACK") != 0)
+                return Abort("\""+path+"\" is not a pack file");
+            if (GetU16(head.data()+6) > MBOX_PACK_VERSION)
+                return Abort("\""+path+"\" has an unsupported pack version");
+
+            if (!LoadIndex(size)) {
+                entries.clear();
+                names.clear();
+                Rebuild(size);
+                bRecovered = bChanged = true;
+            }
+            return true;
+        }
+
+        bool IsOpen() { return fd >= 0; }
+
+        /// Return true if the index has been rebuilt from the blocks by Open()
+        bool IsRecovered() { return bRecovered; }
+
+        std::string GetError() { return error; }
+
+        /// Emails of the pack in their order of addition
+        const std::vector<Mbox_pack_entry>& GetEntries() { return entries; }
+
+        /// Return the email named 'name' or NULL if it is not in the pack
+        const Mbox_pack_entry* Find(const std::string& name) {
+            std::unordered_map<std::string, size_t>::const_iterator it = names.find(name);
+            return (it == names.end()) ? NULL : &entries[it->second];
+        }
+
+        /// Append an email, written when its block is full or by Close()
+        bool Add(const std::string& name, long long date, unsigned int flags, const char *data, size_t len) {
+            if (fd < 0 || !bAppend) return Fail("Pack is not open to append");
+            if (name.length() > 0xFFFF || len > 0xFFFFFFFFUL) return Fail("Email \""+name+"\" can not be packed");
+
+            Mbox_pack_entry entry;
+            entry.name = name;
+            entry.date = date;
+            entry.flags = flags;
+            entry.block = end;
+            entry.offset = rawblock.size();
+            entry.length = len;
+            names[name] = entries.size();
+            entries.push_back(entry);
+            rawblock.insert(rawblock.end(), data, data+len);
+            nbpending++;
+
+            if (rawblock.size() >= MBOX_PACK_BLOCKSIZE) return WriteBlock();
+            return true;
+        }
+
+        /// Read the content of an email
+        bool Read(const Mbox_pack_entry& entry, std::vector<char>& data) {
+            if (fd < 0) return Fail("Pack is not open");
+
+            // Email not written yet
+            if (bAppend && entry.block == end) {
+                data.assign(rawblock.begin()+entry.offset, rawblock.begin()+entry.offset+entry.length);
+                return true;
+            }
+
+            // The last block read is kept as emails are usually read in order
+            if (cache.empty() || cacheblock != entry.block) {
+                cache.clear();
+                BlockHeader bh;
+                std::string table, compressed;
+                if (!ReadBlock(entry.block, bh, table, compressed)) return Fail("Block of \""+entry.name+"\" is damaged in \""+filename+"\"");
+                cache.resize(bh.rawsize);
+                uLongf rawlen = bh.rawsize;
+                if (uncompress((Bytef*)cache.data(), &rawlen, (const Bytef*)compressed.data(), compressed.size()) != Z_OK || rawlen != bh.rawsize) {
+                    cache.clear();
+                    return Fail("Block of \""+entry.name+"\" is damaged in \""+filename+"\"");
+                }
+                cacheblock = entry.block;
+            }
+            if ((unsigned long long)entry.offset + entry.length > cache.size()) return Fail("Email \""+entry.name+"\" is out of its block");
+            data.assign(cache.begin()+entry.offset, cache.begin()+entry.offset+entry.length);
+            return true;
+        }
+
+        /// Write the pending emails and the index, then close the pack
+        /// If bSync is true then the pack is synced before
+        bool Close(bool bSync = false) {
+            if (fd < 0) return true;
+            bool ok = true;
+            if (bAppend && bChanged) ok = WriteBlock() && WriteIndex();
+            if (ok && bAppend && bSync && !SyncFileDescriptor(fd))
+                ok = Fail("Could not sync \""+filename+"\" ("+strerror(errno)+")");
+            close(fd);
+            fd = -1;
+            rawblock.clear();
+            nbpending = 0;
+            return ok;
+        }
+
+    private:
+        struct BlockHeader {
+            unsigned int nbentries, tablesize, rawsize, datasize, crc;
+        };
+
+        int fd;
+        std::string filename;
+        std::string error;
+        bool bAppend;
+        bool bRecovered;
+        bool bChanged; // the index must be written by Close()
+        unsigned long long end; // end of the last block, where the next block or the index is written
+        std::vector<Mbox_pack_entry> entries;
+        std::unordered_map<std::string, size_t> names; // position of each name in entries
+        size_t nbpending; // emails of rawblock
+        std::vector<char> rawblock; // emails of the block being filled
+        std::vector<char> cache; // uncompressed content of the last block read
+        unsigned long long cacheblock;
+
+        bool Fail(const std::string& message) {
+            error = message;
+            return false;
+        }
+
+        bool Abort(const std::string& message) {
+            close(fd);
+            fd = -1;
+            return Fail(message);
+        }
+
+        /// Compress the emails of rawblock and write the block
+        bool WriteBlock() {
+            if (!nbpending) return true;
+
+            std::string table;
+            for (size_t i = entries.size()-nbpending; i < entries.size(); i++) {
+                PutU16(table, entries[i].name.length());
+                table += entries[i].name;
+                PutU32(table, entries[i].offset);
+                PutU32(table, entries[i].length);
+                PutU64(table, (unsigned long long)entries[i].date);
+                PutU32(table, entries[i].flags);
+            }
+
+            uLongf datasize = compressBound(rawblock.size());
+            std::string block(24 + table.size() + datasize, '\0');
+            if (compress2((Bytef*)&block[24+table.size()], &datasize, (const Bytef*)rawblock.data(), rawblock.size(), Z_DEFAULT_COMPRESSION) != Z_OK)
+                return Fail("Could not compress a block of \""+filename+"\"");
+            block.resize(24 + table.size() + datasize);
+            memcpy(&block[24], table.data(), table.size());
+
+            std::string header("MZBK");
+            PutU32(header, nbpending);
+            PutU32(header, table.size());
+            PutU32(header, rawblock.size());
+            PutU32(header, datasize);
+            PutU32(header, crc32(0L, (const Bytef*)block.data()+24, block.size()-24));
+            memcpy(&block[0], header.data(), header.size());
+
+            if (!WriteAll(block.data(), block.size(), end))
+                return Fail("Could not write to \""+filename+"\" ("+strerror(errno)+")");
+            end += block.size();
+            rawblock.clear();
+            nbpending = 0;
+            bChanged = true;
+            return true;
+        }
+
+        /// Write the index and the trailer after the last block
+        bool WriteIndex() {
+            std::string raw;
+            for (size_t i = 0; i < entries.size(); i++) {
+                PutU16(raw, entries[i].name.length());
+                raw += entries[i].name;
+                PutU64(raw, entries[i].block);
+                PutU32(raw, entries[i].offset);
+                PutU32(raw, entries[i].length);
+                PutU64(raw, (unsigned long long)entries[i].date);
+                PutU32(raw, entries[i].flags);
+            }
+            uLongf indexsize = compressBound(raw.size());
+            std::string index(indexsize, '\0');
+            if (compress2((Bytef*)&index[0], &indexsize, (const Bytef*)raw.data(), raw.size(), Z_DEFAULT_COMPRESSION) != Z_OK)
+                return Fail("Could not compress the index of \""+filename+"\"");
+            index.resize(indexsize);
+
+            std::string trailer("MZIX");
+            PutU32(trailer, entries.size());
+            PutU64(trailer, end);
+            PutU32(trailer, index.size());
+            PutU32(trailer, raw.size());
+            PutU32(trailer, crc32(0L, (const Bytef*)index.data(), index.size()));
+            trailer += "MZPK";
+            index += trailer;
+
+            unsigned long long size = end + index.size();
+            bool ok = WriteAll(index.data(), index.size(), end);
+            #ifdef _WIN32
+                ok = ok && _chsize_s(fd, size) == 0;
+            #else
+                ok = ok && ftruncate(fd, (off_t)size) == 0;
+            #endif
+            if (!ok) return Fail("Could not write to \""+filename+"\" ("+strerror(errno)+")");
+            bChanged = false;
+            return true;
+        }
+
+        /// Read the index given by the trailer, return false if it is missing or damaged
+        bool LoadIndex(unsigned long long size) {
+            char trailer[32];
+            if (size < 8+sizeof(trailer) || !ReadAll(trailer, sizeof(trailer), size-sizeof(trailer))) return false;
+            if (memcmp(trailer, "MZIX", 4) != 0 || memcmp(trailer+28, "MZPK", 4) != 0) return false;
+
+            unsigned int nbentries = GetU32(trailer+4);
+            unsigned long long indexoffset = GetU64(trailer+8);
+            unsigned int indexsize = GetU32(trailer+16);
+            unsigned int rawsize = GetU32(trailer+20);
+            if (indexoffset < 8 || indexoffset + indexsize + sizeof(trailer) != size) return false;
+
+            std::string index(indexsize, '\0');
+            if (!ReadAll(&index[0], indexsize, indexoffset)) return false;
+            if (crc32(0L, (const Bytef*)index.data(), indexsize) != GetU32(trailer+24)) return false;
+            std::string raw(rawsize, '\0');
+            uLongf rawlen = rawsize;
+            if (uncompress((Bytef*)&raw[0], &rawlen, (const Bytef*)index.data(), indexsize) != Z_OK || rawlen != rawsize) return false;
+
+            const char *p = raw.data(), *pend = raw.data() + raw.size();
+            for (unsigned int i = 0; i < nbentries; i++) {
+                if (pend - p < 2) return false;
+                size_t namelen = GetU16(p);
+                if ((size_t)(pend - p) < 2 + namelen + 28) return false;
+                Mbox_pack_entry entry;
+                entry.name.assign(p+2, namelen);
+                p += 2 + namelen;
+                entry.block = GetU64(p);
+                entry.offset = GetU32(p+8);
+                entry.length = GetU32(p+12);
+                entry.date = (long long)GetU64(p+16);
+                entry.flags = GetU32(p+24);
+                p += 28;
+                names[entry.name] = entries.size();
+                entries.push_back(entry);
+            }
+            end = indexoffset;
+            return p == pend;
+        }
+
+        /// Rebuild the index from the blocks, the data after the last valid block is ignored
+        void Rebuild(unsigned long long size) {
+            end = 8;
+            BlockHeader bh;
+            std::string table, compressed;
+            while (end < size && ReadBlock(end, bh, table, compressed)) {
+                const char *p = table.data(), *pend = table.data() + table.size();
+                std::vector<Mbox_pack_entry> blockentries;
+                for (unsigned int i = 0; i < bh.nbentries; i++) {
+                    if (pend - p < 2) break;
+                    size_t namelen = GetU16(p);
+                    if ((size_t)(pend - p) < 2 + namelen + 20) break;
+                    Mbox_pack_entry entry;
+                    entry.name.assign(p+2, namelen);
+                    p += 2 + namelen;
+                    entry.block = end;
+                    entry.offset = GetU32(p);
+                    entry.length = GetU32(p+4);
+                    entry.date = (long long)GetU64(p+8);
+                    entry.flags = GetU32(p+16);
+                    p += 20;
+                    blockentries.push_back(entry);
+                }
+                if (blockentries.size() != bh.nbentries) break;
+                for (size_t i = 0; i < blockentries.size(); i++) {
+                    names[blockentries[i].name] = entries.size();
+                    entries.push_back(blockentries[i]);
+                }
+                end += 24 + bh.tablesize + bh.datasize;
+            }
+        }
+
+        /// Read and check the block at 'offset'
+        bool ReadBlock(unsigned long long offset, BlockHeader& bh, std::string& table, std::string& compressed) {
+            char header[24];
+            if (!ReadAll(header, sizeof(header), offset) || memcmp(header, "MZBK", 4) != 0) return false;
+            bh.nbentries = GetU32(header+4);
+            bh.tablesize = GetU32(header+8);
+            bh.rawsize = GetU32(header+12);
+            bh.datasize = GetU32(header+16);
+            bh.crc = GetU32(header+20);
+            if (bh.rawsize > 0x7FFFFFFF || bh.tablesize > 0x7FFFFFFF || bh.datasize > 0x7FFFFFFF) return false;
+
+            std::string data((size_t)bh.tablesize + bh.datasize, '\0');
+            if (!ReadAll(&data[0], data.size(), offset + sizeof(header))) return false;
+            if (crc32(0L, (const Bytef*)data.data(), data.size()) != bh.crc) return false;
+            table.assign(data, 0, bh.tablesize);
+            compressed.assign(data, bh.tablesize, std::string::npos);
+            return true;
+        }
+
+        bool ReadAll(char *data, size_t len, unsigned long long offset) {
+            while (len) {
+                #ifdef _WIN32
+                    long n = (_lseeki64(fd, offset, SEEK_SET) < 0) ? -1 : _read(fd, data, (unsigned int)len);
+                #else
+                    long n = (long)pread(fd, data, len, (off_t)offset);
+                #endif
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return false;
+                data += n;
+                len -= n;
+                offset += n;
+            }
+            return true;
+        }
+
+        bool WriteAll(const char *data, size_t len, unsigned long long offset) {
+            while (len) {
+                #ifdef _WIN32
+                    long n = (_lseeki64(fd, offset, SEEK_SET) < 0) ? -1 : _write(fd, data, (unsigned int)len);
+                #else
+                    long n = (long)pwrite(fd, data, len, (off_t)offset);
+                #endif
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return false;
+                data += n;
+                len -= n;
+                offset += n;
+            }
+            return true;
+        }
+
+        static void PutU16(std::string& s, unsigned int v) {
+            s += (char)(v & 0xFF);
+            s += (char)((v >> 8) & 0xFF);
+        }
+        static void PutU32(std::string& s, unsigned long v) {
+            for (int i = 0; i < 4; i++) s += (char)((v >> (8*i)) & 0xFF);
+        }
+        static void PutU64(std::string& s, unsigned long long v) {
+            for (int i = 0; i < 8; i++) s += (char)((v >> (8*i)) & 0xFF);
+        }
+        static unsigned int GetU16(const char *p) {
+            return (unsigned char)p[0] | ((unsigned char)p[1] << 8);
+        }
+        static unsigned int GetU32(const char *p) {
+            unsigned int v = 0;
+            for (int i = 3; i >= 0; i--) v = (v << 8) | (unsigned char)p[i];
+            return v;
+        }
+        static unsigned long long GetU64(const char *p) {
+            unsigned long long v = 0;
+            for (int i = 7; i >= 0; i--) v = (v << 8) | (unsigned char)p[i];
+            return v;
+        }
+
+        Mbox_pack(const Mbox_pack&);
+        Mbox_pack& operator=(const Mbox_pack&);
+};
+
+#endif //__MBOX_PACK_HPP
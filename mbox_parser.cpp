@@ -54,6 +54,9 @@ Mbox_parser::Mbox_parser(std::string const filename) {
     outputdirectory = "";
     bEmlToWindows = false;
     bSynchronize = false;
+    emlLayout = EML_LAYOUT_FLAT;
+    emlDurability = EML_DURABILITY_NONE;
+    emlFormat = EML_FORMAT_FILE;
     bGenerateMboxCompact = false;
     bExtractMboxEml = false;
     bGenerateMboxSplit = false;
@@ -62,17 +65,28 @@ Mbox_parser::Mbox_parser(std::string const filename) {
     bExtractDeleted = false;
     bExtractDuplicated = false;
     mboxsplitmaxsize = 0;
+    splitMode = MBOX_SPLIT_SIZE;
+    memset(&tm_maildate, 0, sizeof(tm_maildate)); // tm_isdst is kept between mails by GetMailDate()
     GetLocalTimeZone();
     cbFunc_eml_preprocess = NULL;
     cbFunc_eml_process = NULL;
     cbFunc_log = NULL;
+    bUploadEml = false;
+    emlWriter = NULL;
+    splitWriter = NULL;
+    emlPack = NULL;
+    emlTar = NULL;
     readytoparse = false;
 }
 //---------------------------------------------------------------------------------------------
 /**
  *  Class destructor
  */
-Mbox_parser::~Mbox_parser() {}
+Mbox_parser::~Mbox_parser() {
+    delete emlWriter;
+    delete splitWriter;
+    delete emlPack;
+}
 //---------------------------------------------------------------------------------------------
 /**
  *  SetMboxFile()
@@ -157,18 +171,30 @@ void Mbox_parser::Init() {
     bDisableMboxSplit = false;
     splitfilename = "";
     splitindex = 0;
+    splitslice = 0;
+    mailsoffset = 0;
+    mailoffset = 0;
     vmails.clear();
     vmail.clear();
     vheader.clear();
     vmailcrlf.clear();
+    vmailupload.clear();
+    bUploadEml = false;
     tt_timezero = time(0);
     islastmail = false;
     bmaildatestored = false;
     tt_maildate = 0;
     newline = "\n";
     iAnim=0;
+    tp_progressbar = std::chrono::steady_clock::time_point();
     emlfilename = "";
     emlList.clear();
+    emlCount.clear();
+    outputManifest.clear();
+    outputLayoutDirs.clear();
+    outputLayouts.clear();
+    bOutputLayoutMarked = false;
+    bOutputDirectoryExists = false;
 }
 //---------------------------------------------------------------------------------------------
 /**
@@ -176,12 +202,16 @@ void Mbox_parser::Init() {
  *  Display console progress bar for current mbox file
  */
 void Mbox_parser::ShowProgressBar() {
+    // Redraw at most every 40ms (about the previous animation speed) instead of sleeping on each call
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (i_progression < 100 && now - tp_progressbar < std::chrono::milliseconds(40)) return;
+    tp_progressbar = now;
+
     std::cout << "[" << std::string(floor(this->i_progression/2), '=') << std::string(50-floor(this->i_progression/2), ' ') << "] ";
     std::cout << std::setw(3) << i_progression << "% " << Anim[(int)floor(iAnim)] << "\r";
     std::cout.flush();
     iAnim +=.50;
     if (iAnim >= 4) iAnim = 0;
-    usleep(1000);
 }
 //---------------------------------------------------------------------------------------------
 /**
@@ -208,6 +238,130 @@ void Mbox_parser::GetLocalTimeZone() {
     minutelocalTZ = (diff / 60) % 60;
 }
 //---------------------------------------------------------------------------------------------
+/**
+ *  LoadOutputManifest()
+ *  List once the files of output directory to avoid a file system access for each email
+ *  The files of the sub-directories of the layout and of the previous ones recorded in the marker
+ *  file are listed, so that the ones left by a run with another layout are synchronized
+ *  A thunderbird child folder named like a layout sub-directory ("2019", "ab") is never listed
+ */
+void Mbox_parser::LoadOutputManifest() {
+    std::vector<string> vListDirectory;
+
+    outputManifest.clear();
+    outputLayoutDirs.clear();
+    if (ListDirectoryContents(vListDirectory, outputdirectory, true, false))
+        outputManifest.insert(vListDirectory.begin(), vListDirectory.end());
+    outputManifest.erase(EML_LAYOUT_MARKER);
+
+    outputLayouts = GetEmlLayouts(outputdirectory);
+    if (emlLayout != EML_LAYOUT_FLAT && std::find(outputLayouts.begin(), outputLayouts.end(), emlLayout) == outputLayouts.end())
+        outputLayouts.push_back(emlLayout);
+    if (outputLayouts.empty()) return;
+
+    std::vector<string> vLevel1, vLevel2;
+    ListDirectoryContents(vLevel1, outputdirectory, false, true);
+    for (const string& d1 : vLevel1) {
+        int layout = EmlLayoutOfDir(d1);
+        if (std::find(outputLayouts.begin(), outputLayouts.end(), layout) == outputLayouts.end()) continue;
+        vLevel2.clear();
+        ListDirectoryContents(vLevel2, outputdirectory + d1, false, true);
+        for (const string& d2 : vLevel2) {
+            if (!IsEmlLayoutDir(d2, layout, 2)) continue;
+            string subdir = d1 + "/" + d2 + "/";
+            outputLayoutDirs.insert(subdir);
+            vListDirectory.clear();
+            ListDirectoryContents(vListDirectory, outputdirectory + subdir, true, false);
+            for (const string& f : vListDirectory) outputManifest.insert(subdir + f);
+        }
+    }
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  LoadMaildir()
+ *  Create the "tmp", "new" and "cur" sub-directories of the Maildir output directory if needed
+ *  and list once its messages by their unique name (without the flags of "cur" messages), so
+ *  that a message moved or flagged by the mail server since the last run is not delivered again
+ *  Return false if a sub-directory cannot be created
+ */
+bool Mbox_parser::LoadMaildir() {
+    std::vector<string> vListDirectory;
+    const char *subdirs[] = {"tmp", "new", "cur"};
+    bool bCreated = false;
+
+    outputManifest.clear();
+    for (const char *subdir : subdirs) {
+        string dir = outputdirectory + subdir;
+        if (!DirectoryExists(dir)) {
+            if (!createPath(dir)) {
+                if (*cbFunc_log) cbFunc_log ("ERROR", "Maildir directory cannot be created : \""+dir+"\"");
+                return false;
+            }
+            bCreated = true;
+            continue;
+        }
+        if (dir == outputdirectory + "tmp") continue;
+        vListDirectory.clear();
+        ListDirectoryContents(vListDirectory, dir, true, false);
+        for (const string& f : vListDirectory) outputManifest.insert(MaildirUniqueName(f));
+    }
+
+    // Entries of the new sub-directories in the Maildir
+    if (bCreated && emlDurability != EML_DURABILITY_NONE) SyncDirectory(outputdirectory);
+    return true;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  SynchronizeOutput()
+ *  Delete the files of output directory that are not in valid emails list or that are
+ *  not in the sub-directory expected by the layout (eg: after a layout change)
+ *  Deletions are done as a parallel batch
+ */
+void Mbox_parser::SynchronizeOutput() {
+    std::vector<string> vListDiff;
+    std::vector<bool> vRemoved;
+
+    for (const string& n : outputManifest) {
+        size_t pos = n.find_last_of('/');
+        string name = (pos == string::npos)? n : n.substr(pos+1);
+        string dir = (pos == string::npos)? "" : n.substr(0, pos+1);
+        if (!emlCount.count(name) || dir != EmlLayoutDir(name, emlLayout))
+            vListDiff.push_back(outputdirectory + n);
+    }
+    sort(vListDiff.begin(), vListDiff.end());
+
+    nbemlremoved += RemoveFiles(vListDiff, vRemoved);
+
+    for (size_t i = 0; i < vListDiff.size(); i++) {
+        if (vRemoved[i]) outputManifest.erase(vListDiff[i].substr(outputdirectory.length()));
+        if (*cbFunc_log){
+            if (vRemoved[i]) cbFunc_log ("INFO", "File \""+vListDiff[i]+"\" was deleted");
+            else cbFunc_log ("WARNING", "Can not delete file \""+vListDiff[i]+"\"");
+        }
+    }
+
+    // Layout sub-directories left empty are removed (a non empty one cannot be)
+    for (auto it = outputLayoutDirs.begin(); it != outputLayoutDirs.end(); ) {
+        if (std::remove((outputdirectory + *it).c_str()) == 0) {
+            std::remove((outputdirectory + it->substr(0, it->find('/'))).c_str());
+            it = outputLayoutDirs.erase(it);
+        }
+        else ++it;
+    }
+
+    // Only the layouts with sub-directories left stay recorded
+    std::vector<int> vLayouts;
+    for (const string& subdir : outputLayoutDirs) {
+        int layout = EmlLayoutOfDir(subdir.substr(0, subdir.find('/')));
+        if (std::find(vLayouts.begin(), vLayouts.end(), layout) == vLayouts.end()) vLayouts.push_back(layout);
+    }
+    std::vector<int> vMarked = GetEmlLayouts(outputdirectory);
+    sort(vLayouts.begin(), vLayouts.end());
+    sort(vMarked.begin(), vMarked.end());
+    if (vLayouts != vMarked && !SetEmlLayouts(outputdirectory, vLayouts) && *cbFunc_log)
+        cbFunc_log ("WARNING", "Can not write file \""+outputdirectory+EML_LAYOUT_MARKER+"\"");
+}
+//---------------------------------------------------------------------------------------------
 /**
  *  Parse()
  *  Process the source file by block
@@ -230,7 +384,7 @@ int Mbox_parser::Parse() {
     this->Init();
 
     // Create output directory if necessary
-    if ((bGenerateMboxCompact || bExtractMboxEml || (bGenerateMboxSplit && mboxsplitmaxsize)) && !DirectoryExists(outputdirectory)) {
+    if ((bGenerateMboxCompact || (bExtractMboxEml && emlFormat != EML_FORMAT_TAR) || (bGenerateMboxSplit && (mboxsplitmaxsize || splitMode >= MBOX_SPLIT_YEAR))) && !DirectoryExists(outputdirectory)) {
         if (outputdirectory.empty()) {
             mboxfile.close();
             if (*cbFunc_log) cbFunc_log ("ERROR", "Output directory is undefined");
@@ -243,18 +397,49 @@ int Mbox_parser::Parse() {
         }
     }
 
+    // The output directory is checked and listed once, the manifest is then updated as files are written
+    bOutputDirectoryExists = DirectoryExists(outputdirectory);
+    if (bOutputDirectoryExists && bExtractMboxEml && emlFormat == EML_FORMAT_FILE) LoadOutputManifest();
+
+    // The messages already in the Maildir are the output manifest
+    if (bOutputDirectoryExists && bExtractMboxEml && emlFormat == EML_FORMAT_MAILDIR && !LoadMaildir()) {
+        mboxfile.close();
+        return -1;
+    }
+
+    // The emails already in the pack are the output manifest
+    if (bOutputDirectoryExists && bExtractMboxEml && emlFormat == EML_FORMAT_PACK) {
+        packfilename = outputdirectory + mboxfilename + MBOX_PACK_EXTENSION;
+        delete emlPack;
+        emlPack = new Mbox_pack();
+        if (!emlPack->Open(packfilename, true)) {
+            if (*cbFunc_log) cbFunc_log ("ERROR", emlPack->GetError()+". Extraction is aborted.");
+            delete emlPack;
+            emlPack = NULL;
+        }
+        else {
+            if (emlPack->IsRecovered() && *cbFunc_log) cbFunc_log ("WARNING", "Index of \""+packfilename+"\" was rebuilt from its blocks");
+            outputManifest.clear();
+            for (const Mbox_pack_entry& entry : emlPack->GetEntries()) outputManifest.insert(entry.name);
+        }
+    }
+
     if (bGenerateMboxCompact) {
         std::stringstream ss;
         ss << std::put_time(std::localtime(&tt_timezero), "_%Y%m%d%H%M%S");
         compactfilename = outputdirectory + mboxfilename + ss.str();
-        outputcompact.open( compactfilename, std::ofstream::binary | std::ofstream::app );
-        if (! outputcompact.is_open()){
+        if (!outputcompact.Open(mboxfullname, compactfilename + EML_WRITER_TMPSUFFIX)){
              mboxfile.close();
              if (*cbFunc_log) cbFunc_log ("ERROR", "Could not open \""+compactfilename+"\". Compact process is aborted.");
              bDisableMboxCompact = false;
         }
     }
 
+    if (bGenerateMboxSplit) {
+        delete splitWriter;
+        splitWriter = new Mbox_split_writer(mboxfullname, emlDurability);
+    }
+
     tt_timezero = time(0);
     if (mailAgeMax>0) SetAgeMax(mailAgeMax);
     if (mailAgeMin>0) SetAgeMin(mailAgeMin);
@@ -286,38 +471,126 @@ int Mbox_parser::Parse() {
     mboxfile.close();
     readytoparse = false;
 
+    // Wait for the eml files still being written
+    CollectWrites(true);
+    ClosePack();
+
+    // Rename the compact and split files now complete
+    if (outputcompact.IsOpen()) CloseOutputFile(outputcompact, compactfilename);
+    if (splitWriter) {
+        // After an error, the parts not closed are removed with the writer
+        if (!bDisableMboxSplit) splitWriter->CloseAll();
+        CollectSplit(true);
+        delete splitWriter;
+        splitWriter = NULL;
+    }
+
     // Synchronize output directory content
-    if (bSynchronize && bExtractMboxEml) {
-        std::vector<string> vListDirectory;
+    if (bSynchronize && bExtractMboxEml && bOutputDirectoryExists && emlFormat == EML_FORMAT_FILE) SynchronizeOutput();
 
-        // List files (only) contains in directory output
-        if (ListDirectoryContents(vListDirectory, outputdirectory, true, false)){
-            vector<string> vListDiff;
+    // if output directory is empty then delete it
+    std::vector<string> vList;
+    ListDirectoryContents(vList, outputdirectory, true, true);
+    if (vList.empty()) std::remove(outputdirectory.c_str());
 
-            sort(vListDirectory.begin(), vListDirectory.end());
-            sort(emlList.begin(), emlList.end());
+    if (*cbFunc_log) cbFunc_log ("INFO", "End parsing and processing file");
 
-            set_difference(vListDirectory.begin(),vListDirectory.end(),emlList.begin(),emlList.end(),back_inserter(vListDiff));
+    return nbmailok;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  ProcessOutput()
+ *  Call the eml process callbacks for the eml (or eml.gz) files already in the output directory
+ *  instead of parsing the mbox, eg: to upload the emails extracted while the server was down
+ *  The files are read as they were written (compressed or not) and their date is the one of
+ *  their name 'YYYYmmddHHMMSS_MD5.eml', the date filters are applied to it
+ *  The vector 'emlList' then contains the names of the files
+ *  Return the number of files or -1 if the output directory does not exist
+ */
+int Mbox_parser::ProcessOutput() {
 
+    mboxfile.close();
+    readytoparse = false;
+    this->Init();
 
-            for(string n : vListDiff){
-                n = outputdirectory + n;
-                int ret = std::remove(n.c_str());
-                if (!ret) nbemlremoved++;
-                if (*cbFunc_log){
-                    if (!ret) cbFunc_log ("INFO", "File \""+n+"\" was deleted");
-                    else cbFunc_log ("WARNING", "Can not delete file \""+n+"\"");
-                }
-            }
-        }
+    if (outputdirectory.empty() || !DirectoryExists(outputdirectory)) {
+        if (*cbFunc_log) cbFunc_log ("ERROR", "Output directory does not exist : \""+outputdirectory+"\"");
+        return -1;
     }
+    bOutputDirectoryExists = true;
+    LoadOutputManifest();
 
-    // if output directory is empty then delete it
-    std::vector<string> vList;
-    ListDirectoryContents(vList, outputdirectory, true, true);
-    if (vList.empty()) std::remove(outputdirectory.c_str());
+    if (mailAgeMax>0) SetAgeMax(mailAgeMax);
+    if (mailAgeMin>0) SetAgeMin(mailAgeMin);
 
-    if (*cbFunc_log) cbFunc_log ("INFO", "End parsing and processing file");
+    if (*cbFunc_log) cbFunc_log ("INFO", "Start processing the eml files of \""+outputdirectory+"\"");
+
+    std::vector<string> vPaths(outputManifest.begin(), outputManifest.end());
+    sort(vPaths.begin(), vPaths.end());
+
+    std::vector<char> veml;
+    for (const string& path : vPaths) {
+        size_t pos = path.find_last_of('/');
+        string name = (pos == string::npos)? path : path.substr(pos+1);
+        string dir = (pos == string::npos)? "" : path.substr(0, pos+1);
+        size_t ext = name.rfind(".eml");
+        if (ext == string::npos || (name.compare(ext, string::npos, ".eml") && name.compare(ext, string::npos, ".eml.gz"))) continue;
+        if (dir != EmlLayoutDir(name, emlLayout)) continue;
+        nbmailread++;
+
+        // Date of the name, after the prefix of a deleted or duplicated email
+        size_t sep = name.rfind('_', ext);
+        tt_maildate = 0;
+        if (sep != string::npos && sep >= 14 && name.compare(sep-14, 14, "00000000000000")) {
+            memset(&tm_maildate, 0, sizeof(tm_maildate));
+            tm_maildate.tm_year = atoi(name.substr(sep-14, 4).c_str()) - 1900;
+            tm_maildate.tm_mon = atoi(name.substr(sep-10, 2).c_str()) - 1;
+            tm_maildate.tm_mday = atoi(name.substr(sep-8, 2).c_str());
+            tm_maildate.tm_hour = atoi(name.substr(sep-6, 2).c_str());
+            tm_maildate.tm_min = atoi(name.substr(sep-4, 2).c_str());
+            tm_maildate.tm_sec = atoi(name.substr(sep-2, 2).c_str());
+            tm_maildate.tm_isdst = -1;
+            tt_maildate = std::mktime(&tm_maildate);
+            if (tt_maildate < 0) tt_maildate = 0;
+        }
+        if (tt_maildate && IsExcludedMail()) {
+            nbmailexcluded++;
+            continue;
+        }
+
+        nbmailok++;
+        emlList.push_back(path);
+        emlCount[name]++;
+
+        if (!*cbFunc_eml_process) continue;
+        if (*cbFunc_eml_preprocess && !cbFunc_eml_preprocess(outputdirectory, path)) continue;
+
+        std::ifstream file(outputdirectory + path, std::ios::binary | std::ios::ate);
+        if (!file) {
+            if (*cbFunc_log) cbFunc_log ("ERROR", "Failed to open eml file \""+outputdirectory + path+"\"");
+            continue;
+        }
+        veml.resize((size_t)file.tellg());
+        file.seekg(0);
+        if (!file.read(veml.data(), veml.size())) {
+            if (*cbFunc_log) cbFunc_log ("ERROR", "Failed to read eml file \""+outputdirectory + path+"\"");
+            continue;
+        }
+
+        // The file is encrypted as the content of a parsed email is (see AddUploadStages())
+        if (!uploadKey.empty()) {
+            vmailupload.clear();
+            vmailupload.reserve(veml.size() + 2*EML_PIPELINE_IVLEN);
+            Eml_pipeline pipe;
+            AddUploadStages(pipe);
+            pipe.Write(veml.data(), veml.size());
+            pipe.Finish();
+            veml.swap(vmailupload);
+        }
+        cbFunc_eml_process(outputdirectory, path, std::move(veml), tt_maildate);
+    }
+
+    if (*cbFunc_log) cbFunc_log ("INFO", "End processing the eml files");
 
     return nbmailok;
 }
@@ -404,16 +677,15 @@ void Mbox_parser::ProcessPacket() {
 
     ShowProgressBar();
 
-    if (!vmails.size()) {
-        vmails = buffer;
-    }
-    else {
-        copy(buffer.begin(), buffer.begin()+mboxfile.gcount(), std::back_inserter(vmails));
-    }
+    // Only the bytes read are added (the buffer is not filled on the last packet)
+    vmails.insert(vmails.end(), buffer.begin(), buffer.begin()+mboxfile.gcount());
 
     while (FindMailSeparator()) {
-        vmail.assign(vmails.begin(), vmails.begin()+mailsize+((islastmail)?0:1)); // assign after \n from "\nFrom - "
-        vmails.erase(vmails.begin(), vmails.begin()+mailsize+((islastmail)?0:1)); // erase before \n from "\nFrom - "
+        size_t len = mailsize+((islastmail)?0:1);
+        vmail.assign(vmails.begin(), vmails.begin()+len); // assign after \n from "\nFrom - "
+        vmails.erase(vmails.begin(), vmails.begin()+len); // erase before \n from "\nFrom - "
+        mailoffset = mailsoffset;
+        mailsoffset += len;
 
         nbmailread++;
         ProcessMail();
@@ -461,8 +733,7 @@ void Mbox_parser::ProcessMail() {
         // if set to be store (even if marked as deleted)
         else {
             // Generate file name based on MD5 content (without any header field)
-            std::string str(vmail.begin(),vmail.end());
-            emlfilename = "00000000000000_"+PrintMD5(str)+".eml";
+            emlfilename = "00000000000000_"+PrintMD5(vmail.data(), vmail.size())+".eml";
             if (bCompressEml) emlfilename += ".gz";
         }
     }
@@ -488,7 +759,9 @@ void Mbox_parser::ProcessMail() {
         emlfilename = "del_"+EmlFilename();
 
     // Verifying duplicate email
-    int nbdup = count_needle(emlList, EmlFilename());
+    int nbdup = 0;
+    std::unordered_map<string, int>::const_iterator itdup = emlCount.find(EmlFilename());
+    if (itdup != emlCount.end()) nbdup = itdup->second;
     if (nbdup > 0)
     {
         nbmailduplicated++;
@@ -502,120 +775,315 @@ void Mbox_parser::ProcessMail() {
 
 
     nbmailok++;
-    emlList.push_back(EmlFilename());
-
-    if (DirectoryExists(outputdirectory)) {
-        if (bExtractMboxEml) {
-            if (!FileExists(outputdirectory + EmlFilename())) {
-                if (SaveToEML()) {
-                    if (*cbFunc_log) cbFunc_log ("VERBOSE3", "Successfully saved email to \""+outputdirectory + EmlFilename()+"\"");
-                    nbmailextracted++;
-                }
-                else if (*cbFunc_log) cbFunc_log ("VERBOSE1", "Unable to save email to \""+outputdirectory + EmlFilename()+"\"");
-            }
-            else {if (*cbFunc_log) cbFunc_log ("VERBOSE2", "Already existing file \""+outputdirectory + EmlFilename()+"\"");
-                //emlfilename = "_" + EmlFilename();
-                //SaveToEML();
-            }
+    emlList.push_back(EmlPath());
+    emlCount[EmlFilename()]++;
+
+    // The process callback is asked first, so that the eml and the content it takes are made
+    // in the same pass (see StoreEML())
+    bUploadEml = *cbFunc_eml_process && (!*cbFunc_eml_preprocess || cbFunc_eml_preprocess(outputdirectory, EmlPath()));
+
+    // A tar stream does not need the output directory
+    if (bExtractMboxEml && (bOutputDirectoryExists || emlFormat == EML_FORMAT_TAR)) {
+        if (!outputManifest.count(EmlPath())) {
+            // File is accounted by CollectWrites() once it is written
+            if (SaveToEML()) outputManifest.insert(EmlPath());
+            else if (*cbFunc_log) cbFunc_log ("VERBOSE1", "Unable to save email to \""+outputdirectory + EmlPath()+"\"");
+            CollectWrites();
+        }
+        else {if (*cbFunc_log) cbFunc_log ("VERBOSE2", "Already existing file \""+outputdirectory + EmlPath()+"\"");
+            //emlfilename = "_" + EmlFilename();
+            //SaveToEML();
         }
+    }
 
+    if (bOutputDirectoryExists) {
         if (bGenerateMboxCompact && !bDisableMboxCompact) {
             if (SaveToCompact()) nbmailcompact++;
         }
 
         if (bGenerateMboxSplit && !bDisableMboxSplit) {
             if (SaveToSplit()) nbmailsplit++;
+            CollectSplit();
         }
     }
 
-    // If callback for eml process is defined
-    if (*cbFunc_eml_process) {
-        bool valid = true;
-        // If callback for previous test of eml preprocess is defined
-        if (*cbFunc_eml_preprocess)
-            valid = cbFunc_eml_preprocess(outputdirectory, EmlFilename());
-        if (valid) {
-            StoreEML();
-            cbFunc_eml_process(outputdirectory, EmlFilename(), vmailcrlf);
-        }
+    // If callback for eml process is defined and takes the email
+    if (bUploadEml) {
+        StoreEML(false);
+        cbFunc_eml_process(outputdirectory, EmlPath(), std::move(vmailupload), bmaildatestored ? tt_maildate : 0);
     }
 
     vmail.clear();
     vheader.clear();
     vmailcrlf.clear();
+    vmailupload.clear();
 }
 //---------------------------------------------------------------------------------------------
 /**
  *  StoreEML()
  *  Save email to vector vmailcrlf in the brut format as it is in the inbox file unless the
  *  "windows-format" option is specified. In this case, the end of line character is forced to "\r\n"
+ *  If the process callback takes the email, its content vmailupload is made in the same pass,
+ *  the eml gets the plain output and the callback the encrypted one (see AddUploadStages())
+ *  With bEml false, only vmailupload is needed
  */
-void Mbox_parser::StoreEML(){
-
-    if (vmailcrlf.size()) return;
-    int firstline = offset(vmail, "\n")+1;
-
-    if (newline == "\n" && bEmlToWindows) {
-        string crlf = "\r\n";
-        size_t prevpos = firstline;
-        size_t pos = offset(vmail, "\n",firstline);
-        while (pos != (size_t)-1) {
-            ShowProgressBar();
-            vmailcrlf.insert( std::end(vmailcrlf), std::begin(vmail)+prevpos, std::begin(vmail)+pos );
-            if (vmailcrlf.back() == '\r') vmailcrlf.pop_back(); // Sometimes the extracted email contains a mix of linux and windows line breaks
-            vmailcrlf.insert( std::end(vmailcrlf), std::begin(crlf), std::end(crlf) );
-
-            prevpos = pos+1;
-            pos = offset(vmail, "\n", pos+1);
-        }
+void Mbox_parser::StoreEML(bool bEml){
+
+    bool bStore = bEml && vmailcrlf.empty();
+    bool bUpload = bUploadEml && vmailupload.empty();
+    if (!bStore && !bUpload) return;
+    size_t firstline = offset(vmail, "\n")+1;
+    const char *data = vmail.data()+firstline;
+    size_t len = vmail.size()-firstline;
+
+    // Uncompressed conversion is done in place with the exact final size
+    if (bStore && !bUpload && newline == "\n" && bEmlToWindows && !bCompressEml) {
+        bool lastcr = false;
+        vmailcrlf.resize(len + count_bare_lf(data, len));
+        lf_to_crlf(data, len, vmailcrlf.data(), lastcr);
+        return;
     }
-    else {
-        vmailcrlf = std::vector<char> (vmail.begin()+firstline, vmail.end());
+
+    // Line ending conversion, compression and encryption are done in a single pass
+    Eml_pipeline pipe, upload;
+    AddEmlStages(pipe);
+    if (bStore && bUpload) {
+        AddUploadStages(upload);
+        pipe.Add(new Tee_stage(upload));
     }
+    if (bStore) pipe.Add(new Vector_sink(vmailcrlf));
+    else AddUploadStages(pipe);
 
-    if (bCompressEml) {
-        std::vector<char> eml_gz = compress_gzip(vmailcrlf);
-        vmailcrlf = eml_gz;
+    if (!bCompressEml) {
+        if (bStore) vmailcrlf.reserve(len);
+        if (bUpload) vmailupload.reserve(len + 2*EML_PIPELINE_IVLEN);
     }
+    pipe.Write(data, len);
+    pipe.Finish();
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  AddEmlStages()
+ *  Add to the pipeline the stages that transform the brut email to eml content :
+ *  conversion to "\r\n" if "windows-format" option is specified and gzip compression
+ */
+void Mbox_parser::AddEmlStages(Eml_pipeline& pipe){
+
+    if (newline == "\n" && bEmlToWindows)
+        pipe.Add(new Crlf_stage()); // Sometimes the extracted email contains a mix of linux and windows line breaks
+    if (bCompressEml)
+        pipe.Add(new Gzip_stage());
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  AddUploadStages()
+ *  Add to the pipeline the stages that make the content given to the process callback :
+ *  AES-256-CBC encryption if an upload key is set (see SetUploadKey()) and vmailupload
+ */
+void Mbox_parser::AddUploadStages(Eml_pipeline& pipe){
+
+    if (!uploadKey.empty())
+        pipe.Add(new Aes_stage(uploadKey));
+    pipe.Add(new Vector_sink(vmailupload));
 }
 //---------------------------------------------------------------------------------------------
 /**
  *  SaveToEML()
  *  Save email to eml file with name formated as "YYYYmmddHHMMSS_MD5ofMessageID.eml"
  *  or "YYYYmmddHHMMSS_MD5ofMessageID.eml.gz" if compressed
- *  Return true if succeed
+ *  The file is stored in the sub-directories of the output layout, created when needed
+ *  The file is queued to the background writer, its result is given by CollectWrites()
+ *  Return true if the file is queued
  */
 bool Mbox_parser::SaveToEML(){
 
-    string emlfullname = outputdirectory + emlfilename;
-    std::ofstream f( emlfullname, std::ofstream::binary );
-    if (! f.is_open()){
-        if (*cbFunc_log) cbFunc_log ("ERROR", "Could not open \""+emlfullname+"\"");
-        return false;
+    if (emlFormat == EML_FORMAT_PACK) return SaveToPack();
+    if (emlFormat == EML_FORMAT_TAR) return SaveToTar();
+    if (emlFormat == EML_FORMAT_MAILDIR) return SaveToMaildir();
+
+    string layoutdir = EmlLayoutDir(EmlFilename(), emlLayout);
+    if (!layoutdir.empty() && !outputLayoutDirs.count(layoutdir)) {
+        if (!createPath(outputdirectory + layoutdir)) {
+            if (*cbFunc_log) cbFunc_log ("ERROR", "Could not create directory \""+outputdirectory + layoutdir+"\"");
+            return false;
+        }
+        outputLayoutDirs.insert(layoutdir);
+
+        // The layout is recorded before its first file so that a later run lists its sub-directories
+        if (!bOutputLayoutMarked) {
+            std::vector<int> vLayouts = GetEmlLayouts(outputdirectory);
+            if (std::find(vLayouts.begin(), vLayouts.end(), emlLayout) == vLayouts.end()) {
+                vLayouts.push_back(emlLayout);
+                if (!SetEmlLayouts(outputdirectory, vLayouts)) {
+                    if (*cbFunc_log) cbFunc_log ("ERROR", "Could not write file \""+outputdirectory+EML_LAYOUT_MARKER+"\"");
+                    return false;
+                }
+            }
+            bOutputLayoutMarked = true;
+        }
+
+        // Entries of the new sub-directories in their parent
+        if (emlDurability != EML_DURABILITY_NONE) {
+            SyncDirectory(outputdirectory + layoutdir.substr(0, layoutdir.find('/')+1));
+            SyncDirectory(outputdirectory);
+        }
     }
 
+    // The content is built here and written in background
+    // If eml content is needed by the process callback then it is made in the same pass
+    std::vector<char> vdata;
     StoreEML();
+    vdata.swap(vmailcrlf);
+
+    if (!emlWriter) {
+        emlWriter = new Eml_writer();
+        emlWriter->SetDurability(emlDurability);
+    }
+    emlWriter->Submit(outputdirectory + layoutdir + emlfilename, vdata);
 
-    f.write(vmailcrlf.data(), vmailcrlf.size());
-    if (f.bad()) {
-        std::remove(emlfullname.c_str());
-        if (*cbFunc_log) cbFunc_log ("ERROR", "Could not write to \""+emlfullname+"\"");
+    return true;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  SaveToPack()
+ *  Append email to the pack "mboxfilename.mzpack" with its name, date and flags
+ *  (see Mbox_pack), the emails are compressed by blocks
+ *  Return true if succeed
+ */
+bool Mbox_parser::SaveToPack(){
+
+    if (!emlPack) return false;
+
+    unsigned int flags = 0;
+    if (EmlFilename().find("00000000000000_") != string::npos) flags |= MBOX_PACK_INVALID;
+    if (IsDeletedMail()) flags |= MBOX_PACK_DELETED;
+    if (EmlFilename().compare(0, 3, "dup") == 0) flags |= MBOX_PACK_DUPLICATED;
+    long long date = (!(flags & MBOX_PACK_INVALID) && GetMailDate()) ? (long long)tt_maildate : 0;
+
+    StoreEML();
+    if (!emlPack->Add(EmlFilename(), date, flags, vmailcrlf.data(), vmailcrlf.size())) {
+        if (*cbFunc_log) cbFunc_log ("ERROR", emlPack->GetError()+". Extraction is aborted.");
+        ClosePack();
         return false;
     }
 
+    nbmailextracted++;
+    if (*cbFunc_log) cbFunc_log ("VERBOSE3", "Successfully saved email \""+EmlFilename()+"\" to \""+packfilename+"\"");
     return true;
 }
 //---------------------------------------------------------------------------------------------
+/**
+ *  SaveToTar()
+ *  Append email to the tar stream as entry "outputdirectory/layout/YYYYmmddHHMMSS_MD5.eml"
+ *  (or eml.gz if compressed) dated with the mail date, no file is created
+ *  Return true if succeed
+ */
+bool Mbox_parser::SaveToTar(){
+
+    if (!emlTar || !emlTar->IsOpen()) return false;
+
+    StoreEML();
+    long long date = GetMailDate() ? (long long)tt_maildate : (long long)tt_timezero;
+    if (!emlTar->Add(outputdirectory + EmlPath(), date, vmailcrlf.data(), vmailcrlf.size())) {
+        if (*cbFunc_log) cbFunc_log ("ERROR", emlTar->GetError()+". Extraction is aborted.");
+        emlTar = NULL;
+        return false;
+    }
+
+    nbmailextracted++;
+    if (*cbFunc_log) cbFunc_log ("VERBOSE3", "Successfully saved email \""+outputdirectory + EmlPath()+"\" to tar output");
+    return true;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  SaveToMaildir()
+ *  Deliver email to the Maildir output directory : the message is written to "tmp/" then
+ *  renamed to "new/YYYYmmddHHMMSS_MD5.eml" or, if it has flags, to
+ *  "cur/YYYYmmddHHMMSS_MD5.eml:2,FLAGS" (see MaildirFlags())
+ *  The name does not depend on the run so that a rerun skips the delivered messages
+ *  The file is queued to the background writer, its result is given by CollectWrites()
+ *  Return true if the file is queued
+ */
+bool Mbox_parser::SaveToMaildir(){
+
+    std::vector<char> vdata;
+    StoreEML();
+    vdata.swap(vmailcrlf);
+
+    string flags = MaildirFlags();
+    string path = outputdirectory + "new/" + EmlFilename();
+    if (!flags.empty()) path = outputdirectory + "cur/" + EmlFilename() + MAILDIR_INFO_SEPARATOR + "2," + flags;
+
+    if (!emlWriter) {
+        emlWriter = new Eml_writer();
+        emlWriter->SetDurability(emlDurability);
+    }
+    emlWriter->Submit(path, vdata, outputdirectory + "tmp/" + EmlFilename());
+
+    return true;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  ClosePack()
+ *  Write the last block and the index of the pack, then close it
+ *  With durability, the pack and its directory are synced
+ */
+void Mbox_parser::ClosePack(){
+
+    if (!emlPack) return;
+    bool bSync = (emlDurability != EML_DURABILITY_NONE);
+    if (!emlPack->Close(bSync)) {
+        if (*cbFunc_log) cbFunc_log ("ERROR", emlPack->GetError());
+    }
+    else if (bSync && !SyncDirectory(outputdirectory)) {
+        if (*cbFunc_log) cbFunc_log ("ERROR", "Could not sync directory \""+outputdirectory+"\"");
+    }
+    delete emlPack;
+    emlPack = NULL;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  CollectWrites()
+ *  Account the eml files written in background since last call and log their result
+ *  If bWait is true then wait for all pending files to be written before
+ */
+void Mbox_parser::CollectWrites(bool bWait){
+
+    if (!emlWriter) return;
+    if (bWait) emlWriter->Flush();
+
+    std::vector<Eml_write_result> vResults;
+    if (!emlWriter->Collect(vResults)) return;
+
+    for (const Eml_write_result& result : vResults) {
+        if (result.ok) {
+            nbmailextracted++;
+            if (*cbFunc_log) cbFunc_log ("VERBOSE3", "Successfully saved email to \""+result.path+"\"");
+        }
+        else {
+            string name = result.path.substr(outputdirectory.length());
+            if (emlFormat == EML_FORMAT_MAILDIR) name = MaildirUniqueName(name.substr(name.find('/')+1));
+            outputManifest.erase(name);
+            if (*cbFunc_log) {
+                cbFunc_log ("ERROR", result.error);
+                cbFunc_log ("VERBOSE1", "Unable to save email to \""+result.path+"\"");
+            }
+        }
+    }
+}
+//---------------------------------------------------------------------------------------------
 /**
  *  SaveToCompact()
  *  Add full email (with line "From - ...") to new mbox file named "mboxfilename_YYYYmmddHHMMSS"
+ *  The email is copied from its byte range in mbox file (see Mbox_range_file)
  *  Return true if succeed
  */
 bool Mbox_parser::SaveToCompact(){
 
-    outputcompact.write(vmail.data(), vmail.size());
-    if (outputcompact.bad()) {
+    if (!outputcompact.Add(mailoffset, vmail.size())) {
         if (*cbFunc_log) cbFunc_log ("ERROR", "Could not write to \""+compactfilename+"\". Compact process is aborted.");
+        outputcompact.Close();
+        std::remove((compactfilename + EML_WRITER_TMPSUFFIX).c_str());
         bDisableMboxCompact = true;
         return false;
     }
@@ -624,61 +1092,126 @@ bool Mbox_parser::SaveToCompact(){
 //---------------------------------------------------------------------------------------------
 /**
  *  SaveToSplit()
- *  Add full email (with line "From ...") to mbox part
+ *  Add full email (with line "From ...") to mbox part according to split mode :
+ *      MBOX_SPLIT_SIZE  : parts of 'mboxsplitmaxsize' bytes at most "mboxfilename.1", ".2"...
+ *      MBOX_SPLIT_COUNT : parts of 'mboxsplitmaxsize' emails at most
+ *      MBOX_SPLIT_PARTS : 'mboxsplitmaxsize' parts of about the same size
+ *      MBOX_SPLIT_YEAR, MBOX_SPLIT_MONTH, MBOX_SPLIT_DAY : one part by period of mail date
+ *          "mboxfilename.YYYY", ".YYYY-mm" or ".YYYY-mm-dd" ("mboxfilename.undated" if no date)
+ *  The email is queued to the split writer that copies its byte range of mbox file
+ *  (see Mbox_split_writer), the result of each part is given by CollectSplit()
  *  Return true if succeed
  */
 bool Mbox_parser::SaveToSplit(){
 
-    if (!mboxsplitmaxsize) {
+    if (!splitWriter || (!mboxsplitmaxsize && splitMode < MBOX_SPLIT_YEAR)) {
         return false;
     }
 
+    // Parts by period are all open until the end as emails are not always sorted by date
+    if (splitMode >= MBOX_SPLIT_YEAR) {
+        std::string period = EmlDatePeriod(EmlFilename(), splitMode);
+        string filename = outputdirectory + mboxfilename + "." + (period.empty() ? "undated" : period);
+        if (!splitWriter->HasPart(filename)) nbsplitfile++;
+        splitWriter->Add(filename, mailoffset, vmail.size());
+        return true;
+    }
+
     // If an email size exceed max split size
-    if (mailsize > mboxsplitmaxsize){
+    if (splitMode == MBOX_SPLIT_SIZE && mailsize > mboxsplitmaxsize){
         if (*cbFunc_log) cbFunc_log ("ERROR", "At least one email exceeds the defined maximum size of the split file. Split process is aborted.");
         bDisableMboxSplit = true;
         return false;
     }
 
     // if first file or add email is over maxsplit then creation of a new file
-    if (!splitindex || mboxsplitcurrentsize+mailsize > mboxsplitmaxsize){
+    bool bNewPart;
+    size_t slice = 0;
+    if (splitMode == MBOX_SPLIT_PARTS) {
+        slice = (unsigned long long)mailoffset * mboxsplitmaxsize / mboxlength;
+        bNewPart = (!splitindex || slice != splitslice);
+    }
+    else if (splitMode == MBOX_SPLIT_COUNT) bNewPart = (!splitindex || mboxsplitcurrentsize >= mboxsplitmaxsize);
+    else bNewPart = (!splitindex || mboxsplitcurrentsize+mailsize > mboxsplitmaxsize);
+
+    size_t prealloc = 0;
+    if (bNewPart){
 
-        int maxsliptcount = ceil(double(mboxlength) / double(mboxsplitmaxsize));
-        int maxsplitfill = ceil(log10(fabs(maxsliptcount)+1));
+        if (splitindex) splitWriter->Close(splitfilename);
+
+        // The number of parts is unknown when splitting by count, so no padding
+        int maxsplitfill = 0;
+        if (splitMode == MBOX_SPLIT_SIZE) {
+            int maxsliptcount = ceil(double(mboxlength) / double(mboxsplitmaxsize));
+            maxsplitfill = ceil(log10(fabs(maxsliptcount)+1));
+            prealloc = std::min(mboxsplitmaxsize, mboxlength-mailoffset);
+        }
+        else if (splitMode == MBOX_SPLIT_PARTS) {
+            maxsplitfill = ceil(log10(fabs(mboxsplitmaxsize)+1));
+            prealloc = (unsigned long long)(slice+1) * mboxlength / mboxsplitmaxsize - mailoffset;
+            splitslice = slice;
+        }
 
         stringstream ss;
         ss << mboxfilename+".";
         ss << setw(maxsplitfill) << setfill('0') << ++splitindex;
         splitfilename = outputdirectory + ss.str();
 
-        if (outputsplit.is_open()) outputsplit.close();
-
-        if (FileExists(splitfilename)) std::remove(splitfilename.c_str());
-        outputsplit.open( splitfilename, std::ofstream::binary | std::ofstream::app );
-        if (!outputsplit.is_open()){
-            if (*cbFunc_log) cbFunc_log ("ERROR", "Could not open \""+splitfilename+"\". Split process is aborted.");
-            bDisableMboxSplit = true;
-            return false;
-        }
-
         mboxsplitcurrentsize = 0;
         nbsplitfile++;
     }
 
     // Append data to file
-    outputsplit.write(vmail.data(), vmail.size());
-    if (outputsplit.bad()) {
-        if (*cbFunc_log) cbFunc_log ("ERROR", "Could not write to \""+splitfilename+"\". Split process is aborted.");
-        outputsplit.close();
-        bDisableMboxSplit = true;
-        return false;
-    }
+    splitWriter->Add(splitfilename, mailoffset, vmail.size(), prealloc);
 
-    mboxsplitcurrentsize += mailsize;
+    mboxsplitcurrentsize += (splitMode == MBOX_SPLIT_COUNT) ? 1 : mailsize;
 
     return true;
 }
 //---------------------------------------------------------------------------------------------
+/**
+ *  CollectSplit()
+ *  Log the split files written in background since last call
+ *  On error, the split process is aborted
+ *  If bWait is true then wait for all pending files to be written before
+ */
+void Mbox_parser::CollectSplit(bool bWait){
+
+    if (!splitWriter) return;
+    if (bWait) splitWriter->Flush();
+
+    std::vector<Eml_write_result> vResults;
+    if (!splitWriter->Collect(vResults)) return;
+
+    for (const Eml_write_result& result : vResults) {
+        if (result.ok) {
+            if (*cbFunc_log) cbFunc_log ("VERBOSE3", "Successfully saved split file \""+result.path+"\"");
+        }
+        else if (!bDisableMboxSplit) {
+            if (*cbFunc_log) cbFunc_log ("ERROR", result.error+". Split process is aborted.");
+            bDisableMboxSplit = true;
+        }
+        else if (*cbFunc_log) cbFunc_log ("VERBOSE1", result.error);
+    }
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  CloseOutputFile()
+ *  Close the compact file written to its temporary name and rename it, so that
+ *  an interrupted run never leaves a truncated mbox under the final name
+ *  With durability, the file is synced before the rename and the directory after
+ *  Return true if succeed
+ */
+bool Mbox_parser::CloseOutputFile(Mbox_range_file& output, const std::string& filename){
+
+    std::string error;
+    if (!CommitOutputFile(output, filename, emlDurability, error)) {
+        if (*cbFunc_log) cbFunc_log ("ERROR", error);
+        return false;
+    }
+    return true;
+}
+//---------------------------------------------------------------------------------------------
 /**
  *  GetHeaderField()
  *  Read email header specified (even on multiple lines)
@@ -773,7 +1306,7 @@ bool Mbox_parser::IsValidMail() {
  */
 bool Mbox_parser::IsDeletedMail() {
 
-    int  iMozStatus;
+    int  iMozStatus = 0;
     std::stringstream stream;
 
     stream << GetHeaderField("X-Mozilla-Status");
@@ -781,6 +1314,7 @@ bool Mbox_parser::IsDeletedMail() {
     if (iMozStatus & MSG_FLAG_EXPUNGED) return true;
 
     stream.str(std::string()); stream.clear();
+    iMozStatus = 0;
     stream << GetHeaderField("X-Mozilla-Status2");
     stream >> std::hex >> iMozStatus;
     if (iMozStatus & MSG_FLAG_IMAP_DELETED) return true;
@@ -788,6 +1322,28 @@ bool Mbox_parser::IsDeletedMail() {
     return false;
 }
 //---------------------------------------------------------------------------------------------
+/**
+ *  MaildirFlags()
+ *  Return the Maildir flags of the email from X-Mozilla-Status, in ASCII order as required:
+ *  F (marked), P (forwarded), R (replied), S (read) and T (deleted, see IsDeletedMail())
+ */
+string Mbox_parser::MaildirFlags() {
+
+    int  iMozStatus = 0;
+    std::stringstream stream;
+    string flags;
+
+    stream << GetHeaderField("X-Mozilla-Status");
+    stream >> std::hex >> iMozStatus;
+    if (iMozStatus & MSG_FLAG_MARKED) flags += 'F';
+    if (iMozStatus & MSG_FLAG_FORWARDED) flags += 'P';
+    if (iMozStatus & MSG_FLAG_REPLIED) flags += 'R';
+    if (iMozStatus & MSG_FLAG_READ) flags += 'S';
+    if (IsDeletedMail()) flags += 'T';
+
+    return flags;
+}
+//---------------------------------------------------------------------------------------------
 /**
  *  IsExcludedMail()
  *  Return true if email is excluded by the date filtering rules
@@ -907,6 +1463,59 @@ void Mbox_parser::SetSynchronize(bool b){
     bSynchronize = b;
 }
 //---------------------------------------------------------------------------------------------
+/**
+ *  SetLayout()
+ *  Set the output directory layout of eml files :
+ *  EML_LAYOUT_FLAT, EML_LAYOUT_HASH ("ab/cd/") or EML_LAYOUT_DATE ("YYYY/mm/")
+ *  default is EML_LAYOUT_FLAT
+ */
+void Mbox_parser::SetLayout(int layout){
+    emlLayout = layout;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  SetDurability()
+ *  Set the sync policy of the eml, compact and split files :
+ *  EML_DURABILITY_NONE, EML_DURABILITY_GROUP (eml files synced by groups) or EML_DURABILITY_FILE
+ *  Files are always written to a temporary name then renamed
+ *  default is EML_DURABILITY_NONE
+ */
+void Mbox_parser::SetDurability(int mode){
+    emlDurability = mode;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  SetFormat()
+ *  Set the output format of extracted emails :
+ *  EML_FORMAT_FILE (an eml file for each email), EML_FORMAT_PACK (a pack "mboxfilename.mzpack"
+ *  of the mbox output directory, the emails already in the pack are skipped)
+ *  EML_FORMAT_TAR (entries of the tar stream given by SetTarWriter())
+ *  or EML_FORMAT_MAILDIR (the output directory is a Maildir, see SaveToMaildir())
+ *  default is EML_FORMAT_FILE
+ */
+void Mbox_parser::SetFormat(int format){
+    emlFormat = format;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  SetTarWriter()
+ *  Set the tar stream of EML_FORMAT_TAR format, it stays open between the mbox files
+ *  and is closed by the caller
+ */
+void Mbox_parser::SetTarWriter(Eml_tar_writer *tar){
+    emlTar = tar;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  SetUploadKey()
+ *  Set the AES-256-CBC key (32 bytes) of the content given to the eml process callback, it is
+ *  then encrypted with a new IV for each email in the same pass as the eml file (see StoreEML())
+ *  An empty key gives the plain content
+ */
+void Mbox_parser::SetUploadKey(const std::string& key){
+    uploadKey = key;
+}
+//---------------------------------------------------------------------------------------------
 void Mbox_parser::SetActionExtract(bool b, bool compress){
 
     bExtractMboxEml = b;
@@ -924,6 +1533,18 @@ void Mbox_parser::SetActionSplit(bool b, size_t maxsize){
     mboxsplitmaxsize = maxsize;
 }
 //---------------------------------------------------------------------------------------------
+/**
+ *  SetSplitMode()
+ *  Set the split strategy, the size given by SetActionSplit() is then :
+ *  MBOX_SPLIT_SIZE (max bytes of parts), MBOX_SPLIT_COUNT (max emails of parts),
+ *  MBOX_SPLIT_PARTS (number of parts of about the same size)
+ *  or ignored with MBOX_SPLIT_YEAR, MBOX_SPLIT_MONTH, MBOX_SPLIT_DAY (one part by mail date period)
+ *  default is MBOX_SPLIT_SIZE
+ */
+void Mbox_parser::SetSplitMode(int mode){
+    splitMode = mode;
+}
+//---------------------------------------------------------------------------------------------
 /**
  *  set mbox process output directory
  *  return reformatted output directory if necessary indented with "/"
@@ -1134,9 +1755,8 @@ string Mbox_parser::EmlFilename() {
     }
     else {
         // Generate file name based on MD5 content (without "From " line)
-        int firstline = offset(vmail, "\n")+1;
-        std::string str(vmail.begin()+firstline,vmail.end());
-        md5str = PrintMD5(str);
+        size_t firstline = offset(vmail, "\n")+1;
+        md5str = PrintMD5(vmail.data()+firstline, vmail.size()-firstline);
     }
 
     std::stringstream ss;
@@ -1156,6 +1776,15 @@ string Mbox_parser::EmlFilename() {
     return emlfilename;
 }
 //---------------------------------------------------------------------------------------------
+/**
+ *  EmlPath()
+ *  Return the eml file name prefixed by its layout sub-directories (relative to output directory)
+ */
+string Mbox_parser::EmlPath() {
+
+    return EmlLayoutDir(EmlFilename(), emlLayout) + EmlFilename();
+}
+//---------------------------------------------------------------------------------------------
 /**
  *  Set_Callback_Eml_Preprocess()
  *  If this callback is set then this a previous test to perform the call of function cbFunc_eml
@@ -1175,11 +1804,13 @@ void Mbox_parser::Set_Callback_Eml_Preprocess(callback_func_eml_preprocess_ptr p
  *  If this callback is set then it is perform on every valid email
  *
  *  Callback must be declared with syntax like this :
- *    void mycallback(string dirname, string filename, std::vector<char> eml)
+ *    void mycallback(string dirname, string filename, std::vector<char> eml, time_t date)
  *  where :
  *    - dirname is output directory (outputdirectory),
  *    - filename is eml file name (emlfilename),
- *    - eml is char vector contains only message (no line "From - ..." !)
+ *    - eml is char vector contains only message (no line "From - ..." !), or with an upload
+ *      key (see SetUploadKey()) its AES-256-CBC ciphertext followed by the IV (16 bytes)
+ *    - date is the mail's date given by GetMailDate() (0 if not valid)
  */
 void Mbox_parser::Set_Callback_Eml_Process(callback_func_eml_process_ptr ptr) {
     cbFunc_eml_process = ptr;
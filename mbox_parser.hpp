@@ -38,9 +38,18 @@
 #include <algorithm>
 #include <cmath>        //ceil
 #include <regex>
+#include <chrono>
+#include <unordered_set>
+#include <unordered_map>
 #include <dirent.h>
 #include "nsMsgMessageFlags.h"
 #include "simplyzip.hpp"
+#include "eml_pipeline.hpp"
+#include "eml_writer.hpp"
+#include "mbox_range_file.hpp"
+#include "mbox_split_writer.hpp"
+#include "mbox_pack.hpp"
+#include "eml_tar.hpp"
 
 using namespace std;
 
@@ -71,21 +80,40 @@ class Mbox_parser {
         int mailAgeMax; // Maximum age in days that the mails must have (eg: younger than 90 days)
         std::string outputdirectory;
         std::string compactfilename;
-        std::ofstream outputcompact;
-        std::string splitfilename;
-        std::ofstream outputsplit;
+        Mbox_range_file outputcompact;
+        std::string splitfilename; // current part (size, count or parts split mode)
+        Mbox_split_writer *splitWriter; // background writer of split files, created when parsing starts
         size_t i_progression; // mbox process progression percentage
+        std::chrono::steady_clock::time_point tp_progressbar; // last progress bar display
         bool islastmail; // last mail of mbox that doesn't ending with search string "From "
         std::vector<char> buffer; // file read buffer
         std::vector<char> vmails; // mails vector (can content many mails)
         std::vector<char> vmail; // mail vector with "From " line use in compact or split function
         std::vector<char> vheader;
-        std::vector<char> vmailcrlf; // store eml (or eml.gz) with windows crlf use in extraction or callback_eml function
+        std::vector<char> vmailcrlf; // store eml (or eml.gz) with windows crlf use in extraction
+        std::vector<char> vmailupload; // eml content given to the process callback, encrypted if an upload key is set
+        std::string uploadKey; // AES-256-CBC key of the content given to the process callback (see SetUploadKey())
+        bool bUploadEml; // true if the process callback takes the current email
         size_t mailsize; // Size begin with "From " to next one
+        size_t mailsoffset; // offset of vmails in mbox file
+        size_t mailoffset; // offset of vmail in mbox file
         std::string headerfield_date; // Store "Date:" header field value to avoid multiplying search
         std::string headerfield_from; // Store "From:" header field value to avoid multiplying search
         std::string headerfield_msgid; // Store "Message-ID:" header field value to avoid multiplying search
         vector<string> emlList; // list of valid eml file name
+        std::unordered_map<string, int> emlCount; // occurrences of each name of emlList (duplicate test)
+        std::unordered_set<string> outputManifest; // files of output directory, listed once when parsing starts
+        std::unordered_set<string> outputLayoutDirs; // existing sub-directories of output directory layouts
+        std::vector<int> outputLayouts; // layouts whose sub-directories are listed (see EML_LAYOUT_MARKER)
+        bool bOutputLayoutMarked; // true once the layout is recorded in the marker file of output directory
+        int emlLayout; // output directory layout of eml files (EML_LAYOUT_*)
+        Eml_writer *emlWriter; // background writer of eml files, created on first extraction
+        int emlDurability; // sync policy of written files (EML_DURABILITY_*)
+        int emlFormat; // output format of extracted emails (EML_FORMAT_*)
+        Mbox_pack *emlPack; // pack of extracted emails, open while parsing
+        std::string packfilename;
+        Eml_tar_writer *emlTar; // tar stream of eml files (not owned)
+        bool bOutputDirectoryExists;
         bool bEmlToWindows;
         bool bSynchronize;
         bool bGenerateMboxCompact;
@@ -98,8 +126,10 @@ class Mbox_parser {
         bool bExtractDeleted;
         bool bExtractDuplicated;
         int splitindex;
-        size_t mboxsplitmaxsize;
-        size_t mboxsplitcurrentsize;
+        int splitMode; // split strategy (MBOX_SPLIT_*)
+        size_t mboxsplitmaxsize; // bytes, emails or parts according to splitMode
+        size_t mboxsplitcurrentsize; // bytes or emails of the current part
+        size_t splitslice; // slice of mbox of the current part (parts split mode)
         int nbsplitfile;
         bool bmaildatestored; // marked to avoid multi call of function GetMailDate()
         std::string emlfilename;
@@ -114,7 +144,7 @@ class Mbox_parser {
 
         typedef bool (*callback_func_eml_preprocess_ptr)(std::string, std::string);
         callback_func_eml_preprocess_ptr cbFunc_eml_preprocess;
-        typedef void (*callback_func_eml_process_ptr)(std::string, std::string, std::vector<char>); // vector is email's content
+        typedef void (*callback_func_eml_process_ptr)(std::string, std::string, std::vector<char>, time_t); // vector is email's content
         callback_func_eml_process_ptr cbFunc_eml_process;
         typedef void (*callback_func_log_ptr)(std::string, std::string);
         callback_func_log_ptr cbFunc_log;
@@ -127,14 +157,28 @@ class Mbox_parser {
         void ProcessMail();
         std::string GetHeaderField(std::string headerField, bool insensitiveSearch=false, int index=0);
         void GetLocalTimeZone();
+        void LoadOutputManifest();
+        bool LoadMaildir(); // Create the Maildir sub-directories and list its messages
+        void SynchronizeOutput();
         bool IsValidMail();
         bool IsDeletedMail();
+        std::string MaildirFlags(); // Maildir flags from X-Mozilla-Status
         bool IsExcludedMail();
         std::string EmlFilename(); // Generate eml filename from mail headers
-        void StoreEML(); // Set vmailcrlf to save and callback functions
+        std::string EmlPath(); // Eml filename with its layout sub-directories
+        void AddEmlStages(Eml_pipeline& pipe); // Add line ending and compression stages
+        void AddUploadStages(Eml_pipeline& pipe); // Add encryption stage and vmailupload sink
+        void StoreEML(bool bEml=true); // Set vmailcrlf to save and vmailupload for callback function in one pass
         bool SaveToEML();
+        bool SaveToPack();
+        bool SaveToTar();
+        bool SaveToMaildir();
+        void ClosePack();
+        void CollectWrites(bool bWait=false); // Account the eml files written in background
         bool SaveToCompact();
         bool SaveToSplit();
+        void CollectSplit(bool bWait=false); // Log the split files written in background
+        bool CloseOutputFile(Mbox_range_file& output, const std::string& filename); // Complete the compact file
         bool GetMailDate(bool is_forcesearch=false);
 
     public:
@@ -143,6 +187,7 @@ class Mbox_parser {
         bool SetMboxFile(std::string const);
         bool IsReadyToParse();
         int Parse();
+        int ProcessOutput(); // Process the eml files of the output directory instead of the mbox
         int GetMailAvailable();
         int GetMailRead();
         int GetMailInvalid();
@@ -158,9 +203,15 @@ class Mbox_parser {
         void SetWindowsFormat(bool b);
         void SetSaveEmlList(bool b);
         void SetSynchronize(bool b);
+        void SetLayout(int layout);
+        void SetDurability(int mode);
+        void SetFormat(int format);
+        void SetTarWriter(Eml_tar_writer *tar);
+        void SetUploadKey(const std::string& key);
         void SetActionExtract(bool b, bool compress = true);
         void SetActionCompact(bool b);
         void SetActionSplit(bool b, size_t maxsize);
+        void SetSplitMode(int mode);
         std::string SetOutputDirectory(std::string directory);
         void SetExtractInvalid(bool bExtract);
         void SetExtractDeleted(bool bExtract);
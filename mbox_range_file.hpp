@@ -0,0 +1,230 @@
+/*
+    BSD 2-Clause License
+
+    Copyright (c) 2017-2023, Nol Martinon
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+    Output mbox file made of byte ranges of a source mbox.
+
+    Compact and split files are byte exact copies of the kept emails of the
+    source mbox. Instead of writing the content of each email, its byte range
+    is recorded with Add(), contiguous ranges are merged and then copied by
+    large blocks:
+    - on linux with copy_file_range(), the data is copied by the kernel without
+      going through user space (file systems supporting reflinks share the
+      blocks of the ranges aligned on their block size)
+    - elsewhere, or when the file systems do not support it, with read/write
+    eg:
+        Mbox_range_file out;
+        out.Open("/path/mbox", "/path/mbox.1");
+        out.Preallocate(size);
+        out.Add(offset, len);
+        out.Close();
+*/
+
+#ifndef __MBOX_RANGE_FILE_HPP
+#define __MBOX_RANGE_FILE_HPP
+
+#include <vector>
+#include <string>
+#include <utility>        // pair
+#include <algorithm>      // min
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+    #include <io.h>
+#else
+    #include <unistd.h>
+#endif
+#if defined(__linux__)
+    #include <sys/syscall.h>
+    #ifdef __NR_copy_file_range
+        #define MBOX_RANGE_COPY
+    #endif
+#endif
+#ifndef O_BINARY
+    #define O_BINARY 0
+#endif
+
+#define MBOX_RANGE_FLUSHSIZE (64*1024*1024)   // pending bytes that trigger a copy
+#define MBOX_RANGE_BUFFER (1024*1024)         // buffer size of the read/write copy
+
+/// Output file built from byte ranges of a source file
+/**
+ * The ranges are copied when MBOX_RANGE_FLUSHSIZE bytes are pending, by Flush()
+ * and by Close(). The functions return false on error (errno is set).
+ */
+class Mbox_range_file {
+    public:
+        Mbox_range_file() : fdin(-1), fdout(-1), outsize(0), allocated(0), pendingsize(0), bCopyRange(true) {}
+        ~Mbox_range_file() { Close(); }
+
+        /// Open the source file and create the output file, or append to it if bAppend is true
+        bool Open(const std::string& source, const std::string& path, bool bAppend = false) {
+            Close();
+            fdin = open(source.c_str(), O_RDONLY|O_BINARY);
+            if (fdin < 0) return false;
+            fdout = open(path.c_str(), O_WRONLY|O_CREAT|O_BINARY|(bAppend ? 0 : O_TRUNC), 0666);
+            long long end = (fdout < 0) ? -1 : 0;
+            #ifdef _WIN32
+                if (bAppend && fdout >= 0) end = _lseeki64(fdout, 0, SEEK_END);
+            #else
+                if (bAppend && fdout >= 0) end = (long long)lseek(fdout, 0, SEEK_END);
+            #endif
+            if (end < 0) {
+                int err = errno;
+                if (fdout >= 0) close(fdout);
+                close(fdin);
+                fdin = fdout = -1;
+                errno = err;
+                return false;
+            }
+            outsize = end;
+            return true;
+        }
+
+        bool IsOpen() { return fdout >= 0; }
+
+        /// Size of the output file once the pending ranges are copied
+        unsigned long long Size() { return outsize + pendingsize; }
+
+        /// Reserve the disk space of the output file (linux only), the unused space is released by Close()
+        void Preallocate(unsigned long long size) {
+            #ifdef __linux__
+                if (fdout >= 0 && size > allocated && fallocate(fdout, 0, 0, (off_t)size) == 0) allocated = size;
+            #else
+                (void)size;
+            #endif
+        }
+
+        /// Append the range [offset, offset+len) of the source file
+        bool Add(unsigned long long offset, unsigned long long len) {
+            if (!len) return true;
+            if (!ranges.empty() && ranges.back().first + ranges.back().second == offset) ranges.back().second += len;
+            else ranges.push_back(std::make_pair(offset, len));
+            pendingsize += len;
+            if (pendingsize >= MBOX_RANGE_FLUSHSIZE) return Flush();
+            return true;
+        }
+
+        /// Copy the pending ranges to the output file
+        bool Flush() {
+            bool ok = true;
+            for (size_t i = 0; i < ranges.size() && ok; i++) ok = Copy(ranges[i].first, ranges[i].second);
+            ranges.clear();
+            pendingsize = 0;
+            return ok;
+        }
+
+        /// Copy the pending ranges, release the unused preallocated space and close the files
+        bool Close() {
+            if (fdout < 0) return true;
+            bool ok = Flush();
+            int err = errno;
+            #ifdef _WIN32
+                if (ok && allocated > outsize && _chsize_s(fdout, outsize) != 0) { ok = false; err = errno; }
+            #else
+                if (ok && allocated > outsize && ftruncate(fdout, (off_t)outsize) != 0) { ok = false; err = errno; }
+            #endif
+            if (close(fdout) != 0 && ok) { ok = false; err = errno; }
+            close(fdin);
+            fdin = fdout = -1;
+            outsize = allocated = 0;
+            errno = err;
+            return ok;
+        }
+
+    private:
+        int fdin, fdout;
+        unsigned long long outsize; // bytes copied to the output file
+        unsigned long long allocated; // preallocated size of the output file
+        unsigned long long pendingsize; // bytes of the ranges not copied yet
+        bool bCopyRange; // false once copy_file_range() is found unsupported
+        std::vector< std::pair<unsigned long long, unsigned long long> > ranges; // pending ranges (offset, length)
+
+        /// Copy a range of the source to the end of the output file
+        bool Copy(unsigned long long offset, unsigned long long len) {
+            #ifdef MBOX_RANGE_COPY
+                while (len && bCopyRange) {
+                    loff_t offin = offset, offout = outsize;
+                    long n = syscall(__NR_copy_file_range, fdin, &offin, fdout, &offout, (size_t)std::min(len, 1ULL << 30), 0);
+                    if (n > 0) {
+                        offset += n;
+                        len -= n;
+                        outsize += n;
+                    }
+                    else if (n == 0) { errno = EIO; return false; } // source is shorter than the range
+                    else if (errno == EINTR) continue;
+                    else if (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP) bCopyRange = false;
+                    else return false;
+                }
+            #endif
+
+            std::vector<char> buf((size_t)std::min(len, (unsigned long long)MBOX_RANGE_BUFFER));
+            while (len) {
+                long n = ReadAt(buf.data(), (size_t)std::min(len, (unsigned long long)buf.size()), offset);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                    if (n == 0) errno = EIO;
+                    return false;
+                }
+                for (long done = 0; done < n; ) {
+                    long w = WriteAt(buf.data()+done, n-done, outsize);
+                    if (w < 0 && errno == EINTR) continue;
+                    if (w <= 0) return false;
+                    done += w;
+                    outsize += w;
+                }
+                offset += n;
+                len -= n;
+            }
+            return true;
+        }
+
+        long ReadAt(char *data, size_t len, unsigned long long offset) {
+            #ifdef _WIN32
+                if (_lseeki64(fdin, offset, SEEK_SET) < 0) return -1;
+                return _read(fdin, data, (unsigned int)len);
+            #else
+                return (long)pread(fdin, data, len, (off_t)offset);
+            #endif
+        }
+
+        long WriteAt(const char *data, size_t len, unsigned long long offset) {
+            #ifdef _WIN32
+                if (_lseeki64(fdout, offset, SEEK_SET) < 0) return -1;
+                return _write(fdout, data, (unsigned int)len);
+            #else
+                return (long)pwrite(fdout, data, len, (off_t)offset);
+            #endif
+        }
+
+        Mbox_range_file(const Mbox_range_file&);
+        Mbox_range_file& operator=(const Mbox_range_file&);
+};
+
+#endif //__MBOX_RANGE_FILE_HPP
@@ -0,0 +1,355 @@
+/*
+    BSD 2-Clause License
+
+    Copyright (c) 2017-2023, Nol Martinon
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+    Background writer of mbox parts (split files).
+
+    The parse thread gives the byte range of each email kept with Add(), the
+    part being created on first use, and ends a part with Close(). The ranges
+    of a part are handed over to a worker thread when MBOX_SPLIT_HANDOVER bytes
+    are pending or when the part is closed. The worker copies them (see
+    Mbox_range_file), then, on close, syncs (with durability) and renames the
+    part from its temporary name.
+    A part is always handled by the same worker so that its ranges are copied
+    in order, and successive parts go to the next workers so that several parts
+    are written at the same time. With a single core, the parts are written by
+    the calling thread.
+    Each worker keeps at most MBOX_SPLIT_MAXOPEN files open, the least recently
+    used ones are closed and reopened to append when needed.
+    The result of each part is given back by Collect() once it is closed, or on
+    its first error.
+    eg:
+        Mbox_split_writer writer("/path/mbox", EML_DURABILITY_NONE);
+        writer.Add("/path/mbox.2017", offset, len);
+        writer.CloseAll();
+        writer.Flush();
+        writer.Collect(vResults);
+*/
+
+#ifndef __MBOX_SPLIT_WRITER_HPP
+#define __MBOX_SPLIT_WRITER_HPP
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>      // min
+#include "eml_writer.hpp"          // Eml_write_result, SyncFile(), SyncDirectory()
+#include "mbox_range_file.hpp"
+
+#define MBOX_SPLIT_HANDOVER (4*1024*1024)   // pending bytes of a part handed over to its worker
+#define MBOX_SPLIT_MAXOPEN 64               // max open parts of each worker
+
+/// Complete an output file written to its temporary name : close, sync (with durability) and rename
+/// Return false and set 'error' on failure
+inline bool CommitOutputFile(Mbox_range_file& output, const std::string& path, int durability, std::string& error) {
+    std::string tmppath = path + EML_WRITER_TMPSUFFIX;
+    bool bSync = (durability != EML_DURABILITY_NONE);
+
+    if (!output.Close() || (bSync && !SyncFile(tmppath))) {
+        error = "Could not write to \""+tmppath+"\" ("+strerror(errno)+")";
+        std::remove(tmppath.c_str());
+        return false;
+    }
+    #ifdef _WIN32
+        std::remove(path.c_str()); // rename() does not replace on Windows
+    #endif
+    if (std::rename(tmppath.c_str(), path.c_str()) != 0) {
+        error = "Could not rename \""+tmppath+"\" to \""+path+"\" ("+strerror(errno)+")";
+        std::remove(tmppath.c_str());
+        return false;
+    }
+    std::string dir = path.substr(0, path.find_last_of("/\\")+1);
+    if (bSync && !SyncDirectory(dir)) {
+        error = "Could not sync directory \""+dir+"\" ("+strerror(errno)+")";
+        return false;
+    }
+    return true;
+}
+
+/// Write mbox parts in background
+/**
+ * 'nbthreads' is the number of workers (default is the number of cores, limited to 4).
+ */
+class Mbox_split_writer {
+    public:
+        Mbox_split_writer(const std::string& sourcefile, int durabilitymode, unsigned int nbthreads = 0)
+            : source(sourcefile), durability(durabilitymode), nextworker(0), pendingtasks(0), bStop(false) {
+            unsigned int nbcores = std::thread::hardware_concurrency();
+            if (!nbthreads) nbthreads = nbcores;
+            nbthreads = std::min(nbthreads, 4u);
+            if (nbcores == 1 || nbthreads <= 1) nbthreads = 0;
+
+            states.resize(std::max(1u, nbthreads));
+            queues.resize(nbthreads);
+            for (unsigned int i = 0; i < nbthreads; i++)
+                workers.push_back(std::thread(&Mbox_split_writer::Worker, this, i));
+        }
+
+        /// Wait for the pending copies, the parts not closed are removed
+        ~Mbox_split_writer() {
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                bStop = true;
+            }
+            cvTasks.notify_all();
+            for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+            for (size_t i = 0; i < states.size(); i++) Discard(states[i]);
+        }
+
+        /// Return true if the part has been created and is not closed
+        bool HasPart(const std::string& path) { return parts.count(path) > 0; }
+
+        /// Append the range [offset, offset+len) of the source to a part, created if needed
+        /// 'prealloc' is the disk space to reserve for a new part
+        void Add(const std::string& path, unsigned long long offset, unsigned long long len, unsigned long long prealloc = 0) {
+            std::map<std::string, Part>::iterator it = parts.find(path);
+            if (it == parts.end()) {
+                it = parts.insert(std::make_pair(path, Part())).first;
+                it->second.worker = queues.empty() ? 0 : nextworker++ % queues.size();
+                it->second.prealloc = prealloc;
+            }
+            Part& part = it->second;
+            if (!part.ranges.empty() && part.ranges.back().first + part.ranges.back().second == offset)
+                part.ranges.back().second += len;
+            else
+                part.ranges.push_back(std::make_pair(offset, len));
+            part.pending += len;
+            if (part.pending >= MBOX_SPLIT_HANDOVER) Handover(path, part, false);
+        }
+
+        /// End a part, it is renamed once all its ranges are copied
+        void Close(const std::string& path) {
+            std::map<std::string, Part>::iterator it = parts.find(path);
+            if (it == parts.end()) return;
+            Handover(path, it->second, true);
+            parts.erase(it);
+        }
+
+        /// End all the parts
+        void CloseAll() {
+            while (!parts.empty()) Close(parts.begin()->first);
+        }
+
+        /// Wait for all the parts handed over to be written
+        void Flush() {
+            std::unique_lock<std::mutex> lock(mtx);
+            cvDone.wait(lock, [this]{ return pendingtasks == 0; });
+        }
+
+        /// Move the results of the closed or failed parts to vResults, return their number
+        size_t Collect(std::vector<Eml_write_result>& vResults) {
+            std::unique_lock<std::mutex> lock(mtx);
+            size_t n = results.size();
+            vResults.insert(vResults.end(), results.begin(), results.end());
+            results.clear();
+            return n;
+        }
+
+    private:
+        typedef std::vector< std::pair<unsigned long long, unsigned long long> > Ranges;
+
+        /// Part being built by the parse thread
+        struct Part {
+            size_t worker;
+            Ranges ranges; // ranges not handed over yet
+            unsigned long long pending; // bytes of these ranges
+            unsigned long long prealloc; // disk space to reserve, given with the first ranges
+            Part() : worker(0), pending(0), prealloc(0) {}
+        };
+
+        /// Ranges of a part handed over to a worker
+        struct Task {
+            std::string path;
+            Ranges ranges;
+            unsigned long long prealloc;
+            bool bClose;
+        };
+
+        /// Open file of a worker
+        struct Open_part {
+            Mbox_range_file *file;
+            unsigned long long lastuse;
+        };
+
+        /// Files of a worker, only used by this worker
+        struct State {
+            std::map<std::string, Open_part> files;
+            std::set<std::string> created; // parts already created (reopened to append)
+            std::set<std::string> failed; // parts whose error is reported, their next ranges are ignored
+            unsigned long long clock;
+            State() : clock(0) {}
+        };
+
+        std::string source;
+        int durability;
+        std::map<std::string, Part> parts; // parts not closed, used by the parse thread only
+        size_t nextworker;
+        std::vector<State> states;
+        std::vector< std::deque<Task> > queues; // tasks of each worker
+        std::vector<std::thread> workers;
+        std::mutex mtx;
+        std::condition_variable cvTasks, cvDone;
+        std::vector<Eml_write_result> results;
+        size_t pendingtasks;
+        bool bStop;
+
+        void Handover(const std::string& path, Part& part, bool bClose) {
+            Task task;
+            task.path = path;
+            task.ranges.swap(part.ranges);
+            task.prealloc = part.prealloc;
+            task.bClose = bClose;
+            part.pending = 0;
+            part.prealloc = 0;
+
+            if (workers.empty()) {
+                Run(states[0], task);
+                return;
+            }
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                queues[part.worker].push_back(Task());
+                std::swap(queues[part.worker].back(), task);
+                pendingtasks++;
+            }
+            cvTasks.notify_all();
+        }
+
+        void Worker(size_t index) {
+            while (true) {
+                Task task;
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    cvTasks.wait(lock, [this, index]{ return bStop || !queues[index].empty(); });
+                    if (queues[index].empty()) break;
+                    std::swap(task, queues[index].front());
+                    queues[index].pop_front();
+                }
+                Run(states[index], task);
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    pendingtasks--;
+                }
+                cvDone.notify_all();
+            }
+        }
+
+        void Result(const std::string& path, bool ok, const std::string& error = "") {
+            std::unique_lock<std::mutex> lock(mtx);
+            results.push_back(Eml_write_result(path, ok, error));
+        }
+
+        /// Copy the ranges of a task to its part, then complete the part if the task closes it
+        void Run(State& state, Task& task) {
+            std::string tmppath = task.path + EML_WRITER_TMPSUFFIX;
+            if (state.failed.count(task.path)) return;
+
+            std::map<std::string, Open_part>::iterator it = state.files.find(task.path);
+            if (it == state.files.end()) {
+                if (state.files.size() >= MBOX_SPLIT_MAXOPEN) CloseLeastUsed(state);
+                Open_part part;
+                part.file = new Mbox_range_file();
+                bool bAppend = state.created.count(task.path) > 0;
+                if (!part.file->Open(source, tmppath, bAppend)) {
+                    Fail(state, task.path, part.file, "Could not open \""+tmppath+"\" ("+strerror(errno)+")");
+                    return;
+                }
+                state.created.insert(task.path);
+                it = state.files.insert(std::make_pair(task.path, part)).first;
+            }
+            Mbox_range_file *file = it->second.file;
+            it->second.lastuse = ++state.clock;
+            if (task.prealloc) file->Preallocate(task.prealloc);
+
+            bool ok = true;
+            for (size_t i = 0; i < task.ranges.size() && ok; i++) ok = file->Add(task.ranges[i].first, task.ranges[i].second);
+            if (!ok || !file->Flush()) {
+                std::string error = "Could not write to \""+tmppath+"\" ("+strerror(errno)+")";
+                state.files.erase(it);
+                Fail(state, task.path, file, error);
+                return;
+            }
+
+            if (task.bClose) {
+                std::string error;
+                ok = CommitOutputFile(*file, task.path, durability, error);
+                delete file;
+                state.files.erase(it);
+                state.created.erase(task.path);
+                Result(task.path, ok, error);
+            }
+        }
+
+        /// Report the error of a part and remove its temporary file
+        void Fail(State& state, const std::string& path, Mbox_range_file *file, const std::string& error) {
+            file->Close();
+            delete file;
+            std::remove((path + EML_WRITER_TMPSUFFIX).c_str());
+            state.failed.insert(path);
+            Result(path, false, error);
+        }
+
+        void CloseLeastUsed(State& state) {
+            std::map<std::string, Open_part>::iterator oldest = state.files.begin();
+            for (std::map<std::string, Open_part>::iterator it = state.files.begin(); it != state.files.end(); ++it) {
+                if (it->second.lastuse < oldest->second.lastuse) oldest = it;
+            }
+            if (!oldest->second.file->Close()) {
+                std::string path = oldest->first;
+                std::string error = "Could not write to \""+path+EML_WRITER_TMPSUFFIX+"\" ("+strerror(errno)+")";
+                Mbox_range_file *file = oldest->second.file;
+                state.files.erase(oldest);
+                Fail(state, path, file, error);
+                return;
+            }
+            delete oldest->second.file;
+            state.files.erase(oldest);
+        }
+
+        /// Remove the temporary files of the parts that were not closed
+        void Discard(State& state) {
+            for (std::map<std::string, Open_part>::iterator it = state.files.begin(); it != state.files.end(); ++it) {
+                it->second.file->Close();
+                delete it->second.file;
+            }
+            state.files.clear();
+            for (std::set<std::string>::iterator it = state.created.begin(); it != state.created.end(); ++it)
+                std::remove((*it + EML_WRITER_TMPSUFFIX).c_str());
+            state.created.clear();
+        }
+
+        Mbox_split_writer(const Mbox_split_writer&);
+        Mbox_split_writer& operator=(const Mbox_split_writer&);
+};
+
+#endif //__MBOX_SPLIT_WRITER_HPP
@@ -85,6 +85,14 @@ int main(int argc, char**argv)
     int age_max = 0;
     string date_before, date_after;
     int start_wait = 0, start_random = 0;
+    bool bUnpack = false;
+    bool bUploadArchive = false;
+    bool bImapInsecure = false;
+    Eml_tar_writer tarwriter;
+    S3_config s3config;
+    IMAP_config imapconfig;
+    SFTP_config sftpconfig;
+    std::string unpack_name;
 
     int total_mbox=0;
     int total_read=0;
@@ -101,6 +109,7 @@ int main(int argc, char**argv)
     int total_split_files=0;
     int total_upload_succeed=0;
     int total_upload_failed=0;
+    int total_upload_queued=0;
 
 
     try {
@@ -127,6 +136,12 @@ int main(int argc, char**argv)
                 "Split mbox file into several mbox files of maximum N bytes size. "
                 "This smaller files are named 'mboxfilename.#' where # is an increment number with auto leading zero if necessary.",
                 cxxopts::value<int>(iSplitMaxSize), "N")
+            ("split-by",
+                "Split strategy. MODE is 'size' (parts of maximum N bytes), 'count' (parts of maximum N emails), "
+                "'parts' (N parts of about the same size), or 'year', 'month', 'day' (one part by period of the "
+                "email date named 'mboxfilename.YYYY', '.YYYY-mm' or '.YYYY-mm-dd', option 's' is then not required). "
+                "Several parts are written at the same time on multi-core systems.",
+                cxxopts::value<std::string>(split_mode)->default_value("size"), "MODE")
             ("a,auto",
                 "Automatic mbox files search and parse for Mozilla Thunderbird client. The search is performed "
                 "in the current user directory.",
@@ -152,6 +167,31 @@ int main(int argc, char**argv)
             ("z,compress",
                 "Compress eml in gzip format and add extension '.gz' to file name.",
                 cxxopts::value<bool>(bEmlCompress))
+            ("layout",
+                "Output directory layout of eml files. NAME is 'flat' (all files in mbox directory), "
+                "'hash' (sub-directories 'ab/cd/' from the MD5 part of the name) or 'date' "
+                "(sub-directories 'YYYY/mm/' from the email date).",
+                cxxopts::value<std::string>(eml_layout)->default_value("flat"), "NAME")
+            ("format",
+                "Output format of extracted emails. NAME is 'eml' (a file for each email), 'pack' "
+                "(a single file 'mboxfilename.mzpack' for each mbox, with emails compressed by blocks "
+                "and an index, later runs append the new emails only), 'tar' (entries of a tar stream "
+                "written to 'tar-output', no local file is created) or 'maildir' (the output directory "
+                "is a Maildir, emails are delivered to 'new' or, with their flags, to 'cur').",
+                cxxopts::value<std::string>(eml_format)->default_value("eml"), "NAME")
+            ("tar-output",
+                "File or FIFO where the tar stream of 'format' set to 'tar' is written. '-' is the standard "
+                "output, the messages are then written to the standard error.",
+                cxxopts::value<std::string>(tar_output)->default_value("-"), "FILE")
+            ("unpack",
+                "Extract the eml files of the pack files set with 'f' option to the output directory "
+                "(using options 'layout', 'z' and 'durability'). If NAME is set then only this email is extracted.",
+                cxxopts::value<std::string>(unpack_name)->implicit_value(""), "NAME")
+            ("durability",
+                "Sync policy of the eml, compact and split files written. MODE is 'none' (no sync), "
+                "'group' (eml files are synced by groups of 256 files or every second, then renamed) "
+                "or 'file' (each file is synced then renamed).",
+                cxxopts::value<std::string>(eml_durability)->default_value("none"), "MODE")
             ("i,with-invalid",
                 "Invalid emails are retained. This status is defined when at least one of the 'date' "
                 "or 'from' fields is missing from the header. "
@@ -170,8 +210,83 @@ int main(int argc, char**argv)
                 "to be set to trigger the remote sending process. It is independent of 'e' option.",
                 cxxopts::value<std::string>(host_url), "URL")
             ("k,key",
-                "Password used to secure exchanges with the remote host.",
+                "Password used to secure exchanges with the remote host. With 's3-url' option, the messages "
+                "are encrypted with it (AES-256-CBC) before being uploaded.",
                     cxxopts::value<string>(), "KEY")
+            ("s3-url",
+                "S3 compatible object storage where the messages are uploaded in eml or gz file format, "
+                "given as 'http(s)://host[:port]/bucket[/prefix]'. It is independent of 'e' option and "
+                "can not be used with 'u' option.",
+                cxxopts::value<std::string>(s3_url), "URL")
+            ("s3-region",
+                "Region of the S3 storage used to sign the requests.",
+                cxxopts::value<std::string>(s3_region)->default_value("us-east-1"), "NAME")
+            ("s3-access-key",
+                "Access key of the S3 storage, default is the environment variable AWS_ACCESS_KEY_ID.",
+                cxxopts::value<std::string>(s3_access_key), "KEY")
+            ("s3-secret-key",
+                "Secret key of the S3 storage, default is the environment variable AWS_SECRET_ACCESS_KEY.",
+                cxxopts::value<std::string>(s3_secret_key), "KEY")
+            ("imap-url",
+                "IMAP server where the messages are appended with their date, given as "
+                "'imaps://host[:port][/mailbox]' ('imap://' is not encrypted). The sub-directories of the "
+                "output directory are sub-mailboxes. It is independent of 'e' option and can not be used "
+                "with 'u' or 's3-url' option.",
+                cxxopts::value<std::string>(imap_url), "URL")
+            ("imap-user",
+                "User name of the IMAP server.",
+                cxxopts::value<std::string>(imap_user), "NAME")
+            ("imap-password",
+                "Password of the IMAP server, default is the environment variable IMAP_PASSWORD.",
+                cxxopts::value<std::string>(imap_password), "PASS")
+            ("imap-insecure",
+                "Do not verify the TLS certificate of the IMAP server, eg: a self-signed certificate. The "
+                "password is then sent to any server that answers for the host.",
+                    cxxopts::value<bool>(bImapInsecure))
+            ("sftp-url",
+                "SFTP server where the messages are uploaded in eml or gz file format, given as "
+                "'sftp://host[:port][/path]' ('/~/path' is relative to the home directory). It is "
+                "independent of 'e' option and can not be used with 'u', 's3-url' or 'imap-url' option.",
+                cxxopts::value<std::string>(sftp_url), "URL")
+            ("sftp-user",
+                "User name of the SFTP server.",
+                cxxopts::value<std::string>(sftp_user), "NAME")
+            ("sftp-password",
+                "Password of the SFTP server, or passphrase of 'sftp-key', default is the environment "
+                "variable SFTP_PASSWORD.",
+                cxxopts::value<std::string>(sftp_password), "PASS")
+            ("sftp-key",
+                "Private key file used to authenticate to the SFTP server instead of the password.",
+                cxxopts::value<std::string>(sftp_key), "FILE")
+            ("sftp-fingerprint",
+                "SHA256 fingerprint of the host key of the SFTP server as printed by 'ssh-keygen -l', eg: "
+                "'SHA256:' followed by 43 base64 characters. By default, the host key must be in the file "
+                "'~/.ssh/known_hosts'. It is checked before the password or key is sent.",
+                cxxopts::value<std::string>(sftp_fingerprint), "FP")
+            ("upload-threads",
+                "Number of concurrent uploads to the S3 storage or IMAP server, or of SSH sessions to the "
+                "SFTP server (1 to 64). Used if 's3-url', 'imap-url' or 'sftp-url' option is set.",
+                    cxxopts::value<int>(upload_threads)->default_value(std::to_string(S3_UPLOAD_THREADS)), "N")
+            ("upload-adaptive",
+                "Tune the number of concurrent uploads to the S3 storage, at most 'upload-threads': it grows by one "
+                "while the latency or the throughput improves and is halved on timeout or HTTP 429 or 5xx "
+                "answer. Used if 's3-url' option is set.",
+                    cxxopts::value<bool>(bUploadAdaptive))
+            ("upload-order",
+                "Order of the uploads of the emails of a mbox: 'mbox' (as found), 'newest' (most recent date "
+                "first), 'smallest' (smallest size first) or 'mixed' (smallest size weighted by the age first). "
+                "The emails are held in memory to be sorted, at most 'upload-memory'. Used if 'u', "
+                "'s3-url', 'imap-url' or 'sftp-url' option is set.",
+                    cxxopts::value<std::string>(upload_order)->default_value("mbox"), "POLICY")
+            ("upload-memory",
+                "Maximum size in MB of the emails held to be uploaded in 'upload-order'.",
+                    cxxopts::value<int>(upload_memory)->default_value("256"), "N")
+            ("upload-archive",
+                "Upload the eml files of the output directory (extracted by a previous run with 'e' option) "
+                "that are missing on the server instead of parsing the mbox, eg: after a run while the server "
+                "was unavailable. The files are sent as they are stored (compressed or not). Used if 'u', "
+                "'s3-url', 'imap-url' or 'sftp-url' option is set.",
+                    cxxopts::value<bool>(bUploadArchive))
             ("age-min",
                 "Select emails that have more than N days.",
                     cxxopts::value<int>(age_min), "N")
@@ -187,12 +302,26 @@ int main(int argc, char**argv)
                 "Select emails after the specified date. Same syntax as 'date-before'",
                     cxxopts::value<string>(date_after), "DATE")
             ("timeout",
-                "Set maximum time in seconds the remote connection request is allowed to take. Used if 'u' option is set. "
+                "Set maximum time in seconds the remote connection request is allowed to take. Used if 'u', 's3-url', 'imap-url' or 'sftp-url' option is set. "
                 "WARNING: If defined to 0 then process could hang.",
                     cxxopts::value<int>(timeout)->default_value("600"), "N")
             ("speed-limit",
-                "Set maximum speed in bytes per second to send a file. Used if 'u' option is set.",
+                "Set maximum speed in bytes per second of all the uploads together, 0 is unlimited. Used if 'u', "
+                "'s3-url', 'imap-url' or 'sftp-url' option is set.",
                     cxxopts::value<long long>(speedlimit)->default_value("0"), "N")
+            ("speed-schedule",
+                "Set maximum speeds by local time ranges '[days ]HH:MM-HH:MM=N' separated by commas, with days as "
+                "'mon', 'mon-fri', ... and N in bytes per second (0 is unlimited). 'speed-limit' applies out of the "
+                "ranges, eg: \"mon-fri 08:00-18:00=262144\"",
+                    cxxopts::value<std::string>(speed_schedule), "RULES")
+            ("retry-dir",
+                "Directory of the queue where the uploads that failed for a transient reason (network error, "
+                "HTTP 408, 429 or 5xx) are kept encrypted to be sent again later in the run or first on the "
+                "next run. Used if 'u' option is set.",
+                    cxxopts::value<std::string>(retry_dir), "DIR")
+            ("retry-size",
+                "Maximum size in MB of the 'retry-dir' queue.",
+                    cxxopts::value<int>(retry_size)->default_value("256"), "N")
             ("start-wait",
                 "Delay process waiting to start in seconds.",
                     cxxopts::value<int>(start_wait)->default_value("0"), "N")
@@ -291,7 +420,7 @@ int main(int argc, char**argv)
           exit(0);
         }
 
-        if (options.count("e") && (options.count("s")||options.count("c")) && bSynchonize)
+        if (options.count("e") && (options.count("s")||options.count("split-by")||options.count("c")) && bSynchonize)
         {
           throw cxxopts::OptionSpecException(u8"Option 'e' is not compatible with 's' or 'c' when sync is enabled.");
           exit(0);
@@ -310,22 +439,163 @@ int main(int argc, char**argv)
             throw cxxopts::OptionSpecException(u8"Option 'f' or 'a' is required");
         }
 
+        if (GetSplitMode(split_mode) < 0){
+                throw cxxopts::OptionSpecException(u8"Option 'split-by' requires 'size', 'count', 'parts', 'year', 'month' or 'day'");
+        }
+
         if (options.count("s"))
         {
             bActionSplit = true;
             if (iSplitMaxSize<=0)
                 throw cxxopts::OptionSpecException(u8"Option 's' requires a positive value");
         }
+        else if (GetSplitMode(split_mode) >= MBOX_SPLIT_YEAR)
+        {
+            bActionSplit = true;
+        }
+        else if (options.count("split-by"))
+        {
+            throw cxxopts::OptionSpecException(u8"Option 'split-by' with 'size', 'count' or 'parts' requires option 's'");
+        }
 
         if ((options.count("u") && !options.count("k")) ||
-            (!options.count("u") && options.count("k"))) {
+            (!options.count("u") && !options.count("s3-url") && options.count("k"))) {
                 throw cxxopts::OptionSpecException(u8"Options 'u' and 'k' are linked and must both be configured");
         }
 
-        if (options.count("speed-limit") && !options.count("u") && !options.count("k")) {
-                throw cxxopts::OptionSpecException(u8"Option 'speed-limit' can not be used without options 'u' and 'k'");
+        if ((options.count("speed-limit") || options.count("speed-schedule")) && !options.count("u") && !options.count("s3-url")
+            && !options.count("imap-url") && !options.count("sftp-url")) {
+                throw cxxopts::OptionSpecException(u8"Options 'speed-limit' and 'speed-schedule' can not be used without options 'u' and 'k', 's3-url', 'imap-url' or 'sftp-url'");
+        }
+
+        if (speedlimit < 0) {
+                throw cxxopts::OptionSpecException(u8"Option 'speed-limit' requires a positive value or 0");
+        }
+
+        // All the uploads share the limiter, which also measures the throughput
+        if (options.count("u") || options.count("s3-url") || options.count("imap-url") || options.count("sftp-url")) {
+            ratelimiter = new Rate_limiter(speedlimit);
+            if (!ratelimiter->SetSchedule(speed_schedule))
+                throw cxxopts::OptionSpecException(u8"Option 'speed-schedule' : "+ratelimiter->GetError());
+        }
+
+        if (options.count("retry-dir") && !options.count("u")) {
+                throw cxxopts::OptionSpecException(u8"Option 'retry-dir' can not be used without options 'u' and 'k'");
+        }
+
+        if (options.count("retry-size") && (!options.count("retry-dir") || retry_size < 1)) {
+                throw cxxopts::OptionSpecException(u8"Option 'retry-size' requires option 'retry-dir' and a positive value");
+        }
+
+        if ((options.count("upload-order") || options.count("upload-memory")) && !options.count("u")
+            && !options.count("s3-url") && !options.count("imap-url") && !options.count("sftp-url")) {
+                throw cxxopts::OptionSpecException(u8"Options 'upload-order' and 'upload-memory' can not be used without options 'u' and 'k', 's3-url', 'imap-url' or 'sftp-url'");
+        }
+
+        if (Upload_GetOrder(upload_order) < 0) {
+                throw cxxopts::OptionSpecException(u8"Option 'upload-order' requires 'mbox', 'newest', 'smallest' or 'mixed'");
+        }
+
+        if (upload_memory < 1) {
+                throw cxxopts::OptionSpecException(u8"Option 'upload-memory' requires a positive value");
         }
 
+        // The emails of each mbox are held to be uploaded in order
+        if (Upload_GetOrder(upload_order) != UPLOAD_ORDER_MBOX)
+            uploadscheduler = new Upload_scheduler(Upload_GetOrder(upload_order));
+
+        if (bUploadArchive) {
+            if (!options.count("u") && !options.count("s3-url") && !options.count("imap-url") && !options.count("sftp-url"))
+                throw cxxopts::OptionSpecException(u8"Option 'upload-archive' can not be used without options 'u' and 'k', 's3-url', 'imap-url' or 'sftp-url'");
+            if (options.count("e") || options.count("c") || options.count("s") || options.count("split-by"))
+                throw cxxopts::OptionSpecException(u8"Option 'upload-archive' is not compatible with 'e', 'c' or 's'");
+            if (!options.count("o") || GetEmlFormat(eml_format) != EML_FORMAT_FILE)
+                throw cxxopts::OptionSpecException(u8"Option 'upload-archive' requires option 'o' and eml files ('format' eml)");
+        }
+
+        if (bUploadAdaptive && !options.count("s3-url")) {
+                throw cxxopts::OptionSpecException(u8"Option 'upload-adaptive' can not be used without option 's3-url'");
+        }
+
+        if (options.count("s3-url")) {
+            if (options.count("u"))
+                throw cxxopts::OptionSpecException(u8"Options 'u' and 's3-url' can not be specified at the same time");
+            if (!s3config.Parse(s3_url))
+                throw cxxopts::OptionSpecException(u8"Option 's3-url' requires 'http(s)://host[:port]/bucket[/prefix]'");
+            if (s3_access_key.empty() && getenv("AWS_ACCESS_KEY_ID")) s3_access_key = getenv("AWS_ACCESS_KEY_ID");
+            if (s3_secret_key.empty() && getenv("AWS_SECRET_ACCESS_KEY")) s3_secret_key = getenv("AWS_SECRET_ACCESS_KEY");
+            if (s3_access_key.empty() || s3_secret_key.empty())
+                throw cxxopts::OptionSpecException(u8"Option 's3-url' requires options 's3-access-key' and 's3-secret-key' "
+                                                   "or environment variables AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY");
+            if (bSynchonize)
+                throw cxxopts::OptionSpecException(u8"Option 's3-url' is not compatible with 'synchronize'");
+            if (upload_threads < 1 || upload_threads > 64)
+                throw cxxopts::OptionSpecException(u8"Option 'upload-threads' requires a value between 1 and 64");
+            s3config.region = s3_region;
+            s3config.accesskey = s3_access_key;
+            s3config.secretkey = s3_secret_key;
+            s3config.timeout = timeout;
+            s3config.limiter = ratelimiter;
+        }
+
+        if (options.count("imap-url")) {
+            if (options.count("u") || options.count("s3-url"))
+                throw cxxopts::OptionSpecException(u8"Option 'imap-url' can not be used with 'u' or 's3-url'");
+            if (!imapconfig.Parse(imap_url))
+                throw cxxopts::OptionSpecException(u8"Option 'imap-url' requires 'imap(s)://host[:port][/mailbox]'");
+            if (imap_password.empty() && getenv("IMAP_PASSWORD")) imap_password = getenv("IMAP_PASSWORD");
+            if (imap_user.empty() || imap_password.empty())
+                throw cxxopts::OptionSpecException(u8"Option 'imap-url' requires options 'imap-user' and 'imap-password' "
+                                                   "or environment variable IMAP_PASSWORD");
+            if (bSynchonize || bEmlCompress)
+                throw cxxopts::OptionSpecException(u8"Option 'imap-url' is not compatible with 'synchronize' or 'z'");
+            if (upload_threads < 1 || upload_threads > 64)
+                throw cxxopts::OptionSpecException(u8"Option 'upload-threads' requires a value between 1 and 64");
+            imapconfig.user = imap_user;
+            imapconfig.password = imap_password;
+            imapconfig.timeout = timeout;
+            imapconfig.limiter = ratelimiter;
+            imapconfig.bInsecure = bImapInsecure;
+        }
+        else if (bImapInsecure)
+            throw cxxopts::OptionSpecException(u8"Option 'imap-insecure' can not be used without option 'imap-url'");
+
+        if (options.count("sftp-url")) {
+            if (options.count("u") || options.count("s3-url") || options.count("imap-url"))
+                throw cxxopts::OptionSpecException(u8"Option 'sftp-url' can not be used with 'u', 's3-url' or 'imap-url'");
+            if (!sftpconfig.Parse(sftp_url))
+                throw cxxopts::OptionSpecException(u8"Option 'sftp-url' requires 'sftp://host[:port][/path]'");
+            if (sftp_password.empty() && getenv("SFTP_PASSWORD")) sftp_password = getenv("SFTP_PASSWORD");
+            if (sftp_user.empty() || (sftp_password.empty() && sftp_key.empty()))
+                throw cxxopts::OptionSpecException(u8"Option 'sftp-url' requires options 'sftp-user' and 'sftp-password' "
+                                                   "(or environment variable SFTP_PASSWORD) or 'sftp-key'");
+            if (bSynchonize)
+                throw cxxopts::OptionSpecException(u8"Option 'sftp-url' is not compatible with 'synchronize'");
+            if (upload_threads < 1 || upload_threads > 64)
+                throw cxxopts::OptionSpecException(u8"Option 'upload-threads' requires a value between 1 and 64");
+            sftpconfig.user = sftp_user;
+            sftpconfig.password = sftp_password;
+            sftpconfig.keyfile = sftp_key;
+            sftpconfig.timeout = timeout;
+            sftpconfig.limiter = ratelimiter;
+            if (!sftp_fingerprint.empty()) {
+                // The prefix and the base64 padding are optional
+                if (sftp_fingerprint.compare(0, 7, "SHA256:") != 0) sftp_fingerprint = "SHA256:" + sftp_fingerprint;
+                while (*sftp_fingerprint.rbegin() == '=') sftp_fingerprint.erase(sftp_fingerprint.length()-1);
+                if (sftp_fingerprint.length() != 7+43)
+                    throw cxxopts::OptionSpecException(u8"Option 'sftp-fingerprint' requires 'SHA256:' followed by 43 base64 characters");
+                sftpconfig.fingerprint = sftp_fingerprint;
+            }
+            #ifdef _WIN32
+                const char *home = getenv("USERPROFILE");
+            #else
+                const char *home = getenv("HOME");
+            #endif
+            if (home) sftpconfig.knownhosts = path_dusting(home) + "/.ssh/known_hosts";
+        }
+        else if (!sftp_fingerprint.empty())
+            throw cxxopts::OptionSpecException(u8"Option 'sftp-fingerprint' can not be used without option 'sftp-url'");
+
         if (options.count("u")){
             host_url = options["u"].as<std::string>();
         }
@@ -342,6 +612,37 @@ int main(int argc, char**argv)
                 throw cxxopts::OptionSpecException(u8"Options 'age-max' and 'date-after' can not be specified at the same time");
         }
 
+        if (GetEmlLayout(eml_layout) < 0){
+                throw cxxopts::OptionSpecException(u8"Option 'layout' requires 'flat', 'hash' or 'date'");
+        }
+
+        if (GetEmlDurability(eml_durability) < 0){
+                throw cxxopts::OptionSpecException(u8"Option 'durability' requires 'none', 'group' or 'file'");
+        }
+
+        if (GetEmlFormat(eml_format) < 0){
+                throw cxxopts::OptionSpecException(u8"Option 'format' requires 'eml', 'pack', 'tar' or 'maildir'");
+        }
+
+        if (GetEmlFormat(eml_format) == EML_FORMAT_PACK &&
+            (bEmlCompress || bSynchonize || GetEmlLayout(eml_layout) != EML_LAYOUT_FLAT)) {
+                throw cxxopts::OptionSpecException(u8"Option 'format' set to 'pack' is not compatible with 'z', 'synchronize' or 'layout'");
+        }
+
+        if (GetEmlFormat(eml_format) == EML_FORMAT_TAR && (bSynchonize || options.count("unpack"))) {
+                throw cxxopts::OptionSpecException(u8"Option 'format' set to 'tar' is not compatible with 'synchronize' or 'unpack'");
+        }
+
+        if (GetEmlFormat(eml_format) == EML_FORMAT_MAILDIR &&
+            (bEmlCompress || bSynchonize || GetEmlLayout(eml_layout) != EML_LAYOUT_FLAT || options.count("unpack"))) {
+                throw cxxopts::OptionSpecException(u8"Option 'format' set to 'maildir' is not compatible with 'z', 'synchronize', 'layout' or 'unpack'");
+        }
+
+        if (options.count("unpack") && (!options.count("f") || options.count("a") || outputdir.empty())) {
+                throw cxxopts::OptionSpecException(u8"Option 'unpack' requires options 'f' and 'o' and can not be used with 'a'");
+        }
+        bUnpack = (options.count("unpack") > 0);
+
         if (options.count("timeout")){
             if (timeout<0) throw cxxopts::OptionSpecException(u8"Option 'timeout' required a positive value");
         }
@@ -358,6 +659,23 @@ int main(int argc, char**argv)
         exit(1);
     }
 
+    // The tar stream replaces the standard output that is then redirected to the error output
+    if (GetEmlFormat(eml_format) == EML_FORMAT_TAR) {
+        bool ok;
+        #ifndef _WIN32
+            signal(SIGPIPE, SIG_IGN); // a closed pipe is reported as a write error
+        #endif
+        if (tar_output == "-") {
+            int fd = dup(1);
+            ok = (fd >= 0 && dup2(2, 1) >= 0 && tarwriter.Open(fd, true));
+        }
+        else ok = tarwriter.Open(tar_output);
+        if (!ok) {
+            std::cerr << "Error: " << (tarwriter.GetError().empty() ? "Could not redirect standard output" : tarwriter.GetError()) << std::endl;
+            exit(1);
+        }
+    }
+
     std::cout << APP_INFO << std::endl;
 
     el::Configurations defaultConf;
@@ -386,18 +704,43 @@ int main(int argc, char**argv)
         LOG(INFO) << "STARTING mboxzilla";
         if (speedlimit)
             LOG(INFO) << "Maximum speed to upload files is set to "+std::to_string(speedlimit)+" B/s";
+        if (!speed_schedule.empty())
+            LOG(INFO) << "Maximum speed to upload files follows schedule \""+speed_schedule+"\", currently "
+                      << (ratelimiter->GetRate() ? std::to_string(ratelimiter->GetRate())+" B/s" : "unlimited");
 
         // Set global mbox options
         mbox.SetActionExtract(bActionExtract, bEmlCompress);
         mbox.SetActionCompact(bActionCompact);
         mbox.SetActionSplit(bActionSplit, iSplitMaxSize);
+        mbox.SetSplitMode(GetSplitMode(split_mode));
         mbox.SetExtractInvalid(bExtractInvalid);
         mbox.SetExtractDeleted(bExtractDeleted);
         mbox.SetExtractDuplicated(bExtractDuplicated);
         mbox.SetWindowsFormat(bWindowsFormat);
         mbox.SetSynchronize(bSynchonize);
+        mbox.SetLayout(GetEmlLayout(eml_layout));
+        mbox.SetDurability(GetEmlDurability(eml_durability));
+        mbox.SetFormat(GetEmlFormat(eml_format));
+        mbox.SetTarWriter(&tarwriter);
         mbox.Set_Callback_Log(&callbackLOG);
 
+        // Pack files set with 'f' option are extracted instead of parsed
+        if (bUnpack) {
+            int nbunpacked = 0;
+            for (auto const& packfile : vmboxfile) {
+                string outdir = mbox.SetOutputDirectory(path_dusting(outputdir));
+                LOG(INFO) << "Unpacking file \""+packfile+"\" to \""+outdir+"\"";
+                int nb = UnpackEml(path_dusting(packfile), outdir, unpack_name, GetEmlLayout(eml_layout),
+                                   bEmlCompress, GetEmlDurability(eml_durability));
+                if (nb < 0) continue;
+                LOG(INFO) << "-> extracted to " << (bEmlCompress ? "eml.gz" : "eml") << " = " << nb;
+                nbunpacked += nb;
+            }
+            if (vmboxfile.size()>1) LOG(INFO) << "-> total extracted = " << nbunpacked;
+            LOG(INFO) << "ENDING mboxzilla";
+            return 0;
+        }
+
         // Add mbox files set with 'f' option to mbox list
         mapmbox[""] = vmboxfile;
 
@@ -414,6 +757,36 @@ int main(int argc, char**argv)
             if (!mapMailMbox.size()) LOG(ERROR) << "No Mozilla Thunderbird mbox files found";
         }
 
+        if (!s3_url.empty())
+            s3uploader = new S3_uploader(s3config, upload_threads, bUploadAdaptive);
+        if (!imap_url.empty())
+            imapuploader = new IMAP_uploader(imapconfig, upload_threads);
+        if (!sftp_url.empty())
+            sftpuploader = new SFTP_uploader(sftpconfig, upload_threads);
+
+        // The queued uploads of a previous run for this server and key are sent first
+        if (!retry_dir.empty()) {
+            retryqueue = new Retry_queue();
+            if (!retryqueue->Open(path_dusting(retry_dir), (unsigned long long)retry_size*1024*1024, sha256(host_url+"\n"+aes_key).substr(0, 16))) {
+                LOG(ERROR) << retryqueue->GetError();
+                delete retryqueue;
+                retryqueue = NULL;
+            }
+            else if (retryqueue->GetForeignCount()) {
+                LOG(WARNING) << "Retry queue \""+retry_dir+"\" has " << retryqueue->GetForeignCount() << " emails of another server or key, they are kept";
+            }
+            if (retryqueue && retryqueue->GetCount()) {
+                LOG(INFO) << "Retry queue has " << retryqueue->GetCount() << " emails to upload";
+                try {
+                    if (Remote_IsAvailable()) Remote_RetryQueued(false);
+                }
+                catch (const std::exception& ex) {
+                    LOG(ERROR) << "Connection exception : " << ex.what();
+                }
+                LOG(INFO) << "-> retried uploads succeed = " << nbRetrySuccess;
+            }
+        }
+
         for(auto const& key : mapmbox) {
             string outdirfinal = outputdir;
             string outputpathfinal = outputpath;
@@ -479,11 +852,14 @@ int main(int argc, char**argv)
                             else {
                                 LOG(INFO) << "Remote connection to \""+host_url+"\" ready";
                                 mbox.Set_Callback_Eml_Preprocess(&callbackEMLvalid);
-                                mbox.Set_Callback_Eml_Process(&callbackEML);
+                                Schedule_SetCallback(mbox, &callbackEML);
+                                mbox.SetUploadKey(aes_key);
+                                // Read before parsing, since a local synchronization forgets the previous layouts
+                                sync_layout = Remote_SyncLayout({outdir});
                                 Remote_GetList(json_remotelist, outdir);
                             }
 
-                            nbUploadSuccess=0; nbUploadError=0;
+                            nbUploadSuccess=0; nbUploadError=0; nbUploadQueued=0;
                         }
                         catch (const std::exception& ex) {
                             LOG(ERROR) << "Connection exception : " << ex.what();
@@ -491,18 +867,96 @@ int main(int argc, char**argv)
                         }
                     }
 
+                    // The objects of the output directory are listed once, the uploads run in background
+                    if (s3uploader) {
+                        std::string error;
+                        s3_remotelist.clear();
+                        remote_ok = s3uploader->List(S3_ObjectKey(outdir), s3_remotelist, error);
+                        mbox.Set_Callback_Eml_Preprocess(&callbackS3valid);
+                        if (!remote_ok) {
+                            LOG(ERROR) << "Remote connection to \""+s3_url+"\" unavailable : "+error;
+                            mbox.Set_Callback_Eml_Process(NULL);
+                            if (!bActionExtract && !bActionCompact && !bActionSplit) continue;
+                        }
+                        else {
+                            LOG(INFO) << "Remote connection to \""+s3_url+"\" ready";
+                            Schedule_SetCallback(mbox, &callbackS3);
+                            mbox.SetUploadKey(aes_key);
+                        }
+                        nbUploadSuccess=0; nbUploadError=0;
+                    }
+
+                    // The mailbox of the output directory is created if needed and its Message-ID fetched once
+                    if (imapuploader) {
+                        std::string error, outputbase = path_dusting(outputdir);
+                        if (!outputbase.empty() && *outputbase.rbegin() != '/') outputbase += "/";
+                        std::vector<std::string> vMessageIds;
+                        remote_ok = imapuploader->Prepare(outdir.compare(0, outputbase.length(), outputbase) == 0 ?
+                                                          outdir.substr(outputbase.length()) : outdir,
+                                                          imap_mailbox, vMessageIds, error);
+                        imap_remotelist.clear();
+                        for (auto const& msgid : vMessageIds) imap_remotelist.insert(PrintMD5(msgid));
+                        mbox.Set_Callback_Eml_Preprocess(&callbackIMAPvalid);
+                        if (!remote_ok) {
+                            LOG(ERROR) << "Remote connection to \""+imap_url+"\" unavailable : "+error;
+                            mbox.Set_Callback_Eml_Process(NULL);
+                            if (!bActionExtract && !bActionCompact && !bActionSplit) continue;
+                        }
+                        else {
+                            LOG(INFO) << "Remote connection to \""+imap_url+"\" ready, mailbox \""+imap_mailbox+"\" has "
+                                      << vMessageIds.size() << " messages";
+                            Schedule_SetCallback(mbox, &callbackIMAP);
+                            mbox.SetUploadKey("");
+                        }
+                        nbUploadSuccess=0; nbUploadError=0;
+                    }
+
+                    // The files of the output directory are listed once (created if needed), the uploads run in background
+                    if (sftpuploader) {
+                        std::string error;
+                        sftp_remotelist.clear();
+                        remote_ok = sftpuploader->List(S3_ObjectKey(outdir), sftp_remotelist, error);
+                        mbox.Set_Callback_Eml_Preprocess(&callbackSFTPvalid);
+                        if (!remote_ok) {
+                            LOG(ERROR) << "Remote connection to \""+sftp_url+"\" unavailable : "+error;
+                            mbox.Set_Callback_Eml_Process(NULL);
+                            if (!bActionExtract && !bActionCompact && !bActionSplit) continue;
+                        }
+                        else {
+                            LOG(INFO) << "Remote connection to \""+sftp_url+"\" ready";
+                            Schedule_SetCallback(mbox, &callbackSFTP);
+                            mbox.SetUploadKey("");
+                        }
+                        nbUploadSuccess=0; nbUploadError=0;
+                    }
+
                     bool bExceptionOccurred = false; // Used to disable files synchronization if partial parsing
+                    if (uploadscheduler) uploadscheduler->Clear();
                     try {
                         total_mbox++;
-                        mbox.Parse();
+                        if (bUploadArchive) mbox.ProcessOutput();
+                        else mbox.Parse();
                     }
                     catch (const std::exception& ex) {
                         LOG(ERROR) << "Parse exception : " << ex.what();
                         bExceptionOccurred = true;
                     }
+                    // The emails still held by the scheduler are uploaded in order
+                    if (uploadscheduler && uploadscheduler->GetCount()) {
+                        try {
+                            Schedule_Release(true);
+                        }
+                        catch (const std::exception& ex) {
+                            LOG(ERROR) << "Connection exception : " << ex.what();
+                            bExceptionOccurred = true;
+                        }
+                    }
+                    S3_CollectUploads(true);
+                    IMAP_CollectUploads(true);
+                    SFTP_CollectUploads(true);
 
-                    // Clear directories
-                    if (bActionExtract || bActionCompact || bActionCompact)
+                    // Clear directories (the empty sub-directories of a Maildir are part of it)
+                    if ((bActionExtract || bActionCompact || bActionCompact) && GetEmlFormat(eml_format) != EML_FORMAT_MAILDIR)
                         Remove_EmptyDir(outdirfinal);
 
                     // Add directory for sync if Thunderbird is processed and (extract or upload)
@@ -527,7 +981,10 @@ int main(int argc, char**argv)
                         total_excluded += mbox.GetMailExcluded();
 
                         if (bActionExtract) {
-                            if (bEmlCompress) LOG(INFO) << "-> extracted to eml.gz = " << mbox.GetMailExtracted();
+                            if (GetEmlFormat(eml_format) == EML_FORMAT_PACK) LOG(INFO) << "-> extracted to pack = " << mbox.GetMailExtracted();
+                            else if (GetEmlFormat(eml_format) == EML_FORMAT_TAR) LOG(INFO) << "-> extracted to tar = " << mbox.GetMailExtracted();
+                            else if (GetEmlFormat(eml_format) == EML_FORMAT_MAILDIR) LOG(INFO) << "-> extracted to maildir = " << mbox.GetMailExtracted();
+                            else if (bEmlCompress) LOG(INFO) << "-> extracted to eml.gz = " << mbox.GetMailExtracted();
                             else LOG(INFO) << "-> extracted to eml = " << mbox.GetMailExtracted();
                             if (bSynchonize) LOG(INFO) << "-> removed from destination = " << mbox.GetEmlDeleted();
                             total_extracted += mbox.GetMailExtracted();
@@ -550,12 +1007,23 @@ int main(int argc, char**argv)
                         if (remote_ok) {
                             LOG(INFO) << "-> uploads succeed = " << nbUploadSuccess;
                             LOG(INFO) << "-> uploads failed = " << nbUploadError;
+                            if (retryqueue) LOG(INFO) << "-> uploads queued to retry = " << nbUploadQueued;
+                            if (s3uploader && bUploadAdaptive) {
+                                std::vector<std::string> vDecisions;
+                                Upload_window window = s3uploader->GetWindow(vDecisions);
+                                LOG(INFO) << "-> upload window = " << window.GetSize() << " (min " << window.GetMin() << ", max "
+                                          << window.GetMax() << ", decreases " << window.GetDecreases() << ")";
+                            }
+                            if (uploadscheduler)
+                                LOG(INFO) << "-> upload order = " << upload_order << " (at most " << uploadscheduler->GetMaxCount()
+                                          << " emails held, " << bytes_convert(uploadscheduler->GetMaxBytes()) << ")";
                             total_upload_succeed += nbUploadSuccess;
                             total_upload_failed += nbUploadError;
+                            total_upload_queued += nbUploadQueued;
 
                             if (bSynchonize && !bExceptionOccurred) {
                                 LOG(INFO) << "Syncing files to \""+host_url+"\"";
-                                if (Remote_SendSyncList("sync_filelist", outdir, mbox.GetEmlList())) LOG(INFO) << "Synchronization done";
+                                if (Remote_SyncFileList(outdir, mbox.GetEmlList())) LOG(INFO) << "Synchronization done";
                                 else LOG(ERROR) << "Synchronization not completed";
                             }
                         }
@@ -564,6 +1032,21 @@ int main(int argc, char**argv)
             } // END key.second loop
         } // END mapmbox loop
 
+        // The uploads queued during the run are retried, waiting for the retry delays
+        if (retryqueue && (nbRetrySuccess || nbRetryError || retryqueue->GetCount())) {
+            if (retryqueue->GetCount()) LOG(INFO) << "Retrying " << retryqueue->GetCount() << " queued uploads";
+            Remote_RetryQueued(true);
+            LOG(INFO) << "Retry queue summary :";
+            LOG(INFO) << "-> retried uploads succeed = " << nbRetrySuccess;
+            LOG(INFO) << "-> retried uploads failed = " << nbRetryError;
+            LOG(INFO) << "-> left in retry queue = " << retryqueue->GetCount();
+        }
+
+        // A write error of the tar stream is already reported by the parser
+        bool bTarOk = tarwriter.GetError().empty();
+        if (tarwriter.IsOpen() && !tarwriter.Close(GetEmlDurability(eml_durability) != EML_DURABILITY_NONE) && bTarOk)
+            LOG(ERROR) << tarwriter.GetError();
+
         // Synchronize directory tree (remove old dir - apply only on Thunderbird)
         if (bSynchonize && voutputdir.size()) {
             string outdirbase = voutputdir[0]; // Retrieve base directory that is outputdir/username
@@ -573,53 +1056,60 @@ int main(int argc, char**argv)
 
             if (!host_url.empty()){
                 LOG(INFO) << "Syncing directories to \""+host_url+"\"";
+                sync_layout = Remote_SyncLayout(voutputdir);
 
                 if (Remote_SendSyncList("sync_dirlist", outdirbase, voutputdir)) LOG(INFO) << "Synchronization done";
                 else LOG(ERROR) << "Synchronization not completed";
             }
 
             if (bActionExtract) {
-                std::vector<string> vListDirectories;
-                vListDirectories.push_back(outdirbase);
-                ListAllSubDirectories(vListDirectories, outdirbase);
-
-                for (auto& dir : vListDirectories)
-                    dir = dir+"/";
-
-                vector<string> vListDiff;
-                sort(vListDirectories.begin(), vListDirectories.end());
-                sort(voutputdir.begin(), voutputdir.end()); // voutputdir ending with '/'
-
-                // Search elements of vListDirectories which are not found in the sorted voutputdir
-                set_difference(vListDirectories.begin(),vListDirectories.end(),voutputdir.begin(),voutputdir.end(),back_inserter(vListDiff));
+                // Output directories and all their parents are kept (paths relative to outdirbase)
+                std::unordered_set<std::string> sKeep, sOutput;
+                for (auto& dir : voutputdir) { // voutputdir ending with '/'
+                    if (dir.compare(0, outdirbase.length()+1, outdirbase+"/") != 0) continue;
+                    for (size_t pos = dir.find('/', outdirbase.length()+1); pos != string::npos; pos = dir.find('/', pos+1))
+                        sKeep.insert(dir.substr(outdirbase.length()+1, pos-outdirbase.length()-1));
+                    sOutput.insert(dir.substr(outdirbase.length()+1, dir.length()-outdirbase.length()-2));
+                }
 
+                std::vector<Walk_entry> vListDiff;
+                DiffDirectory(vListDiff, outdirbase, sKeep, false, true);
+
+                // Children are removed before parents
+                // The layout sub-directories of output directories are kept too: the ones of the layout
+                // and of the previous layouts recorded in their marker file (see EML_LAYOUT_MARKER)
+                int layout = GetEmlLayout(eml_layout);
+                auto is_layout = [&](const string& dir, int dirlayout) {
+                    if (dirlayout == EML_LAYOUT_FLAT || !sOutput.count(dir)) return false;
+                    if (dirlayout == layout) return true;
+                    std::vector<int> vLayouts = GetEmlLayouts(outdirbase+"/"+dir+"/");
+                    return std::find(vLayouts.begin(), vLayouts.end(), dirlayout) != vLayouts.end();
+                };
                 std::vector<std::string> v_dirtoremove;
-
-                for (auto dir:vListDiff) {
-                    bool isParentDir = false;
-                    for (auto& str : voutputdir) {
-                        if (str.find(dir) == 0) {
-                            isParentDir = true;
-                            break;
-                        }
-                    }
-                    if (!isParentDir)
-                        v_dirtoremove.push_back(dir);
+                for (auto& entry : vListDiff) {
+                    size_t pos1 = entry.path.find_last_of('/');
+                    if (pos1 != string::npos && is_layout(entry.path.substr(0, pos1), EmlLayoutOfDir(entry.path.substr(pos1+1)))) continue;
+                    size_t pos2 = (pos1 == string::npos || pos1 == 0)? string::npos : entry.path.find_last_of('/', pos1-1);
+                    int dirlayout = (pos2 == string::npos)? EML_LAYOUT_FLAT : EmlLayoutOfDir(entry.path.substr(pos2+1, pos1-pos2-1));
+                    if (pos2 != string::npos && IsEmlLayoutDir(entry.path.substr(pos1+1), dirlayout, 2)
+                        && is_layout(entry.path.substr(0, pos2), dirlayout)) continue;
+                    v_dirtoremove.push_back(outdirbase+"/"+entry.path+"/");
                 }
-
+                sort(v_dirtoremove.begin(), v_dirtoremove.end());
                 std::reverse(v_dirtoremove.begin(),v_dirtoremove.end());
+
                 for (auto dir:v_dirtoremove) {
                     std::vector<string> vListFiles;
+                    std::vector<bool> vRemoved;
 
                     // List files (only) contains in directory output
                     if (ListDirectoryContents(vListFiles, dir, true, false)) {
-                        for(string file : vListFiles){
+                        for (auto& file : vListFiles)
                             file = dir + file;
-                            std::remove(file.c_str());
-                        }
+                        RemoveFiles(vListFiles, vRemoved);
                         int ret = std::remove(dir.c_str());
                         if (!ret) LOG(INFO) <<  "Directory \""+dir+"\" was deleted";
-                        else LOG(ERROR) << "WARNING", "Can not delete directory \""+dir+"\"";
+                        else LOG(WARNING) << "Can not delete directory \""+dir+"\"";
                     }
                 }
             }
@@ -635,7 +1125,10 @@ int main(int argc, char**argv)
             LOG(INFO) << "-> excluded = " << total_excluded;
 
             if (bActionExtract) {
-                if (bEmlCompress) LOG(INFO) << "-> extracted to eml.gz = " << total_extracted;
+                if (GetEmlFormat(eml_format) == EML_FORMAT_PACK) LOG(INFO) << "-> extracted to pack = " << total_extracted;
+                else if (GetEmlFormat(eml_format) == EML_FORMAT_TAR) LOG(INFO) << "-> extracted to tar = " << total_extracted;
+                else if (GetEmlFormat(eml_format) == EML_FORMAT_MAILDIR) LOG(INFO) << "-> extracted to maildir = " << total_extracted;
+                else if (bEmlCompress) LOG(INFO) << "-> extracted to eml.gz = " << total_extracted;
                 else LOG(INFO) << "-> extracted to eml = " << total_extracted;
                 if (bSynchonize) LOG(INFO) << "-> removed from destination = " << total_emldeleted;
             }
@@ -649,11 +1142,30 @@ int main(int argc, char**argv)
                 LOG(INFO) << "-> number of split files = " << total_split_files;
             }
 
-            if (!host_url.empty()) {
+            if (!host_url.empty() || !s3_url.empty() || !imap_url.empty() || !sftp_url.empty()) {
                 LOG(INFO) << "-> uploads succeed = " << total_upload_succeed;
                 LOG(INFO) << "-> uploads failed = " << total_upload_failed;
+                if (retryqueue) LOG(INFO) << "-> uploads queued to retry = " << total_upload_queued;
             }
         }
+
+        if (ratelimiter && ratelimiter->GetBytes()) {
+            double seconds = ratelimiter->GetSeconds();
+            LOG(INFO) << "Upload throughput : " << bytes_convert(ratelimiter->GetBytes()) << " sent in " << floor(seconds*100)/100
+                      << " seconds (" << bytes_convert(seconds > 0 ? ratelimiter->GetBytes()/seconds : 0) << "/s)";
+        }
+        delete s3uploader;
+        s3uploader = NULL;
+        delete imapuploader;
+        imapuploader = NULL;
+        delete sftpuploader;
+        sftpuploader = NULL;
+        delete retryqueue;
+        retryqueue = NULL;
+        delete ratelimiter;
+        ratelimiter = NULL;
+        delete uploadscheduler;
+        uploadscheduler = NULL;
         LOG(INFO) << "ENDING mboxzilla";
     }
     catch (const std::exception& ex) {
@@ -35,17 +35,25 @@
 #include <algorithm>    // find_if
 #include <functional>   // std::not1
 #include <time.h>
+#include <csignal>
 #include <zlib.h>
 
 #include <curl/curl.h>
 #include <openssl/evp.h>
-#include <openssl/buffer.h>
 #include <openssl/sha.h>
 #include <openssl/aes.h>
 #include <openssl/rand.h>
 
 #include "common.hpp"
 #include "mbox_parser.hpp"
+#include "base64.hpp"
+#include "s3_uploader.hpp"
+#include "imap_uploader.hpp"
+#include "sftp_uploader.hpp"
+#include "sync_digest.hpp"
+#include "retry_queue.hpp"
+#include "rate_limiter.hpp"
+#include "upload_scheduler.hpp"
 
 #include "json.hpp"
 #include "cxxopts.hpp"
@@ -61,13 +69,44 @@ using namespace std;
 json json_remotelist;
 std::vector<unsigned char> aes_iv_token;
 std::string sToken, ciphertext_token;
-string ciphertext;
-int nbUploadSuccess = 0, nbUploadError = 0;
+int nbUploadSuccess = 0, nbUploadError = 0, nbUploadQueued = 0;
+int nbRetrySuccess = 0, nbRetryError = 0; // uploads from the retry queue
 string aes_key;
 string host_url; // eg: "https://www.domain.net/backup";
+string eml_layout = "flat"; // output directory layout of eml files: "flat", "hash" or "date"
+string sync_layout; // layouts of the remote directory whose sub-directories are listed by the server, eg: "hash,date"
+string eml_durability = "none"; // sync policy of written files: "none", "group" or "file"
+string split_mode = "size"; // split strategy: "size", "count", "parts", "year", "month" or "day"
+string eml_format = "eml"; // output format of extracted emails: "eml", "pack" or "tar"
+string tar_output = "-"; // file or FIFO of the tar stream, "-" is the standard output
 int maxlogfiles = 5;
 int timeout = 600;
-long long speedlimit = 0;
+long long speedlimit = 0; // bytes per second of all the uploads, 0 is unlimited
+string speed_schedule; // eg: "mon-fri 08:00-18:00=262144" (see Rate_limiter)
+Rate_limiter *ratelimiter = NULL;
+string retry_dir; // directory of the queue of the uploads to send again (see Retry_queue)
+int retry_size = 256; // maximal size in MB of the queue
+Retry_queue *retryqueue = NULL;
+string upload_order = "mbox"; // eg: "newest" (see Upload_scheduler)
+int upload_memory = 256; // maximal size in MB of the emails held to be uploaded in order
+Upload_scheduler *uploadscheduler = NULL;
+void (*callbackScheduled)(string, string, std::vector<char>, time_t) = NULL; // upload callback of the emails released by the scheduler
+string s3_url; // eg: "https://s3.domain.net/bucket/prefix"
+string s3_region = "us-east-1";
+string s3_access_key, s3_secret_key;
+int upload_threads = S3_UPLOAD_THREADS;
+bool bUploadAdaptive = false; // number of S3 uploads tuned by an Upload_window
+S3_uploader *s3uploader = NULL;
+std::unordered_set<std::string> s3_remotelist; // objects of the current output directory
+string imap_url; // eg: "imaps://mail.domain.net/Archives"
+string imap_user, imap_password;
+IMAP_uploader *imapuploader = NULL;
+string imap_mailbox; // mailbox of the current output directory
+std::unordered_set<std::string> imap_remotelist; // MD5 of the Message-ID of its messages
+string sftp_url; // eg: "sftp://backup.domain.net/~/mails"
+string sftp_user, sftp_password, sftp_key, sftp_fingerprint;
+SFTP_uploader *sftpuploader = NULL;
+std::unordered_set<std::string> sftp_remotelist; // files of the current output directory
 
 //---------------------------------------------------------------------------------------------
 
@@ -289,26 +328,10 @@ void AES_Decrypt(string key, std::vector<unsigned char>& iv, std::string& ctext,
  */
 std::string base64Encode(const std::string &data, size_t len=-1) {
 
-    BIO *bmem, *b64, *bcontainer;
-    BUF_MEM *bptr;
-    std::string encoded_data;
-    if (len == (size_t)-1) len = data.size();
+    if (len == (size_t)-1 || len > data.size()) len = data.size();
 
-    b64 = BIO_new(BIO_f_base64());
-    // we don't want newlines
-    BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
-    bmem = BIO_new(BIO_s_mem());
-    bcontainer = BIO_push(b64, bmem);
-    BIO_write(bcontainer, (void*)data.c_str(), len);
-    (void) BIO_flush(bcontainer);
-    BIO_get_mem_ptr(bcontainer, &bptr);
-
-    char *buf = new char[bptr->length];
-    memcpy(buf, bptr->data, bptr->length);
-    encoded_data.assign(buf, bptr->length);
-
-    delete [] buf;
-    BIO_free_all(bcontainer);
+    std::string encoded_data(base64_encoded_size(len), 0);
+    base64_encode((const unsigned char*)data.data(), len, &encoded_data[0]);
 
     return encoded_data;
 }
@@ -316,33 +339,17 @@ std::string base64Encode(const std::string &data, size_t len=-1) {
 /**
  *  base64Decode()
  *  Decodes data encoded with MIME base64
+ *  Return empty string if data is not valid base64
  */
 std::string base64Decode(const std::string &data) {
 
-    BIO *bmem, *b64, *bcontainer;
-
-    char *buf = new char[data.size()];
-    int decoded_len = 0;
-    std::string decoded_data;
-
-    // create a memory buffer containing base64 encoded data
-    bmem = BIO_new_mem_buf((void*)data.c_str(), data.size());
-
-    //create a base64 filter
-    b64 = BIO_new(BIO_f_base64());
-
-    // we don't want newlines
-    BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
-
-    // push a Base64 filter so that reading from buffer decodes it
-    bcontainer = BIO_push(b64, bmem);
-
-    decoded_len = BIO_read(bcontainer, (void*)buf, data.size());
-    BIO_free_all(bcontainer);
+    std::string decoded_data(base64_decoded_maxsize(data.size()), 0);
+    size_t decoded_len = 0;
 
-    decoded_data.assign(buf, decoded_len);
-    delete [] buf;
+    if (!base64_decode(data.data(), data.size(), (unsigned char*)&decoded_data[0], decoded_len))
+        return "";
 
+    decoded_data.resize(decoded_len);
     return decoded_data;
 }
 //---------------------------------------------------------------------------------------------
@@ -483,6 +490,25 @@ bool Remote_IsAvailable() {
     return ret;
 }
 //---------------------------------------------------------------------------------------------
+/**
+ *  Remote_SyncLayout()
+ *  Return the layouts of output directories, sent to the server as "sync_layout": the layout
+ *  and the previous ones recorded in the local marker files (see EML_LAYOUT_MARKER)
+ *  Without them, the server only lists the files at the top of a directory
+ */
+string Remote_SyncLayout(const std::vector<string>& vDirs) {
+
+    std::vector<int> vLayouts;
+    if (GetEmlLayout(eml_layout) > EML_LAYOUT_FLAT) vLayouts.push_back(GetEmlLayout(eml_layout));
+    for (const string& dir : vDirs)
+        for (int layout : GetEmlLayouts(dir))
+            if (std::find(vLayouts.begin(), vLayouts.end(), layout) == vLayouts.end()) vLayouts.push_back(layout);
+
+    string layouts;
+    for (int layout : vLayouts) layouts += (layouts.empty() ? "" : ",") + GetEmlLayoutName(layout);
+    return layouts;
+}
+//---------------------------------------------------------------------------------------------
 /**
  *  Remote_GetList()
  *  Get files stored in remote directory. Use to find out if a file must be uploaded.
@@ -528,6 +554,11 @@ bool Remote_GetList(json &j, const std::string outputdir) {
         part = curl_mime_addpart(multipart);
         curl_mime_name(part, "get_filelist");
         curl_mime_data(part, outputdir.c_str(), CURL_ZERO_TERMINATED);
+        if (!sync_layout.empty()) {
+            part = curl_mime_addpart(multipart);
+            curl_mime_name(part, "sync_layout");
+            curl_mime_data(part, sync_layout.c_str(), CURL_ZERO_TERMINATED);
+        }
 
         curl_easy_setopt(curl, CURLOPT_URL, host_url.c_str());
         curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
@@ -565,25 +596,20 @@ bool Remote_GetList(json &j, const std::string outputdir) {
 }
 //---------------------------------------------------------------------------------------------
 /**
- *  Remote_SendEml()
- *  Send eml or eml.gz to remote host
+ *  Remote_PostEml()
+ *  Post an encrypted eml or eml.gz to remote host
+ *  Return the HTTP status code or 0 if the transfer failed (error is set)
  */
-bool Remote_SendEml(string fname, std::vector<char> eml) {
+long Remote_PostEml(string fname, const std::string& aes_iv_str, const char *data, size_t size, std::string& error) {
 
     CURL *curl;
-    CURLcode res;
+    CURLcode res = CURLE_OK;
     double speed_upload, total_time;
-    bool ret = false;
+    long http_code = 0;
 
     struct curl_slist *headerlist = NULL;
     static const char buf[] =  "Expect:";
 
-    // initialize ciphertext (eml) and  iv
-    std::vector<unsigned char> aes_iv;
-    if (!AES_Encrypt(aes_key, aes_iv, eml, ciphertext))
-        return false;
-    std::string aes_iv_str = base64Encode(std::string(aes_iv.begin(), aes_iv.end()));
-
     // initialize token
     std::time_t t = std::time(nullptr);
     std::tm tm = *std::localtime(&t);
@@ -592,10 +618,12 @@ bool Remote_SendEml(string fname, std::vector<char> eml) {
     std::string sToken = token.str();
 
     std::vector<char> vToken(sToken.begin(), sToken.end());
-    if (!AES_Encrypt(aes_key, aes_iv_token, vToken, ciphertext_token))
-        return false;
+    if (!AES_Encrypt(aes_key, aes_iv_token, vToken, ciphertext_token)) {
+        error = "Encryption of token failed";
+        return 0;
+    }
 
-    VLOG(3) << "Uploading to " << fname << " (" << bytes_convert(eml.size()) << ")";
+    VLOG(3) << "Uploading to " << fname << " (" << bytes_convert(size) << ")";
 
     std::string aes_iv_token_str = base64Encode(std::string(aes_iv_token.begin(), aes_iv_token.end()));
     string ciphertext_token_b64 = base64Encode(ciphertext_token, ciphertext_token.size());
@@ -619,7 +647,8 @@ bool Remote_SendEml(string fname, std::vector<char> eml) {
         fname = base64Encode(fname); // b64 encoded because COPYNAME strip slash
         part = curl_mime_addpart(multipart);
         curl_mime_name(part, "fileToUpload");
-        curl_mime_data(part, ciphertext.data(), (curl_off_t) ciphertext.size());
+        Rate_reader reader(data, size, ratelimiter);
+        curl_mime_data_cb(part, (curl_off_t) size, Rate_reader::Read, Rate_reader::Seek, NULL, &reader);
         curl_mime_filename(part, fname.c_str());
 
         struct curl_slist *headers=NULL;
@@ -633,7 +662,6 @@ bool Remote_SendEml(string fname, std::vector<char> eml) {
         curl_easy_setopt(curl, CURLOPT_MIMEPOST, multipart);
         curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback); // Disable standard output
         curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
-        curl_easy_setopt(curl, CURLOPT_MAX_SEND_SPEED_LARGE, speedlimit);
 
         res = curl_easy_perform(curl);
         /* Check for errors */
@@ -643,17 +671,171 @@ bool Remote_SendEml(string fname, std::vector<char> eml) {
             curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total_time);
             VLOG(3) << "Speed was " << bytes_convert(speed_upload) << "/s during " << floor(total_time*100)/100 << " seconds";
 
+            curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &http_code);
+        }
+        else error = curl_easy_strerror(res);
+
+        curl_easy_cleanup(curl);
+        curl_mime_free(multipart);
+        curl_slist_free_all(headerlist);
+    }
+
+    if (!curl) throw std::runtime_error("curl_easy_init() failed\n");
+    return http_code;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  Remote_SendEml()
+ *  Send eml or eml.gz to remote host, encrypted by the parser in the same pass as the eml
+ *  file (see Mbox_parser::SetUploadKey()) so that eml is the ciphertext followed by its IV
+ *  Return 1 if sent, 0 on failure or -1 if it failed for a transient reason and was
+ *  queued to be sent again (see Retry_queue)
+ */
+int Remote_SendEml(string fname, const std::vector<char>& eml) {
+
+    size_t size = eml.size() - EML_PIPELINE_IVLEN;
+    std::string aes_iv_str = base64Encode(std::string(eml.data()+size, EML_PIPELINE_IVLEN));
+
+    std::string error;
+    long http_code = Remote_PostEml(fname, aes_iv_str, eml.data(), size, error);
+    if (http_code == 200) {
+        if (retryqueue) retryqueue->Succeeded();
+        return 1;
+    }
+
+    if (retryqueue && Retry_IsTransient(http_code)) {
+        if (retryqueue->Add(fname, aes_iv_str, eml.data(), size)) {
+            VLOG(1) << "Upload of \""+fname+"\" failed (" << (http_code ? "HTTP "+std::to_string(http_code) : error) << "), queued to retry";
+            return -1;
+        }
+        LOG(WARNING) << retryqueue->GetError();
+    }
+    if (!http_code) throw std::runtime_error(error);
+    return 0;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  Remote_RetryQueued()
+ *  Send again the queued emails whose retry delay is over (see Retry_queue)
+ *  If bWait is true then wait for the delays until all are sent or the retries stop
+ */
+void Remote_RetryQueued(bool bWait) {
+
+    if (!retryqueue) return;
+    Retry_entry entry;
+    std::string data, error;
+
+    while (retryqueue->Next(entry, bWait)) {
+        if (!retryqueue->Read(entry, data)) {
+            LOG(ERROR) << retryqueue->GetError();
+            retryqueue->Remove(entry);
+            nbRetryError++;
+            continue;
+        }
+        long http_code = Remote_PostEml(entry.name, entry.iv, data.data(), data.size(), error);
+        if (http_code == 200) {
+            retryqueue->Remove(entry);
+            nbRetrySuccess++;
+        }
+        else if (Retry_IsTransient(http_code)) {
+            VLOG(1) << "Retry of \""+entry.name+"\" failed (" << (http_code ? "HTTP "+std::to_string(http_code) : error) << ")";
+            retryqueue->Failed(entry);
+        }
+        else {
+            LOG(ERROR) << "Retry of \""+entry.name+"\" failed (HTTP " << http_code << "), removed from retry queue";
+            retryqueue->Remove(entry);
+            nbRetryError++;
+        }
+    }
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  Remote_SendSyncDigest()
+ *  Send the root digest of the emails list (see Sync_digest) to server, that answers its
+ *  bucket digests if the root differs
+ *  Return 1 if nothing differs, 0 if vDiff is set to the buckets that differ or -1 if
+ *  the server does not support it (old index.php) so that the whole list must be sent
+ */
+int Remote_SendSyncDigest(std::string SyncDir, const Sync_digest& digest, std::vector<size_t>& vDiff) {
+
+    string sBucketCount = std::to_string(digest.GetBucketCount());
+    CURL *curl;
+    CURLcode res;
+    int ret = -1;
+    std::string readBuffer;
+    vDiff.clear();
+
+    struct curl_slist *headerlist = NULL;
+    static const char buf[] =  "Expect:";
+
+    // initialize token
+    std::time_t t = std::time(nullptr);
+    std::tm tm = *std::localtime(&t);
+    std::stringstream token;
+    token << std::put_time(&tm, "%Y%m%d_%H%M%S");
+    std::string sToken = token.str();
+
+    std::vector<char> vToken(sToken.begin(), sToken.end());
+    if (!AES_Encrypt(aes_key, aes_iv_token, vToken, ciphertext_token))
+        return -1;
+
+    std::string aes_iv_token_str = base64Encode(std::string(aes_iv_token.begin(), aes_iv_token.end()));
+    string ciphertext_token_b64 = base64Encode(ciphertext_token, ciphertext_token.size());
+
+    curl_global_init(CURL_GLOBAL_ALL);
+    curl = curl_easy_init();
+
+    // initialize custom header list (stating that Expect: 100-continue is not wanted
+    headerlist = curl_slist_append(headerlist, buf);
+    if (curl) {
+        curl_mime *multipart = curl_mime_init(curl);
+        curl_mimepart *part = curl_mime_addpart(multipart);
+        curl_mime_name(part, "token");
+        curl_mime_data(part, ciphertext_token_b64.c_str(), CURL_ZERO_TERMINATED);
+        part = curl_mime_addpart(multipart);
+        curl_mime_name(part, "token_iv");
+        curl_mime_data(part, aes_iv_token_str.c_str(), CURL_ZERO_TERMINATED);
+        part = curl_mime_addpart(multipart);
+        curl_mime_name(part, "sync_root");
+        curl_mime_data(part, digest.GetRoot().c_str(), CURL_ZERO_TERMINATED);
+        part = curl_mime_addpart(multipart);
+        curl_mime_name(part, "sync_bucketcount");
+        curl_mime_data(part, sBucketCount.c_str(), CURL_ZERO_TERMINATED);
+        if (!sync_layout.empty()) {
+            part = curl_mime_addpart(multipart);
+            curl_mime_name(part, "sync_layout");
+            curl_mime_data(part, sync_layout.c_str(), CURL_ZERO_TERMINATED);
+        }
+        part = curl_mime_addpart(multipart);
+        curl_mime_name(part, "sync_directory");
+        curl_mime_data(part, SyncDir.c_str(), CURL_ZERO_TERMINATED);
+
+        curl_easy_setopt(curl, CURLOPT_URL, host_url.c_str());
+        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
+        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0);
+        curl_easy_setopt(curl, CURLOPT_MIMEPOST, multipart);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback_toBuffer); // Disable standard output
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &readBuffer);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
+
+        res = curl_easy_perform(curl);
+        /* Check for errors */
+        if (res == CURLE_OK) {
             long http_code = 0;
             curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &http_code);
-            if (http_code == 200 && res != CURLE_ABORTED_BY_CALLBACK)
-            {
-                //Succeeded
-                ret = true;
+            // A root that differs is answered by the bucket digests of the server as "DIGEST#d0,d1,...",
+            // else it is a log message
+            if (http_code == 200 && readBuffer.find("DIGEST#") == 0) {
+                std::stringstream ss(readBuffer.substr(7, readBuffer.find_last_not_of("\r\n")-6));
+                std::vector<string> vDigests;
+                string item;
+                while (getline(ss, item, ',')) vDigests.push_back(item);
+                digest.Diff(vDigests, vDiff);
+                ret = vDiff.empty() ? 1 : 0;
             }
-            else
-            {
-                //Failed
-                ret = false;
+            else if (http_code == 200 && readBuffer.find("INFO#") == 0) {
+                WriteCallback(&readBuffer[0], 1, readBuffer.size(), NULL);
+                ret = 1;
             }
         }
 
@@ -670,8 +852,11 @@ bool Remote_SendEml(string fname, std::vector<char> eml) {
 /**
  *  Remote_SendSyncList()
  *  Send list to server in order to keep only emails or directories listed
+ *  If vBuckets is set then the list is the emails of these buckets only (see Sync_digest)
+ *  and the server keeps the emails of the other buckets
  */
-bool Remote_SendSyncList(const std::string ListName, std::string SyncDir, std::vector<std::string> vList) {
+bool Remote_SendSyncList(const std::string ListName, std::string SyncDir, std::vector<std::string> vList,
+                         size_t BucketCount=0, const std::vector<size_t>& vBuckets=std::vector<size_t>()) {
 
     json j_sync(vList);
     string sSync = j_sync.dump();
@@ -715,6 +900,21 @@ bool Remote_SendSyncList(const std::string ListName, std::string SyncDir, std::v
         part = curl_mime_addpart(multipart);
         curl_mime_name(part, ListName.c_str());
         curl_mime_data(part, sSync.c_str(), CURL_ZERO_TERMINATED);
+        if (!sync_layout.empty()) {
+            part = curl_mime_addpart(multipart);
+            curl_mime_name(part, "sync_layout");
+            curl_mime_data(part, sync_layout.c_str(), CURL_ZERO_TERMINATED);
+        }
+        if (BucketCount) {
+            std::stringstream buckets;
+            for (size_t i = 0; i < vBuckets.size(); i++) buckets << (i ? "," : "") << vBuckets[i];
+            part = curl_mime_addpart(multipart);
+            curl_mime_name(part, "sync_bucketcount");
+            curl_mime_data(part, std::to_string(BucketCount).c_str(), CURL_ZERO_TERMINATED);
+            part = curl_mime_addpart(multipart);
+            curl_mime_name(part, "sync_buckets");
+            curl_mime_data(part, buckets.str().c_str(), CURL_ZERO_TERMINATED);
+        }
         part = curl_mime_addpart(multipart);
         curl_mime_name(part, "sync_directory");
         curl_mime_data(part, SyncDir.c_str(), CURL_ZERO_TERMINATED);
@@ -757,6 +957,104 @@ bool Remote_SendSyncList(const std::string ListName, std::string SyncDir, std::v
     return ret;
 }
 //---------------------------------------------------------------------------------------------
+/**
+ *  Remote_SyncFileList()
+ *  Synchronize the emails of a remote directory with the list: the root digest of the list
+ *  is sent first, then the emails of the buckets that differ only
+ */
+bool Remote_SyncFileList(std::string SyncDir, const std::vector<std::string>& vList) {
+
+    Sync_digest digest(vList, Sync_BucketCount(vList.size()));
+    std::vector<size_t> vDiff;
+    int ret = Remote_SendSyncDigest(SyncDir, digest, vDiff);
+    if (ret == 1) return true;
+    if (ret == -1) {
+        VLOG(2) << "Digests not supported by \""+host_url+"\", sending the whole list";
+        return Remote_SendSyncList("sync_filelist", SyncDir, vList);
+    }
+
+    std::vector<std::string> vNames;
+    digest.GetNames(vDiff, vNames);
+    VLOG(3) << vDiff.size() << " of " << digest.GetBucketCount() << " buckets differ, sending " << vNames.size() << " names";
+    return Remote_SendSyncList("sync_filelist", SyncDir, vNames, digest.GetBucketCount(), vDiff);
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  UnpackEml()
+ *  Extract the emails of a pack file (see Mbox_pack) to eml (or eml.gz) files of the
+ *  output directory and its layout sub-directories. Existing files are not replaced.
+ *  If 'name' is not empty then only this email is read from the pack
+ *  Return the number of files written or -1 if the pack or the email is not found
+ */
+int UnpackEml(const string& packfile, const string& outdir, const string& name, int layout, bool compress, int durability) {
+
+    Mbox_pack pack;
+    if (!pack.Open(packfile)) {
+        LOG(ERROR) << pack.GetError();
+        return -1;
+    }
+    if (pack.IsRecovered()) LOG(WARNING) << "Index of \""+packfile+"\" is damaged, emails are listed from its blocks";
+
+    std::vector<const Mbox_pack_entry*> vEntries;
+    if (name.empty()) {
+        for (const Mbox_pack_entry& entry : pack.GetEntries()) vEntries.push_back(&entry);
+    }
+    else if (pack.Find(name)) vEntries.push_back(pack.Find(name));
+    else {
+        LOG(ERROR) << "Email \""+name+"\" is not in \""+packfile+"\"";
+        return -1;
+    }
+
+    Eml_writer writer;
+    writer.SetDurability(durability);
+    std::unordered_set<string> layoutdirs;
+    std::vector<Eml_write_result> vResults;
+    for (const Mbox_pack_entry *entry : vEntries) {
+        string layoutdir = EmlLayoutDir(entry->name, layout);
+        string filename = outdir + layoutdir + entry->name + (compress ? ".gz" : "");
+        if (FileExists(filename)) {
+            VLOG(2) << "Already existing file \""+filename+"\"";
+            continue;
+        }
+        if (!layoutdirs.count(layoutdir)) {
+            if (!createPath(outdir + layoutdir)) {
+                LOG(ERROR) << "Could not create directory \""+outdir + layoutdir+"\"";
+                continue;
+            }
+            // The layout is recorded with its first sub-directory (see EML_LAYOUT_MARKER)
+            if (layout != EML_LAYOUT_FLAT && layoutdirs.empty()) {
+                std::vector<int> vLayouts = GetEmlLayouts(outdir);
+                if (std::find(vLayouts.begin(), vLayouts.end(), layout) == vLayouts.end()) {
+                    vLayouts.push_back(layout);
+                    if (!SetEmlLayouts(outdir, vLayouts)) LOG(WARNING) << "Could not write file \""+outdir+EML_LAYOUT_MARKER+"\"";
+                }
+            }
+            layoutdirs.insert(layoutdir);
+        }
+
+        std::vector<char> data;
+        if (!pack.Read(*entry, data)) {
+            LOG(ERROR) << pack.GetError();
+            continue;
+        }
+        if (compress) data = compress_gzip(data);
+        writer.Submit(filename, data);
+        writer.Collect(vResults);
+    }
+    writer.Flush();
+    writer.Collect(vResults);
+
+    int nbwritten = 0;
+    for (const Eml_write_result& result : vResults) {
+        if (result.ok) {
+            nbwritten++;
+            VLOG(3) << "Successfully saved email to \""+result.path+"\"";
+        }
+        else LOG(ERROR) << result.error;
+    }
+    return nbwritten;
+}
+//---------------------------------------------------------------------------------------------
 /**
  *  callbackEMLvalid()
  *  Callback function to start callbackEML() when current file is not
@@ -774,11 +1072,222 @@ bool callbackEMLvalid(string dirname, string filename) {
 ** callbackEML()
 ** Callback function to start Remote_SendEml()
 */
-void callbackEML(string dirname, string filename, std::vector<char> eml) {
+void callbackEML(string dirname, string filename, std::vector<char> eml, time_t date) {
 
     string fullpathfile = dirname + filename;
-    if (Remote_SendEml(fullpathfile, eml)) nbUploadSuccess++;
+    int ret = Remote_SendEml(fullpathfile, eml);
+    if (ret > 0) nbUploadSuccess++;
+    else if (ret < 0) nbUploadQueued++;
     else nbUploadError++;
+    Remote_RetryQueued(false);
+}
+//---------------------------------------------------------------------------------------------
+/**
+** S3_CollectUploads()
+** Account the objects uploaded in background since last call and log their result
+** If bWait is true then wait for all submitted objects to be uploaded before
+*/
+void S3_CollectUploads(bool bWait) {
+
+    if (!s3uploader) return;
+    if (bWait) s3uploader->Flush();
+
+    if (bUploadAdaptive) {
+        std::vector<std::string> vDecisions;
+        s3uploader->GetWindow(vDecisions);
+        for (const std::string& decision : vDecisions) VLOG(1) << decision;
+    }
+
+    std::vector<S3_upload_result> vResults;
+    if (!s3uploader->Collect(vResults)) return;
+
+    for (const S3_upload_result& result : vResults) {
+        if (result.ok) {
+            nbUploadSuccess++;
+            VLOG(3) << "Uploaded \"" << result.key << "\" (" << bytes_convert(result.size) << ")";
+        }
+        else {
+            nbUploadError++;
+            LOG(ERROR) << result.error;
+        }
+    }
+}
+//---------------------------------------------------------------------------------------------
+/**
+** callbackS3valid()
+** Callback function to start callbackS3() when current file is not
+** in the objects listed from the storage
+*/
+bool callbackS3valid(string dirname, string filename) {
+
+    return !s3_remotelist.count(filename);
+}
+//---------------------------------------------------------------------------------------------
+/**
+** callbackS3()
+** Callback function to queue the eml to the S3 uploader, encrypted if a key is set
+** The parser then gives the ciphertext followed by its IV (see Mbox_parser::SetUploadKey()),
+** the IV of an encrypted object is stored in its metadata 'x-amz-meta-iv' (base64)
+*/
+void callbackS3(string dirname, string filename, std::vector<char> eml, time_t date) {
+
+    S3_headers headers;
+    if (!aes_key.empty()) {
+        size_t size = eml.size() - EML_PIPELINE_IVLEN;
+        headers["content-type"] = "application/octet-stream";
+        headers["x-amz-meta-iv"] = base64Encode(std::string(eml.data()+size, EML_PIPELINE_IVLEN));
+        eml.resize(size);
+    }
+    else if (filename.length() > 3 && filename.compare(filename.length()-3, 3, ".gz") == 0)
+        headers["content-type"] = "application/gzip";
+    else headers["content-type"] = "message/rfc822";
+
+    VLOG(3) << "Uploading to " << dirname + filename << " (" << bytes_convert(eml.size()) << ")";
+    s3uploader->Submit(S3_ObjectKey(dirname + filename), eml, headers);
+    S3_CollectUploads(false);
+}
+//---------------------------------------------------------------------------------------------
+/**
+** IMAP_CollectUploads()
+** Account the messages appended in background since last call and log their result
+** If bWait is true then wait for all submitted messages to be appended before
+*/
+void IMAP_CollectUploads(bool bWait) {
+
+    if (!imapuploader) return;
+    if (bWait) imapuploader->Flush();
+
+    std::vector<IMAP_upload_result> vResults;
+    if (!imapuploader->Collect(vResults)) return;
+
+    for (const IMAP_upload_result& result : vResults) {
+        if (result.ok) {
+            nbUploadSuccess++;
+            VLOG(3) << "Appended \"" << result.name << "\" to \"" << result.mailbox << "\" (" << bytes_convert(result.size) << ")";
+        }
+        else {
+            nbUploadError++;
+            LOG(ERROR) << result.error;
+        }
+    }
+}
+//---------------------------------------------------------------------------------------------
+/**
+** callbackIMAPvalid()
+** Callback function to start callbackIMAP() when the Message-ID of current file
+** (MD5 of its name "YYYYmmddHHMMSS_MD5.eml") is not in the messages of the mailbox
+*/
+bool callbackIMAPvalid(string dirname, string filename) {
+
+    size_t end = filename.rfind(".eml");
+    size_t pos = (end == string::npos) ? string::npos : filename.rfind('_', end);
+    if (pos == string::npos) return true;
+    return !imap_remotelist.count(filename.substr(pos+1, end-pos-1));
+}
+//---------------------------------------------------------------------------------------------
+/**
+** callbackIMAP()
+** Callback function to queue the eml to the IMAP uploader, its date is the INTERNALDATE
+*/
+void callbackIMAP(string dirname, string filename, std::vector<char> eml, time_t date) {
+
+    VLOG(3) << "Appending " << filename << " to \"" << imap_mailbox << "\" (" << bytes_convert(eml.size()) << ")";
+    imapuploader->Submit(imap_mailbox, filename, eml, date);
+    IMAP_CollectUploads(false);
+}
+//---------------------------------------------------------------------------------------------
+/**
+** SFTP_CollectUploads()
+** Account the files uploaded in background since last call and log their result
+** If bWait is true then wait for all submitted files to be uploaded before
+*/
+void SFTP_CollectUploads(bool bWait) {
+
+    if (!sftpuploader) return;
+    if (bWait) sftpuploader->Flush();
+
+    std::vector<SFTP_upload_result> vResults;
+    if (!sftpuploader->Collect(vResults)) return;
+
+    for (const SFTP_upload_result& result : vResults) {
+        if (result.ok) {
+            nbUploadSuccess++;
+            VLOG(3) << "Uploaded \"" << result.path << "\" (" << bytes_convert(result.size) << ")";
+        }
+        else {
+            nbUploadError++;
+            LOG(ERROR) << result.error;
+        }
+    }
+}
+//---------------------------------------------------------------------------------------------
+/**
+** callbackSFTPvalid()
+** Callback function to start callbackSFTP() when current file is not
+** in the files listed from the server
+*/
+bool callbackSFTPvalid(string dirname, string filename) {
+
+    return !sftp_remotelist.count(filename);
+}
+//---------------------------------------------------------------------------------------------
+/**
+** callbackSFTP()
+** Callback function to queue the eml to the SFTP uploader
+*/
+void callbackSFTP(string dirname, string filename, std::vector<char> eml, time_t date) {
+
+    VLOG(3) << "Uploading to " << dirname + filename << " (" << bytes_convert(eml.size()) << ")";
+    sftpuploader->Submit(S3_ObjectKey(dirname + filename), eml);
+    SFTP_CollectUploads(false);
+}
+//---------------------------------------------------------------------------------------------
+/**
+** Schedule_SinkHasRoom()
+** Return true if the background uploads are short of emails to send
+** (the HTTP upload is done in the callback so it never has room)
+*/
+bool Schedule_SinkHasRoom() {
+
+    if (s3uploader) return s3uploader->GetPendingBytes() < UPLOAD_ORDER_SINKBYTES;
+    if (imapuploader) return imapuploader->GetPendingBytes() < UPLOAD_ORDER_SINKBYTES;
+    if (sftpuploader) return sftpuploader->GetPendingBytes() < UPLOAD_ORDER_SINKBYTES;
+    return false;
+}
+//---------------------------------------------------------------------------------------------
+/**
+** Schedule_Release()
+** Upload the first emails of the scheduler while it holds more than 'upload-memory'
+** or while the background uploads have room, or all of them if bAll is true
+*/
+void Schedule_Release(bool bAll) {
+
+    Scheduled_eml item;
+    while (uploadscheduler->GetCount()) {
+        if (!bAll && uploadscheduler->GetBytes() <= (size_t)upload_memory*1024*1024 && !Schedule_SinkHasRoom()) break;
+        uploadscheduler->Pop(item);
+        callbackScheduled(item.dirname, item.filename, std::move(item.eml), item.date);
+    }
+}
+//---------------------------------------------------------------------------------------------
+/**
+** callbackSchedule()
+** Callback function to hold the eml in the scheduler until its turn to be uploaded
+*/
+void callbackSchedule(string dirname, string filename, std::vector<char> eml, time_t date) {
+
+    uploadscheduler->Push(dirname, filename, eml, date);
+    Schedule_Release(false);
+}
+//---------------------------------------------------------------------------------------------
+/**
+** Schedule_SetCallback()
+** Set the upload callback function of the mbox, through the scheduler if an upload order is set
+*/
+void Schedule_SetCallback(Mbox_parser& mbox, void (*callback)(string, string, std::vector<char>, time_t)) {
+
+    callbackScheduled = callback;
+    mbox.Set_Callback_Eml_Process(uploadscheduler ? &callbackSchedule : callback);
 }
 //---------------------------------------------------------------------------------------------
 /**
@@ -875,36 +1384,29 @@ int GetRegexVector (std::vector<std::string>& vString, const std::string& sRegex
  */
 void ListThunderbirdMbox(std::map<std::string, std::vector<std::string>>& map, std::string destination_path, std::string directory, vector<string>& vMboxExcluded) {
 
-    std::vector<string> vListDirectories;
-
-    vListDirectories.push_back(directory);
-    ListAllSubDirectories(vListDirectories, directory);
-
-    for (auto itDir:vListDirectories) {
-        std::vector<string> vList;
-        ListDirectoryContents(vList, itDir, true, false);
-
-        for (auto itFile:vList) {
-            string mbx = itDir+"/"+itFile;
-            if (IsMboxFile(mbx)) {
-                // Extract mbox name only (without account dir) and test if excluded
-                mbx = mbx.data()+directory.length()+1;
-
-                bool bIgnore = false;
-                if (vMboxExcluded.size()) {
-                    for (auto it:vMboxExcluded) {
-                        std::regex rgx(it, regex_constants::icase);
-                        if (std::regex_match(mbx, rgx)) {
-                            LOG(WARNING) << "-> Ignore Mbox file  \""+itDir+"/"+itFile+"\"";
-                            bIgnore = true;
-                            break;
-                        }
+    std::vector<Walk_entry> vEntries;
+
+    // All files of directory tree are listed in one walk
+    WalkDirectory(vEntries, directory, true, false);
+
+    for (auto& entry:vEntries) {
+        string mbx = directory+"/"+entry.path;
+        if (IsMboxFile(mbx)) {
+            // Mbox name only (without account dir) is tested if excluded
+            bool bIgnore = false;
+            if (vMboxExcluded.size()) {
+                for (auto it:vMboxExcluded) {
+                    std::regex rgx(it, regex_constants::icase);
+                    if (std::regex_match(entry.path, rgx)) {
+                        LOG(WARNING) << "-> Ignore Mbox file  \""+mbx+"\"";
+                        bIgnore = true;
+                        break;
                     }
                 }
-
-                if (!bIgnore)
-                    map[destination_path+"|"+directory].push_back(itDir+"/"+itFile);
             }
+
+            if (!bIgnore)
+                map[destination_path+"|"+directory].push_back(mbx);
         }
     }
 
@@ -1121,20 +1623,8 @@ std::map<std::string, std::vector<std::string>> GetThunderbirdMbox(bool b_getloc
  */
 void Remove_EmptyDir(std::string directory) {
 
-    std::vector<string> vListDirectory;
-    ListAllSubDirectories(vListDirectory, directory);
-
-    // Sort and reverse list because we need to verify child directories before parents
-    // in order to recursively delete empty dir
-    sort(vListDirectory.begin(), vListDirectory.end());
-    std::reverse(vListDirectory.begin(), vListDirectory.end());
-
-    for (auto itDir:vListDirectory) {
-        std::vector<string> vList;
-        ListDirectoryContents(vList, itDir, true, true);
-        if (vList.empty())
-            std::remove(itDir.c_str());
-    }
+    // Child directories are verified before parents in the same walk
+    PruneEmptyDirectories(directory);
 }
 //---------------------------------------------------------------------------------------------
 
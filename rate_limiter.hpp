@@ -0,0 +1,263 @@
+/*
+    BSD 2-Clause License
+
+    Copyright (c) 2017-2023, Nol Martinon
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+    Token bucket limiting the bandwidth of all the uploads of the process.
+
+    The workers of every sink take the bytes they are about to send with
+    Acquire(), which grants at most the burst (RATE_BURST_MS of the rate) and
+    sleeps the time the bucket needs to pay it back, so the total of all the
+    threads follows the rate whatever their number. Rate_reader feeds a curl
+    upload from a buffer through the limiter (CURLOPT_READFUNCTION or
+    curl_mime_data_cb()).
+    The rate can follow a schedule of local time ranges, the first matching
+    range gives the rate and the default rate applies outside of them. A range
+    is "[days ]HH:MM-HH:MM=N" with days as "mon", "mon-fri" or "sat-sun", N in
+    bytes per second and 0 for unlimited, eg: "mon-fri 08:00-18:00=262144".
+    The bytes granted and the time from the first to the last one give the
+    achieved throughput.
+    eg:
+        Rate_limiter limiter(1048576);
+        if (!limiter.SetSchedule("mon-fri 08:00-18:00=262144")) std::cerr << limiter.GetError();
+        size_t len = limiter.Acquire(data.size() - pos);
+        send(sock, data.data() + pos, len, 0);
+*/
+
+#ifndef __RATE_LIMITER_HPP
+#define __RATE_LIMITER_HPP
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <algorithm>      // min, max
+#include <cstdlib>        // strtoll
+#include <cstdio>         // sscanf
+#include <cstring>        // memcpy
+#include <ctime>          // localtime
+#include <curl/curl.h>
+
+#define RATE_BURST_MS 250       // bytes granted at once, in ms of the rate
+#define RATE_MINBURST 4096      // minimal burst in bytes
+
+struct Rate_range {
+    int days;           // bit i for the day i (0 is sunday)
+    int start;          // minutes from midnight
+    int end;            // minutes from midnight, before start if the range ends the next day
+    long long rate;     // bytes per second, 0 is unlimited
+};
+
+class Rate_limiter {
+    public:
+        Rate_limiter(long long defaultrate = 0) : defrate(defaultrate), rate(-1), tokens(0), burst(0),
+                                                 bytes(0), checked(0), bStarted(false) {}
+
+        /// Set the ranges of the schedule from "[days ]HH:MM-HH:MM=N[,...]"
+        bool SetSchedule(const std::string& schedule) {
+            static const char *dayname[] = {"sun", "mon", "tue", "wed", "thu", "fri", "sat"};
+            std::vector<Rate_range> vParsed;
+            size_t pos = 0;
+            while (pos < schedule.length()) {
+                size_t comma = schedule.find(',', pos);
+                if (comma == std::string::npos) comma = schedule.length();
+                std::string item = schedule.substr(pos, comma-pos);
+                pos = comma + 1;
+                item.erase(0, item.find_first_not_of(' '));
+                item.erase(item.find_last_not_of(' ') + 1);
+                if (item.empty()) continue;
+
+                Rate_range range;
+                range.days = 0x7f;
+                size_t space = item.find(' ');
+                if (space != std::string::npos) {
+                    std::string days = item.substr(0, space);
+                    item.erase(0, item.find_first_not_of(' ', space));
+                    int first = -1, last = -1;
+                    for (int i = 0; i < 7; i++) {
+                        if (days.compare(0, 3, dayname[i]) == 0) first = i;
+                        if (days.length() == 7 && days[3] == '-' && days.compare(4, 3, dayname[i]) == 0) last = i;
+                    }
+                    if (days.length() == 3) last = first;
+                    if (first < 0 || last < 0) return Fail("Invalid days \""+days+"\" in schedule");
+                    range.days = 0;
+                    for (int i = first; ; i = (i+1) % 7) {
+                        range.days |= 1 << i;
+                        if (i == last) break;
+                    }
+                }
+
+                int h1, m1, h2, m2, n = 0;
+                char rate[32] = "";
+                if (sscanf(item.c_str(), "%2d:%2d-%2d:%2d=%31[0-9]%n", &h1, &m1, &h2, &m2, rate, &n) != 5 || n != (int)item.length()
+                    || h1 > 24 || h2 > 24 || m1 > 59 || m2 > 59 || h1*60+m1 > 1440 || h2*60+m2 > 1440)
+                    return Fail("Invalid range \""+item+"\" in schedule, 'HH:MM-HH:MM=N' expected");
+                range.start = h1*60 + m1;
+                range.end = h2*60 + m2;
+                range.rate = strtoll(rate, NULL, 10);
+                vParsed.push_back(range);
+            }
+            std::unique_lock<std::mutex> lock(mtx);
+            vRanges.swap(vParsed);
+            checked = 0;
+            return true;
+        }
+
+        /// Take up to 'want' bytes to send and wait for them if the rate is exceeded, return the bytes granted
+        size_t Acquire(size_t want) {
+            if (!want) return 0;
+            size_t grant = want;
+            std::chrono::steady_clock::duration wait(0);
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                if (!bStarted) {
+                    first = now;
+                    bStarted = true;
+                }
+                UpdateRate(now);
+                if (rate > 0) {
+                    tokens = std::min(burst, tokens + std::chrono::duration<double>(now - refill).count() * rate);
+                    refill = now;
+                    grant = (size_t)std::min((double)want, burst);
+                    tokens -= grant;
+                    // The bytes granted beyond the bucket are paid back by waiting
+                    if (tokens < 0)
+                        wait = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(-tokens / rate));
+                }
+                bytes += grant;
+                last = now + wait;
+            }
+            if (wait.count() > 0) std::this_thread::sleep_for(wait);
+            return grant;
+        }
+
+        /// Current rate in bytes per second, 0 if unlimited
+        long long GetRate() {
+            std::unique_lock<std::mutex> lock(mtx);
+            UpdateRate(std::chrono::steady_clock::now());
+            return rate;
+        }
+
+        /// Bytes granted since the start
+        unsigned long long GetBytes() {
+            std::unique_lock<std::mutex> lock(mtx);
+            return bytes;
+        }
+
+        /// Seconds from the first bytes granted to the last ones sent
+        double GetSeconds() {
+            std::unique_lock<std::mutex> lock(mtx);
+            return bStarted ? std::chrono::duration<double>(last - first).count() : 0;
+        }
+
+        std::string GetError() const { return error; }
+
+    private:
+        long long defrate;
+        long long rate;     // current rate, -1 before the first use
+        double tokens;      // bytes that can be sent at once, negative while waits are pending
+        double burst;
+        unsigned long long bytes;
+        time_t checked;     // second the rate was set for
+        bool bStarted;
+        std::chrono::steady_clock::time_point first, last, refill;
+        std::vector<Rate_range> vRanges;
+        std::mutex mtx;
+        std::string error;
+
+        Rate_limiter(const Rate_limiter&);
+        Rate_limiter& operator=(const Rate_limiter&);
+
+        bool Fail(const std::string& message) {
+            error = message;
+            return false;
+        }
+
+        /// Set the rate of the schedule for the current time (once by second), the bucket is full on a change
+        void UpdateRate(std::chrono::steady_clock::time_point now) {
+            time_t t = time(NULL);
+            if (t == checked && rate >= 0) return;
+            checked = t;
+            long long newrate = defrate;
+            if (!vRanges.empty()) {
+                struct tm tmnow;
+                #ifdef _WIN32
+                    localtime_s(&tmnow, &t);
+                #else
+                    localtime_r(&t, &tmnow);
+                #endif
+                int minute = tmnow.tm_hour*60 + tmnow.tm_min;
+                int yesterday = (tmnow.tm_wday + 6) % 7;
+                for (const Rate_range& range : vRanges) {
+                    bool bIn;
+                    if (range.start <= range.end) bIn = (range.days & (1 << tmnow.tm_wday)) && minute >= range.start && minute < range.end;
+                    else bIn = ((range.days & (1 << tmnow.tm_wday)) && minute >= range.start)
+                               || ((range.days & (1 << yesterday)) && minute < range.end);
+                    if (bIn) {
+                        newrate = range.rate;
+                        break;
+                    }
+                }
+            }
+            if (newrate == rate) return;
+            rate = newrate;
+            burst = std::max((double)rate * RATE_BURST_MS / 1000, (double)RATE_MINBURST);
+            tokens = burst;
+            refill = now;
+        }
+};
+
+/// Source of a curl upload from a buffer through a limiter (none if NULL)
+struct Rate_reader {
+    const char *data;
+    size_t size;
+    size_t pos;
+    Rate_limiter *limiter;
+
+    Rate_reader(const char *buffer, size_t len, Rate_limiter *ratelimiter) : data(buffer), size(len), pos(0), limiter(ratelimiter) {}
+
+    static size_t Read(char *buffer, size_t size, size_t nitems, void *userp) {
+        Rate_reader *reader = (Rate_reader*)userp;
+        size_t len = std::min(size * nitems, reader->size - reader->pos);
+        if (reader->limiter) len = reader->limiter->Acquire(len);
+        if (len) memcpy(buffer, reader->data + reader->pos, len);
+        reader->pos += len;
+        return len;
+    }
+
+    /// The body is sent again if a reused connection was closed
+    static int Seek(void *userp, curl_off_t offset, int origin) {
+        Rate_reader *reader = (Rate_reader*)userp;
+        if (origin != SEEK_SET || offset < 0 || (size_t)offset > reader->size) return CURL_SEEKFUNC_CANTSEEK;
+        reader->pos = (size_t)offset;
+        return CURL_SEEKFUNC_OK;
+    }
+};
+
+#endif // __RATE_LIMITER_HPP
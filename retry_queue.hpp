@@ -0,0 +1,275 @@
+/*
+    BSD 2-Clause License
+
+    Copyright (c) 2017-2023, Nol Martinon
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+    Durable queue of the uploads that failed for a transient reason (network
+    error, HTTP 408, 429 or 5xx), so that they are sent again later in the run
+    or on the next run instead of parsing the mbox again.
+
+    Each entry is a file of the queue directory holding the encrypted payload
+    as it was posted, with the remote name and the IV. It is written to a
+    temporary name, synced and renamed, so an accepted entry survives a crash.
+    The entries are retried in order. After a failure the queue waits for an
+    exponential delay (RETRY_BACKOFF_MIN to RETRY_BACKOFF_MAX, doubled for
+    each consecutive failure) with jitter. An entry gets RETRY_ATTEMPTS attempts
+    by run before it is left for the next run, and the retries stop after
+    RETRY_ATTEMPTS consecutive failures until an upload succeeds again.
+    The entries are bound to a scope (the server and key they are encrypted
+    for), the ones of other scopes are kept but not returned. The total size
+    of the directory is limited, Add() fails when it is reached.
+    eg:
+        Retry_queue queue;
+        if (!queue.Open("retry/", 256*1024*1024, scope)) std::cerr << queue.GetError();
+        queue.Add("dir/name.eml", iv, ciphertext.data(), ciphertext.size());
+        Retry_entry entry;
+        while (queue.Next(entry, true)) {
+            queue.Read(entry, data);
+            if (Send(entry.name, entry.iv, data)) queue.Remove(entry);
+            else queue.Failed(entry);
+        }
+*/
+
+#ifndef __RETRY_QUEUE_HPP
+#define __RETRY_QUEUE_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <algorithm>      // min
+#include <cstdio>         // rename
+#include "common.hpp"              // ListDirectoryContents(), createPath()
+#include "eml_writer.hpp"          // SyncFile(), SyncDirectory()
+
+#define RETRY_ATTEMPTS 5            // attempts of an entry by run
+#define RETRY_BACKOFF_MIN 1000      // delay in ms after a first failure
+#define RETRY_BACKOFF_MAX 60000     // maximal delay in ms between two attempts
+#define RETRY_SUFFIX ".retry"
+#define RETRY_MAGIC "MBOXZILLA-RETRY 1"
+
+/// Return true if an upload that ended with this HTTP status (0 for a transfer error) may succeed later
+inline bool Retry_IsTransient(long status) {
+    return status == 0 || status == 408 || status == 429 || status >= 500;
+}
+
+struct Retry_entry {
+    unsigned long long seq; // order of the entry, name of its file
+    std::string name;       // remote name of the email
+    std::string iv;         // IV of the payload (base64)
+    size_t size;            // payload size
+    int attempts;           // attempts during this run
+};
+
+class Retry_queue {
+    public:
+        Retry_queue() : maxsize(0), totalsize(0), nextseq(1), nbforeign(0), failures(0),
+                        next(std::chrono::steady_clock::now()), rng(std::random_device()()) {}
+
+        /// Load the entries of the directory (created if needed) for the scope
+        bool Open(const std::string& directory, unsigned long long maxbytes, const std::string& scopeid) {
+            dir = directory;
+            if (!dir.empty() && *dir.rbegin() != '/') dir += "/";
+            maxsize = maxbytes;
+            scope = scopeid;
+            entries.clear();
+            totalsize = 0;
+            nbforeign = 0;
+
+            if (!DirectoryExists(dir) && !createPath(dir)) return Fail("Could not create retry queue directory \""+dir+"\"");
+            std::vector<std::string> vFiles;
+            if (!ListDirectoryContents(vFiles, dir, true, false)) return Fail("Could not list retry queue directory \""+dir+"\"");
+            std::sort(vFiles.begin(), vFiles.end());
+
+            for (const std::string& file : vFiles) {
+                size_t len = file.length(), suffixlen = strlen(RETRY_SUFFIX);
+                // A temporary file is an entry whose write was interrupted
+                if (len > suffixlen+4 && file.compare(len-suffixlen-4, suffixlen+4, RETRY_SUFFIX ".tmp") == 0) {
+                    std::remove((dir + file).c_str());
+                    continue;
+                }
+                if (len <= suffixlen || file.compare(len-suffixlen, suffixlen, RETRY_SUFFIX) != 0) continue;
+
+                Retry_entry entry;
+                std::string entryscope;
+                size_t filesize = 0;
+                entry.seq = strtoull(file.c_str(), NULL, 10);
+                if (entry.seq >= nextseq) nextseq = entry.seq + 1;
+                bool ok = ReadHeader(dir + file, entry, entryscope, filesize);
+                totalsize += filesize;
+                if (ok && entryscope == scope) entries.push_back(entry);
+                else nbforeign++;
+            }
+            return true;
+        }
+
+        /// Add the payload of an email, return false if the queue is full or on write error
+        bool Add(const std::string& name, const std::string& iv, const char *data, size_t size) {
+            if (name.find('\n') != std::string::npos) return Fail("Invalid name for retry queue \""+name+"\"");
+            std::ostringstream header;
+            header << RETRY_MAGIC "\nscope " << scope << "\nname " << name << "\niv " << iv << "\nsize " << size << "\n\n";
+            unsigned long long filesize = header.str().size() + size;
+            if (totalsize + filesize > maxsize) return Fail("Retry queue \""+dir+"\" is full, \""+name+"\" is not queued");
+
+            Retry_entry entry;
+            entry.seq = nextseq++;
+            entry.name = name;
+            entry.iv = iv;
+            entry.size = size;
+            entry.attempts = 0;
+            std::string path = Path(entry), tmppath = path + ".tmp";
+
+            std::ofstream file(tmppath.c_str(), std::ios::binary | std::ios::trunc);
+            file << header.str();
+            file.write(data, size);
+            file.close();
+            if (!file || !SyncFile(tmppath) || std::rename(tmppath.c_str(), path.c_str()) != 0 || !SyncDirectory(dir)) {
+                std::remove(tmppath.c_str());
+                return Fail("Could not write to \""+path+"\" ("+strerror(errno)+")");
+            }
+            totalsize += filesize;
+            entries.push_back(entry);
+            return true;
+        }
+
+        /// Set entry to the next one to send. If the retry delay is not over then return false,
+        /// or wait for it if bWait is true. Return false if no entry has attempts left
+        bool Next(Retry_entry& entry, bool bWait) {
+            if (failures >= RETRY_ATTEMPTS) return false;
+            auto it = std::find_if(entries.begin(), entries.end(), [](const Retry_entry& e) { return e.attempts < RETRY_ATTEMPTS; });
+            if (it == entries.end()) return false;
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (now < next) {
+                if (!bWait) return false;
+                std::this_thread::sleep_for(next - now);
+            }
+            entry = *it;
+            return true;
+        }
+
+        /// Read the payload of an entry
+        bool Read(const Retry_entry& entry, std::string& data) {
+            std::ifstream file(Path(entry).c_str(), std::ios::binary);
+            std::string line;
+            while (std::getline(file, line) && !line.empty()) {}
+            data.resize(entry.size);
+            if (!file || !file.read(&data[0], entry.size))
+                return Fail("Could not read \""+Path(entry)+"\"");
+            return true;
+        }
+
+        /// Remove an entry (sent or failed for good)
+        void Remove(const Retry_entry& entry) {
+            for (auto it = entries.begin(); it != entries.end(); ++it) {
+                if (it->seq != entry.seq) continue;
+                struct stat st;
+                if (stat(Path(entry).c_str(), &st) == 0) totalsize -= std::min(totalsize, (unsigned long long)st.st_size);
+                std::remove(Path(entry).c_str());
+                entries.erase(it);
+                break;
+            }
+            Succeeded();
+        }
+
+        /// An attempt of an entry failed for a transient reason, the next one is delayed
+        void Failed(const Retry_entry& entry) {
+            for (Retry_entry& e : entries)
+                if (e.seq == entry.seq) e.attempts++;
+            failures++;
+            unsigned long long delay = std::min((unsigned long long)RETRY_BACKOFF_MAX,
+                                                (unsigned long long)RETRY_BACKOFF_MIN << std::min(failures-1, 16));
+            // Half of the delay is random so that clients failing together do not retry together
+            delay = delay/2 + std::uniform_int_distribution<unsigned long long>(0, delay/2)(rng);
+            next = std::chrono::steady_clock::now() + std::chrono::milliseconds(delay);
+        }
+
+        /// The server answered again (an upload succeeded), the retries start without delay
+        void Succeeded() {
+            failures = 0;
+            next = std::chrono::steady_clock::now();
+        }
+
+        size_t GetCount() const { return entries.size(); }
+        size_t GetForeignCount() const { return nbforeign; }
+        unsigned long long GetSize() const { return totalsize; }
+        std::string GetError() const { return error; }
+
+    private:
+        std::string dir;
+        std::string scope;
+        unsigned long long maxsize;
+        unsigned long long totalsize; // bytes of all the files of the directory
+        unsigned long long nextseq;
+        size_t nbforeign;             // entries of other scopes or damaged
+        int failures;                 // consecutive failed attempts
+        std::chrono::steady_clock::time_point next;
+        std::mt19937 rng;
+        std::deque<Retry_entry> entries;
+        std::string error;
+
+        Retry_queue(const Retry_queue&);
+        Retry_queue& operator=(const Retry_queue&);
+
+        bool Fail(const std::string& message) {
+            error = message;
+            return false;
+        }
+
+        std::string Path(const Retry_entry& entry) const {
+            char name[32];
+            snprintf(name, sizeof(name), "%020llu", entry.seq);
+            return dir + name + RETRY_SUFFIX;
+        }
+
+        /// Read the header of an entry file, return false if it is damaged
+        static bool ReadHeader(const std::string& path, Retry_entry& entry, std::string& entryscope, size_t& filesize) {
+            std::ifstream file(path.c_str(), std::ios::binary | std::ios::ate);
+            if (!file) return false;
+            filesize = (size_t)file.tellg();
+            file.seekg(0);
+
+            std::string line;
+            if (!std::getline(file, line) || line != RETRY_MAGIC) return false;
+            entry.size = (size_t)-1;
+            entry.attempts = 0;
+            while (std::getline(file, line) && !line.empty()) {
+                size_t space = line.find(' ');
+                std::string key = line.substr(0, space), value = (space == std::string::npos) ? "" : line.substr(space+1);
+                if (key == "scope") entryscope = value;
+                else if (key == "name") entry.name = value;
+                else if (key == "iv") entry.iv = value;
+                else if (key == "size") entry.size = strtoull(value.c_str(), NULL, 10);
+            }
+            return file && !entry.name.empty() && (size_t)file.tellg() + entry.size == filesize;
+        }
+};
+
+#endif // __RETRY_QUEUE_HPP
@@ -0,0 +1,650 @@
+/*
+    BSD 2-Clause License
+
+    Copyright (c) 2017-2023, Nol Martinon
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+    Upload of eml files to an S3 compatible object storage.
+
+    The requests are signed with AWS Signature Version 4 and sent with path-style
+    addresses ("http(s)://host[:port]/bucket/key"), so any S3 compatible server
+    can be used (eg: a local MinIO). The parse thread hands over each object with
+    Submit() and goes on while a pool of S3_UPLOAD_THREADS threads uploads them,
+    each thread with its own connection kept alive between requests. Objects of
+    S3_MULTIPART_THRESHOLD bytes or more are sent by multipart upload whose parts
+    are spread over the threads. The result of each object is given back by
+    Collect().
+    The objects already stored are listed once with ListObjectsV2 by List().
+    eg:
+        S3_config config;
+        config.Parse("http://127.0.0.1:9000/backup/mails");
+        config.accesskey = "key"; config.secretkey = "secret";
+        S3_uploader uploader(config);
+        uploader.List("Inbox/", names, error);
+        uploader.Submit("Inbox/20170101000000_MD5.eml", vdata, headers); // vdata is taken
+        uploader.Flush();
+        uploader.Collect(vResults);
+*/
+
+#ifndef __S3_UPLOADER_HPP
+#define __S3_UPLOADER_HPP
+
+#include <map>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <unordered_set>
+#include <algorithm>      // min, max, transform
+#include <cstring>        // strlen
+#include <cctype>         // isalnum, tolower
+#include <time.h>
+#include <curl/curl.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include "rate_limiter.hpp"
+#include "upload_window.hpp"
+
+#define S3_UPLOAD_THREADS 8                      // default number of concurrent uploads
+#define S3_UPLOAD_MAXPENDING (64*1024*1024)      // bytes waiting for upload before Submit() blocks
+#define S3_MULTIPART_THRESHOLD (8*1024*1024)     // objects from this size are sent by multipart upload
+#define S3_MULTIPART_PARTSIZE (8*1024*1024)      // size of the parts, 5 MB at least for S3
+#define S3_OVERLOAD_RETRIES 3                    // attempts again of a request refused by an overloaded server (adaptive window)
+
+/// Headers of a request, names in lower case (eg: "content-type", "x-amz-meta-*")
+typedef std::map<std::string, std::string> S3_headers;
+
+/// Location and credentials of the storage
+struct S3_config {
+    std::string endpoint;   // "http(s)://host[:port]"
+    std::string host;       // "host[:port]" as signed
+    std::string bucket;
+    std::string prefix;     // prefix of all the keys, empty or ending with '/'
+    std::string region;
+    std::string accesskey;
+    std::string secretkey;
+    long timeout;           // seconds allowed to each request, 0 is unlimited
+    Rate_limiter *limiter;  // bandwidth shared with the other uploads, NULL is unlimited
+
+    S3_config() : region("us-east-1"), timeout(600), limiter(NULL) {}
+
+    /// Set endpoint, bucket and prefix from "http(s)://host[:port]/bucket[/prefix]"
+    bool Parse(const std::string& url) {
+        size_t pos = url.find("://");
+        if (pos == std::string::npos || (url.compare(0, pos, "http") != 0 && url.compare(0, pos, "https") != 0))
+            return false;
+        size_t slash = url.find('/', pos+3);
+        if (slash == std::string::npos || slash == pos+3) return false;
+        endpoint = url.substr(0, slash);
+        host = url.substr(pos+3, slash-pos-3);
+        std::string path = url.substr(slash+1);
+        size_t end = path.find('/');
+        bucket = path.substr(0, end);
+        prefix = (end == std::string::npos) ? "" : path.substr(end+1);
+        while (!prefix.empty() && prefix[0] == '/') prefix.erase(0, 1);
+        if (!prefix.empty() && *prefix.rbegin() != '/') prefix += '/';
+        return !bucket.empty();
+    }
+};
+
+/// Result of an uploaded object
+struct S3_upload_result {
+    std::string key;
+    bool ok;
+    std::string error;  // error message, empty if ok
+    size_t size;
+    S3_upload_result(const std::string& k, bool b, const std::string& e, size_t s) : key(k), ok(b), error(e), size(s) {}
+};
+
+/// Key of an object from a local path (relative, without "./")
+inline std::string S3_ObjectKey(const std::string& path) {
+    std::string key = path;
+    while (true) {
+        if (!key.empty() && key[0] == '/') key.erase(0, 1);
+        else if (key.compare(0, 2, "./") == 0) key.erase(0, 2);
+        else break;
+    }
+    return key;
+}
+
+inline std::string S3_Hex(const unsigned char *data, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(len*2, '0');
+    for (size_t i = 0; i < len; i++) {
+        hex[2*i] = digits[data[i] >> 4];
+        hex[2*i+1] = digits[data[i] & 0x0f];
+    }
+    return hex;
+}
+
+inline std::string S3_Sha256Hex(const char *data, size_t len) {
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int hashlen = 0;
+    EVP_Digest(data ? data : "", len, hash, &hashlen, EVP_sha256(), NULL);
+    return S3_Hex(hash, hashlen);
+}
+
+inline std::string S3_Hmac(const std::string& key, const std::string& msg) {
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned int maclen = 0;
+    HMAC(EVP_sha256(), key.data(), (int)key.size(), (const unsigned char*)msg.data(), msg.size(), mac, &maclen);
+    return std::string((char*)mac, maclen);
+}
+
+/// URI encoding of SigV4 : all but unreserved characters, '/' is kept if !bSlash
+inline std::string S3_UriEncode(const std::string& value, bool bSlash) {
+    static const char digits[] = "0123456789ABCDEF";
+    std::string encoded;
+    encoded.reserve(value.size()*3/2);
+    for (unsigned char c : value) {
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || (c == '/' && !bSlash)) encoded += (char)c;
+        else {
+            encoded += '%';
+            encoded += digits[c >> 4];
+            encoded += digits[c & 0x0f];
+        }
+    }
+    return encoded;
+}
+
+/// Values of the elements 'tag' of an XML response, with the predefined entities decoded
+inline void S3_XmlValues(const std::string& xml, const std::string& tag, std::vector<std::string>& vValues) {
+    static const char *entities[][2] = {{"&lt;", "<"}, {"&gt;", ">"}, {"&quot;", "\""}, {"&apos;", "'"}, {"&amp;", "&"}};
+    std::string open = "<" + tag + ">", close = "</" + tag + ">";
+    size_t pos = 0;
+    while ((pos = xml.find(open, pos)) != std::string::npos) {
+        pos += open.length();
+        size_t end = xml.find(close, pos);
+        if (end == std::string::npos) break;
+        std::string value = xml.substr(pos, end-pos);
+        for (auto& entity : entities) {
+            size_t p = 0;
+            while ((p = value.find(entity[0], p)) != std::string::npos) {
+                value.replace(p, strlen(entity[0]), entity[1]);
+                p++;
+            }
+        }
+        vValues.push_back(value);
+        pos = end + close.length();
+    }
+}
+
+inline std::string S3_XmlValue(const std::string& xml, const std::string& tag) {
+    std::vector<std::string> vValues;
+    S3_XmlValues(xml, tag, vValues);
+    return vValues.empty() ? "" : vValues[0];
+}
+
+/// Signed requests to the storage over one connection, for one thread
+/**
+ * The functions return false on error, the message is given by GetError().
+ */
+class S3_client {
+    public:
+        S3_client(const S3_config& cfg) : config(cfg), curl(NULL), nboverloaded(0) {}
+        ~S3_client() { if (curl) curl_easy_cleanup(curl); }
+
+        std::string GetError() { return error; }
+
+        /// Number of requests that timed out or got HTTP 429 or 5xx
+        unsigned long GetOverloaded() { return nboverloaded; }
+
+        bool PutObject(const std::string& key, const char *data, size_t len, const S3_headers& headers) {
+            std::string response;
+            return Request("PUT", key, Query(), headers, data, len, response);
+        }
+
+        bool CreateMultipart(const std::string& key, const S3_headers& headers, std::string& uploadid) {
+            std::string response;
+            Query query;
+            query["uploads"] = "";
+            if (!Request("POST", key, query, headers, NULL, 0, response)) return false;
+            uploadid = S3_XmlValue(response, "UploadId");
+            if (uploadid.empty()) return Fail("No upload id for \""+key+"\"");
+            return true;
+        }
+
+        bool UploadPart(const std::string& key, const std::string& uploadid, int partnumber, const char *data, size_t len, std::string& etag) {
+            std::string response;
+            Query query;
+            query["partNumber"] = std::to_string(partnumber);
+            query["uploadId"] = uploadid;
+            if (!Request("PUT", key, query, S3_headers(), data, len, response, &etag)) return false;
+            if (etag.empty()) return Fail("No ETag for part "+std::to_string(partnumber)+" of \""+key+"\"");
+            return true;
+        }
+
+        bool CompleteMultipart(const std::string& key, const std::string& uploadid, const std::vector<std::string>& vEtags) {
+            std::string body = "<CompleteMultipartUpload>";
+            for (size_t i = 0; i < vEtags.size(); i++)
+                body += "<Part><PartNumber>"+std::to_string(i+1)+"</PartNumber><ETag>"+vEtags[i]+"</ETag></Part>";
+            body += "</CompleteMultipartUpload>";
+            std::string response;
+            Query query;
+            query["uploadId"] = uploadid;
+            S3_headers headers;
+            headers["content-type"] = "application/xml";
+            if (!Request("POST", key, query, headers, body.data(), body.size(), response)) return false;
+            // The completion can fail after a "200 OK" has been sent
+            if (response.find("<Error>") != std::string::npos) return Fail(ResponseError(key, 200, response));
+            return true;
+        }
+
+        bool AbortMultipart(const std::string& key, const std::string& uploadid) {
+            std::string response;
+            Query query;
+            query["uploadId"] = uploadid;
+            return Request("DELETE", key, query, S3_headers(), NULL, 0, response);
+        }
+
+        /// Add to sNames the keys starting with 'prefix', without it
+        bool ListObjects(const std::string& prefix, std::unordered_set<std::string>& sNames) {
+            std::string token;
+            do {
+                std::string response;
+                Query query;
+                query["list-type"] = "2";
+                query["prefix"] = config.prefix + prefix;
+                if (!token.empty()) query["continuation-token"] = token;
+                if (!Request("GET", "", query, S3_headers(), NULL, 0, response)) return false;
+
+                std::vector<std::string> vKeys;
+                S3_XmlValues(response, "Key", vKeys);
+                size_t len = config.prefix.length() + prefix.length();
+                for (const std::string& key : vKeys) {
+                    if (key.length() > len) sNames.insert(key.substr(len));
+                }
+                token = (S3_XmlValue(response, "IsTruncated") == "true") ? S3_XmlValue(response, "NextContinuationToken") : "";
+            } while (!token.empty());
+            return true;
+        }
+
+    private:
+        typedef std::map<std::string, std::string> Query; // sorted as required by the signature
+
+        S3_config config;
+        CURL *curl;             // kept between the requests to reuse the connection
+        std::string error;
+        unsigned long nboverloaded;
+        std::string signdate;   // day of the signing key
+        std::string signkey;
+
+        S3_client(const S3_client&);
+        S3_client& operator=(const S3_client&);
+
+        bool Fail(const std::string& message) {
+            error = message;
+            return false;
+        }
+
+        static size_t WriteBody(void *buffer, size_t size, size_t nmemb, void *userp) {
+            ((std::string*)userp)->append((char*)buffer, size*nmemb);
+            return size*nmemb;
+        }
+
+        static size_t WriteHeader(char *buffer, size_t size, size_t nmemb, void *userp) {
+            std::string line(buffer, size*nmemb);
+            std::string name = line.substr(0, 5);
+            std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+            if (name == "etag:") {
+                size_t start = line.find_first_not_of(" \t", 5);
+                size_t end = line.find_last_not_of(" \t\r\n");
+                if (start != std::string::npos && end != std::string::npos && end >= start)
+                    *(std::string*)userp = line.substr(start, end-start+1);
+            }
+            return size*nmemb;
+        }
+
+        static std::string ResponseError(const std::string& key, long code, const std::string& response) {
+            std::string message = "HTTP " + std::to_string(code);
+            std::string s3code = S3_XmlValue(response, "Code"), s3message = S3_XmlValue(response, "Message");
+            if (!s3code.empty()) message += " " + s3code;
+            if (!s3message.empty()) message += " (" + s3message + ")";
+            return "Request on \""+key+"\" failed : "+message;
+        }
+
+        /// Authorization header of AWS Signature Version 4
+        std::string Authorization(const std::string& method, const std::string& uri, const std::string& query,
+                                  const S3_headers& headers, const std::string& payloadhash, const std::string& amzdate) {
+            std::string canonical = method + "\n" + uri + "\n" + query + "\n";
+            std::string signedheaders;
+            for (auto& header : headers) {
+                canonical += header.first + ":" + header.second + "\n";
+                signedheaders += (signedheaders.empty() ? "" : ";") + header.first;
+            }
+            canonical += "\n" + signedheaders + "\n" + payloadhash;
+
+            std::string date = amzdate.substr(0, 8);
+            std::string scope = date + "/" + config.region + "/s3/aws4_request";
+            std::string tosign = "AWS4-HMAC-SHA256\n" + amzdate + "\n" + scope + "\n" + S3_Sha256Hex(canonical.data(), canonical.size());
+            if (signdate != date) {
+                signkey = S3_Hmac(S3_Hmac(S3_Hmac(S3_Hmac("AWS4" + config.secretkey, date), config.region), "s3"), "aws4_request");
+                signdate = date;
+            }
+            std::string signature = S3_Hmac(signkey, tosign);
+            return "AWS4-HMAC-SHA256 Credential=" + config.accesskey + "/" + scope + ", SignedHeaders=" + signedheaders
+                   + ", Signature=" + S3_Hex((const unsigned char*)signature.data(), signature.size());
+        }
+
+        /// Send a signed request on 'key' (the bucket if empty), the body of the answer is set to 'response'
+        bool Request(const std::string& method, const std::string& key, const Query& query, const S3_headers& extra,
+                     const char *data, size_t len, std::string& response, std::string *etag = NULL) {
+            std::string uri = "/" + S3_UriEncode(config.bucket, true);
+            if (!key.empty()) uri += "/" + S3_UriEncode(config.prefix + key, false);
+            std::string querystring;
+            for (auto& param : query)
+                querystring += (querystring.empty() ? "" : "&") + S3_UriEncode(param.first, true) + "=" + S3_UriEncode(param.second, true);
+
+            char amzdate[17];
+            time_t now = time(NULL);
+            struct tm tmnow;
+            #ifdef _WIN32
+                gmtime_s(&tmnow, &now);
+            #else
+                gmtime_r(&now, &tmnow);
+            #endif
+            strftime(amzdate, sizeof(amzdate), "%Y%m%dT%H%M%SZ", &tmnow);
+
+            S3_headers headers = extra;
+            headers["host"] = config.host;
+            headers["x-amz-content-sha256"] = S3_Sha256Hex(data, len);
+            headers["x-amz-date"] = amzdate;
+
+            struct curl_slist *headerlist = NULL;
+            for (auto& header : headers) headerlist = curl_slist_append(headerlist, (header.first + ": " + header.second).c_str());
+            headerlist = curl_slist_append(headerlist, ("Authorization: " + Authorization(method, uri, querystring, headers, headers["x-amz-content-sha256"], amzdate)).c_str());
+            if (!headers.count("content-type")) headerlist = curl_slist_append(headerlist, "Content-Type:");
+            headerlist = curl_slist_append(headerlist, "Expect:");
+
+            if (!curl) curl = curl_easy_init();
+            else curl_easy_reset(curl); // the connection stays open
+            if (!curl) {
+                curl_slist_free_all(headerlist);
+                return Fail("curl_easy_init() failed");
+            }
+
+            std::string url = config.endpoint + uri + (querystring.empty() ? "" : "?" + querystring);
+            char errbuf[CURL_ERROR_SIZE] = "";
+            std::string etagvalue;
+            curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headerlist);
+            curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L); // required by threads
+            curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errbuf);
+            curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteBody);
+            curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+            curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, WriteHeader);
+            curl_easy_setopt(curl, CURLOPT_HEADERDATA, &etagvalue);
+            curl_easy_setopt(curl, CURLOPT_TIMEOUT, config.timeout);
+            curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30L);
+            Rate_reader reader(data ? data : "", len, config.limiter);
+            if (method == "GET") curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+            else {
+                curl_easy_setopt(curl, CURLOPT_POST, 1L);
+                curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, method.c_str());
+                curl_easy_setopt(curl, CURLOPT_READFUNCTION, Rate_reader::Read);
+                curl_easy_setopt(curl, CURLOPT_READDATA, &reader);
+                curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, Rate_reader::Seek);
+                curl_easy_setopt(curl, CURLOPT_SEEKDATA, &reader);
+                curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)len);
+            }
+
+            CURLcode res = curl_easy_perform(curl);
+            long code = 0;
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+            curl_slist_free_all(headerlist);
+            if (res == CURLE_OPERATION_TIMEDOUT || (res == CURLE_OK && (code == 429 || code >= 500))) nboverloaded++;
+
+            if (res != CURLE_OK) return Fail("Request on \""+(key.empty() ? config.bucket : key)+"\" failed : "+(*errbuf ? errbuf : curl_easy_strerror(res)));
+            if (code < 200 || code > 299) return Fail(ResponseError(key.empty() ? config.bucket : key, code, response));
+            if (etag) *etag = etagvalue;
+            return true;
+        }
+};
+
+/// Parallel upload of objects
+/**
+ * Submit() blocks while more than S3_UPLOAD_MAXPENDING bytes are waiting.
+ * The destructor waits for the objects already submitted.
+ * If bAdaptive is true then the requests running at the same time are bounded
+ * by an Upload_window whose ceiling is the number of threads, and a request
+ * refused by an overloaded server is queued again.
+ */
+class S3_uploader {
+    public:
+        S3_uploader(const S3_config& cfg, unsigned int nbthreads = S3_UPLOAD_THREADS, bool bAdaptive = false)
+            : config(cfg), lister(cfg), bWindow(bAdaptive) {
+            bStop = false;
+            pendingbytes = 0;
+            pendingobjects = 0;
+            curl_global_init(CURL_GLOBAL_ALL); // before any thread
+            nbthreads = std::max(1u, std::min(nbthreads, 64u));
+            window = Upload_window(nbthreads, cfg.timeout);
+            for (unsigned int i = 0; i < nbthreads; i++)
+                workers.push_back(std::thread(&S3_uploader::Worker, this));
+        }
+
+        ~S3_uploader() {
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                bStop = true;
+            }
+            cvJobs.notify_all();
+            for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+        }
+
+        size_t GetThreads() { return workers.size(); }
+
+        /// Bytes of the objects submitted and not uploaded yet
+        size_t GetPendingBytes() {
+            std::unique_lock<std::mutex> lock(mtx);
+            return pendingbytes;
+        }
+
+        /// State of the upload window (if adaptive), its decisions since the last call are moved to vDecisions
+        Upload_window GetWindow(std::vector<std::string>& vDecisions) {
+            std::unique_lock<std::mutex> lock(mtx);
+            window.Collect(vDecisions);
+            return window;
+        }
+
+        /// Add to sNames the objects under 'prefix', named relatively to it, from the calling thread
+        bool List(const std::string& prefix, std::unordered_set<std::string>& sNames, std::string& error) {
+            if (lister.ListObjects(prefix, sNames)) return true;
+            error = lister.GetError();
+            return false;
+        }
+
+        /// Queue an object to upload, the content of 'data' is taken (data is emptied)
+        void Submit(const std::string& key, std::vector<char>& data, const S3_headers& headers) {
+            std::shared_ptr<Object> obj(new Object());
+            obj->key = key;
+            obj->headers = headers;
+            obj->data.swap(data);
+
+            std::unique_lock<std::mutex> lock(mtx);
+            cvDone.wait(lock, [this]{ return pendingbytes <= S3_UPLOAD_MAXPENDING; });
+            jobs.push_back(Job(obj, 0));
+            pendingobjects++;
+            pendingbytes += obj->data.size();
+            lock.unlock();
+            cvJobs.notify_one();
+        }
+
+        /// Wait for all submitted objects to be uploaded
+        void Flush() {
+            std::unique_lock<std::mutex> lock(mtx);
+            cvDone.wait(lock, [this]{ return pendingobjects == 0; });
+        }
+
+        /// Move the results of the uploaded objects to vResults, return their number
+        size_t Collect(std::vector<S3_upload_result>& vResults) {
+            std::unique_lock<std::mutex> lock(mtx);
+            size_t n = results.size();
+            vResults.insert(vResults.end(), results.begin(), results.end());
+            results.clear();
+            return n;
+        }
+
+    private:
+        /// Object being uploaded, shared by the jobs of its parts
+        struct Object {
+            std::string key;
+            S3_headers headers;
+            std::vector<char> data;
+            std::string uploadid;             // multipart upload only
+            std::vector<std::string> etags;   // of the parts, by part number - 1
+            size_t partsleft;
+            std::string error;                // first error, empty if none
+            Object() : partsleft(0) {}
+        };
+
+        /// Whole object (part 0) or part of a multipart upload
+        struct Job {
+            std::shared_ptr<Object> obj;
+            int part;
+            int attempts;
+            Job(const std::shared_ptr<Object>& o, int p, int a = 0) : obj(o), part(p), attempts(a) {}
+        };
+
+        S3_config config;
+        S3_client lister;
+        std::mutex mtx;
+        std::condition_variable cvJobs, cvDone;
+        std::deque<Job> jobs;
+        std::vector<S3_upload_result> results;
+        std::vector<std::thread> workers;
+        size_t pendingbytes;
+        size_t pendingobjects;
+        bool bStop;
+        bool bWindow;           // adaptive number of requests
+        Upload_window window;
+
+        S3_uploader(const S3_uploader&);
+        S3_uploader& operator=(const S3_uploader&);
+
+        void Worker() {
+            S3_client client(config);
+            while (true) {
+                std::unique_lock<std::mutex> lock(mtx);
+                cvJobs.wait(lock, [this]{ return (bStop && jobs.empty()) || (!jobs.empty() && (!bWindow || window.CanStart())); });
+                if (jobs.empty()) break;
+                Job job = jobs.front();
+                jobs.pop_front();
+                unsigned long long ticket = bWindow ? window.Start() : 0;
+                lock.unlock();
+
+                auto start = std::chrono::steady_clock::now();
+                unsigned long overloaded = client.GetOverloaded();
+                size_t bytes = (job.part == 0) ? Upload(client, job) : UploadPart(client, job);
+                if (!bWindow) continue;
+
+                lock.lock();
+                window.Finished(ticket, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(),
+                                bytes, client.GetOverloaded() != overloaded);
+                lock.unlock();
+                cvJobs.notify_all();
+            }
+        }
+
+        /// Queue again a job whose request was refused by an overloaded server, return false if it is not retried
+        bool Requeue(S3_client& client, const Job& job, unsigned long overloaded) {
+            if (!bWindow || client.GetOverloaded() == overloaded || job.attempts >= S3_OVERLOAD_RETRIES) return false;
+            std::unique_lock<std::mutex> lock(mtx);
+            jobs.push_back(Job(job.obj, job.part, job.attempts+1));
+            return true;
+        }
+
+        /// Upload an object, or start its multipart upload, return the bytes sent
+        size_t Upload(S3_client& client, const Job& job) {
+            const std::shared_ptr<Object>& obj = job.obj;
+            size_t size = obj->data.size();
+            unsigned long overloaded = client.GetOverloaded();
+            if (size < S3_MULTIPART_THRESHOLD) {
+                bool ok = client.PutObject(obj->key, obj->data.data(), size, obj->headers);
+                if (!ok && Requeue(client, job, overloaded)) return size;
+                Done(obj, ok ? "" : client.GetError());
+                return size;
+            }
+
+            std::string uploadid;
+            if (!client.CreateMultipart(obj->key, obj->headers, uploadid)) {
+                if (!Requeue(client, job, overloaded)) Done(obj, client.GetError());
+                return 0;
+            }
+            // The parts are taken next by all the threads
+            size_t nbparts = (size + S3_MULTIPART_PARTSIZE - 1) / S3_MULTIPART_PARTSIZE;
+            std::unique_lock<std::mutex> lock(mtx);
+            obj->uploadid = uploadid;
+            obj->etags.resize(nbparts);
+            obj->partsleft = nbparts;
+            for (size_t part = nbparts; part >= 1; part--) jobs.push_front(Job(obj, (int)part));
+            lock.unlock();
+            cvJobs.notify_all();
+            return 0;
+        }
+
+        /// Upload a part of a multipart upload, and complete it if it is the last one, return the bytes sent
+        size_t UploadPart(S3_client& client, const Job& job) {
+            const std::shared_ptr<Object>& obj = job.obj;
+            int part = job.part;
+            size_t offset = (size_t)(part-1) * S3_MULTIPART_PARTSIZE;
+            size_t len = std::min((size_t)S3_MULTIPART_PARTSIZE, obj->data.size() - offset);
+            std::string etag;
+            unsigned long overloaded = client.GetOverloaded();
+            bool ok = client.UploadPart(obj->key, obj->uploadid, part, obj->data.data() + offset, len, etag);
+            if (!ok && Requeue(client, job, overloaded)) return len;
+
+            // The thread of the last part completes the upload
+            std::unique_lock<std::mutex> lock(mtx);
+            if (ok) obj->etags[part-1] = etag;
+            else if (obj->error.empty()) obj->error = client.GetError();
+            if (--obj->partsleft) return len;
+            std::string error = obj->error;
+            lock.unlock();
+
+            if (error.empty() && !client.CompleteMultipart(obj->key, obj->uploadid, obj->etags)) error = client.GetError();
+            if (!error.empty()) client.AbortMultipart(obj->key, obj->uploadid);
+            Done(obj, error);
+            return len;
+        }
+
+        void Done(const std::shared_ptr<Object>& obj, const std::string& error) {
+            size_t size = obj->data.size();
+            std::vector<char>().swap(obj->data);
+            std::unique_lock<std::mutex> lock(mtx);
+            results.push_back(S3_upload_result(obj->key, error.empty(), error, size));
+            pendingbytes -= size;
+            pendingobjects--;
+            lock.unlock();
+            cvDone.notify_all();
+        }
+};
+
+#endif // __S3_UPLOADER_HPP
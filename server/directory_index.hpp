@@ -0,0 +1,231 @@
+/*
+    BSD 2-Clause License
+
+    Copyright (c) 2017-2023, Nol Martinon
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+    In-memory index of the files and sub-directories of a directory tree.
+
+    A directory is read once (readdir) the first time it is used, then the index
+    is kept up to date with the changes done through it, so that listing a
+    directory or checking a file does not read the disk again. The changes done
+    by other programs are detected with the modification time of the directory,
+    checked when no change of it is in progress through the index.
+    The paths are relative to the root, the ones of directories end with '/'
+    ("" is the root). All the functions are thread safe.
+    eg:
+        Directory_index index("backup/");
+        std::vector<std::string> vFiles;
+        index.GetFiles("user/Inbox/", vFiles);
+        if (index.Reserve("user/Inbox/", "20170101000000_MD5.eml")) {
+            bool bCreated = ...; // write "backup/user/Inbox/20170101000000_MD5.eml"
+            index.Release("user/Inbox/", "20170101000000_MD5.eml", bCreated);
+        }
+*/
+
+#ifndef __DIRECTORY_INDEX_HPP
+#define __DIRECTORY_INDEX_HPP
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include <cstring>       // strcmp
+#include <dirent.h>      // opendir
+#include <sys/stat.h>
+
+class Directory_index {
+    public:
+        Directory_index(const std::string& rootpath) : root(rootpath) {
+            if (!root.empty() && *root.rbegin() != '/') root += "/";
+        }
+
+        /// Return true if 'dir' is a directory
+        bool IsDirectory(const std::string& dir) {
+            std::unique_lock<std::mutex> lock(mtx);
+            return Get(dir) != NULL;
+        }
+
+        /// Return true if the file 'name' of 'dir' exists (file or directory)
+        bool Exists(const std::string& dir, const std::string& name) {
+            std::unique_lock<std::mutex> lock(mtx);
+            Node *node = Get(dir);
+            return node && (node->files.count(name) || node->subdirs.count(name));
+        }
+
+        /// Set vFiles to the sorted names of the files of 'dir', return false if it is not a directory
+        bool GetFiles(const std::string& dir, std::vector<std::string>& vFiles) {
+            std::unique_lock<std::mutex> lock(mtx);
+            Node *node = Get(dir);
+            if (!node) return false;
+            vFiles.assign(node->files.begin(), node->files.end());
+            return true;
+        }
+
+        /// Set vDirs to the sorted names of the sub-directories of 'dir', return false if it is not a directory
+        bool GetSubdirs(const std::string& dir, std::vector<std::string>& vDirs) {
+            std::unique_lock<std::mutex> lock(mtx);
+            Node *node = Get(dir);
+            if (!node) return false;
+            vDirs.assign(node->subdirs.begin(), node->subdirs.end());
+            return true;
+        }
+
+        /// Reserve the file 'name' of 'dir' to create it, return false if it exists or is already reserved
+        bool Reserve(const std::string& dir, const std::string& name) {
+            std::unique_lock<std::mutex> lock(mtx);
+            Node *node = Get(dir);
+            if (node && (node->files.count(name) || node->subdirs.count(name))) return false;
+            if (!reserved.insert(dir + name).second) return false;
+            pending[dir]++;
+            return true;
+        }
+
+        /// End the reservation of the file 'name' of 'dir', bCreated tells if it was created (with 'dir' if missing)
+        void Release(const std::string& dir, const std::string& name, bool bCreated) {
+            std::unique_lock<std::mutex> lock(mtx);
+            reserved.erase(dir + name);
+            if (bCreated) {
+                // The missing directories of the path may have been created too
+                size_t pos = 0, next;
+                while ((next = dir.find('/', pos)) != std::string::npos) {
+                    auto it = nodes.find(dir.substr(0, pos));
+                    if (it != nodes.end() && it->second.subdirs.insert(dir.substr(pos, next-pos)).second) Touched(dir.substr(0, pos));
+                    pos = next + 1;
+                }
+                auto it = nodes.find(dir);
+                if (it != nodes.end()) it->second.files.insert(name);
+            }
+            if (--pending[dir] == 0) pending.erase(dir);
+            Touched(dir);
+        }
+
+        /// Start changes of 'dir' (removals) through the index, End() must follow
+        void Begin(const std::string& dir) {
+            std::unique_lock<std::mutex> lock(mtx);
+            pending[dir]++;
+        }
+
+        void End(const std::string& dir) {
+            std::unique_lock<std::mutex> lock(mtx);
+            if (--pending[dir] == 0) pending.erase(dir);
+            Touched(dir);
+        }
+
+        /// The file 'name' of 'dir' was removed
+        void RemoveFile(const std::string& dir, const std::string& name) {
+            std::unique_lock<std::mutex> lock(mtx);
+            auto it = nodes.find(dir);
+            if (it != nodes.end()) it->second.files.erase(name);
+        }
+
+        /// The directory 'dir' was removed with its content
+        void RemoveDirectory(const std::string& dir) {
+            std::unique_lock<std::mutex> lock(mtx);
+            for (auto it = nodes.begin(); it != nodes.end(); ) {
+                if (it->first.compare(0, dir.length(), dir) == 0) it = nodes.erase(it);
+                else ++it;
+            }
+            size_t pos = dir.rfind('/', dir.length() >= 2 ? dir.length()-2 : 0);
+            std::string parent = (pos == std::string::npos || dir.length() < 2) ? "" : dir.substr(0, pos+1);
+            auto it = nodes.find(parent);
+            if (it != nodes.end()) {
+                it->second.subdirs.erase(dir.substr(parent.length(), dir.length()-parent.length()-1));
+                Touched(parent);
+            }
+        }
+
+    private:
+        struct Node {
+            struct timespec mtime;
+            std::set<std::string> files;
+            std::set<std::string> subdirs;
+        };
+
+        std::string root;
+        std::mutex mtx;
+        std::unordered_map<std::string, Node> nodes;
+        std::unordered_map<std::string, int> pending; // changes in progress by directory
+        std::unordered_set<std::string> reserved;     // files being created
+
+        Directory_index(const Directory_index&);
+        Directory_index& operator=(const Directory_index&);
+
+        /// Node of 'dir' read again from the disk if it was changed by another program, NULL if it is not a directory
+        Node *Get(const std::string& dir) {
+            auto it = nodes.find(dir);
+            if (it != nodes.end() && pending.count(dir)) return &it->second;
+
+            struct stat st;
+            if (stat((root + dir).c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+                if (it != nodes.end()) nodes.erase(it);
+                return NULL;
+            }
+            if (it != nodes.end() && it->second.mtime.tv_sec == st.st_mtim.tv_sec && it->second.mtime.tv_nsec == st.st_mtim.tv_nsec)
+                return &it->second;
+
+            Node& node = nodes[dir];
+            node.mtime = st.st_mtim;
+            node.files.clear();
+            node.subdirs.clear();
+            DIR *dp = opendir((root + dir).c_str());
+            if (!dp) {
+                nodes.erase(dir);
+                return NULL;
+            }
+            struct dirent *entry;
+            while ((entry = readdir(dp)) != NULL) {
+                if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+                bool bDir = entry->d_type == DT_DIR;
+                bool bFile = entry->d_type == DT_REG;
+                if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+                    struct stat stentry;
+                    if (stat((root + dir + entry->d_name).c_str(), &stentry) == 0) {
+                        bDir = S_ISDIR(stentry.st_mode);
+                        bFile = S_ISREG(stentry.st_mode);
+                    }
+                }
+                if (bDir) node.subdirs.insert(entry->d_name);
+                else if (bFile) node.files.insert(entry->d_name);
+            }
+            closedir(dp);
+            return &node;
+        }
+
+        /// The index of 'dir' is up to date with the disk after a change through it
+        void Touched(const std::string& dir) {
+            auto it = nodes.find(dir);
+            if (it == nodes.end() || pending.count(dir)) return;
+            struct stat st;
+            if (stat((root + dir).c_str(), &st) == 0) it->second.mtime = st.st_mtim;
+            else nodes.erase(it);
+        }
+};
+
+#endif // __DIRECTORY_INDEX_HPP
@@ -0,0 +1,635 @@
+/*
+    BSD 2-Clause License
+
+    Copyright (c) 2017-2023, Nol Martinon
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+    Event-driven HTTP/1.1 server for Linux (epoll).
+
+    One thread accepts the connections and reads and writes all the sockets
+    without blocking (edge-triggered epoll). Each complete request is handed to
+    a pool of worker threads that run the handler (decryption, disk writes...)
+    and its response goes back to the I/O thread through an eventfd. So a slow
+    client never holds a worker and the workers never wait for the network.
+    A request body is read in memory (Content-Length, up to a maximum size),
+    'Expect: 100-continue' and keep-alive connections are supported.
+    eg:
+        Http_server server([](Http_request& request, Http_response& response) {
+            response.body = "Hello";
+        }, 4);
+        if (!server.Listen("0.0.0.0", 8080)) std::cerr << server.GetError();
+        server.Run(); // until Stop()
+*/
+
+#ifndef __HTTP_SERVER_HPP
+#define __HTTP_SERVER_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <unordered_map>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <algorithm>     // transform
+#include <cstring>       // strerror
+#include <cstdlib>       // strtoull
+#include <ctime>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define HTTP_MAXHEADERSIZE (64*1024) // bytes of the request line and headers
+#define HTTP_READBUFFER (256*1024)
+
+/// Received request, the names of the headers are in lower case
+struct Http_request {
+    std::string method;
+    std::string target;
+    std::string version;
+    std::map<std::string, std::string> headers;
+    std::string body;
+    std::string peer;   // address of the client
+    time_t start;       // time of the first byte of the request
+
+    std::string Header(const std::string& name) const {
+        auto it = headers.find(name);
+        return it == headers.end() ? "" : it->second;
+    }
+};
+
+/// Response of the handler
+struct Http_response {
+    int status;
+    std::string contenttype;
+    std::string body;
+    Http_response() : status(200), contenttype("text/html; charset=UTF-8") {}
+};
+
+typedef std::function<void(Http_request&, Http_response&)> Http_handler;
+
+/// Fields and files of a form (multipart/form-data or application/x-www-form-urlencoded)
+struct Http_form_file {
+    std::string filename;
+    std::string data;
+};
+
+struct Http_form {
+    std::map<std::string, std::string> fields;
+    std::map<std::string, Http_form_file> files;
+
+    bool Has(const std::string& name) const { return fields.count(name) > 0; }
+    std::string Get(const std::string& name) const {
+        auto it = fields.find(name);
+        return it == fields.end() ? "" : it->second;
+    }
+};
+
+inline const char *Http_StatusText(int status) {
+    switch (status) {
+        case 100: return "Continue";
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 408: return "Request Timeout";
+        case 411: return "Length Required";
+        case 413: return "Payload Too Large";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        case 503: return "Service Unavailable";
+        default: return "Unknown";
+    }
+}
+
+/// Value of the parameter 'name' of a header value (eg: boundary of "multipart/form-data; boundary=xyz")
+inline std::string Http_HeaderParam(const std::string& value, const std::string& name) {
+    size_t pos = 0;
+    while ((pos = value.find(';', pos)) != std::string::npos) {
+        pos = value.find_first_not_of(" \t", pos+1);
+        if (pos == std::string::npos) break;
+        size_t eq = value.find('=', pos);
+        if (eq == std::string::npos) break;
+        std::string key = value.substr(pos, eq-pos);
+        std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+        if (key != name) continue;
+        if (eq+1 < value.length() && value[eq+1] == '"') {
+            std::string param;
+            for (size_t i = eq+2; i < value.length() && value[i] != '"'; i++) {
+                if (value[i] == '\\' && i+1 < value.length()) i++;
+                param += value[i];
+            }
+            return param;
+        }
+        size_t end = value.find(';', eq);
+        std::string param = value.substr(eq+1, end == std::string::npos ? std::string::npos : end-eq-1);
+        while (!param.empty() && (*param.rbegin() == ' ' || *param.rbegin() == '\t')) param.erase(param.length()-1);
+        return param;
+    }
+    return "";
+}
+
+inline std::string Http_UrlDecode(const std::string& str) {
+    std::string decoded;
+    for (size_t i = 0; i < str.length(); i++) {
+        if (str[i] == '+') decoded += ' ';
+        else if (str[i] == '%' && i+2 < str.length() && isxdigit((unsigned char)str[i+1]) && isxdigit((unsigned char)str[i+2])) {
+            decoded += (char)strtol(str.substr(i+1, 2).c_str(), NULL, 16);
+            i += 2;
+        }
+        else decoded += str[i];
+    }
+    return decoded;
+}
+
+/// Parse the form of the body of a request, return false if it is not a valid form
+inline bool Http_ParseForm(const Http_request& request, Http_form& form) {
+    std::string contenttype = request.Header("content-type");
+    std::string type = contenttype.substr(0, contenttype.find(';'));
+    std::transform(type.begin(), type.end(), type.begin(), ::tolower);
+    const std::string& body = request.body;
+
+    if (type == "application/x-www-form-urlencoded") {
+        size_t pos = 0;
+        while (pos < body.length()) {
+            size_t end = body.find('&', pos);
+            if (end == std::string::npos) end = body.length();
+            size_t eq = body.find('=', pos);
+            if (eq != std::string::npos && eq < end)
+                form.fields[Http_UrlDecode(body.substr(pos, eq-pos))] = Http_UrlDecode(body.substr(eq+1, end-eq-1));
+            pos = end + 1;
+        }
+        return true;
+    }
+    if (type != "multipart/form-data") return false;
+
+    std::string boundary = Http_HeaderParam(contenttype, "boundary");
+    if (boundary.empty()) return false;
+    std::string delimiter = "--" + boundary;
+    size_t pos = body.find(delimiter);
+    if (pos == std::string::npos) return false;
+    delimiter = "\r\n" + delimiter;
+    pos += delimiter.length() - 2;
+
+    while (true) {
+        // After a delimiter: "--" ends the body, else CRLF then the headers of the part
+        if (body.compare(pos, 2, "--") == 0) return true;
+        if (body.compare(pos, 2, "\r\n") != 0) return false;
+        size_t headend = body.find("\r\n\r\n", pos);
+        if (headend == std::string::npos) return false;
+        std::string name, filename;
+        bool bFile = false;
+        size_t line = pos + 2;
+        while (line < headend + 2) {
+            size_t eol = body.find("\r\n", line);
+            std::string header = body.substr(line, eol-line);
+            size_t colon = header.find(':');
+            std::string key = header.substr(0, colon);
+            std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+            if (colon != std::string::npos && key == "content-disposition") {
+                std::string value = header.substr(colon+1);
+                name = Http_HeaderParam(value, "name");
+                bFile = value.find("filename=") != std::string::npos;
+                filename = Http_HeaderParam(value, "filename");
+            }
+            line = eol + 2;
+        }
+        size_t start = headend + 4;
+        size_t end = body.find(delimiter, start);
+        if (end == std::string::npos) return false;
+        if (bFile) {
+            Http_form_file& file = form.files[name];
+            file.filename = filename;
+            file.data.assign(body, start, end-start);
+        }
+        else form.fields[name].assign(body, start, end-start);
+        pos = end + delimiter.length();
+    }
+}
+
+class Http_server {
+    public:
+        /// handler is run by nbthreads workers, maxsize is the maximum size of a request body, timeout the seconds an idle connection is kept
+        Http_server(Http_handler requesthandler, unsigned int nbthreads, size_t maxbodysize = 128*1024*1024, int idletimeout = 60)
+            : handler(requesthandler), maxsize(maxbodysize), timeout(idletimeout), threads(std::max(1u, nbthreads)) {
+            listenfd = epfd = eventfd = -1;
+            nextid = FIRST_CONNECTION;
+            bStop = false;
+        }
+
+        ~Http_server() {
+            for (auto& it : connections) {
+                close(it.second->fd);
+                delete it.second;
+            }
+            if (listenfd >= 0) close(listenfd);
+            if (eventfd >= 0) close(eventfd);
+            if (epfd >= 0) close(epfd);
+        }
+
+        std::string GetError() { return error; }
+
+        /// Listen on address:port (address "" or "0.0.0.0" for all the IPv4 addresses, "::" for all)
+        bool Listen(const std::string& address, int port) {
+            struct addrinfo hints, *res = NULL;
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+            int rc = getaddrinfo(address.empty() ? NULL : address.c_str(), std::to_string(port).c_str(), &hints, &res);
+            if (rc != 0) return Fail("Invalid address \""+address+"\" : "+gai_strerror(rc));
+
+            listenfd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            int one = 1;
+            if (listenfd >= 0) setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            bool ok = listenfd >= 0 && bind(listenfd, res->ai_addr, res->ai_addrlen) == 0 && listen(listenfd, SOMAXCONN) == 0;
+            freeaddrinfo(res);
+            if (!ok) return Fail("Listening on "+address+":"+std::to_string(port)+" failed : "+strerror(errno));
+
+            epfd = epoll_create1(EPOLL_CLOEXEC);
+            eventfd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (epfd < 0 || eventfd < 0) return Fail(std::string("epoll initialization failed : ")+strerror(errno));
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.u64 = LISTEN_ID;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev);
+            ev.data.u64 = EVENT_ID;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, eventfd, &ev);
+            return true;
+        }
+
+        /// Serve the requests until Stop()
+        void Run() {
+            std::vector<std::thread> workers;
+            for (unsigned int i = 0; i < threads; i++) workers.push_back(std::thread(&Http_server::Worker, this));
+
+            struct epoll_event events[256];
+            time_t lastcheck = time(NULL);
+            while (!bStop) {
+                int n = epoll_wait(epfd, events, 256, 1000);
+                for (int i = 0; i < n; i++) {
+                    uint64_t id = events[i].data.u64;
+                    if (id == LISTEN_ID) Accept();
+                    else if (id == EVENT_ID) Completed();
+                    else {
+                        auto it = connections.find(id);
+                        if (it == connections.end()) continue;
+                        Connection *conn = it->second;
+                        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) Read(conn);
+                        if (connections.count(id) && (events[i].events & EPOLLOUT)) Write(conn);
+                    }
+                }
+
+                // Idle connections are closed, not the ones whose request is processed
+                time_t now = time(NULL);
+                if (timeout > 0 && now != lastcheck) {
+                    lastcheck = now;
+                    std::vector<Connection*> vIdle;
+                    for (auto& it : connections)
+                        if (!it.second->busy && now - it.second->lastactivity > timeout) vIdle.push_back(it.second);
+                    for (Connection *conn : vIdle) Close(conn);
+                }
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                jobs.clear();
+            }
+            cvJobs.notify_all();
+            for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+        }
+
+        /// Stop Run(), can be called from a signal handler
+        void Stop() {
+            bStop = true;
+            uint64_t one = 1;
+            if (write(eventfd, &one, sizeof(one)) < 0) {}
+        }
+
+    private:
+        enum { LISTEN_ID = 0, EVENT_ID = 1, FIRST_CONNECTION = 2 };
+
+        struct Connection {
+            int fd;
+            uint64_t id;
+            std::string in;          // received data not processed yet
+            std::string out;         // data to send
+            size_t outpos;
+            bool busy;               // its request is processed by a worker
+            bool keepalive;
+            bool closing;            // closed once the output is sent
+            bool continuesent;
+            bool peerclosed;
+            time_t lastactivity;
+            std::string peer;
+            Http_request request;    // request whose body is being received
+            size_t headersize;       // 0 while its headers are not complete
+            size_t contentlength;
+        };
+
+        struct Job {
+            uint64_t id;
+            Http_request request;
+            bool keepalive;
+        };
+
+        struct Result {
+            uint64_t id;
+            std::string data;
+            bool keepalive;
+        };
+
+        Http_handler handler;
+        size_t maxsize;
+        int timeout;
+        unsigned int threads;
+        int listenfd, epfd, eventfd;
+        uint64_t nextid;
+        std::atomic<bool> bStop;
+        std::string error;
+        std::unordered_map<uint64_t, Connection*> connections; // used by the I/O thread only
+        std::mutex mtx;
+        std::condition_variable cvJobs;
+        std::deque<Job> jobs;
+        std::deque<Result> results;
+
+        Http_server(const Http_server&);
+        Http_server& operator=(const Http_server&);
+
+        bool Fail(const std::string& message) {
+            error = message;
+            return false;
+        }
+
+        void Accept() {
+            while (true) {
+                struct sockaddr_storage addr;
+                socklen_t addrlen = sizeof(addr);
+                int fd = accept4(listenfd, (struct sockaddr*)&addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd < 0) return; // EAGAIN or too many files, the next events retry
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+                Connection *conn = new Connection();
+                conn->fd = fd;
+                conn->id = nextid++;
+                conn->outpos = 0;
+                conn->busy = conn->keepalive = conn->closing = conn->continuesent = conn->peerclosed = false;
+                conn->lastactivity = time(NULL);
+                conn->headersize = conn->contentlength = 0;
+                char host[INET6_ADDRSTRLEN] = "";
+                if (addr.ss_family == AF_INET) inet_ntop(AF_INET, &((struct sockaddr_in*)&addr)->sin_addr, host, sizeof(host));
+                else if (addr.ss_family == AF_INET6) inet_ntop(AF_INET6, &((struct sockaddr_in6*)&addr)->sin6_addr, host, sizeof(host));
+                conn->peer = host;
+                connections[conn->id] = conn;
+
+                struct epoll_event ev;
+                ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                ev.data.u64 = conn->id;
+                epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+            }
+        }
+
+        void Close(Connection *conn) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+            close(conn->fd);
+            connections.erase(conn->id);
+            delete conn;
+        }
+
+        void Read(Connection *conn) {
+            char buffer[HTTP_READBUFFER];
+            while (true) {
+                ssize_t n = recv(conn->fd, buffer, sizeof(buffer), 0);
+                if (n > 0) {
+                    if (conn->in.empty() && !conn->headersize) conn->request.start = time(NULL);
+                    conn->in.append(buffer, n);
+                    conn->lastactivity = time(NULL);
+                    continue;
+                }
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+                conn->peerclosed = true; // end of stream or error
+                break;
+            }
+            if (conn->busy) return; // the response is sent before the next request is parsed
+            if (!Parse(conn)) return;
+            if (conn->peerclosed && !conn->busy && conn->out.empty()) Close(conn);
+        }
+
+        /// Parse the received data, dispatch a complete request, return false if conn was closed
+        bool Parse(Connection *conn) {
+            if (!conn->headersize) {
+                size_t end = conn->in.find("\r\n\r\n");
+                if (end == std::string::npos) {
+                    if (conn->in.size() > HTTP_MAXHEADERSIZE) return Reply(conn, 431, "", false);
+                    return true;
+                }
+                if (!ParseHeaders(conn, end)) return Reply(conn, 400, "", false);
+                conn->headersize = end + 4;
+
+                if (!conn->request.Header("transfer-encoding").empty()) return Reply(conn, 501, "", false);
+                std::string length = conn->request.Header("content-length");
+                if (length.empty() && conn->request.method == "POST") return Reply(conn, 411, "", false);
+                conn->contentlength = strtoull(length.c_str(), NULL, 10);
+                if (conn->contentlength > maxsize) {
+                    // Same answer as a PHP post_max_size overflow
+                    return Reply(conn, 403, "ERROR#Posted data is too large. "+std::to_string(conn->contentlength)+
+                                 " bytes exceeds the maximum size of "+std::to_string(maxsize)+" bytes.", false);
+                }
+                std::string expect = conn->request.Header("expect");
+                std::transform(expect.begin(), expect.end(), expect.begin(), ::tolower);
+                if (expect == "100-continue" && conn->in.size() < conn->headersize + conn->contentlength) {
+                    conn->out += "HTTP/1.1 100 Continue\r\n\r\n";
+                    Write(conn);
+                    if (!connections.count(conn->id)) return false;
+                }
+            }
+            if (conn->in.size() < conn->headersize + conn->contentlength) return true;
+
+            Job job;
+            job.id = conn->id;
+            job.request.method.swap(conn->request.method);
+            job.request.target.swap(conn->request.target);
+            job.request.version.swap(conn->request.version);
+            job.request.headers.swap(conn->request.headers);
+            job.request.start = conn->request.start;
+            job.request.peer = conn->peer;
+            job.request.body.assign(conn->in, conn->headersize, conn->contentlength);
+            conn->in.erase(0, conn->headersize + conn->contentlength);
+            conn->request = Http_request();
+            conn->request.start = time(NULL);
+            conn->headersize = conn->contentlength = 0;
+
+            std::string connection = job.request.Header("connection");
+            std::transform(connection.begin(), connection.end(), connection.begin(), ::tolower);
+            job.keepalive = job.request.version == "HTTP/1.1" ? connection != "close" : connection == "keep-alive";
+            conn->busy = true;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                jobs.push_back(std::move(job));
+            }
+            cvJobs.notify_one();
+            return true;
+        }
+
+        bool ParseHeaders(Connection *conn, size_t end) {
+            Http_request& request = conn->request;
+            size_t eol = conn->in.find("\r\n");
+            std::string line = conn->in.substr(0, eol);
+            size_t sp1 = line.find(' '), sp2 = line.rfind(' ');
+            if (sp1 == std::string::npos || sp2 == sp1) return false;
+            request.method = line.substr(0, sp1);
+            request.target = line.substr(sp1+1, sp2-sp1-1);
+            request.version = line.substr(sp2+1);
+            size_t pos = eol + 2;
+            while (pos < end + 2) {
+                eol = conn->in.find("\r\n", pos);
+                line = conn->in.substr(pos, eol-pos);
+                pos = eol + 2;
+                size_t colon = line.find(':');
+                if (colon == std::string::npos) return false;
+                std::string name = line.substr(0, colon);
+                std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+                size_t start = line.find_first_not_of(" \t", colon+1);
+                std::string value = (start == std::string::npos) ? "" : line.substr(start);
+                while (!value.empty() && (*value.rbegin() == ' ' || *value.rbegin() == '\t')) value.erase(value.length()-1);
+                request.headers[name] = value;
+            }
+            return true;
+        }
+
+        /// Send a response from the I/O thread, return false if conn was closed
+        bool Reply(Connection *conn, int status, const std::string& body, bool keepalive) {
+            Http_response response;
+            response.status = status;
+            response.body = body;
+            conn->out += Format(response, keepalive);
+            conn->closing = !keepalive;
+            conn->busy = true; // nothing more is read from this connection
+            Write(conn);
+            return connections.count(conn->id) > 0;
+        }
+
+        static std::string Format(const Http_response& response, bool keepalive) {
+            std::string data = "HTTP/1.1 " + std::to_string(response.status) + " " + Http_StatusText(response.status) + "\r\n"
+                               "Content-Type: " + response.contenttype + "\r\n"
+                               "Content-Length: " + std::to_string(response.body.size()) + "\r\n"
+                               "Connection: " + (keepalive ? "keep-alive" : "close") + "\r\n\r\n";
+            data += response.body;
+            return data;
+        }
+
+        void Write(Connection *conn) {
+            while (conn->outpos < conn->out.size()) {
+                ssize_t n = send(conn->fd, conn->out.data() + conn->outpos, conn->out.size() - conn->outpos, MSG_NOSIGNAL);
+                if (n > 0) {
+                    conn->outpos += n;
+                    conn->lastactivity = time(NULL);
+                    continue;
+                }
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return; // EPOLLOUT goes on
+                Close(conn);
+                return;
+            }
+            conn->out.clear();
+            conn->outpos = 0;
+            if (conn->closing) Close(conn);
+        }
+
+        /// Send the responses given by the workers
+        void Completed() {
+            uint64_t count;
+            if (read(eventfd, &count, sizeof(count)) < 0) {}
+            std::deque<Result> done;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                done.swap(results);
+            }
+            for (Result& result : done) {
+                auto it = connections.find(result.id);
+                if (it == connections.end()) continue; // closed meanwhile
+                Connection *conn = it->second;
+                conn->busy = false;
+                conn->closing = !result.keepalive;
+                conn->out += result.data;
+                Write(conn);
+                if (!connections.count(result.id) || conn->busy) continue;
+                // A pipelined request may already be received
+                if (conn->peerclosed && conn->in.empty()) {
+                    if (conn->out.empty()) Close(conn);
+                    continue;
+                }
+                if (!conn->closing) Parse(conn);
+            }
+        }
+
+        void Worker() {
+            while (true) {
+                Job job;
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    cvJobs.wait(lock, [this]{ return bStop || !jobs.empty(); });
+                    if (bStop) return;
+                    job = std::move(jobs.front());
+                    jobs.pop_front();
+                }
+
+                Http_response response;
+                try {
+                    handler(job.request, response);
+                }
+                catch (const std::exception& ex) {
+                    response = Http_response();
+                    response.status = 500;
+                }
+                Result result;
+                result.id = job.id;
+                result.keepalive = job.keepalive;
+                result.data = Format(response, job.keepalive);
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    results.push_back(std::move(result));
+                }
+                uint64_t one = 1;
+                if (write(eventfd, &one, sizeof(one)) < 0) {}
+            }
+        }
+};
+
+#endif // __HTTP_SERVER_HPP
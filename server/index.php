@@ -79,6 +79,119 @@ function rmdir_recursive($dir)
 	return true;
 }
 
+/**
+ * Return true if $name is a sub-directory of the eml layout at $depth (1 or 2)
+ * "hash" layout is "ab/cd/" and "date" layout is "YYYY/mm/"
+*/
+function is_layout_dir($name, $layout, $depth)
+{
+	if ($layout == "hash") return preg_match('/^[0-9a-f]{2}$/', $name) === 1;
+	if ($layout == "date") return preg_match(($depth == 1) ? '/^[0-9]{4}$/' : '/^[0-9]{2}$/', $name) === 1;
+	return false;
+}
+
+/**
+ * Return the layouts of the synchronized directory given by the client as "sync_layout" (eg: "hash,date")
+ * None for a flat directory or an older client
+*/
+function sync_layouts()
+{
+	if (!isset($_POST["sync_layout"])) return array();
+	return array_values(array_intersect(explode(",", $_POST["sync_layout"]), array("hash", "date")));
+}
+
+/**
+ * Return the layout of $layouts whose first level sub-directories are named like $name or "" if none
+ * So that a mail folder named "2019" is not taken for a sub-directory of a flat directory
+*/
+function layout_of_dir($name, $layouts)
+{
+	foreach ($layouts as $layout) {
+		if (is_layout_dir($name, $layout, 1)) return $layout;
+	}
+	return "";
+}
+
+/**
+ * List the email files of $directory (ending with "/") with their path relative to it
+ * Files of the sub-directories of the layouts of $layouts are included (see sync_layouts()),
+ * not the ones of other sub-directories
+*/
+function list_eml_files($directory, $layouts)
+{
+	$files = array();
+	foreach (scandir($directory) as $item) {
+		if (is_file($directory.$item)) $files[] = $item;
+	}
+
+	foreach (scandir($directory) as $dir1) {
+		$layout = layout_of_dir($dir1, $layouts);
+		if ($layout == "" || !is_dir($directory.$dir1)) continue;
+		foreach (scandir($directory.$dir1) as $dir2) {
+			$subdir = $dir1."/".$dir2."/";
+			if (!is_layout_dir($dir2, $layout, 2) || !is_dir($directory.$subdir)) continue;
+			foreach (scandir($directory.$subdir) as $item) {
+				if (is_file($directory.$subdir.$item)) $files[] = $subdir.$item;
+			}
+		}
+	}
+	return $files;
+}
+
+/**
+ * Remove the empty layout sub-directories of $directory (ending with "/")
+*/
+function remove_empty_layout_dirs($directory, $layouts)
+{
+	foreach (scandir($directory) as $dir1) {
+		$layout = layout_of_dir($dir1, $layouts);
+		if ($layout == "" || !is_dir($directory.$dir1)) continue;
+		foreach (scandir($directory.$dir1) as $dir2) {
+			$subdir = $directory.$dir1."/".$dir2;
+			if (is_layout_dir($dir2, $layout, 2) && is_dir($subdir) && count(scandir($subdir)) == 2) rmdir($subdir);
+		}
+		if (count(scandir($directory.$dir1)) == 2) rmdir($directory.$dir1);
+	}
+}
+
+/**
+ * Return true if $dir is a layout sub-directory of one of the directories of $dir_valid
+*/
+function is_layout_subdir($dir_valid, $dir, $layouts)
+{
+	$parts = explode("/", rtrim($dir, "/"));
+	$n = count($parts);
+	if ($n > 1 && layout_of_dir($parts[$n-1], $layouts) != ""
+		&& in_array(implode("/", array_slice($parts, 0, $n-1))."/", $dir_valid)) return true;
+	if ($n > 2 && is_layout_dir($parts[$n-1], layout_of_dir($parts[$n-2], $layouts), 2)
+		&& in_array(implode("/", array_slice($parts, 0, $n-2))."/", $dir_valid)) return true;
+	return false;
+}
+
+/**
+ * Digests of the names split in $buckets buckets (see sync_digest.hpp of mboxzilla)
+ * The digest of a bucket is the 16 first characters of the md5 of its sorted names, each followed by "\n"
+*/
+function sync_digests($names, $buckets)
+{
+	$lists = array_fill(0, $buckets, array());
+	foreach ($names as $name) $lists[crc32($name) % $buckets][] = $name;
+	$digests = array();
+	foreach ($lists as $list) {
+		sort($list, SORT_STRING);
+		$digests[] = substr(md5(count($list) ? implode("\n", $list)."\n" : ""), 0, 16);
+	}
+	return $digests;
+}
+
+/**
+ * Root digest of the bucket digests, computed as the digest of a bucket
+*/
+function sync_root($digests)
+{
+	return substr(md5(implode("\n", $digests)."\n"), 0, 16);
+}
+
 if ( $_SERVER['REQUEST_METHOD'] == 'POST' && empty($_POST) &&
      empty($_FILES) && $_SERVER['CONTENT_LENGTH'] > 0 )
 {
@@ -106,7 +219,7 @@ if ( $_SERVER['REQUEST_METHOD'] == 'POST' && empty($_POST) &&
 
 // Some post values are required
 if (!isset($_POST["token_iv"]) || !isset($_POST["token"]) ||
-   (!isset($_POST["check"]) && !isset($_POST["checkfile"]) && !isset($_POST["sync_filelist"]) && !isset($_POST["sync_dirlist"]) && !isset($_POST["get_filelist"]) && !isset($_POST["iv"]))) {
+   (!isset($_POST["check"]) && !isset($_POST["checkfile"]) && !isset($_POST["sync_root"]) && !isset($_POST["sync_filelist"]) && !isset($_POST["sync_dirlist"]) && !isset($_POST["get_filelist"]) && !isset($_POST["iv"]))) {
 	http_response_code(403);
 	echo "ERROR#Remote access denied 0";
 	exit();
@@ -149,17 +262,42 @@ if(isset($_POST["get_filelist"])) {
 		exit();
 	}
 
-	$scanned_directory = array_filter(scandir($directory), function($item) {
-		global $directory;
-		return is_file($directory . $item);
-	});
+	$scanned_directory = list_eml_files($directory, sync_layouts());
 
 	echo gzencode(json_encode(array_values($scanned_directory)),9);
 	exit();
 }
 
+/*
+ *  Compare the root digest of the client emails list with the one of the directory
+ *  If it differs, answer the bucket digests of the directory as "DIGEST#d0,d1,..."
+ *  the client then sends the emails of the buckets that differ only
+ */
+if(isset($_POST["sync_root"]) && isset($_POST["sync_directory"])) {
+	$bucketcount = isset($_POST["sync_bucketcount"]) ? intval($_POST["sync_bucketcount"]) : 0;
+	$directory = $target_dir .$_POST["sync_directory"];
+
+	if(!is_dir($directory)) {
+		echo "INFO#-> Nothing to do\n";
+		exit();
+	}
+	if ($bucketcount < 1 || $bucketcount > 4096) {
+		http_response_code(403);
+		exit();
+	}
+
+	$scanned_directory = list_eml_files($directory, sync_layouts());
+	$local_digests = sync_digests($scanned_directory, $bucketcount);
+
+	if (sync_root($local_digests) == $_POST["sync_root"]) echo "INFO#-> Nothing to do (".count($scanned_directory)." emails on server)\n";
+	else echo "DIGEST#".implode(",", $local_digests)."\n";
+	exit();
+}
+
 /*
  *  Sync email files (eml or eml.gz) - delete emails that client does not have
+ *  If "sync_buckets" is set then the list only has the emails of these buckets (see sync_digests())
+ *  and the emails of the other buckets are kept
  */
 if(isset($_POST["sync_filelist"]) && isset($_POST["sync_directory"])) {
 	$retval = true;
@@ -176,12 +314,18 @@ if(isset($_POST["sync_filelist"]) && isset($_POST["sync_directory"])) {
 	// Set array to avoid php warning on array_diff() with an empty array argument
 	if (empty($eml_valid)) $eml_valid = array("");
 
-	$scanned_directory = array_filter(scandir($directory), function($item) {
-		global $directory;
-		return is_file($directory . $item);
-	});
+	$scanned_directory = list_eml_files($directory, sync_layouts());
+	$candidates = $scanned_directory;
+	if (isset($_POST["sync_buckets"]) && isset($_POST["sync_bucketcount"]) && intval($_POST["sync_bucketcount"]) > 0) {
+		$buckets = array_flip(explode(",", $_POST["sync_buckets"]));
+		$bucketcount = intval($_POST["sync_bucketcount"]);
+		$candidates = array();
+		foreach ($scanned_directory as $eml) {
+			if (isset($buckets[crc32($eml) % $bucketcount])) $candidates[] = $eml;
+		}
+	}
 
-	$emltoremove = array_diff($scanned_directory, $eml_valid);
+	$emltoremove = array_diff($candidates, $eml_valid);
 
 	// Remove unnecessary email files
 	foreach ($emltoremove as $eml) {
@@ -197,6 +341,7 @@ if(isset($_POST["sync_filelist"]) && isset($_POST["sync_directory"])) {
 	}
 
 	// Remove empty dir
+	remove_empty_layout_dirs($directory, sync_layouts());
 	if (count(scandir($directory)) == 2) {
 		if (rmdir($directory)) echo "VERBOSE3#-> Successfully deleted \"".$directory."\"\n";
 		else {
@@ -251,7 +396,8 @@ if(isset($_POST["sync_dirlist"]) && isset($_POST["sync_directory"])) {
 	rsort($dirtoremove);
 	foreach ($dirtoremove as $key => $val) {
 		// Keep value only if not a parent directory of elements found in "sync_directory" list
-		if (!is_forbidden($dir_valid, $val)) {
+		// and if not a layout sub-directory of one of them
+		if (!is_forbidden($dir_valid, $val) && !is_layout_subdir($dir_valid, $val, sync_layouts())) {
 			$retval = false;
 			$dir = $target_dir .$val;
 			if (rmdir_recursive($dir))
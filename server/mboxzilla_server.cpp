@@ -0,0 +1,850 @@
+/*
+    BSD 2-Clause License
+
+    Copyright (c) 2017-2023, Nol Martinon
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+    mboxzilla_server receives the eml files uploaded by mboxzilla with 'u' and 'k'
+    options. It speaks the same protocol as server/index.php (check, checkfile,
+    get_filelist, sync_root, sync_filelist, sync_dirlist and fileToUpload requests) and
+    stores the files in the same tree, so both can be swapped.
+    The connections are served by one event-driven thread (see Http_server) and
+    the requests by a pool of workers. The directories are read once and kept in
+    memory (see Directory_index) for the lists, checks and syncs.
+*/
+
+/****** Application description and notice ******/
+#define APP_VERSION "1.3.0"
+
+#define APP_INFO "\
+\n\
+mboxzilla_server version " APP_VERSION "\n\
+Copyright (C) 2017-2023 Noel Martinon. All rights reserved.\n\
+"
+
+#define APP_DESCRIPTION "\
+License:\n\
+  mboxzilla_server comes with ABSOLUTELY NO WARRANTY. This is free software,\n\
+  and you are welcome to redistribute it under certain conditions. See the\n\
+  BSD 2-Clause License for details.\n\
+  \n\
+Features:\n\
+  mboxzilla_server receives the eml files uploaded by mboxzilla ('u' and 'k'\n\
+  options) and synchronizes them. It replaces server/index.php.\n\
+"
+
+#define APP_NOTICE "\
+Examples and more:\n\
+  See the readme file or https://github.com/noelmartinon/mboxzilla\n\
+"
+/*************************************/
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <csignal>
+#include <openssl/evp.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "http_server.hpp"
+#include "directory_index.hpp"
+#include "../base64.hpp"
+#include "../simplyzip.hpp"
+#include "../sync_digest.hpp"
+#include "../json.hpp"
+#include "../cxxopts.hpp"
+
+//#define ELPP_NO_DEFAULT_LOG_FILE and ELPP_THREAD_SAFE -> specified on command line with gcc -D option
+#include "../easylogging++.h"
+INITIALIZE_EASYLOGGINGPP
+
+using json = nlohmann::json;
+using namespace std;
+
+#define UPLOAD_TMPPREFIX ".upload_" // files being received, hidden from the lists
+
+string target_dir = "backup/";
+string aes_key;
+int maxdelay = 60;
+mode_t file_mode = 0644; // mode of the created files and directories (0666 and 0777 less umask)
+mode_t dir_mode = 0755;
+Directory_index *dirindex = NULL;
+Http_server *server = NULL;
+
+//---------------------------------------------------------------------------------------------
+/**
+ *  sha256()
+ *  Generate a 256 SHA hash from string
+ */
+string sha256(const string& inputstr) {
+
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    EVP_Digest((const unsigned char *)inputstr.c_str(), inputstr.length(), hash, &len, EVP_sha256(), NULL);
+
+    std::stringstream stream;
+    for (unsigned int i = 0; i < len; i++)
+        stream << std::hex << std::setw(2) << std::setfill('0') << static_cast<unsigned int>(hash[i]);
+    return stream.str();
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  AES_Decrypt()
+ *  Decrypt string using AES_256_CBC encryption mode (as openssl_decrypt() of PHP)
+ *  Return false if ctext is not valid
+ */
+bool AES_Decrypt(const string& key, const string& iv, const string& ctext, string& rtext) {
+
+    if (key.length() != 32 || iv.length() != 16) return false;
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) return false;
+
+    rtext.resize(ctext.size() + 16);
+    int out_len1 = 0, out_len2 = 0;
+    bool ok = EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, (const unsigned char*)key.data(), (const unsigned char*)iv.data()) == 1 &&
+              EVP_DecryptUpdate(ctx, (unsigned char*)&rtext[0], &out_len1, (const unsigned char*)ctext.data(), (int)ctext.size()) == 1 &&
+              EVP_DecryptFinal_ex(ctx, (unsigned char*)&rtext[0]+out_len1, &out_len2) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+    rtext.resize(ok ? out_len1 + out_len2 : 0);
+    return ok;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  base64Decode()
+ *  Decodes data encoded with MIME base64
+ *  Return empty string if data is not valid base64
+ */
+string base64Decode(const string &data) {
+
+    string decoded_data(base64_decoded_maxsize(data.size()), 0);
+    size_t decoded_len = 0;
+
+    if (!base64_decode(data.data(), data.size(), (unsigned char*)&decoded_data[0], decoded_len))
+        return "";
+
+    decoded_data.resize(decoded_len);
+    return decoded_data;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  ValidateToken()
+ *  Return true if the token (client date 'Ymd_His') was sent in the last maxdelay seconds,
+ *  the time to receive the request being excluded (as validateDate() of index.php)
+ */
+bool ValidateToken(const string& token, time_t start) {
+
+    std::tm tm = {};
+    std::istringstream ss(token);
+    ss >> std::get_time(&tm, "%Y%m%d_%H%M%S");
+    if (ss.fail() || token.length() != 15) return false;
+    tm.tm_isdst = -1;
+
+    // mktime() reloads the time zone at each call (glibc), the workers call it in turn
+    static std::mutex mtx;
+    std::unique_lock<std::mutex> lock(mtx);
+    time_t date = mktime(&tm);
+
+    // The date must exist (no 31 of february)
+    std::tm check = {};
+    localtime_r(&date, &check);
+    lock.unlock();
+    std::ostringstream formatted;
+    formatted << std::put_time(&check, "%Y%m%d_%H%M%S");
+    if (formatted.str() != token) return false;
+
+    time_t now = time(NULL);
+    return now - date < (now - start) + maxdelay;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  NormalizePath()
+ *  Return the path relative to the target directory ("a/b/" for a directory), without
+ *  empty or "." components. Return false if it has a ".." component
+ */
+bool NormalizePath(const string& path, bool bDirectory, string& normalized) {
+
+    normalized.clear();
+    size_t pos = 0;
+    while (pos <= path.length()) {
+        size_t end = path.find('/', pos);
+        if (end == string::npos) end = path.length();
+        string component = path.substr(pos, end-pos);
+        pos = end + 1;
+        if (component.empty() || component == ".") continue;
+        if (component == "..") return false;
+        normalized += component + "/";
+    }
+    if (!bDirectory && !normalized.empty()) normalized.erase(normalized.length()-1);
+    return true;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  IsLayoutDir()
+ *  Return true if name is a sub-directory of the eml layout at depth (1 or 2)
+ *  "hash" layout is "ab/cd/" and "date" layout is "YYYY/mm/"
+ */
+bool IsLayoutDir(const string& name, const string& layout, int depth) {
+
+    size_t len = (layout == "date" && depth == 1) ? 4 : 2;
+    if ((layout != "hash" && layout != "date") || name.length() != len) return false;
+    for (char c : name) {
+        if (layout == "hash" && !isdigit((unsigned char)c) && (c < 'a' || c > 'f')) return false;
+        if (layout == "date" && !isdigit((unsigned char)c)) return false;
+    }
+    return true;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  SyncLayouts()
+ *  Return the layouts of the synchronized directory given by the client as "sync_layout"
+ *  (eg: "hash,date"), none for a flat directory or an older client
+ */
+vector<string> SyncLayouts(const Http_form& form) {
+
+    vector<string> vLayouts;
+    std::istringstream ss(form.Get("sync_layout"));
+    string layout;
+    while (getline(ss, layout, ','))
+        if (layout == "hash" || layout == "date") vLayouts.push_back(layout);
+    return vLayouts;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  LayoutOfDir()
+ *  Return the layout of vLayouts whose first level sub-directories are named like name
+ *  or "" if none, so that a mail folder named "2019" is not taken for a flat directory layout
+ */
+string LayoutOfDir(const string& name, const vector<string>& vLayouts) {
+
+    for (const string& layout : vLayouts)
+        if (IsLayoutDir(name, layout, 1)) return layout;
+    return "";
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  ListEmlFiles()
+ *  List the email files of directory (ending with "/") with their path relative to it
+ *  Files of the sub-directories of the layouts of vLayouts are included (see SyncLayouts()),
+ *  not the ones of other sub-directories
+ */
+void ListEmlFiles(const string& directory, const vector<string>& vLayouts, vector<string>& vFiles) {
+
+    vector<string> vDirs1;
+    dirindex->GetFiles(directory, vFiles);
+    if (!vLayouts.empty()) dirindex->GetSubdirs(directory, vDirs1);
+
+    for (const string& dir1 : vDirs1) {
+        string layout = LayoutOfDir(dir1, vLayouts);
+        if (layout.empty()) continue;
+        vector<string> vDirs2;
+        dirindex->GetSubdirs(directory + dir1 + "/", vDirs2);
+        for (const string& dir2 : vDirs2) {
+            if (!IsLayoutDir(dir2, layout, 2)) continue;
+            string subdir = dir1 + "/" + dir2 + "/";
+            vector<string> vSubFiles;
+            dirindex->GetFiles(directory + subdir, vSubFiles);
+            for (const string& file : vSubFiles) vFiles.push_back(subdir + file);
+        }
+    }
+
+    // Files being received by other requests are not emails yet
+    vFiles.erase(remove_if(vFiles.begin(), vFiles.end(), [](const string& file) {
+        size_t slash = file.rfind('/');
+        return file.compare(slash == string::npos ? 0 : slash+1, strlen(UPLOAD_TMPPREFIX), UPLOAD_TMPPREFIX) == 0;
+    }), vFiles.end());
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  RemoveDirectory()
+ *  Remove a directory if it is empty
+ */
+bool RemoveDirectory(const string& directory) {
+
+    vector<string> vFiles, vDirs;
+    if (!dirindex->GetFiles(directory, vFiles) || !dirindex->GetSubdirs(directory, vDirs)) return false;
+    if (!vFiles.empty() || !vDirs.empty()) return false;
+    if (rmdir((target_dir + directory).c_str()) != 0) return false;
+    dirindex->RemoveDirectory(directory);
+    return true;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  RemoveTree()
+ *  Remove a directory with all its content, return false on the first error
+ */
+bool RemoveTree(const string& directory) {
+
+    vector<string> vFiles, vDirs;
+    if (!dirindex->GetFiles(directory, vFiles) || !dirindex->GetSubdirs(directory, vDirs)) return false;
+    for (const string& dir : vDirs)
+        if (!RemoveTree(directory + dir + "/")) return false;
+    for (const string& file : vFiles) {
+        if (unlink((target_dir + directory + file).c_str()) != 0) return false;
+        dirindex->RemoveFile(directory, file);
+    }
+    if (rmdir((target_dir + directory).c_str()) != 0) return false;
+    dirindex->RemoveDirectory(directory);
+    return true;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  ListDirectories()
+ *  Add the sub-directories of directory, recursively, as "prefix/sub/" (parents before children)
+ */
+void ListDirectories(const string& directory, const string& prefix, vector<string>& vDirs) {
+
+    vector<string> vSubdirs;
+    dirindex->GetSubdirs(directory, vSubdirs);
+    for (const string& dir : vSubdirs) {
+        vDirs.push_back(prefix + dir + "/");
+        ListDirectories(directory + dir + "/", prefix + dir + "/", vDirs);
+    }
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  MakeDirectories()
+ *  Create the missing directories of a path relative to the target directory
+ */
+bool MakeDirectories(const string& directory) {
+
+    size_t pos = 0;
+    while ((pos = directory.find('/', pos)) != string::npos) {
+        string path = target_dir + directory.substr(0, pos);
+        pos++;
+        if (mkdir(path.c_str(), dir_mode) != 0 && errno != EEXIST) return false;
+    }
+    return true;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  WriteFile()
+ *  Write a new file, return 1 if written, 0 if it exists or -1 on error
+ *  The data is written to a temporary file linked to its name once complete
+ */
+int WriteFile(const string& directory, const string& name, const string& data) {
+
+    if (!MakeDirectories(directory)) return -1;
+    string tmpname = target_dir + directory + UPLOAD_TMPPREFIX "XXXXXX";
+    int fd = mkstemp(&tmpname[0]);
+    if (fd < 0) return -1;
+    fchmod(fd, file_mode);
+
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = write(fd, data.data() + written, data.size() - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        written += n;
+    }
+    bool ok = (close(fd) == 0) && written == data.size();
+
+    int ret = -1;
+    if (ok) {
+        if (link(tmpname.c_str(), (target_dir + directory + name).c_str()) == 0) ret = 1;
+        else if (errno == EEXIST) ret = 0;
+    }
+    unlink(tmpname.c_str());
+    return ret;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  SyncDigest()
+ *  Compare the root digest of the client emails list with the one of the directory
+ *  If it differs, the bucket digests of the directory are answered as "DIGEST#d0,d1,..."
+ */
+void SyncDigest(const Http_form& form, Http_response& response) {
+
+    string directory;
+    if (!NormalizePath(form.Get("sync_directory"), true, directory) || !dirindex->IsDirectory(directory)) {
+        response.body = "INFO#-> Nothing to do\n";
+        return;
+    }
+
+    size_t bucketcount = strtoul(form.Get("sync_bucketcount").c_str(), NULL, 10);
+    if (!bucketcount || bucketcount > SYNC_MAXBUCKETS) {
+        response.status = 403;
+        return;
+    }
+
+    vector<string> vFiles;
+    ListEmlFiles(directory, SyncLayouts(form), vFiles);
+    Sync_digest digest(vFiles, bucketcount);
+
+    std::ostringstream out;
+    if (digest.GetRoot() == form.Get("sync_root")) out << "INFO#-> Nothing to do (" << vFiles.size() << " emails on server)\n";
+    else {
+        out << "DIGEST#";
+        for (size_t i = 0; i < digest.GetDigests().size(); i++) out << (i ? "," : "") << digest.GetDigests()[i];
+        out << "\n";
+    }
+    response.body = out.str();
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  SyncFileList()
+ *  Delete the email files of the directory that the client does not have
+ *  If "sync_buckets" is set then the list only has the emails of these buckets (see SyncDigest())
+ *  and the emails of the other buckets are kept
+ */
+void SyncFileList(const Http_form& form, Http_response& response) {
+
+    string directory;
+    vector<string> vLayouts = SyncLayouts(form);
+    string displaydir = target_dir + form.Get("sync_directory");
+    if (!NormalizePath(form.Get("sync_directory"), true, directory) || !dirindex->IsDirectory(directory)) {
+        response.body = "INFO#-> Nothing to do\n";
+        return;
+    }
+
+    json jValid = json::parse(decompress_gzip(base64Decode(form.Get("sync_filelist"))), nullptr, false);
+    std::unordered_set<string> sValid;
+    if (jValid.is_array())
+        for (auto& item : jValid) if (item.is_string()) sValid.insert(item.get<string>());
+
+    size_t bucketcount = strtoul(form.Get("sync_bucketcount").c_str(), NULL, 10);
+    std::unordered_set<size_t> sBuckets;
+    if (form.Has("sync_buckets") && bucketcount) {
+        std::istringstream ss(form.Get("sync_buckets"));
+        string index;
+        while (getline(ss, index, ',')) if (!index.empty()) sBuckets.insert(strtoul(index.c_str(), NULL, 10));
+    }
+    else bucketcount = 0;
+
+    vector<string> vFiles;
+    bool retval = true;
+    int deleted_ok = 0, deleted_err = 0;
+    std::ostringstream out;
+
+    dirindex->Begin(directory);
+    ListEmlFiles(directory, vLayouts, vFiles);
+    for (const string& eml : vFiles) {
+        if (sValid.count(eml)) continue;
+        if (bucketcount && !sBuckets.count(Sync_Bucket(eml, bucketcount))) continue;
+        size_t slash = eml.rfind('/');
+        string subdir = directory + (slash == string::npos ? "" : eml.substr(0, slash+1));
+        if (unlink((target_dir + directory + eml).c_str()) == 0) {
+            dirindex->RemoveFile(subdir, eml.substr(slash == string::npos ? 0 : slash+1));
+            out << "VERBOSE3#-> Successfully deleted \"" << eml << "\"\n";
+            deleted_ok++;
+        }
+        else {
+            out << "VERBOSE1#-> Unable to remove \"" << eml << "\"\n";
+            retval = false;
+            deleted_err++;
+        }
+    }
+
+    // Remove the empty layout sub-directories then the directory if empty
+    vector<string> vLayoutDirs;
+    if (!vLayouts.empty()) dirindex->GetSubdirs(directory, vLayoutDirs);
+    for (const string& dir1 : vLayoutDirs) {
+        string layout = LayoutOfDir(dir1, vLayouts);
+        if (layout.empty()) continue;
+        vector<string> vDirs2;
+        dirindex->GetSubdirs(directory + dir1 + "/", vDirs2);
+        for (const string& dir2 : vDirs2)
+            if (IsLayoutDir(dir2, layout, 2)) RemoveDirectory(directory + dir1 + "/" + dir2 + "/");
+        RemoveDirectory(directory + dir1 + "/");
+    }
+    dirindex->End(directory);
+
+    vector<string> vRemaining, vDirs;
+    dirindex->GetFiles(directory, vRemaining);
+    dirindex->GetSubdirs(directory, vDirs);
+    if (vRemaining.empty() && vDirs.empty() && !directory.empty()) {
+        if (RemoveDirectory(directory)) out << "VERBOSE3#-> Successfully deleted \"" << displaydir << "\"\n";
+        else {
+            out << "VERBOSE1#-> Unable to remove \"" << displaydir << "\"\n";
+            retval = false;
+        }
+    }
+
+    if (!deleted_ok && !deleted_err)
+        out << "INFO#-> Nothing to do (" << vFiles.size() << " emails on server)\n";
+    else
+        out << "INFO#-> " << deleted_ok << " deletions succeed and " << deleted_err << " in failure\n";
+    response.body = out.str();
+    if (!retval) response.status = 403;
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  SyncDirList()
+ *  Delete the directories (with their content) that the client does not have
+ */
+void SyncDirList(const Http_form& form, Http_response& response) {
+
+    string directory;
+    vector<string> vLayouts = SyncLayouts(form);
+    if (!NormalizePath(form.Get("sync_directory"), true, directory)) {
+        response.status = 403;
+        return;
+    }
+
+    json jValid = json::parse(decompress_gzip(base64Decode(form.Get("sync_dirlist"))), nullptr, false);
+    vector<string> vValid;
+    if (jValid.is_array())
+        for (auto& item : jValid) if (item.is_string()) vValid.push_back(item.get<string>());
+    std::unordered_set<string> sValid(vValid.begin(), vValid.end());
+
+    // The directories are named as the client does: its sync directory followed by the sub-directories
+    string prefix = form.Get("sync_directory");
+    while (!prefix.empty() && *prefix.rbegin() == '/') prefix.erase(prefix.length()-1);
+    prefix += "/";
+    vector<string> vDirs;
+    ListDirectories(directory, prefix, vDirs);
+
+    vector<string> vRemove;
+    for (const string& dir : vDirs) if (!sValid.count(dir)) vRemove.push_back(dir);
+    sort(vRemove.rbegin(), vRemove.rend());
+
+    // Keep a parent directory of a directory of the list and a layout sub-directory of one of them
+    auto is_forbidden = [&](const string& dir) {
+        string lowdir = dir;
+        transform(lowdir.begin(), lowdir.end(), lowdir.begin(), ::tolower);
+        for (const string& valid : vValid) {
+            string lowvalid = valid;
+            transform(lowvalid.begin(), lowvalid.end(), lowvalid.begin(), ::tolower);
+            if (lowvalid.find(lowdir) != string::npos) return true;
+        }
+        return false;
+    };
+    auto is_layout_subdir = [&](const string& dir) {
+        vector<string> parts;
+        std::istringstream ss(dir.substr(0, dir.find_last_not_of('/')+1));
+        string part;
+        while (getline(ss, part, '/')) parts.push_back(part);
+        size_t n = parts.size();
+        auto join = [&](size_t count) {
+            string joined;
+            for (size_t i = 0; i < count; i++) joined += (i ? "/" : "") + parts[i];
+            return joined + "/";
+        };
+        if (n > 1 && !LayoutOfDir(parts[n-1], vLayouts).empty() && sValid.count(join(n-1))) return true;
+        if (n > 2 && IsLayoutDir(parts[n-1], LayoutOfDir(parts[n-2], vLayouts), 2) && sValid.count(join(n-2))) return true;
+        return false;
+    };
+
+    bool retval = true;
+    std::ostringstream out;
+    dirindex->Begin(directory);
+    for (const string& dir : vRemove) {
+        if (is_forbidden(dir) || is_layout_subdir(dir)) continue;
+        retval = false;
+        string path;
+        NormalizePath(directory + dir.substr(prefix.length()), true, path);
+        if (RemoveTree(path)) out << "VERBOSE3#-> Successfully deleted \"" << target_dir + dir << "\"\n";
+        else out << "VERBOSE1#-> Unable to remove \"" << target_dir + dir << "\"\n";
+    }
+    dirindex->End(directory);
+
+    if (retval) out << "INFO#-> Nothing to do\n";
+    response.body = out.str();
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  Upload()
+ *  Decrypt the uploaded file and store it if it does not exist
+ */
+void Upload(const Http_form& form, Http_response& response, const string& peer) {
+
+    auto itFile = form.files.find("fileToUpload");
+    if (itFile == form.files.end()) return;
+
+    string path, data;
+    if (!NormalizePath(base64Decode(itFile->second.filename), false, path) || path.empty()) {
+        response.status = 403;
+        response.body = "ERROR#Remote access denied";
+        return;
+    }
+    size_t slash = path.rfind('/');
+    string directory = (slash == string::npos) ? "" : path.substr(0, slash+1);
+    string name = path.substr(directory.length());
+
+    if (!AES_Decrypt(aes_key, base64Decode(form.Get("iv")), itFile->second.data, data)) {
+        response.status = 403;
+        response.body = "VERBOSE1#Failed to upload " + name;
+        LOG(ERROR) << "Decryption of \"" << path << "\" from " << peer << " failed";
+        return;
+    }
+
+    if (!dirindex->Reserve(directory, name)) {
+        response.status = 403;
+        response.body = "Sorry, file already exists.";
+        return;
+    }
+    int ret = WriteFile(directory, name, data);
+    dirindex->Release(directory, name, ret == 1);
+
+    if (ret == 1) {
+        response.body = "VERBOSE3#Successfully uploaded " + name;
+        VLOG(3) << "Received \"" << path << "\" from " << peer << " (" << data.size() << " bytes)";
+    }
+    else if (ret == 0) {
+        response.status = 403;
+        response.body = "Sorry, file already exists.";
+    }
+    else {
+        response.status = 403;
+        response.body = "VERBOSE1#Failed to upload " + name;
+        LOG(ERROR) << "Writing of \"" << target_dir + path << "\" failed : " << strerror(errno);
+    }
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  HandleRequest()
+ *  Answer a request as index.php
+ */
+void HandleRequest(Http_request& request, Http_response& response) {
+
+    Http_form form;
+    Http_ParseForm(request, form);
+
+    // Some post values are required
+    if (!form.Has("token_iv") || !form.Has("token") ||
+        (!form.Has("check") && !form.Has("checkfile") && !form.Has("sync_root") && !form.Has("sync_filelist") && !form.Has("sync_dirlist") &&
+         !form.Has("get_filelist") && !form.Has("iv"))) {
+        response.status = 403;
+        response.body = "ERROR#Remote access denied 0";
+        return;
+    }
+
+    string token;
+    if (!AES_Decrypt(aes_key, base64Decode(form.Get("token_iv")), base64Decode(form.Get("token")), token) ||
+        !ValidateToken(token, request.start)) {
+        response.status = 403;
+        response.body = "ERROR#Remote access denied";
+        VLOG(1) << "Request from " << request.peer << " denied (token)";
+        return;
+    }
+
+    if (form.Has("check")) {
+        if (form.Get("check") == "HELLO") response.body = "READY";
+        else response.status = 403;
+        return;
+    }
+
+    // Test if file must be uploaded (=file not exist)
+    if (form.Has("checkfile")) {
+        string path;
+        if (!NormalizePath(form.Get("checkfile"), false, path)) response.status = 403;
+        else {
+            size_t slash = path.rfind('/');
+            string directory = (slash == string::npos) ? "" : path.substr(0, slash+1);
+            if (path.empty() || dirindex->Exists(directory, path.substr(directory.length()))) response.status = 403;
+        }
+        return;
+    }
+
+    if (form.Has("get_filelist")) {
+        string directory;
+        if (!NormalizePath(form.Get("get_filelist"), true, directory) || !dirindex->IsDirectory(directory)) {
+            response.status = 403;
+            return;
+        }
+        vector<string> vFiles;
+        ListEmlFiles(directory, SyncLayouts(form), vFiles);
+        response.contenttype = "application/octet-stream";
+        response.body = compress_gzip(json(vFiles).dump(), 9);
+        VLOG(3) << "List of \"" << directory << "\" (" << vFiles.size() << " files) sent to " << request.peer;
+        return;
+    }
+
+    if (form.Has("sync_root") && form.Has("sync_directory")) {
+        SyncDigest(form, response);
+        return;
+    }
+
+    if (form.Has("sync_filelist") && form.Has("sync_directory")) {
+        SyncFileList(form, response);
+        return;
+    }
+
+    if (form.Has("sync_dirlist") && form.Has("sync_directory")) {
+        SyncDirList(form, response);
+        return;
+    }
+
+    if (!form.Has("iv")) {
+        response.status = 403;
+        return;
+    }
+
+    Upload(form, response, request.peer);
+}
+//---------------------------------------------------------------------------------------------
+/**
+ *  SignalHandler()
+ *  Stop the server on SIGINT or SIGTERM
+ */
+void SignalHandler(int) {
+
+    if (server) server->Stop();
+}
+//---------------------------------------------------------------------------------------------
+int main(int argc, char**argv)
+{
+    string key = "_password";
+    string listen_address = "0.0.0.0";
+    int port = 8080;
+    int threads = std::max(2u, std::thread::hardware_concurrency());
+    long long max_size = 128*1024*1024;
+    int timeout = 60;
+    string logfilename;
+
+    try {
+        cxxopts::Options options("mboxzilla_server", APP_DESCRIPTION);
+
+        options.add_options()
+            ("d,directory",
+                "Directory where the files are stored (as $target_dir of index.php).",
+                cxxopts::value<std::string>(target_dir)->default_value("backup/"), "DIR")
+            ("k,key",
+                "Password used to secure exchanges with mboxzilla (as $key of index.php).",
+                cxxopts::value<std::string>(key)->default_value("_password"), "KEY")
+            ("l,listen",
+                "Address to listen on, '::' for all IPv4 and IPv6 addresses.",
+                cxxopts::value<std::string>(listen_address)->default_value("0.0.0.0"), "ADDR")
+            ("p,port",
+                "Port to listen on.",
+                cxxopts::value<int>(port)->default_value("8080"), "N")
+            ("threads",
+                "Number of threads processing the requests (1 to 256), default is the number of CPU (at least 2).",
+                cxxopts::value<int>(threads), "N")
+            ("max-delay",
+                "Maximum seconds between the date of a request and its receipt (as $maxdelay of index.php).",
+                cxxopts::value<int>(maxdelay)->default_value("60"), "N")
+            ("max-size",
+                "Maximum size in bytes of a request (as post_max_size of PHP).",
+                cxxopts::value<long long>(max_size)->default_value(std::to_string(max_size)), "N")
+            ("timeout",
+                "Seconds an idle connection is kept.",
+                cxxopts::value<int>(timeout)->default_value("60"), "N")
+            ("log-file",
+                "Log what we're doing to the specified FILE.",
+                cxxopts::value<std::string>(logfilename), "FILE")
+            ("v,verbose",
+                "Verbose level (N between 1 and 3, 3 is implicit). 1=ERROR, 2=WARNING, 3=INFO.",
+                cxxopts::value<int>()->implicit_value("3"), "N")
+            ("version",
+                "Display version number.")
+            ("help",
+                "Display command line options.")
+        ;
+
+        options.parse(argc, argv);
+
+        if (argc>1) {
+            std::string msg = u8"Too many or unknown specified options ";
+            for (int i=1; i<argc; i++) {
+                msg = msg+"'"+argv[i]+"'";
+                if (i+1<argc) msg += ", ";
+            }
+            throw cxxopts::OptionSpecException(msg);
+        }
+
+        if (options.count("version"))
+        {
+          std::cout << APP_VERSION << endl;
+          exit(0);
+        }
+
+        if (options.count("help"))
+        {
+          std::cout << APP_INFO << std::endl;
+          std::cout << options.help({""}) << std::endl;
+          std::cout << APP_NOTICE << endl;
+          exit(0);
+        }
+
+        if (options.count("v"))
+        {
+            int value = options["v"].as<int>();
+            if (value<1 || value>3)
+                throw cxxopts::OptionSpecException(u8"Option 'v' requires an optional value between 1 and 3 (implicitly 3)");
+            el::Loggers::setVerboseLevel(value);
+        }
+
+        if (threads < 1 || threads > 256)
+            throw cxxopts::OptionSpecException(u8"Option 'threads' requires a value between 1 and 256");
+        if (port < 1 || port > 65535)
+            throw cxxopts::OptionSpecException(u8"Option 'port' requires a value between 1 and 65535");
+        if (max_size < 1)
+            throw cxxopts::OptionSpecException(u8"Option 'max-size' requires a positive value");
+        if (key.empty())
+            throw cxxopts::OptionSpecException(u8"Option 'key' can not be empty");
+    }
+    catch (const cxxopts::OptionException& e)
+    {
+        std::cout << "Error parsing options: " << e.what() << std::endl;
+        exit(1);
+    }
+
+    std::cout << APP_INFO << std::endl;
+
+    el::Configurations defaultConf;
+    defaultConf.set(el::Level::Global, el::ConfigurationType::Format, "%datetime %level %msg");
+    if (!logfilename.empty()) {
+        defaultConf.set(el::Level::Global, el::ConfigurationType::ToFile, "true");
+        defaultConf.set(el::Level::Global, el::ConfigurationType::Filename, logfilename);
+    }
+    el::Loggers::reconfigureLogger("default", defaultConf);
+    el::Loggers::addFlag(el::LoggingFlag::DisableApplicationAbortOnFatalLog);
+    el::Loggers::addFlag(el::LoggingFlag::ColoredTerminalOutput);
+
+    if (!target_dir.empty() && *target_dir.rbegin() != '/') target_dir += "/";
+    struct stat st;
+    if (stat(target_dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        LOG(ERROR) << "Directory \"" << target_dir << "\" not found";
+        return 1;
+    }
+
+    // Same key as index.php: the 32 first hex characters of the SHA-256 of the password
+    aes_key = sha256(key).substr(0, 32);
+    mode_t mask = umask(0);
+    umask(mask);
+    file_mode = 0666 & ~mask;
+    dir_mode = 0777 & ~mask;
+
+    Directory_index index(target_dir);
+    dirindex = &index;
+    Http_server httpserver(&HandleRequest, threads, (size_t)max_size, timeout);
+    if (!httpserver.Listen(listen_address, port)) {
+        LOG(ERROR) << httpserver.GetError();
+        return 1;
+    }
+    server = &httpserver;
+    signal(SIGINT, SignalHandler);
+    signal(SIGTERM, SignalHandler);
+    signal(SIGPIPE, SIG_IGN);
+
+    LOG(INFO) << "STARTING mboxzilla_server on " << listen_address << ":" << port << " with " << threads
+              << " threads, directory \"" << target_dir << "\"";
+    httpserver.Run();
+    server = NULL;
+    LOG(INFO) << "ENDING mboxzilla_server";
+    return 0;
+}
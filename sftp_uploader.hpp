@@ -0,0 +1,698 @@
+/*
+    BSD 2-Clause License
+
+    Copyright (c) 2017-2023, Nol Martinon
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+    Upload of eml files to a SFTP server.
+
+    The files are written under the directory of the URL with the same names as
+    in the output directory. The parse thread hands over each file with Submit()
+    and goes on while a pool of threads uploads them. Each thread keeps one SSH
+    session open with SFTP_CHANNELS SFTP channels driven in non-blocking mode,
+    so that the requests of several files are outstanding at the same time on
+    each channel: the opening of a file, the writes of another one (sent by
+    chunks without waiting for their acknowledgement), the closing of a third
+    one and the renaming of a fourth. A file is written to 'name.tmp' then
+    renamed, so that an interrupted upload is not taken as done. The result of
+    each file is given back by Collect().
+    The TCP connection is opened by libcurl and the session runs over it. The
+    host key is checked before the authentication, against the fingerprint of
+    the configuration if set, else against the known_hosts file.
+    List() reads the directories once (one READDIR pass) to give the files
+    already uploaded.
+    eg:
+        SFTP_config config;
+        config.Parse("sftp://backup.domain.net/~/mails");
+        config.user = "user"; config.password = "password";
+        config.knownhosts = "/home/user/.ssh/known_hosts";
+        SFTP_uploader uploader(config);
+        uploader.List("Inbox/", names, error);
+        uploader.Submit("Inbox/20170101000000_MD5.eml", vdata); // vdata is taken
+        uploader.Flush();
+        uploader.Collect(vResults);
+*/
+
+#ifndef __SFTP_UPLOADER_HPP
+#define __SFTP_UPLOADER_HPP
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <unordered_set>
+#include <algorithm>      // min, max
+#include <cstdlib>        // atoi
+#include <curl/curl.h>
+#include <libssh2.h>
+#include <libssh2_sftp.h>
+#include "rate_limiter.hpp"
+#ifndef _WIN32
+    #include <sys/select.h>
+#endif
+
+#define SFTP_CHANNELS 4                          // SFTP channels of each session
+#define SFTP_PIPELINE_DEPTH 8                    // files in progress on each channel
+#define SFTP_UPLOAD_MAXPENDING (64*1024*1024)    // bytes waiting for upload before Submit() blocks
+#define SFTP_TMPSUFFIX ".tmp"
+
+/// Location and credentials of the server
+struct SFTP_config {
+    std::string host;
+    int port;
+    std::string directory;  // remote directory, relative to the home directory if not starting with '/'
+    std::string user;
+    std::string password;   // password, or passphrase of the private key
+    std::string keyfile;    // private key file, password authentication if empty
+    std::string knownhosts; // known_hosts file (OpenSSH format) where the host key must be
+    std::string fingerprint;// "SHA256:" fingerprint of the host key (unpadded base64), checked instead of knownhosts
+    long timeout;           // seconds allowed to wait for the server, 0 is unlimited
+    Rate_limiter *limiter;  // bandwidth shared with the other uploads, NULL is unlimited
+
+    SFTP_config() : port(22), timeout(600), limiter(NULL) {}
+
+    /// Set host, port and directory from "sftp://host[:port][/path]", "/~/path" is relative to the home directory
+    bool Parse(const std::string& url) {
+        if (url.compare(0, 7, "sftp://") != 0) return false;
+        size_t slash = url.find('/', 7);
+        host = url.substr(7, slash == std::string::npos ? std::string::npos : slash-7);
+        port = 22;
+        size_t colon = host.rfind(':');
+        if (colon != std::string::npos && host.find(']', colon) == std::string::npos) {
+            port = atoi(host.c_str()+colon+1);
+            host.erase(colon);
+        }
+        directory = (slash == std::string::npos) ? "" : url.substr(slash);
+        if (directory.compare(0, 3, "/~/") == 0 || directory == "/~") directory.erase(0, 3);
+        while (directory.length() > 1 && *directory.rbegin() == '/') directory.erase(directory.length()-1);
+        return !host.empty() && port > 0 && port < 65536;
+    }
+
+    /// Remote path of a path relative to the directory
+    std::string RemotePath(const std::string& path) const {
+        std::string relative = path;
+        while (true) {
+            if (!relative.empty() && relative[0] == '/') relative.erase(0, 1);
+            else if (relative.compare(0, 2, "./") == 0) relative.erase(0, 2);
+            else break;
+        }
+        if (directory.empty()) return relative;
+        if (relative.empty()) return directory;
+        return (*directory.rbegin() == '/' ? directory : directory + "/") + relative;
+    }
+};
+
+/// Result of an uploaded file
+struct SFTP_upload_result {
+    std::string path;
+    bool ok;
+    std::string error;  // error message, empty if ok
+    size_t size;
+    SFTP_upload_result(const std::string& p, bool b, const std::string& e, size_t s) : path(p), ok(b), error(e), size(s) {}
+};
+
+/// Message of a SFTP status code
+inline std::string SFTP_StatusMessage(unsigned long code) {
+    switch (code) {
+        case LIBSSH2_FX_NO_SUCH_FILE: return "no such file";
+        case LIBSSH2_FX_PERMISSION_DENIED: return "permission denied";
+        case LIBSSH2_FX_FAILURE: return "failure";
+        case LIBSSH2_FX_FILE_ALREADY_EXISTS: return "file already exists";
+        default: return "status " + std::to_string(code);
+    }
+}
+
+/// Fingerprint "SHA256:..." of a host key hash (32 bytes), as printed by ssh-keygen
+inline std::string SFTP_Fingerprint(const char *hash) {
+    static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const unsigned char *p = (const unsigned char*)hash;
+    std::string fingerprint = "SHA256:";
+    for (size_t i = 0; i < 32; i += 3) {
+        unsigned long n = (unsigned long)p[i] << 16 | (i+1 < 32 ? p[i+1] << 8 : 0) | (i+2 < 32 ? p[i+2] : 0);
+        for (size_t j = 0; j < 4 && i*4/3+j < 43; j++) fingerprint += b64[(n >> (18-6*j)) & 63];
+    }
+    return fingerprint;
+}
+
+/// Key type of the known_hosts entries to compare with a host key type, 0 for all
+inline int SFTP_KnownHostKeyType(int type) {
+    switch (type) {
+        case LIBSSH2_HOSTKEY_TYPE_RSA: return LIBSSH2_KNOWNHOST_KEY_SSHRSA;
+        case LIBSSH2_HOSTKEY_TYPE_DSS: return LIBSSH2_KNOWNHOST_KEY_SSHDSS;
+        case LIBSSH2_HOSTKEY_TYPE_ECDSA_256: return LIBSSH2_KNOWNHOST_KEY_ECDSA_256;
+        case LIBSSH2_HOSTKEY_TYPE_ECDSA_384: return LIBSSH2_KNOWNHOST_KEY_ECDSA_384;
+        case LIBSSH2_HOSTKEY_TYPE_ECDSA_521: return LIBSSH2_KNOWNHOST_KEY_ECDSA_521;
+        case LIBSSH2_HOSTKEY_TYPE_ED25519: return LIBSSH2_KNOWNHOST_KEY_ED25519;
+        default: return 0;
+    }
+}
+
+/// SSH session with its SFTP channels over one connection, for one thread
+/**
+ * The functions return false on error, the message is given by GetError().
+ * After an error of the session, IsConnected() is false.
+ */
+class SFTP_session {
+    public:
+        std::vector<LIBSSH2_SFTP*> channels;
+
+        SFTP_session(const SFTP_config& cfg) : config(cfg), curl(NULL), sock(CURL_SOCKET_BAD), session(NULL) {}
+        ~SFTP_session() { Close(); }
+
+        std::string GetError() { return error; }
+        bool IsConnected() { return session != NULL; }
+        LIBSSH2_SESSION *GetSession() { return session; }
+
+        /// Connect, authenticate and open nbchannels SFTP channels, in blocking mode
+        bool Connect(size_t nbchannels) {
+            Close();
+            curl = curl_easy_init();
+            if (!curl) return Fail("curl_easy_init() failed");
+
+            // The TCP connection is done as for HTTP but nothing is sent
+            std::string url = "http://" + config.host + ":" + std::to_string(config.port) + "/";
+            char errbuf[CURL_ERROR_SIZE] = "";
+            curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+            curl_easy_setopt(curl, CURLOPT_CONNECT_ONLY, 1L);
+            curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L); // required by threads
+            curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errbuf);
+            curl_easy_setopt(curl, CURLOPT_PROXY, "");
+            curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30L);
+            CURLcode res = curl_easy_perform(curl);
+            if (res != CURLE_OK) return Broken("Connection to \""+config.host+"\" failed : "+(*errbuf ? errbuf : curl_easy_strerror(res)));
+            if (curl_easy_getinfo(curl, CURLINFO_ACTIVESOCKET, &sock) != CURLE_OK || sock == CURL_SOCKET_BAD)
+                return Broken("No socket for \""+config.host+"\"");
+
+            session = libssh2_session_init();
+            if (!session) return Broken("libssh2_session_init() failed");
+            libssh2_session_set_blocking(session, 1);
+            libssh2_session_set_timeout(session, config.timeout*1000);
+            if (libssh2_session_handshake(session, sock)) return Broken("SSH handshake with \""+config.host+"\" failed : "+SessionError());
+            if (!CheckHostKey()) return false;
+
+            int rc;
+            if (config.keyfile.empty()) rc = libssh2_userauth_password(session, config.user.c_str(), config.password.c_str());
+            else rc = libssh2_userauth_publickey_fromfile(session, config.user.c_str(), NULL, config.keyfile.c_str(), config.password.c_str());
+            if (rc) return Broken("Authentication of \""+config.user+"\" failed : "+SessionError());
+
+            for (size_t i = 0; i < nbchannels; i++) {
+                LIBSSH2_SFTP *sftp = libssh2_sftp_init(session);
+                if (!sftp) return Broken("SFTP channel failed : "+SessionError());
+                channels.push_back(sftp);
+            }
+            return true;
+        }
+
+        /// Check the host key before sending the credentials
+        bool CheckHostKey() {
+            size_t len = 0;
+            int type = LIBSSH2_HOSTKEY_TYPE_UNKNOWN;
+            const char *key = libssh2_session_hostkey(session, &len, &type);
+            const char *hash = libssh2_hostkey_hash(session, LIBSSH2_HOSTKEY_HASH_SHA256);
+            if (!key || !hash) return Broken("No host key from \""+config.host+"\"");
+            std::string fingerprint = SFTP_Fingerprint(hash);
+
+            if (!config.fingerprint.empty()) {
+                if (fingerprint == config.fingerprint) return true;
+                return Broken("Host key of \""+config.host+"\" ("+fingerprint+") does not match the expected fingerprint");
+            }
+
+            // The entries are "host" for port 22, else "[host]:port", an IPv6 address is given without brackets
+            std::string host = config.host;
+            if (host.length() > 2 && host[0] == '[' && *host.rbegin() == ']') host = host.substr(1, host.length()-2);
+            LIBSSH2_KNOWNHOSTS *hosts = libssh2_knownhost_init(session);
+            if (!hosts) return Broken("libssh2_knownhost_init() failed");
+            int check = LIBSSH2_KNOWNHOST_CHECK_FAILURE;
+            bool read = libssh2_knownhost_readfile(hosts, config.knownhosts.c_str(), LIBSSH2_KNOWNHOST_FILE_OPENSSH) >= 0;
+            if (read)
+                check = libssh2_knownhost_checkp(hosts, host.c_str(), config.port, key, len,
+                                                 LIBSSH2_KNOWNHOST_TYPE_PLAIN | LIBSSH2_KNOWNHOST_KEYENC_RAW | SFTP_KnownHostKeyType(type), NULL);
+            libssh2_knownhost_free(hosts);
+
+            if (!read) return Broken("Could not read known hosts file \""+config.knownhosts+"\" to check the host key of \""+config.host+"\" ("+fingerprint+")");
+            switch (check) {
+                case LIBSSH2_KNOWNHOST_CHECK_MATCH: return true;
+                case LIBSSH2_KNOWNHOST_CHECK_MISMATCH: return Broken("Host key of \""+config.host+"\" ("+fingerprint+") does not match the known hosts file \""+config.knownhosts+"\"");
+                case LIBSSH2_KNOWNHOST_CHECK_NOTFOUND: return Broken("Host \""+config.host+"\" ("+fingerprint+") is not in the known hosts file \""+config.knownhosts+"\"");
+                default: return Broken("Check of the host key of \""+config.host+"\" failed");
+            }
+        }
+
+        void Close() {
+            if (session) {
+                libssh2_session_set_blocking(session, 1);
+                libssh2_session_set_timeout(session, 5000);
+                for (LIBSSH2_SFTP *sftp : channels) libssh2_sftp_shutdown(sftp);
+                libssh2_session_disconnect(session, "Normal shutdown");
+                libssh2_session_free(session);
+                session = NULL;
+            }
+            channels.clear();
+            if (curl) curl_easy_cleanup(curl);
+            curl = NULL;
+            sock = CURL_SOCKET_BAD;
+        }
+
+        /// Fail and close the session that can not be used anymore
+        bool Broken(const std::string& message) {
+            error = message;
+            Close();
+            return false;
+        }
+
+        std::string SessionError() {
+            char *msg = NULL;
+            libssh2_session_last_error(session, &msg, NULL, 0);
+            return (msg && *msg) ? msg : "unknown error";
+        }
+
+        /// Error of a failed request : SFTP status (the session can go on) or error of the session (closed)
+        std::string RequestError(LIBSSH2_SFTP *sftp, const std::string& request) {
+            if (libssh2_session_last_errno(session) == LIBSSH2_ERROR_SFTP_PROTOCOL)
+                return request+" failed : "+SFTP_StatusMessage(libssh2_sftp_last_error(sftp));
+            Broken(request+" failed : "+SessionError());
+            return error;
+        }
+
+        /// Wait for the socket in the directions libssh2 is blocked on (non-blocking mode), at most maxms
+        bool Wait(int directions, long maxms) {
+            fd_set rfds, wfds;
+            FD_ZERO(&rfds);
+            FD_ZERO(&wfds);
+            FD_SET(sock, &rfds); // the data of a channel can be read by a request of another one
+            if (directions & LIBSSH2_SESSION_BLOCK_OUTBOUND) FD_SET(sock, &wfds);
+            struct timeval tv;
+            tv.tv_sec = maxms / 1000;
+            tv.tv_usec = (maxms % 1000) * 1000;
+            return select((int)sock+1, &rfds, &wfds, NULL, &tv) >= 0;
+        }
+
+        /// Run a request until it is not blocked (non-blocking mode), return its result
+        template <class Request> int Run(Request request) {
+            int rc;
+            auto start = std::chrono::steady_clock::now();
+            while ((rc = request()) == LIBSSH2_ERROR_EAGAIN) {
+                if (config.timeout > 0 && std::chrono::steady_clock::now() - start > std::chrono::seconds(config.timeout)) break;
+                Wait(libssh2_session_block_directions(session), 100);
+            }
+            return rc;
+        }
+
+    private:
+        SFTP_config config;
+        CURL *curl;
+        curl_socket_t sock;
+        LIBSSH2_SESSION *session;
+        std::string error;
+
+        SFTP_session(const SFTP_session&);
+        SFTP_session& operator=(const SFTP_session&);
+
+        bool Fail(const std::string& message) {
+            error = message;
+            return false;
+        }
+};
+
+/// Parallel upload of files
+/**
+ * Submit() blocks while more than SFTP_UPLOAD_MAXPENDING bytes are waiting.
+ * The destructor waits for the files already submitted.
+ */
+class SFTP_uploader {
+    public:
+        SFTP_uploader(const SFTP_config& cfg, unsigned int nbthreads) : config(cfg), lister(cfg) {
+            bStop = false;
+            pendingbytes = 0;
+            pendingfiles = 0;
+            curl_global_init(CURL_GLOBAL_ALL); // before any thread
+            libssh2_init(0);
+            nbthreads = std::max(1u, std::min(nbthreads, 64u));
+            for (unsigned int i = 0; i < nbthreads; i++)
+                workers.push_back(std::thread(&SFTP_uploader::Worker, this));
+        }
+
+        ~SFTP_uploader() {
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                bStop = true;
+            }
+            cvJobs.notify_all();
+            for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+            lister.Close();
+            libssh2_exit();
+        }
+
+        size_t GetThreads() { return workers.size(); }
+
+        /// Bytes of the files submitted and not uploaded yet
+        size_t GetPendingBytes() {
+            std::unique_lock<std::mutex> lock(mtx);
+            return pendingbytes;
+        }
+
+        /// Create the directory 'path' if needed and add to sNames its files (with their sub-directories), from the calling thread
+        bool List(const std::string& path, std::unordered_set<std::string>& sNames, std::string& error) {
+            // The connection may have been closed by the server while it was not used
+            for (int attempt = 0; attempt < 2; attempt++) {
+                if (!lister.IsConnected() && !lister.Connect(1)) break;
+                std::string directory = config.RemotePath(path);
+                MakeDirectories(lister, lister.channels[0], directory + "/");
+                if (ListDirectory(directory, "", sNames)) return true;
+                if (lister.IsConnected()) break;
+            }
+            error = lister.GetError();
+            return false;
+        }
+
+        /// Queue a file to upload, the content of 'data' is taken (data is emptied)
+        void Submit(const std::string& path, std::vector<char>& data) {
+            Transfer *transfer = new Transfer();
+            transfer->path = path;
+            transfer->remote = config.RemotePath(path);
+            transfer->data.swap(data);
+
+            std::unique_lock<std::mutex> lock(mtx);
+            cvDone.wait(lock, [this]{ return pendingbytes <= SFTP_UPLOAD_MAXPENDING; });
+            jobs.push_back(transfer);
+            pendingfiles++;
+            pendingbytes += transfer->data.size();
+            lock.unlock();
+            cvJobs.notify_one();
+        }
+
+        /// Wait for all submitted files to be uploaded
+        void Flush() {
+            std::unique_lock<std::mutex> lock(mtx);
+            cvDone.wait(lock, [this]{ return pendingfiles == 0; });
+        }
+
+        /// Move the results of the uploaded files to vResults, return their number
+        size_t Collect(std::vector<SFTP_upload_result>& vResults) {
+            std::unique_lock<std::mutex> lock(mtx);
+            size_t n = results.size();
+            vResults.insert(vResults.end(), results.begin(), results.end());
+            results.clear();
+            return n;
+        }
+
+    private:
+        /// Steps of a file upload, the requests of each step are sent one at a time on a channel
+        enum { STEP_OPEN, STEP_WRITE, STEP_CLOSE, STEP_RENAME, STEP_UNLINK, STEP_DONE };
+
+        struct Transfer {
+            std::string path;
+            std::string remote;
+            std::vector<char> data;
+            size_t written;
+            size_t allowed;         // bytes granted by the limiter
+            LIBSSH2_SFTP_HANDLE *handle;
+            int step;
+            std::string error;
+            Transfer() : written(0), allowed(0), handle(NULL), step(STEP_OPEN) {}
+        };
+
+        /// Files in progress on a SFTP channel
+        struct Channel {
+            LIBSSH2_SFTP *sftp;
+            std::vector<Transfer*> transfers;
+            Transfer *running[STEP_DONE]; // file whose request of each step is outstanding
+        };
+
+        SFTP_config config;
+        SFTP_session lister;
+        std::unordered_set<std::string> knowndirs; // remote directories that exist
+        std::mutex mtx;
+        std::condition_variable cvJobs, cvDone;
+        std::deque<Transfer*> jobs;
+        std::vector<SFTP_upload_result> results;
+        std::vector<std::thread> workers;
+        size_t pendingbytes;
+        size_t pendingfiles;
+        bool bStop;
+
+        SFTP_uploader(const SFTP_uploader&);
+        SFTP_uploader& operator=(const SFTP_uploader&);
+
+        /// Create the missing directories of the path of a file (or of a directory ending with '/')
+        void MakeDirectories(SFTP_session& session, LIBSSH2_SFTP *sftp, const std::string& path) {
+            size_t pos = 0;
+            while ((pos = path.find('/', pos+1)) != std::string::npos) {
+                std::string directory = path.substr(0, pos);
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    if (knowndirs.count(directory)) continue;
+                }
+                // The directory may already exist, then the opening of the file tells the error
+                session.Run([&]{ return libssh2_sftp_mkdir_ex(sftp, directory.c_str(), (unsigned int)directory.length(), 0755); });
+                if (!session.IsConnected()) return;
+                std::unique_lock<std::mutex> lock(mtx);
+                knowndirs.insert(directory);
+            }
+        }
+
+        /// Add the files of a directory and of its sub-directories, with 'prefix', in blocking mode
+        bool ListDirectory(const std::string& directory, const std::string& prefix, std::unordered_set<std::string>& sNames) {
+            LIBSSH2_SFTP *sftp = lister.channels[0];
+            LIBSSH2_SFTP_HANDLE *handle = libssh2_sftp_open_ex(sftp, directory.c_str(), (unsigned int)directory.length(), 0, 0, LIBSSH2_SFTP_OPENDIR);
+            if (!handle) {
+                lister.RequestError(sftp, "Listing of \""+directory+"\"");
+                return false;
+            }
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                knowndirs.insert(directory);
+            }
+            std::vector<std::string> vSubdirs;
+            char name[512];
+            LIBSSH2_SFTP_ATTRIBUTES attrs;
+            int rc;
+            while ((rc = libssh2_sftp_readdir_ex(handle, name, sizeof(name), NULL, 0, &attrs)) > 0) {
+                std::string filename(name, rc);
+                if (filename == "." || filename == "..") continue;
+                if ((attrs.flags & LIBSSH2_SFTP_ATTR_PERMISSIONS) && LIBSSH2_SFTP_S_ISDIR(attrs.permissions))
+                    vSubdirs.push_back(filename);
+                else sNames.insert(prefix + filename);
+            }
+            libssh2_sftp_close_handle(handle);
+            if (rc < 0) {
+                lister.RequestError(sftp, "Listing of \""+directory+"\"");
+                return false;
+            }
+            for (const std::string& subdir : vSubdirs)
+                if (!ListDirectory(directory + "/" + subdir, prefix + subdir + "/", sNames)) return false;
+            return true;
+        }
+
+        void Worker() {
+            SFTP_session session(config);
+            std::vector<Channel> vChannels;
+            size_t nbtransfers = 0;
+            int idlerounds = 0;
+            auto lastprogress = std::chrono::steady_clock::now();
+
+            while (true) {
+                // New files are taken while the channels have room, waiting for them only if nothing is in progress
+                std::vector<Transfer*> vNew;
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    if (!nbtransfers) cvJobs.wait(lock, [this]{ return bStop || !jobs.empty(); });
+                    if (!nbtransfers && jobs.empty()) break;
+                    while (!jobs.empty() && nbtransfers + vNew.size() < SFTP_CHANNELS*SFTP_PIPELINE_DEPTH) {
+                        vNew.push_back(jobs.front());
+                        jobs.pop_front();
+                    }
+                }
+                if (!vNew.empty()) lastprogress = std::chrono::steady_clock::now();
+
+                for (Transfer *transfer : vNew) {
+                    if (!session.IsConnected()) {
+                        vChannels.clear();
+                        if (session.Connect(SFTP_CHANNELS)) {
+                            libssh2_session_set_blocking(session.GetSession(), 0);
+                            for (LIBSSH2_SFTP *sftp : session.channels) {
+                                Channel channel;
+                                channel.sftp = sftp;
+                                std::fill(channel.running, channel.running+STEP_DONE, (Transfer*)NULL);
+                                vChannels.push_back(channel);
+                            }
+                        }
+                    }
+                    if (session.IsConnected()) MakeDirectories(session, session.channels[0], transfer->remote);
+                    if (!session.IsConnected()) {
+                        transfer->error = session.GetError();
+                        Done(transfer);
+                        continue;
+                    }
+                    // The file goes to the least busy channel
+                    Channel *channel = &vChannels[0];
+                    for (Channel& c : vChannels)
+                        if (c.transfers.size() < channel->transfers.size()) channel = &c;
+                    channel->transfers.push_back(transfer);
+                    nbtransfers++;
+                }
+                if (!nbtransfers) continue;
+
+                // Each request that is not blocked goes on
+                bool progress = false;
+                int directions = 0;
+                for (Channel& channel : vChannels) {
+                    for (int step = STEP_OPEN; step < STEP_DONE && session.IsConnected(); step++) {
+                        if (!channel.running[step]) {
+                            for (Transfer *transfer : channel.transfers)
+                                if (transfer->step == step) { channel.running[step] = transfer; break; }
+                            if (!channel.running[step]) continue;
+                        }
+                        Transfer *transfer = channel.running[step];
+                        if (!Step(session, channel.sftp, transfer)) {
+                            directions |= libssh2_session_block_directions(session.GetSession());
+                            continue;
+                        }
+                        progress = true;
+                        channel.running[step] = NULL;
+                    }
+                    if (!session.IsConnected()) break;
+
+                    for (size_t i = 0; i < channel.transfers.size(); ) {
+                        if (channel.transfers[i]->step != STEP_DONE) { i++; continue; }
+                        Done(channel.transfers[i]);
+                        channel.transfers.erase(channel.transfers.begin()+i);
+                        nbtransfers--;
+                    }
+                }
+
+                // A response read for a channel may be waiting in memory, the socket is waited after a second idle round
+                if (progress) {
+                    idlerounds = 0;
+                    lastprogress = std::chrono::steady_clock::now();
+                }
+                else if (session.IsConnected() && ++idlerounds >= 2) {
+                    if (config.timeout > 0 && std::chrono::steady_clock::now() - lastprogress > std::chrono::seconds(config.timeout))
+                        session.Broken("Timeout of the connection to \""+config.host+"\"");
+                    else session.Wait(directions, 20);
+                }
+
+                // All the files in progress fail with the session
+                if (!session.IsConnected()) {
+                    for (Channel& channel : vChannels) {
+                        for (Transfer *transfer : channel.transfers) {
+                            transfer->error = session.GetError();
+                            Done(transfer);
+                        }
+                    }
+                    vChannels.clear();
+                    nbtransfers = 0;
+                    idlerounds = 0;
+                }
+            }
+        }
+
+        /// Send or go on with the request of the current step, return false if it is blocked
+        bool Step(SFTP_session& session, LIBSSH2_SFTP *sftp, Transfer *transfer) {
+            std::string tmpname = transfer->remote + SFTP_TMPSUFFIX;
+            switch (transfer->step) {
+                case STEP_OPEN:
+                    transfer->handle = libssh2_sftp_open_ex(sftp, tmpname.c_str(), (unsigned int)tmpname.length(),
+                                                            LIBSSH2_FXF_WRITE|LIBSSH2_FXF_CREAT|LIBSSH2_FXF_TRUNC,
+                                                            LIBSSH2_SFTP_S_IRUSR|LIBSSH2_SFTP_S_IWUSR|LIBSSH2_SFTP_S_IRGRP|LIBSSH2_SFTP_S_IROTH,
+                                                            LIBSSH2_SFTP_OPENFILE);
+                    if (!transfer->handle) {
+                        if (libssh2_session_last_errno(session.GetSession()) == LIBSSH2_ERROR_EAGAIN) return false;
+                        transfer->error = session.RequestError(sftp, "Opening of \""+tmpname+"\"");
+                        transfer->step = STEP_DONE;
+                    }
+                    else transfer->step = transfer->data.empty() ? STEP_CLOSE : STEP_WRITE;
+                    return true;
+
+                case STEP_WRITE: {
+                    // All the chunks are sent before the first acknowledgement is waited. A blocked write
+                    // is called again with the same length, so the limiter is asked once it is done
+                    if (transfer->allowed == transfer->written) {
+                        size_t left = transfer->data.size() - transfer->written;
+                        transfer->allowed += config.limiter ? config.limiter->Acquire(left) : left;
+                    }
+                    ssize_t rc = libssh2_sftp_write(transfer->handle, transfer->data.data() + transfer->written,
+                                                    transfer->allowed - transfer->written);
+                    if (rc == LIBSSH2_ERROR_EAGAIN || rc == 0) return false;
+                    if (rc < 0) {
+                        transfer->error = session.RequestError(sftp, "Writing of \""+tmpname+"\"");
+                        transfer->step = STEP_CLOSE;
+                        return true;
+                    }
+                    transfer->written += rc;
+                    if (transfer->written == transfer->data.size()) transfer->step = STEP_CLOSE;
+                    return true;
+                }
+
+                case STEP_CLOSE: {
+                    int rc = libssh2_sftp_close_handle(transfer->handle);
+                    if (rc == LIBSSH2_ERROR_EAGAIN) return false;
+                    transfer->handle = NULL;
+                    if (rc < 0 && transfer->error.empty()) transfer->error = session.RequestError(sftp, "Closing of \""+tmpname+"\"");
+                    transfer->step = transfer->error.empty() ? STEP_RENAME : STEP_UNLINK;
+                    return true;
+                }
+
+                case STEP_RENAME: {
+                    int rc = libssh2_sftp_rename_ex(sftp, tmpname.c_str(), (unsigned int)tmpname.length(),
+                                                    transfer->remote.c_str(), (unsigned int)transfer->remote.length(),
+                                                    LIBSSH2_SFTP_RENAME_ATOMIC|LIBSSH2_SFTP_RENAME_NATIVE);
+                    if (rc == LIBSSH2_ERROR_EAGAIN) return false;
+                    if (rc < 0) {
+                        transfer->error = session.RequestError(sftp, "Renaming of \""+tmpname+"\"");
+                        transfer->step = STEP_UNLINK;
+                    }
+                    else transfer->step = STEP_DONE;
+                    return true;
+                }
+
+                case STEP_UNLINK: {
+                    int rc = libssh2_sftp_unlink_ex(sftp, tmpname.c_str(), (unsigned int)tmpname.length());
+                    if (rc == LIBSSH2_ERROR_EAGAIN) return false;
+                    transfer->step = STEP_DONE;
+                    return true;
+                }
+            }
+            return true;
+        }
+
+        void Done(Transfer *transfer) {
+            size_t size = transfer->data.size();
+            std::unique_lock<std::mutex> lock(mtx);
+            std::string error = transfer->error.empty() ? "" : "Upload of \""+transfer->path+"\" failed : "+transfer->error;
+            results.push_back(SFTP_upload_result(transfer->path, error.empty(), error, size));
+            pendingbytes -= size;
+            pendingfiles--;
+            lock.unlock();
+            cvDone.notify_all();
+            delete transfer;
+        }
+};
+
+#endif // __SFTP_UPLOADER_HPP
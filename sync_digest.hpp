@@ -0,0 +1,133 @@
+/*
+    BSD 2-Clause License
+
+    Copyright (c) 2017-2023, Nol Martinon
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+    Digests of a list of names (eml files) split in buckets, used to synchronize
+    a remote directory without sending the whole list.
+
+    A name goes to the bucket crc32(name) % buckets and the digest of a bucket
+    is the 16 first hexadecimal characters of the MD5 of its sorted names, each
+    one followed by "\n". So both sides compute the same digests from the same
+    names in any order (index.php does it with crc32(), sort() and md5()).
+    The root digest is computed the same way from the bucket digests.
+    The client sends the root digest only, so an unchanged directory costs a
+    few bytes. Otherwise the server answers its bucket digests and only the
+    names of the buckets that differ are sent then.
+    eg:
+        Sync_digest digest(vNames, Sync_BucketCount(vNames.size()));
+        if (digest.GetRoot() == otherRoot) return;
+        std::vector<size_t> vDiff;
+        digest.Diff(vOtherDigests, vDiff);
+        std::vector<std::string> vSend;
+        digest.GetNames(vDiff, vSend);
+*/
+
+#ifndef __SYNC_DIGEST_HPP
+#define __SYNC_DIGEST_HPP
+
+#include <string>
+#include <vector>
+#include <algorithm>    // sort
+#include <zlib.h>       // crc32
+#include <openssl/evp.h>
+
+#define SYNC_BUCKET_NAMES 64   // names wanted by bucket
+#define SYNC_MAXBUCKETS 4096
+#define SYNC_DIGESTLEN 16      // hexadecimal characters of a bucket or root digest
+
+/// Number of buckets for 'count' names: a power of 2 for about SYNC_BUCKET_NAMES names by bucket
+inline size_t Sync_BucketCount(size_t count) {
+    size_t buckets = 1;
+    while (buckets < SYNC_MAXBUCKETS && buckets * SYNC_BUCKET_NAMES < count) buckets *= 2;
+    return buckets;
+}
+
+/// Bucket of a name
+inline size_t Sync_Bucket(const std::string& name, size_t buckets) {
+    return crc32(0L, (const Bytef*)name.data(), (uInt)name.size()) % buckets;
+}
+
+/// Digest of a list: the SYNC_DIGESTLEN first hexadecimal characters of the MD5 of its strings, each one followed by "\n"
+inline std::string Sync_ListDigest(const std::vector<std::string>& vList) {
+    static const char hex[] = "0123456789abcdef";
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    EVP_DigestInit_ex(ctx, EVP_md5(), NULL);
+    for (const std::string& item : vList) {
+        EVP_DigestUpdate(ctx, item.data(), item.size());
+        EVP_DigestUpdate(ctx, "\n", 1);
+    }
+    EVP_DigestFinal_ex(ctx, md, &len);
+    EVP_MD_CTX_free(ctx);
+
+    std::string digest;
+    for (unsigned int i = 0; i < len && digest.size() < SYNC_DIGESTLEN; i++) {
+        digest += hex[md[i] >> 4];
+        digest += hex[md[i] & 0x0f];
+    }
+    return digest;
+}
+
+class Sync_digest {
+    public:
+        Sync_digest(const std::vector<std::string>& vNames, size_t buckets) : vBuckets(buckets ? buckets : 1) {
+            for (const std::string& name : vNames) vBuckets[Sync_Bucket(name, vBuckets.size())].push_back(name);
+
+            for (std::vector<std::string>& vBucket : vBuckets) {
+                std::sort(vBucket.begin(), vBucket.end());
+                vDigests.push_back(Sync_ListDigest(vBucket));
+            }
+            root = Sync_ListDigest(vDigests);
+        }
+
+        size_t GetBucketCount() const { return vBuckets.size(); }
+        const std::vector<std::string>& GetDigests() const { return vDigests; }
+        const std::string& GetRoot() const { return root; }
+
+        /// Set vDiff to the buckets whose digest is not the one of vOther (all if the count differs)
+        void Diff(const std::vector<std::string>& vOther, std::vector<size_t>& vDiff) const {
+            vDiff.clear();
+            for (size_t i = 0; i < vDigests.size(); i++)
+                if (vOther.size() != vDigests.size() || vOther[i] != vDigests[i]) vDiff.push_back(i);
+        }
+
+        /// Set vNames to the names of the buckets of vIndex
+        void GetNames(const std::vector<size_t>& vIndex, std::vector<std::string>& vNames) const {
+            vNames.clear();
+            for (size_t i : vIndex)
+                if (i < vBuckets.size()) vNames.insert(vNames.end(), vBuckets[i].begin(), vBuckets[i].end());
+        }
+
+    private:
+        std::vector<std::vector<std::string> > vBuckets;
+        std::vector<std::string> vDigests;
+        std::string root;
+};
+
+#endif // __SYNC_DIGEST_HPP
@@ -1,14 +1,16 @@
 #!/bin/bash
 
-if [[ $# -ne 2 ]]; then
+if [[ $# -lt 2 || $# -gt 3 || ( $# -eq 3 && ! "$3" =~ ^(flat|hash|date)$ ) ]]; then
  echo "Invalid arguments"
- echo "Syntax: $(basename $0) /path/to/source/folder_eml_gz/ /path/to/target/"
+ echo "Syntax: $(basename $0) /path/to/source/folder_eml_gz/ /path/to/target/ [flat|hash|date]"
  echo "The mbox files are stored in subfolder /path/to/target/EMAILS.sbd"
+ echo "The last argument is the mboxzilla output layout of the source (default is flat)"
  exit 1
 fi
 
 source=$1
 dest=$2
+layout=${3:-flat}
 STARTTIME=$(date +%s)
 target=$dest/EMAILS.sbd/
 
@@ -20,9 +22,11 @@ target=$dest/EMAILS.sbd/
 total=`find "${source}/" -type f | wc -l`
 echo "Total files = $total"
 
-# Create target directories
+# Create target directories (layout sub-directories are not mail folders, they are skipped)
 mkdir -p "${target}/"
-rsync -a -f"+ */" -f"- *" "${source}/" "${target}/"
+if [[ "$layout" == "flat" ]]; then
+    rsync -a -f"+ */" -f"- *" "${source}/" "${target}/"
+fi
 
 # Create main mbox target file
 touch $dest/EMAILS
@@ -33,7 +37,12 @@ find "${source}" -type f -name '*.gz' -print0 | while read -d '' -r gz; do
     filename="${gz%.*}" # Original eml filename (remove extension .gz)
     filename=$(sed "s|${source}|${target}|g" <<< "${filename}") # Target filename
     targetdir="$(dirname "$filename")" # Current mbox target folder
-    mboxfile="$targetdir/$(basename "$(dirname "$filename")").mbox" # Mbox name is the same as parent folder $(basename "$(dirname "$gz")")
+    case "$layout" in # Remove layout sub-directories "ab/cd" or "YYYY/mm"
+        hash) targetdir=$(sed -E 's|/[0-9a-f]{2}/[0-9a-f]{2}$||' <<< "${targetdir}") ;;
+        date) targetdir=$(sed -E 's|/[0-9]{4}/[0-9]{2}$||' <<< "${targetdir}") ;;
+    esac
+    mkdir -p "$targetdir"
+    mboxfile="$targetdir/$(basename "$targetdir").mbox" # Mbox name is the same as parent folder
     date=`LANG=en_us_88591; date` # Date always in english
 
     echo "From - ${date}" >> "$mboxfile"
@@ -0,0 +1,163 @@
+/*
+    BSD 2-Clause License
+
+    Copyright (c) 2017-2023, Nol Martinon
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+    Order of the uploads of the emails of a mbox by priority instead of their
+    place in the mbox (oldest first most of the time).
+
+    The emails parsed are pushed with their date and size and the best one is
+    popped first:
+    - UPLOAD_ORDER_NEWEST: the most recent date first
+    - UPLOAD_ORDER_SMALLEST: the smallest size first, then the most recent
+    - UPLOAD_ORDER_MIXED: the smallest (1 + age in days) * size first, so a
+      recent email goes before a slightly smaller old one and a small email
+      before a large one of the same day
+    The emails without date come last with every policy (by size for the
+    smallest and mixed ones). The caller pops an email when the bytes
+    held are over its memory budget or when the upload has room, and pops all
+    of them at the end of the mbox, so that with a budget larger than the mbox
+    the whole mbox is sent in this order.
+    eg:
+        Upload_scheduler scheduler(UPLOAD_ORDER_NEWEST);
+        scheduler.Push(dirname, filename, eml, date); // eml is taken
+        Scheduled_eml item;
+        while (scheduler.GetBytes() > budget && scheduler.Pop(item)) Send(item);
+*/
+
+#ifndef __UPLOAD_SCHEDULER_HPP
+#define __UPLOAD_SCHEDULER_HPP
+
+#include <string>
+#include <vector>
+#include <algorithm>      // push_heap, pop_heap, max
+#include <utility>        // move
+#include <cfloat>         // DBL_MAX
+#include <ctime>
+
+#define UPLOAD_ORDER_MBOX 0
+#define UPLOAD_ORDER_NEWEST 1
+#define UPLOAD_ORDER_SMALLEST 2
+#define UPLOAD_ORDER_MIXED 3
+#define UPLOAD_ORDER_UNDATED 1e15              // rank added to an email without date by size, above any dated one
+#define UPLOAD_ORDER_SINKBYTES (4*1024*1024)   // bytes waiting in a background upload queue before the next email is held
+
+/// Return the upload order from its name ("mbox", "newest", "smallest" or "mixed") or -1 if unknown
+inline int Upload_GetOrder(const std::string& name) {
+    if (name == "mbox") return UPLOAD_ORDER_MBOX;
+    if (name == "newest") return UPLOAD_ORDER_NEWEST;
+    if (name == "smallest") return UPLOAD_ORDER_SMALLEST;
+    if (name == "mixed") return UPLOAD_ORDER_MIXED;
+    return -1;
+}
+
+struct Scheduled_eml {
+    std::string dirname;
+    std::string filename;
+    std::vector<char> eml;
+    time_t date;                // 0 if unknown
+    double rank;                // lowest first
+    unsigned long long seq;     // order in the mbox, for equal ranks
+};
+
+class Upload_scheduler {
+    public:
+        Upload_scheduler(int uploadorder) : order(uploadorder), bytes(0), maxbytes(0), maxcount(0), nextseq(0), now(time(NULL)) {}
+
+        /// Add an email, the content of 'eml' is taken (eml is emptied)
+        void Push(const std::string& dirname, const std::string& filename, std::vector<char>& eml, time_t date) {
+            Scheduled_eml item;
+            item.dirname = dirname;
+            item.filename = filename;
+            item.eml.swap(eml);
+            item.date = date;
+            item.seq = nextseq++;
+            item.rank = Rank(item);
+            bytes += item.eml.size();
+            heap.push_back(std::move(item));
+            std::push_heap(heap.begin(), heap.end(), Later);
+            maxbytes = std::max(maxbytes, bytes);
+            maxcount = std::max(maxcount, heap.size());
+        }
+
+        /// Move the first email to upload to 'item', return false if there is none
+        bool Pop(Scheduled_eml& item) {
+            if (heap.empty()) return false;
+            std::pop_heap(heap.begin(), heap.end(), Later);
+            item = std::move(heap.back());
+            heap.pop_back();
+            bytes -= item.eml.size();
+            return true;
+        }
+
+        /// Drop the emails held and reset the maximums (next mbox)
+        void Clear() {
+            heap.clear();
+            bytes = 0;
+            maxbytes = 0;
+            maxcount = 0;
+        }
+
+        size_t GetCount() const { return heap.size(); }
+        size_t GetBytes() const { return bytes; }
+        size_t GetMaxCount() const { return maxcount; }
+        size_t GetMaxBytes() const { return maxbytes; }
+
+    private:
+        int order;
+        size_t bytes;           // size of the emails held
+        size_t maxbytes, maxcount;
+        unsigned long long nextseq;
+        time_t now;             // reference of the ages
+        std::vector<Scheduled_eml> heap;
+
+        Upload_scheduler(const Upload_scheduler&);
+        Upload_scheduler& operator=(const Upload_scheduler&);
+
+        double Rank(const Scheduled_eml& item) const {
+            double size = (double)item.eml.size();
+            switch (order) {
+                case UPLOAD_ORDER_NEWEST:
+                    return item.date > 0 ? -(double)item.date : DBL_MAX;
+                case UPLOAD_ORDER_SMALLEST:
+                    return item.date > 0 ? size : UPLOAD_ORDER_UNDATED + size;
+                case UPLOAD_ORDER_MIXED:
+                    return item.date > 0 ? (1 + std::max(0.0, difftime(now, item.date) / 86400)) * size : UPLOAD_ORDER_UNDATED + size;
+                default:
+                    return 0;
+            }
+        }
+
+        /// Heap order: true if a goes after b
+        static bool Later(const Scheduled_eml& a, const Scheduled_eml& b) {
+            if (a.rank != b.rank) return a.rank > b.rank;
+            if (a.date != b.date) return a.date < b.date;
+            return a.seq > b.seq;
+        }
+};
+
+#endif // __UPLOAD_SCHEDULER_HPP
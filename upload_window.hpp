@@ -0,0 +1,177 @@
+/*
+    BSD 2-Clause License
+
+    Copyright (c) 2017-2023, Nol Martinon
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this
+      list of conditions and the following disclaimer.
+
+    * Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+    FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+    DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+    OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+    Number of uploads running at the same time (window), tuned by additive
+    increase and multiplicative decrease (AIMD) from the measured latency,
+    throughput and errors.
+
+    The window starts at WINDOW_START. Each time a window of uploads has ended
+    without error (a round), it grows by one up to the ceiling while the mean
+    latency of the round stays under WINDOW_LATENCY_FACTOR times the best one
+    or the throughput goes WINDOW_GAIN over the best one, else it holds: more
+    uploads would only wait in the same queue. The throughput of a round is
+    window * bytes / latency, steadier than the bytes by second of so few
+    uploads. A timeout, an overloaded server (HTTP 429 or 5xx) or an upload
+    longer than half of the timeout halves it, once for the uploads started
+    before the decrease.
+    The decisions are kept as text to be logged. It is not thread safe, the
+    caller locks it.
+    eg:
+        Upload_window window(8, 600);
+        if (window.CanStart()) {
+            unsigned long long ticket = window.Start();
+            bool ok = Upload(...);
+            window.Finished(ticket, seconds, bytes, bOverloaded);
+        }
+*/
+
+#ifndef __UPLOAD_WINDOW_HPP
+#define __UPLOAD_WINDOW_HPP
+
+#include <string>
+#include <vector>
+#include <algorithm>      // min, max
+#include <cstdio>         // snprintf
+
+#define WINDOW_START 2
+#define WINDOW_LATENCY_FACTOR 2.0   // mean latency of a round, relatively to the best one, that stops the increases
+#define WINDOW_GAIN 1.1             // throughput of a round, relatively to the best one, that keeps the increases
+
+class Upload_window {
+    public:
+        Upload_window(unsigned int maxsize = 1, long timeout = 0)
+            : ceiling(std::max(1u, maxsize)), size(std::min((unsigned int)WINDOW_START, ceiling)), timeoutsec(timeout),
+              running(0), started(0), decreasedat(0), roundcount(0), roundbytes(0), roundlatency(0),
+              bestlatency(0), bestthroughput(0), bHolding(false), minsize(size), maxreached(size), nbdecrease(0) {}
+
+        /// Return true if one more upload can start
+        bool CanStart() const { return running < size; }
+
+        /// An upload starts, return its ticket for Finished()
+        unsigned long long Start() {
+            running++;
+            return started++;
+        }
+
+        /// The upload of 'ticket' ended after 'seconds' with 'bytes' sent, bOverloaded if it timed out or got HTTP 429 or 5xx
+        void Finished(unsigned long long ticket, double seconds, size_t bytes, bool bOverloaded) {
+            if (running) running--;
+            bool bSlow = timeoutsec > 0 && seconds > timeoutsec / 2.0;
+            if (bOverloaded || bSlow) {
+                // The uploads started before a decrease do not decrease it again
+                if (ticket < decreasedat) return;
+                unsigned int old = size;
+                size = std::max(1u, size / 2);
+                decreasedat = started;
+                nbdecrease++;
+                minsize = std::min(minsize, size);
+                bHolding = false;
+                NewRound();
+                char text[128];
+                if (bOverloaded) snprintf(text, sizeof(text), "timeout or overloaded server");
+                else snprintf(text, sizeof(text), "upload of %.1f s over half of the timeout", seconds);
+                Decide(old, text);
+                return;
+            }
+
+            roundcount++;
+            roundbytes += bytes;
+            roundlatency += seconds;
+            if (roundcount < size) return;
+
+            // A round ends
+            double latency = roundlatency / roundcount;
+            double throughput = roundlatency > 0 ? roundbytes * size / roundlatency : 0;
+            if (!bestlatency || latency < bestlatency) bestlatency = latency;
+            bool bGain = throughput >= bestthroughput * WINDOW_GAIN;
+            bestthroughput = std::max(bestthroughput, throughput);
+            char text[128];
+            snprintf(text, sizeof(text), "%u uploads of %.0f ms in mean (best %.0f ms), %.1f KB/s (best %.1f KB/s)",
+                     roundcount, latency*1000, bestlatency*1000, throughput/1024, bestthroughput/1024);
+            if (size < ceiling) {
+                if (latency <= bestlatency * WINDOW_LATENCY_FACTOR || bGain) {
+                    unsigned int old = size;
+                    size++;
+                    maxreached = std::max(maxreached, size);
+                    bHolding = false;
+                    Decide(old, text);
+                }
+                else if (!bHolding) {
+                    bHolding = true;
+                    Decide(size, text);
+                }
+            }
+            NewRound();
+        }
+
+        unsigned int GetSize() const { return size; }
+        unsigned int GetCeiling() const { return ceiling; }
+        unsigned int GetMin() const { return minsize; }
+        unsigned int GetMax() const { return maxreached; }
+        unsigned int GetDecreases() const { return nbdecrease; }
+
+        /// Move the decisions taken since the last call to vDecisions, return their number
+        size_t Collect(std::vector<std::string>& vDecisions) {
+            size_t n = decisions.size();
+            vDecisions.insert(vDecisions.end(), decisions.begin(), decisions.end());
+            decisions.clear();
+            return n;
+        }
+
+    private:
+        unsigned int ceiling;
+        unsigned int size;
+        long timeoutsec;
+        unsigned int running;
+        unsigned long long started;       // uploads started, ticket of the next one
+        unsigned long long decreasedat;   // ticket of the first upload started after the last decrease
+        unsigned int roundcount;
+        double roundbytes;
+        double roundlatency;              // sum of the latencies of the round
+        double bestlatency;
+        double bestthroughput;
+        bool bHolding;
+        unsigned int minsize, maxreached;
+        unsigned int nbdecrease;
+        std::vector<std::string> decisions;
+
+        void NewRound() {
+            roundcount = 0;
+            roundbytes = 0;
+            roundlatency = 0;
+        }
+
+        void Decide(unsigned int old, const std::string& reason) {
+            std::string what = (size > old) ? "increased" : (size < old) ? "decreased" : "held";
+            decisions.push_back("Upload window " + what + " " + std::to_string(old) + " -> " + std::to_string(size)
+                                + " (ceiling " + std::to_string(ceiling) + ") : " + reason);
+        }
+};
+
+#endif // __UPLOAD_WINDOW_HPP